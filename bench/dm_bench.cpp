@@ -0,0 +1,634 @@
+/**
+ * @file dm_bench.cpp
+ * @brief Load generator. Runs client threads, optionally in many processes,
+ * issuing a mix of operations on distributed memory, then reports throughput
+ * and latency percentiles.
+ *
+ * Every thread is a separate client with its own DM_client object, mapping
+ * the same range of blocks. Contention is set by the number of blocks used
+ * and by how accesses are spread over them: with few blocks and a skewed
+ * distribution clients keep invalidating each other's copies.
+ *
+ * Operations:
+ * - map: unmaps a block, then maps it again; only the map is timed
+ * - update: dm_block_update()
+ * - write: dm_block_write(); a write rejected because another client wrote
+ *   the block first is counted as a conflict, and the block is updated
+ *   (untimed) so that the next write can succeed
+ * - wait: dm_block_wait_for() with a time limit; expired waits are counted
+ *   as timeouts
+ *
+ * With a transfer size smaller than a block, update and write transfer only
+ * that many bytes with dm_block_read_range() and dm_block_write_range(). With
+ * a larger size, each operation works on consecutive blocks.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <math.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../src/distmem.h"
+#include "../src/histogram.h"
+
+/**
+ * @def NOPS
+ * Number of operation types.
+ */
+#define NOPS	4
+
+/**
+ * Names of operation types, in the order used by all arrays.
+ */
+static const char *names[NOPS] = { "map", "update", "write", "wait" };
+
+/**
+ * @struct settings dm_bench.cpp
+ * @brief Benchmark parameters, shared by all workers.
+ */
+struct settings {
+	/**
+	 * Configuration file.
+	 */
+	char *config_file;
+
+	/**
+	 * Threads per process.
+	 */
+	int threads;
+
+	/**
+	 * Processes.
+	 */
+	int processes;
+
+	/**
+	 * Operations per thread, 0 if run is timed.
+	 */
+	long ops;
+
+	/**
+	 * Run length in seconds, if ops is 0.
+	 */
+	double seconds;
+
+	/**
+	 * Weight of each operation type.
+	 */
+	int mix[NOPS];
+
+	/**
+	 * Key distribution: 'u' uniform, 's' sequential, 'z' zipfian.
+	 */
+	char dist;
+
+	/**
+	 * Zipfian skew.
+	 */
+	double theta;
+
+	/**
+	 * First block used.
+	 */
+	block_id first;
+
+	/**
+	 * Number of keys, i.e. of positions an operation can start at.
+	 */
+	int keys;
+
+	/**
+	 * Bytes transferred per operation, 0 for one block.
+	 */
+	int size;
+
+	/**
+	 * Time limit of waits in milliseconds.
+	 */
+	int wait_limit;
+
+	/**
+	 * Seed of random generators.
+	 */
+	unsigned long long seed;
+};
+
+/**
+ * @struct results dm_bench.cpp
+ * @brief Results of a worker, or merged results of many. Copied as raw memory
+ * from child processes.
+ */
+struct results {
+	/**
+	 * Latency in nanoseconds of each operation type.
+	 */
+	Histogram latency[NOPS];
+
+	/**
+	 * Failed operations of each type.
+	 */
+	unsigned long long errors[NOPS];
+
+	/**
+	 * Writes rejected because block had been written by another client.
+	 */
+	unsigned long long conflicts;
+
+	/**
+	 * Waits whose time limit expired.
+	 */
+	unsigned long long timeouts;
+
+	/**
+	 * Workers which could not start.
+	 */
+	int failed;
+
+	/**
+	 * Sum of run times of workers, in seconds.
+	 */
+	double elapsed;
+};
+
+/**
+ * Benchmark parameters.
+ */
+static settings conf;
+
+/**
+ * Results of threads of this process.
+ */
+static results total;
+
+/**
+ * Mutex protecting total.
+ */
+static pthread_mutex_t total_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Zipfian constants, computed once: zeta(keys, theta), zeta(2, theta),
+ * alpha and eta as in Gray et al., "Quickly generating billion-record
+ * synthetic databases".
+ */
+static double zetan, zeta2, alpha, eta;
+
+/**
+ * Returns monotonic time.
+ * @return	Time in nanoseconds.
+ */
+static unsigned long long now ()
+{
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns next value of a xorshift64* random generator.
+ * @param[in,out]	state Generator state, never 0.
+ * @return	Random value.
+ */
+static unsigned long long next_random (unsigned long long *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+/**
+ * Returns a uniform random number in [0, 1).
+ * @param[in,out]	state Generator state.
+ * @return	Random number.
+ */
+static double uniform (unsigned long long *state)
+{
+	return (next_random (state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Computes zipfian constants for conf.keys and conf.theta.
+ * @return	No value is returned.
+ */
+static void zipf_init ()
+{
+	zetan = 0;
+	for (int i = 1; i <= conf.keys; i++)
+		zetan += 1 / pow (i, conf.theta);
+	zeta2 = 1 + 1 / pow (2, conf.theta);
+	alpha = 1 / (1 - conf.theta);
+	eta = (1 - pow (2.0 / conf.keys, 1 - conf.theta)) /
+	      (1 - zeta2 / zetan);
+}
+
+/**
+ * Returns a zipfian distributed key, 0 being the most popular.
+ * @param[in,out]	state Generator state.
+ * @return	Key in [0, conf.keys).
+ */
+static int zipf (unsigned long long *state)
+{
+	double u = uniform (state);
+	double uz = u * zetan;
+	if (uz < 1)
+		return 0;
+	if (uz < zeta2)
+		return 1;
+	int k = (int) (conf.keys * pow (eta * u - eta + 1, alpha));
+	return k < conf.keys ? k : conf.keys - 1;
+}
+
+/**
+ * Parses an operation mix such as "update=60,write=30,wait=10".
+ * @param[in]	s Mix.
+ * @param[out]	mix Weight of each operation type.
+ * @return	0 on success, -1 on error.
+ */
+static int parse_mix (char *s, int *mix)
+{
+	memset (mix, 0, NOPS * sizeof(int));
+	int sum = 0;
+	for (char *p = strtok (s, ","); p != NULL; p = strtok (NULL, ",")) {
+		char *v = strchr (p, '=');
+		if (v == NULL)
+			return -1;
+		*v = '\0';
+		int i;
+		for (i = 0; i < NOPS; i++)
+			if (strcmp (p, names[i]) == 0)
+				break;
+		if (i == NOPS || atoi (v + 1) < 0)
+			return -1;
+		mix[i] = atoi (v + 1);
+		sum += mix[i];
+	}
+	return sum > 0 ? 0 : -1;
+}
+
+/**
+ * Worker thread: runs operations as a separate client and adds its results
+ * to total.
+ * @param[in]	in Worker index, among all processes.
+ */
+static void *worker (void *in)
+{
+	long index = (long) in;
+	results res;
+	memset ((void *) res.errors, 0, sizeof(res.errors));
+	res.conflicts = 0;
+	res.timeouts = 0;
+	res.failed = 0;
+	res.elapsed = 0;
+
+	DM_client dm;
+	int dim = 0;
+	if (dm.dm_init (conf.config_file) == 0)
+		dim = dm.dm_block_dim ();
+	// blocks touched by one operation
+	int span = 1;
+	if (conf.size > dim && dim > 0)
+		span = (conf.size + dim - 1) / dim;
+	int blocks = conf.keys + span - 1;
+	char *mem = new char[(size_t) blocks * (dim > 0 ? dim : 1)];
+	bool ok = dim > 0;
+	for (int i = 0; ok && i < blocks; i++)
+		if (dm.dm_block_map (conf.first + i,
+				     mem + (size_t) i * dim) != 0)
+			ok = false;
+	if (!ok) {
+		res.failed = 1;
+		pthread_mutex_lock (&total_mutex);
+		total.failed += res.failed;
+		pthread_mutex_unlock (&total_mutex);
+		delete[] mem;
+		return NULL;
+	}
+
+	int cumulative[NOPS];
+	int sum = 0;
+	for (int i = 0; i < NOPS; i++) {
+		sum += conf.mix[i];
+		cumulative[i] = sum;
+	}
+	unsigned long long state = conf.seed + index * 0x9e3779b97f4a7c15ULL;
+	if (state == 0)
+		state = 1;
+	// sequential walks start far apart
+	long cursor = index * (long) conf.keys / (conf.threads *
+						 conf.processes);
+	bool partial = conf.size > 0 && conf.size < dim;
+
+	unsigned long long start = now ();
+	unsigned long long end = start +
+				 (unsigned long long) (conf.seconds * 1e9);
+	unsigned long long t = start;
+	for (long n = 0; conf.ops > 0 ? n < conf.ops : t < end; n++) {
+		int r = next_random (&state) % sum;
+		int op = 0;
+		while (r >= cumulative[op])
+			op++;
+		int key;
+		if (conf.dist == 's')
+			key = cursor++ % conf.keys;
+		else if (conf.dist == 'z')
+			key = zipf (&state);
+		else
+			key = next_random (&state) % conf.keys;
+		block_id ID = conf.first + key;
+
+		if (op == 0) {
+			for (int i = 0; i < span; i++)
+				dm.dm_block_unmap (ID + i);
+		}
+
+		t = now ();
+		int ret = 0;
+		for (int i = 0; i < span && ret == 0; i++) {
+			char *data = mem + (size_t) (key + i) * dim;
+			if (op == 0)
+				ret = dm.dm_block_map (ID + i, data);
+			else if (op == 1 && partial)
+				ret = dm.dm_block_read_range (ID + i, 0,
+							      conf.size);
+			else if (op == 1)
+				ret = dm.dm_block_update (ID + i);
+			else if (op == 2 && partial)
+				ret = dm.dm_block_write_range (ID + i, 0,
+							       conf.size);
+			else if (op == 2)
+				ret = dm.dm_block_write (ID + i);
+			else
+				ret = dm.dm_block_wait_for (ID + i,
+							    conf.wait_limit);
+		}
+		unsigned long long done = now ();
+		res.latency[op].add (done - t);
+		t = done;
+
+		if (op == 2 && ret == -2) {
+			// another client wrote first: catch up, untimed
+			res.conflicts++;
+			for (int i = 0; i < span; i++)
+				dm.dm_block_update (ID + i);
+		} else if (op == 3 && ret == -4) {
+			res.timeouts++;
+		} else if (ret < 0) {
+			res.errors[op]++;
+		}
+	}
+	res.elapsed = (t - start) / 1e9;
+
+	pthread_mutex_lock (&total_mutex);
+	for (int i = 0; i < NOPS; i++) {
+		total.latency[i].merge (res.latency[i]);
+		total.errors[i] += res.errors[i];
+	}
+	total.conflicts += res.conflicts;
+	total.timeouts += res.timeouts;
+	total.elapsed += res.elapsed;
+	pthread_mutex_unlock (&total_mutex);
+
+	delete[] mem;
+	return NULL;
+}
+
+/**
+ * Runs conf.threads workers in this process and waits for them.
+ * @param[in]	process Index of this process.
+ * @return	No value is returned.
+ */
+static void run (int process)
+{
+	vector<pthread_t> tids (conf.threads);
+	for (int i = 0; i < conf.threads; i++) {
+		long index = process * conf.threads + i;
+		pthread_create (&tids[i], NULL, worker, (void *) index);
+	}
+	for (int i = 0; i < conf.threads; i++)
+		pthread_join (tids[i], NULL);
+}
+
+/**
+ * Prints a latency summary.
+ * @param[in]	name Operation name.
+ * @param[in]	h Latency histogram, in nanoseconds.
+ * @param[in]	errors Failed operations.
+ * @param[in]	wall Wall clock time of the run, in seconds.
+ * @param[in]	json Print as a JSON object member.
+ * @param[in]	last Last JSON member.
+ * @return	No value is returned.
+ */
+static void print_op (const char *name, Histogram &h, unsigned long long errors,
+		      double wall, bool json, bool last)
+{
+	if (json) {
+		printf ("    \"%s\": {\"count\": %llu, \"errors\": %llu, "
+			"\"ops_per_sec\": %.1f, \"mean_us\": %.2f, "
+			"\"p50_us\": %.2f, \"p99_us\": %.2f, "
+			"\"p999_us\": %.2f, \"max_us\": %.2f}%s\n",
+			name, h.count (), errors,
+			wall > 0 ? h.count () / wall : 0, h.mean () / 1e3,
+			h.percentile (50) / 1e3, h.percentile (99) / 1e3,
+			h.percentile (99.9) / 1e3, h.max () / 1e3,
+			last ? "" : ",");
+		return;
+	}
+	printf ("%-8s %10llu %8llu %12.1f %10.2f %10.2f %10.2f %10.2f "
+		"%10.2f\n", name, h.count (), errors,
+		wall > 0 ? h.count () / wall : 0, h.mean () / 1e3,
+		h.percentile (50) / 1e3, h.percentile (99) / 1e3,
+		h.percentile (99.9) / 1e3, h.max () / 1e3);
+}
+
+/**
+ * Dm_bench main function, usage is:
+ *
+ * dm_bench [-t threads] [-p processes] [-n ops | -T seconds] [-m mix]
+ *	    [-d distribution] [-f first] [-k keys] [-s size] [-w ms] [-r seed]
+ *	    [-j] config_file
+ *
+ * @param[in]	config_file A valid Distributed Memory configuration file;
+ *		servers must be running.
+ * @param[in]	-t Client threads per process (default 1).
+ * @param[in]	-p Processes (default 1).
+ * @param[in]	-n Operations per thread.
+ * @param[in]	-T Run length in seconds, if -n is not given (default 5).
+ * @param[in]	-m Operation mix, weights of map, update, write and wait, e.g.
+ *		update=60,write=30,wait=10 (default update=50,write=50).
+ * @param[in]	-d Key distribution: uniform (default), sequential, zipf or
+ *		zipf:theta (default theta 0.99).
+ * @param[in]	-f First block used (default 0).
+ * @param[in]	-k Number of keys (default 256). Fewer keys, more contention.
+ * @param[in]	-s Bytes transferred per operation (default one block).
+ * @param[in]	-w Time limit of waits in milliseconds (default 10).
+ * @param[in]	-r Seed (default 1), runs with the same seed and parameters
+ *		issue the same operations.
+ * @param[in]	-j Machine-readable output (JSON).
+ */
+int main (int argc, char *argv[])
+{
+	conf.threads = 1;
+	conf.processes = 1;
+	conf.ops = 0;
+	conf.seconds = 5;
+	conf.mix[0] = 0;
+	conf.mix[1] = 50;
+	conf.mix[2] = 50;
+	conf.mix[3] = 0;
+	conf.dist = 'u';
+	conf.theta = 0.99;
+	conf.first = 0;
+	conf.keys = 256;
+	conf.size = 0;
+	conf.wait_limit = 10;
+	conf.seed = 1;
+	bool json = false;
+	char dist[32] = "uniform";
+
+	int c;
+	while ((c = getopt (argc, argv, "t:p:n:T:m:d:f:k:s:w:r:j")) != -1) {
+		bool bad = false;
+		if (c == 't') {
+			conf.threads = atoi (optarg);
+			bad = conf.threads <= 0;
+		} else if (c == 'p') {
+			conf.processes = atoi (optarg);
+			bad = conf.processes <= 0;
+		} else if (c == 'n') {
+			conf.ops = atol (optarg);
+			bad = conf.ops <= 0;
+		} else if (c == 'T') {
+			conf.seconds = atof (optarg);
+			bad = conf.seconds <= 0;
+		} else if (c == 'm') {
+			bad = parse_mix (optarg, conf.mix) == -1;
+		} else if (c == 'd') {
+			snprintf (dist, sizeof(dist), "%s", optarg);
+			conf.dist = optarg[0];
+			if (strncmp (optarg, "zipf:", 5) == 0)
+				conf.theta = atof (optarg + 5);
+			bad = (strcmp (optarg, "uniform") != 0 &&
+			       strcmp (optarg, "sequential") != 0 &&
+			       strncmp (optarg, "zipf", 4) != 0) ||
+			      conf.theta <= 0 || conf.theta >= 1;
+		} else if (c == 'f') {
+			conf.first = strtoll (optarg, NULL, 10);
+		} else if (c == 'k') {
+			conf.keys = atoi (optarg);
+			bad = conf.keys <= 0;
+		} else if (c == 's') {
+			conf.size = atoi (optarg);
+			bad = conf.size < 0;
+		} else if (c == 'w') {
+			conf.wait_limit = atoi (optarg);
+		} else if (c == 'r') {
+			conf.seed = strtoull (optarg, NULL, 10);
+		} else if (c == 'j') {
+			json = true;
+		} else {
+			bad = true;
+		}
+		if (bad) {
+			printf ("Dm_bench: Bad arguments\n");
+			exit (1);
+		}
+	}
+	if (argc - optind != 1) {
+		printf ("Dm_bench: Bad arguments\n");
+		exit (1);
+	}
+	conf.config_file = argv[optind];
+	if (conf.dist == 'z')
+		zipf_init ();
+
+	unsigned long long start = now ();
+	if (conf.processes == 1) {
+		run (0);
+	} else {
+		// each child sends its results through its own pipe
+		vector<int> fds;
+		for (int p = 0; p < conf.processes; p++) {
+			int fd[2];
+			if (pipe (fd) == -1) {
+				printf ("Dm_bench: Unable to create pipe\n");
+				exit (1);
+			}
+			pid_t pid = fork ();
+			if (pid == -1) {
+				printf ("Dm_bench: Unable to fork\n");
+				exit (1);
+			}
+			if (pid == 0) {
+				close (fd[0]);
+				run (p);
+				if (write (fd[1], &total, sizeof(total)) !=
+				    sizeof(total))
+					exit (1);
+				exit (0);
+			}
+			close (fd[1]);
+			fds.push_back (fd[0]);
+		}
+		for (int p = 0; p < conf.processes; p++) {
+			results *r = new results;
+			if (recv_msg (fds[p], r, sizeof(results)) == 0) {
+				for (int i = 0; i < NOPS; i++) {
+					total.latency[i].merge (r->latency[i]);
+					total.errors[i] += r->errors[i];
+				}
+				total.conflicts += r->conflicts;
+				total.timeouts += r->timeouts;
+				total.failed += r->failed;
+				total.elapsed += r->elapsed;
+			} else {
+				total.failed += conf.threads;
+			}
+			delete r;
+			close (fds[p]);
+		}
+		while (wait (NULL) > 0)
+			;
+	}
+	double wall = (now () - start) / 1e9;
+
+	Histogram all;
+	unsigned long long errors = 0;
+	for (int i = 0; i < NOPS; i++) {
+		all.merge (total.latency[i]);
+		errors += total.errors[i];
+	}
+	int workers = conf.threads * conf.processes;
+	if (json) {
+		printf ("{\n  \"threads\": %d, \"processes\": %d, "
+			"\"distribution\": \"%s\", \"keys\": %d, "
+			"\"size\": %d, \"seed\": %llu,\n"
+			"  \"failed_workers\": %d, \"seconds\": %.3f, "
+			"\"conflicts\": %llu, \"timeouts\": %llu,\n"
+			"  \"ops\": {\n", conf.threads, conf.processes, dist,
+			conf.keys, conf.size, conf.seed, total.failed, wall,
+			total.conflicts, total.timeouts);
+		for (int i = 0; i < NOPS; i++)
+			if (conf.mix[i] > 0)
+				print_op (names[i], total.latency[i],
+					  total.errors[i], wall, true, false);
+		print_op ("all", all, errors, wall, true, true);
+		printf ("  }\n}\n");
+	} else {
+		printf ("%d clients (%d failed), %s keys %d, %.2f s, "
+			"%llu conflicts, %llu timeouts\n", workers,
+			total.failed, dist, conf.keys, wall, total.conflicts,
+			total.timeouts);
+		printf ("%-8s %10s %8s %12s %10s %10s %10s %10s %10s\n", "op",
+			"count", "errors", "ops/s", "mean us", "p50 us",
+			"p99 us", "p999 us", "max us");
+		for (int i = 0; i < NOPS; i++)
+			if (conf.mix[i] > 0)
+				print_op (names[i], total.latency[i],
+					  total.errors[i], wall, false, false);
+		print_op ("all", all, errors, wall, false, true);
+	}
+
+	exit (total.failed > 0 ? 1 : 0);
+}
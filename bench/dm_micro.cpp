@@ -0,0 +1,407 @@
+/**
+ * @file dm_micro.cpp
+ * @brief Microbenchmarks of server storage. Threads call DM and Block
+ * methods directly, without sockets, to measure locking and copying costs.
+ *
+ * Scenarios:
+ * - hot: all threads update and write the same block
+ * - disjoint: every thread updates and writes its own block
+ * - waiters: one thread writes a block, all others wait on it
+ * - clean: many clients map all blocks, then threads disconnect them with
+ *   DM::clean()
+ *
+ * Each operation is timed in CPU cycles (in nanoseconds where no cycle
+ * counter is available). With -p, block locks are profiled as by server -p
+ * option, so that the cost of profiling can be measured too.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include "../src/dm.h"
+#include "../src/histogram.h"
+
+/**
+ * Names of scenarios.
+ */
+static const char *scenarios[] = { "hot", "disjoint", "waiters", "clean" };
+
+/**
+ * @def NSCENARIOS
+ * Number of scenarios.
+ */
+#define NSCENARIOS	4
+
+/**
+ * Threads.
+ */
+static int threads = 4;
+
+/**
+ * Operations per thread.
+ */
+static long ops = 100000;
+
+/**
+ * Blocks in memory.
+ */
+static int blocks = 256;
+
+/**
+ * Clients disconnected in clean scenario.
+ */
+static int clients = 1000;
+
+/**
+ * Memory under test, rebuilt for every scenario.
+ */
+static DM *mem;
+
+/**
+ * Set by writer when waiters must stop.
+ */
+static volatile int stop;
+
+/**
+ * Waiters which have stopped.
+ */
+static volatile int stopped;
+
+/**
+ * @struct worker_arg dm_micro.cpp
+ * @brief Argument and results of a benchmark thread.
+ */
+struct worker_arg {
+	/**
+	 * Thread index.
+	 */
+	int index;
+
+	/**
+	 * Block used by thread.
+	 */
+	int ID;
+
+	/**
+	 * Cycles of each timed operation.
+	 */
+	Histogram latency;
+
+	/**
+	 * Operations which did not succeed, i.e. writes rejected because
+	 * another client wrote the block first.
+	 */
+	unsigned long long misses;
+};
+
+/**
+ * Returns a cycle counter.
+ * @return	Cycles, or nanoseconds if processor has no cycle counter.
+ */
+static inline unsigned long long cycles ()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc ();
+#else
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Returns monotonic time.
+ * @return	Time in seconds.
+ */
+static double now ()
+{
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Hot and disjoint scenarios: alternates updates and writes of a block, as a
+ * client keeping its copy valid. A write rejected because the block was
+ * written by another client is a miss.
+ * @param[in]	in Worker argument.
+ */
+static void *update_write (void *in)
+{
+	worker_arg *arg = (worker_arg *) in;
+	client_id cid = arg->index + 1;
+	int ID = arg->ID;
+	char buf[DIMBLOCK];
+	memset (buf, arg->index, DIMBLOCK);
+	mem->map_client (cid, ID, buf);
+
+	for (long i = 0; i < ops; i++) {
+		unsigned long long t = cycles ();
+		int ret;
+		if (i & 1)
+			ret = mem->write_block (cid, ID, buf);
+		else
+			ret = mem->update_block (cid, ID, buf);
+		arg->latency.add (cycles () - t);
+		if (ret == -2)
+			arg->misses++;
+	}
+
+	mem->unmap_client (cid, ID);
+	return NULL;
+}
+
+/**
+ * Waiters scenario, waiting thread: brings its copy up to date, then waits
+ * for block 0 to be written. Only waits are timed, so they measure how long
+ * a waiter sleeps between writes and how fast it is woken up.
+ * @param[in]	in Worker argument.
+ */
+static void *waiter (void *in)
+{
+	worker_arg *arg = (worker_arg *) in;
+	client_id cid = arg->index + 1;
+	char buf[DIMBLOCK];
+	mem->map_client (cid, 0, buf);
+
+	while (!stop) {
+		mem->update_block (cid, 0, buf);
+		unsigned long long t = cycles ();
+		mem->wait_block (cid, 0);
+		arg->latency.add (cycles () - t);
+	}
+
+	mem->unmap_client (cid, 0);
+	__sync_fetch_and_add (&stopped, 1);
+	return NULL;
+}
+
+/**
+ * Waiters scenario, writing thread: writes block 0 ops times, each write
+ * waking up all waiters. Then writes until all waiters have stopped.
+ * @param[in]	in Worker argument.
+ */
+static void *writer (void *in)
+{
+	worker_arg *arg = (worker_arg *) in;
+	client_id cid = arg->index + 1;
+	char buf[DIMBLOCK];
+	mem->map_client (cid, 0, buf);
+
+	for (long i = 0; i < ops; i++) {
+		unsigned long long t = cycles ();
+		int ret = mem->write_block (cid, 0, buf);
+		arg->latency.add (cycles () - t);
+		if (ret != 0)
+			arg->misses++;
+	}
+
+	stop = 1;
+	while (stopped < threads - 1) {
+		mem->write_block (cid, 0, buf);
+		sched_yield ();
+	}
+
+	mem->unmap_client (cid, 0);
+	return NULL;
+}
+
+/**
+ * Clean scenario: disconnects every threads-th client, starting from the
+ * thread index.
+ * @param[in]	in Worker argument.
+ */
+static void *cleaner (void *in)
+{
+	worker_arg *arg = (worker_arg *) in;
+	for (int c = arg->index; c < clients; c += threads) {
+		unsigned long long t = cycles ();
+		mem->clean (c + 1);
+		arg->latency.add (cycles () - t);
+	}
+	return NULL;
+}
+
+/**
+ * Runs a scenario and prints its results.
+ * @param[in]	s Scenario index.
+ * @param[in]	json Print as a JSON object.
+ * @return	No value is returned.
+ */
+static void run (int s, bool json)
+{
+	mem = new DM;
+	mem->init (0, blocks - 1, NULL, 0, false);
+	stop = 0;
+	stopped = 0;
+
+	if (s == 3) {
+		// mappings are set up before timing
+		char buf[DIMBLOCK];
+		for (int c = 1; c <= clients; c++)
+			for (int i = 0; i < blocks; i++)
+				mem->map_client (c, i, buf);
+	}
+
+	vector<worker_arg> args (threads);
+	vector<pthread_t> tids (threads);
+	double start = now ();
+	for (int i = 0; i < threads; i++) {
+		args[i].index = i;
+		args[i].ID = 0;
+		args[i].misses = 0;
+		void *(*body) (void *) = cleaner;
+		if (s == 0) {
+			// every thread is a different client of block 0
+			body = update_write;
+		} else if (s == 1) {
+			args[i].ID = i % blocks;
+			body = update_write;
+		} else if (s == 2) {
+			body = i == 0 ? writer : waiter;
+		}
+		pthread_create (&tids[i], NULL, body, &args[i]);
+	}
+	for (int i = 0; i < threads; i++)
+		pthread_join (tids[i], NULL);
+	double elapsed = now () - start;
+
+	// in waiters scenario only the writer's operations count toward
+	// throughput, waiters report wakeup latency
+	Histogram h, w;
+	unsigned long long misses = 0;
+	for (int i = 0; i < threads; i++) {
+		if (s == 2 && i > 0)
+			w.merge (args[i].latency);
+		else
+			h.merge (args[i].latency);
+		misses += args[i].misses;
+	}
+
+	if (json) {
+		printf ("  \"%s\": {\"threads\": %d, \"ops\": %llu, "
+			"\"seconds\": %.4f, \"ops_per_sec\": %.1f, "
+			"\"mean_cycles\": %.1f, \"p50_cycles\": %llu, "
+			"\"p99_cycles\": %llu, \"max_cycles\": %llu, "
+			"\"misses\": %llu", scenarios[s], threads, h.count (),
+			elapsed, h.count () / elapsed, h.mean (),
+			h.percentile (50), h.percentile (99), h.max (), misses);
+		if (s == 2)
+			printf (", \"wakeups\": %llu, \"wait_p50_cycles\": "
+				"%llu, \"wait_p99_cycles\": %llu", w.count (),
+				w.percentile (50), w.percentile (99));
+		printf ("}");
+	} else {
+		printf ("%-9s %7d %10llu %12.1f %10.1f %10llu %10llu %12llu "
+			"%8llu\n", scenarios[s], threads, h.count (),
+			h.count () / elapsed, h.mean (), h.percentile (50),
+			h.percentile (99), h.max (), misses);
+		if (s == 2)
+			printf ("%-9s %7d %10llu %12.1f %10.1f %10llu %10llu "
+				"%12llu\n", "(wakeup)", threads - 1, w.count (),
+				w.count () / elapsed, w.mean (),
+				w.percentile (50), w.percentile (99), w.max ());
+	}
+
+	vector<block_contention> locks;
+	map<client_id, unsigned long long> culprits;
+	if (!json && mem->contention (1, &locks, &culprits) == 0 &&
+	    !locks.empty ()) {
+		lock_profile &p = locks[0].profile;
+		printf ("%-9s block %d: %llu of %llu acquisitions contended, "
+			"%.1f us waited, %.2f us mean hold\n", "(lock)",
+			locks[0].ID, p.contended, p.acquisitions,
+			p.wait_ns / 1e3,
+			p.sampled > 0 ? p.hold_ns / 1e3 / p.sampled : 0);
+	}
+
+	delete mem;
+}
+
+/**
+ * Dm_micro main function, usage is:
+ *
+ * dm_micro [-s scenario] [-t threads] [-n ops] [-b blocks] [-c clients]
+ *	    [-p sampling] [-j]
+ *
+ * @param[in]	-s Scenario: hot, disjoint, waiters or clean. All scenarios
+ *		are run if not given.
+ * @param[in]	-t Threads (default 4), at least 2 for waiters.
+ * @param[in]	-n Operations per thread (default 100000).
+ * @param[in]	-b Blocks in memory (default 256).
+ * @param[in]	-c Clients disconnected in clean scenario (default 1000).
+ * @param[in]	-p Profiles block locks, measuring hold time of one
+ *		acquisition every sampling. Most contended block is printed
+ *		after each scenario.
+ * @param[in]	-j Machine-readable output (JSON).
+ */
+int main (int argc, char *argv[])
+{
+	int only = -1;
+	bool json = false;
+
+	int c;
+	while ((c = getopt (argc, argv, "s:t:n:b:c:p:j")) != -1) {
+		bool bad = false;
+		if (c == 's') {
+			for (only = 0; only < NSCENARIOS; only++)
+				if (strcmp (optarg, scenarios[only]) == 0)
+					break;
+			bad = only == NSCENARIOS;
+		} else if (c == 't') {
+			threads = atoi (optarg);
+			bad = threads <= 0;
+		} else if (c == 'n') {
+			ops = atol (optarg);
+			bad = ops <= 0;
+		} else if (c == 'b') {
+			blocks = atoi (optarg);
+			bad = blocks <= 0;
+		} else if (c == 'c') {
+			clients = atoi (optarg);
+			bad = clients <= 0;
+		} else if (c == 'p') {
+			Block::sampling = atoi (optarg);
+			bad = Block::sampling < 0;
+		} else if (c == 'j') {
+			json = true;
+		} else {
+			bad = true;
+		}
+		if (bad) {
+			printf ("Dm_micro: Bad arguments\n");
+			exit (1);
+		}
+	}
+	if (optind != argc) {
+		printf ("Dm_micro: Bad arguments\n");
+		exit (1);
+	}
+
+	if (json)
+		printf ("{\n");
+	else
+		printf ("%-9s %7s %10s %12s %10s %10s %10s %12s %8s\n",
+			"scenario", "threads", "ops", "ops/s", "mean cyc",
+			"p50 cyc", "p99 cyc", "max cyc", "misses");
+	bool first = true;
+	for (int s = 0; s < NSCENARIOS; s++) {
+		if ((only != -1 && s != only) || (s == 2 && threads < 2))
+			continue;
+		if (json && !first)
+			printf (",\n");
+		run (s, json);
+		first = false;
+	}
+	if (json)
+		printf ("\n}\n");
+
+	exit (0);
+}
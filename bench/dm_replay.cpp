@@ -0,0 +1,479 @@
+/**
+ * @file dm_replay.cpp
+ * @brief Replays traces recorded by servers started with -t option against
+ * running servers, at original or accelerated rate.
+ *
+ * Every traced client becomes a DM_client, with a thread for each server it
+ * talked to, issuing the requests of the client to that server in order, each
+ * one at its original time divided by the speed factor. Traces of different
+ * servers can be replayed together: clients are recognized by their
+ * fingerprint, records are ordered by wall clock time.
+ *
+ * Client library issues handshakes and versioned requests by itself, so
+ * HELLO requests are skipped and versioned requests are replayed as their
+ * plain counterparts. Requests between servers (REPLICATE, MOVE),
+ * administration requests (MIGRATE, STATS), SCAN requests, whose class is not
+ * traced, and STALE requests are skipped.
+ *
+ * Latencies of replayed requests are reported next to the traced ones, with
+ * the number of requests whose outcome differs from the traced one, e.g.
+ * writes which succeeded in the trace but were rejected in the replay.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <time.h>
+#include <algorithm>
+#include <set>
+#include "../src/distmem.h"
+#include "../src/histogram.h"
+#include "../src/trace.h"
+
+/**
+ * @def NOPS
+ * Request types replayed.
+ */
+#define NOPS	7
+
+/**
+ * Names of replayed request types.
+ */
+static const char *names[NOPS] = {
+	"map", "unmap", "update", "write", "wait", "read_range", "write_range"
+};
+
+/**
+ * Outcome classes, compared between trace and replay.
+ */
+enum outcome { SUCCESS, CONFLICT, TIMEOUT, FAILURE };
+
+/**
+ * @struct replay_client dm_replay.cpp
+ * @brief A traced client.
+ */
+struct replay_client {
+	/**
+	 * Client library instance.
+	 */
+	DM_client dm;
+
+	/**
+	 * Local copy of every block the client uses.
+	 */
+	map<block_id, char *> blocks;
+};
+
+/**
+ * @struct replay_stream dm_replay.cpp
+ * @brief Requests of a client to a server, replayed by a thread.
+ */
+struct replay_stream {
+	/**
+	 * Client sending requests.
+	 */
+	replay_client *client;
+
+	/**
+	 * Requests in order.
+	 */
+	vector<trace_record> records;
+
+	/**
+	 * Traced latency of each request type, in nanoseconds.
+	 */
+	Histogram traced[NOPS];
+
+	/**
+	 * Replayed latency of each request type, in nanoseconds.
+	 */
+	Histogram replayed[NOPS];
+
+	/**
+	 * Requests of each type whose outcome differs from trace.
+	 */
+	unsigned long long diverged[NOPS];
+
+	/**
+	 * Longest delay of a request after its scheduled time, in
+	 * nanoseconds.
+	 */
+	unsigned long long lag;
+};
+
+/**
+ * Speed factor, 0 for as fast as possible.
+ */
+static double speed = 1;
+
+/**
+ * Time limit of waits in milliseconds, -1 for traced time of each wait.
+ */
+static int wait_limit = -1;
+
+/**
+ * Time of first traced request.
+ */
+static unsigned long long first_time;
+
+/**
+ * Monotonic time replay started at.
+ */
+static unsigned long long replay_start;
+
+/**
+ * Returns monotonic time.
+ * @return	Time in nanoseconds.
+ */
+static unsigned long long now ()
+{
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Returns the index of a replayed request type.
+ * @param[in]	opcode Traced request type.
+ * @return	Index in names, -1 if request is not replayed.
+ */
+static int op_index (int opcode)
+{
+	if (opcode == MAP)
+		return 0;
+	if (opcode == UNMAP)
+		return 1;
+	if (opcode == UPDATE || opcode == VUPDATE)
+		return 2;
+	if (opcode == WRITE || opcode == VWRITE)
+		return 3;
+	if (opcode == WAIT || opcode == VWAIT)
+		return 4;
+	if (opcode == READ_RANGE)
+		return 5;
+	if (opcode == WRITE_RANGE)
+		return 6;
+	return -1;
+}
+
+/**
+ * Classifies the outcome of a traced request.
+ * @param[in]	r Record.
+ * @return	Outcome class.
+ */
+static outcome traced_outcome (const trace_record &r)
+{
+	// redirected requests are repeated on the new owner by the client
+	if (r.outcome == OK || r.outcome == UPDATED || r.outcome == REDIRECT)
+		return SUCCESS;
+	if (r.outcome == INVALID)
+		return CONFLICT;
+	return FAILURE;
+}
+
+/**
+ * Classifies the outcome of a replayed request.
+ * @param[in]	op Request type index.
+ * @param[in]	ret Result of client library call.
+ * @return	Outcome class.
+ */
+static outcome replayed_outcome (int op, int ret)
+{
+	if (ret >= 0)
+		return SUCCESS;
+	if (ret == -2 && (op == 3 || op == 6))
+		return CONFLICT;
+	if (ret == -4 && op == 4)
+		return TIMEOUT;
+	return FAILURE;
+}
+
+/**
+ * Returns the time limit of a replayed wait: as long as traced, but no longer
+ * than until the next request of the client, which couldn't be sent before
+ * the wait ended. Server traces a wait whose client gave up only once it
+ * notices.
+ * @param[in]	c Stream of requests.
+ * @param[in]	i Index of wait in stream.
+ * @return	Time limit in milliseconds.
+ */
+static int limit (replay_stream *c, unsigned int i)
+{
+	unsigned long long ns = c->records[i].latency;
+	if (i + 1 < c->records.size () &&
+	    c->records[i + 1].time - c->records[i].time < ns)
+		ns = c->records[i + 1].time - c->records[i].time;
+	if (speed > 0)
+		ns = (unsigned long long) (ns / speed);
+	return ns / 1000000 + 1;
+}
+
+/**
+ * Thread replaying requests of a client to a server.
+ * @param[in]	in Stream of requests.
+ */
+static void *replay (void *in)
+{
+	replay_stream *c = (replay_stream *) in;
+	DM_client &dm = c->client->dm;
+	memset ((void *) c->diverged, 0, sizeof(c->diverged));
+	c->lag = 0;
+
+	for (unsigned int i = 0; i < c->records.size (); i++) {
+		trace_record &r = c->records[i];
+		int op = op_index (r.opcode);
+
+		if (speed > 0) {
+			unsigned long long due = replay_start +
+				(unsigned long long) ((r.time - first_time) /
+						      speed);
+			unsigned long long t = now ();
+			if (t < due) {
+				timespec ts;
+				ts.tv_sec = (due - t) / 1000000000ULL;
+				ts.tv_nsec = (due - t) % 1000000000ULL;
+				nanosleep (&ts, NULL);
+			} else if (t - due > c->lag) {
+				c->lag = t - due;
+			}
+		}
+
+		unsigned long long start = now ();
+		int ret;
+		if (op == 0)
+			ret = dm.dm_block_map (r.ID, c->client->blocks[r.ID]);
+		else if (op == 1)
+			ret = dm.dm_block_unmap (r.ID);
+		else if (op == 2)
+			ret = dm.dm_block_update (r.ID);
+		else if (op == 3)
+			ret = dm.dm_block_write (r.ID);
+		else if (op == 4)
+			ret = dm.dm_block_wait_for (r.ID, wait_limit != -1 ?
+						    wait_limit : limit (c, i));
+		else if (op == 5)
+			ret = dm.dm_block_read_range (r.ID, r.arg, r.length);
+		else
+			ret = dm.dm_block_write_range (r.ID, r.arg, r.length);
+		c->replayed[op].add (now () - start);
+		c->traced[op].add (r.latency);
+		if (replayed_outcome (op, ret) != traced_outcome (r))
+			c->diverged[op]++;
+	}
+
+	return NULL;
+}
+
+/**
+ * Reads a trace file.
+ * @param[in]	path Trace file path.
+ * @param[in]	file Index of trace file.
+ * @param[out]	streams Filled with records of each client, keyed by
+ *		trace file index and client fingerprint.
+ * @param[out]	conns Filled with connections seen, as trace file index and
+ *		connection number.
+ * @param[out]	skipped Incremented by number of records not replayed.
+ * @return	Block size of traced server, -1 on error.
+ */
+static int load (char *path, int file,
+		 map<pair<int, unsigned int>, replay_stream *> *streams,
+		 set<pair<int, unsigned int> > *conns,
+		 unsigned long long *skipped)
+{
+	FILE *f = fopen (path, "rb");
+	if (f == NULL)
+		return -1;
+
+	trace_header h;
+	if (fread (&h, sizeof(h), 1, f) != 1 || h.magic != TRACEMAGIC ||
+	    h.version != TRACEVERSION ||
+	    h.record_size != sizeof(trace_record)) {
+		fclose (f);
+		return -1;
+	}
+
+	trace_record r;
+	while (fread (&r, sizeof(r), 1, f) == 1) {
+		if (op_index (r.opcode) == -1) {
+			(*skipped)++;
+			continue;
+		}
+		// connections of a client to a server follow one another: a
+		// new one is opened only if the previous one failed
+		replay_stream *&c = (*streams)[make_pair (file, r.client)];
+		if (c == NULL)
+			c = new replay_stream;
+		c->records.push_back (r);
+		conns->insert (make_pair (file, r.connection));
+	}
+	fclose (f);
+
+	return h.block_size;
+}
+
+/**
+ * Orders records by time.
+ * @param[in]	a First record.
+ * @param[in]	b Second record.
+ * @return	True if a came before b.
+ */
+static bool earlier (const trace_record &a, const trace_record &b)
+{
+	return a.time < b.time;
+}
+
+/**
+ * Dm_replay main function, usage is:
+ *
+ * dm_replay [-s speed] [-w ms] [-j] config_file trace_file...
+ *
+ * @param[in]	config_file A valid Distributed Memory configuration file;
+ *		servers must be running, with the blocks used in trace.
+ * @param[in]	trace_file Trace files recorded by servers.
+ * @param[in]	-s Speed factor (default 1, original rate), 0 to replay as
+ *		fast as possible.
+ * @param[in]	-w Time limit of waits in milliseconds (default: as long as
+ *		traced, see limit()), so that a wait never woken up in
+ *		replay doesn't stop it.
+ * @param[in]	-j Machine-readable output (JSON).
+ */
+int main (int argc, char *argv[])
+{
+	bool json = false;
+	int c;
+	while ((c = getopt (argc, argv, "s:w:j")) != -1) {
+		if (c == 's') {
+			speed = atof (optarg);
+		} else if (c == 'w') {
+			wait_limit = atoi (optarg);
+		} else if (c == 'j') {
+			json = true;
+		} else {
+			printf ("Dm_replay: Bad arguments\n");
+			exit (1);
+		}
+	}
+	if (argc - optind < 2 || speed < 0) {
+		printf ("Dm_replay: Bad arguments\n");
+		exit (1);
+	}
+
+	map<pair<int, unsigned int>, replay_stream *> streams;
+	set<pair<int, unsigned int> > conns;
+	unsigned long long skipped = 0;
+	int dim = 0;
+	for (int i = optind + 1; i < argc; i++) {
+		int d = load (argv[i], i, &streams, &conns, &skipped);
+		if (d == -1 || (dim != 0 && d != dim)) {
+			printf ("Dm_replay: Unable to read trace %s\n",
+				argv[i]);
+			exit (1);
+		}
+		dim = d;
+	}
+
+	// one client library instance per traced client, with a local copy
+	// of each block it uses
+	map<unsigned int, replay_client *> clients;
+	first_time = ~0ULL;
+	unsigned long long last_time = 0, records = 0;
+	map<pair<int, unsigned int>, replay_stream *>::iterator it;
+	for (it = streams.begin (); it != streams.end (); it++) {
+		replay_stream *rc = it->second;
+		replay_client *&cl = clients[it->first.second];
+		if (cl == NULL) {
+			cl = new replay_client;
+			if (cl->dm.dm_init (argv[optind]) == -1 ||
+			    cl->dm.dm_block_dim () != dim) {
+				printf ("Dm_replay: Unable to initialize DM\n");
+				exit (1);
+			}
+		}
+		rc->client = cl;
+		sort (rc->records.begin (), rc->records.end (), earlier);
+		for (unsigned int i = 0; i < rc->records.size (); i++) {
+			trace_record &r = rc->records[i];
+			if (cl->blocks.find (r.ID) == cl->blocks.end ())
+				cl->blocks[r.ID] = new char[dim];
+			first_time = min (first_time, r.time);
+			last_time = max (last_time, r.time);
+		}
+		records += rc->records.size ();
+	}
+	if (records == 0) {
+		printf ("Dm_replay: Nothing to replay\n");
+		exit (1);
+	}
+
+	vector<pthread_t> tids;
+	replay_start = now ();
+	for (it = streams.begin (); it != streams.end (); it++) {
+		pthread_t tid;
+		pthread_create (&tid, NULL, replay, it->second);
+		tids.push_back (tid);
+	}
+	for (unsigned int i = 0; i < tids.size (); i++)
+		pthread_join (tids[i], NULL);
+	double elapsed = (now () - replay_start) / 1e9;
+	double traced = (last_time - first_time) / 1e9;
+
+	Histogram t[NOPS], r[NOPS];
+	unsigned long long diverged[NOPS], lag = 0;
+	memset ((void *) diverged, 0, sizeof(diverged));
+	for (it = streams.begin (); it != streams.end (); it++) {
+		for (int i = 0; i < NOPS; i++) {
+			t[i].merge (it->second->traced[i]);
+			r[i].merge (it->second->replayed[i]);
+			diverged[i] += it->second->diverged[i];
+		}
+		lag = max (lag, it->second->lag);
+	}
+
+	if (json) {
+		printf ("{\n  \"clients\": %d, \"connections\": %d, "
+			"\"records\": %llu, \"skipped\": %llu, "
+			"\"speed\": %g,\n  \"traced_seconds\": %.3f, "
+			"\"replay_seconds\": %.3f, \"max_lag_us\": %.1f,\n"
+			"  \"ops\": {\n", (int) clients.size (),
+			(int) conns.size (), records, skipped, speed, traced,
+			elapsed, lag / 1e3);
+	} else {
+		printf ("%d clients, %d connections, %llu records (%llu "
+			"skipped), traced %.3f s, replayed %.3f s at speed %g, "
+			"max lag %.1f us\n", (int) clients.size (),
+			(int) conns.size (), records, skipped, traced, elapsed,
+			speed, lag / 1e3);
+		printf ("%-12s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+			"trace p50", "trace p99", "p50 us", "p99 us",
+			"diverged");
+	}
+	bool first = true;
+	for (int i = 0; i < NOPS; i++) {
+		if (r[i].count () == 0)
+			continue;
+		if (json) {
+			printf ("%s    \"%s\": {\"count\": %llu, "
+				"\"traced_p50_us\": %.2f, "
+				"\"traced_p99_us\": %.2f, \"p50_us\": %.2f, "
+				"\"p99_us\": %.2f, \"diverged\": %llu}",
+				first ? "" : ",\n", names[i], r[i].count (),
+				t[i].percentile (50) / 1e3,
+				t[i].percentile (99) / 1e3,
+				r[i].percentile (50) / 1e3,
+				r[i].percentile (99) / 1e3, diverged[i]);
+		} else {
+			printf ("%-12s %10llu %10.2f %10.2f %10.2f %10.2f "
+				"%10llu\n", names[i], r[i].count (),
+				t[i].percentile (50) / 1e3,
+				t[i].percentile (99) / 1e3,
+				r[i].percentile (50) / 1e3,
+				r[i].percentile (99) / 1e3, diverged[i]);
+		}
+		first = false;
+	}
+	if (json)
+		printf ("\n  }\n}\n");
+
+	exit (0);
+}
@@ -0,0 +1,514 @@
+/**
+ * @file dm_shape.cpp
+ * @brief Shaping proxy. Forwards connections from local ports to servers,
+ * adding latency, jitter and a bandwidth limit in each direction, so that
+ * clients and benchmarks can be run on one machine as over a real network.
+ *
+ * Every connection accepted on a local port is forwarded to its server on a
+ * new connection. Each direction is handled by a reader thread, which takes
+ * data as soon as it arrives and schedules it, and a writer thread, which
+ * sends it when due. Data is due once it has been transmitted at the given
+ * bandwidth, after all data before it, plus the delay and a random jitter.
+ * Data never overtakes data sent before it, as on a TCP connection.
+ *
+ * Clients reach servers through the proxy with a configuration file listing
+ * the proxy ports in place of the server ports. Redirects after a migration
+ * carry the address of the new owner, which clients then reach directly.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+using namespace std;
+
+/**
+ * @def CHUNK
+ * Largest piece of data read at once, in bytes.
+ */
+#define CHUNK	16384
+/**
+ * @def MAXQUEUED
+ * Bytes a direction holds before it stops reading, so that a slow link
+ * pushes back on the sender instead of filling memory.
+ */
+#define MAXQUEUED	(4 * 1024 * 1024)
+/**
+ * @def BACKLOG
+ * Pending connections on a local port.
+ */
+#define BACKLOG	64
+
+/**
+ * Directions, indexes of shapes.
+ */
+enum direction { UP, DOWN };
+
+/**
+ * @struct shape dm_shape.cpp
+ * @brief Network conditions of a direction.
+ */
+struct shape {
+	/**
+	 * One-way delay in nanoseconds.
+	 */
+	double delay;
+
+	/**
+	 * Jitter in nanoseconds: delay varies uniformly by up to this much
+	 * either way.
+	 */
+	double jitter;
+
+	/**
+	 * Bandwidth in bytes per nanosecond, 0 for no limit.
+	 */
+	double rate;
+};
+
+/**
+ * Conditions of client to server (UP) and server to client (DOWN) direction.
+ */
+static shape shapes[2];
+
+/**
+ * @struct chunk dm_shape.cpp
+ * @brief A piece of data waiting to be sent.
+ */
+struct chunk {
+	/**
+	 * Time it is due at.
+	 */
+	unsigned long long due;
+
+	/**
+	 * Size in bytes, 0 for end of data.
+	 */
+	int size;
+
+	/**
+	 * Data.
+	 */
+	char *data;
+};
+
+struct connection;
+
+/**
+ * @struct stream dm_shape.cpp
+ * @brief A direction of a forwarded connection.
+ */
+struct stream {
+	/**
+	 * Socket data is read from.
+	 */
+	int from;
+
+	/**
+	 * Socket data is sent to.
+	 */
+	int to;
+
+	/**
+	 * Conditions of direction.
+	 */
+	shape *s;
+
+	/**
+	 * Connection of stream.
+	 */
+	connection *conn;
+
+	/**
+	 * Mutex protecting queue, queued and dead.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Condition signaled when queue changes.
+	 */
+	pthread_cond_t cond;
+
+	/**
+	 * Data waiting to be sent, in order.
+	 */
+	deque<chunk> queue;
+
+	/**
+	 * Bytes in queue.
+	 */
+	int queued;
+
+	/**
+	 * True if destination failed: nothing more is sent.
+	 */
+	bool dead;
+
+	/**
+	 * Time last byte read has been transmitted at, accessed by reader
+	 * only.
+	 */
+	unsigned long long sent;
+
+	/**
+	 * Time last chunk is due at, accessed by reader only.
+	 */
+	unsigned long long last;
+
+	/**
+	 * Seed of jitter, accessed by reader only.
+	 */
+	unsigned int seed;
+};
+
+/**
+ * @struct connection dm_shape.cpp
+ * @brief A forwarded connection.
+ */
+struct connection {
+	/**
+	 * Client to server and server to client streams.
+	 */
+	stream streams[2];
+
+	/**
+	 * Mutex protecting running.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Threads still running; the last one closes sockets.
+	 */
+	int running;
+};
+
+/**
+ * @struct route dm_shape.cpp
+ * @brief A local port and the server it forwards to.
+ */
+struct route {
+	/**
+	 * Listening socket.
+	 */
+	int sd;
+
+	/**
+	 * Server address.
+	 */
+	sockaddr_in server;
+};
+
+/**
+ * Returns monotonic time.
+ * @return	Time in nanoseconds.
+ */
+static unsigned long long now ()
+{
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Ends a thread of a connection. The last one closes sockets and frees
+ * connection.
+ * @param[in]	c Connection.
+ * @return	No value is returned.
+ */
+static void finish (connection *c)
+{
+	pthread_mutex_lock (&c->mutex);
+	int left = --c->running;
+	pthread_mutex_unlock (&c->mutex);
+	if (left > 0)
+		return;
+
+	close (c->streams[UP].from);
+	close (c->streams[UP].to);
+	for (int i = 0; i < 2; i++) {
+		stream *s = &c->streams[i];
+		for (unsigned int j = 0; j < s->queue.size (); j++)
+			delete[] s->queue[j].data;
+		pthread_mutex_destroy (&s->mutex);
+		pthread_cond_destroy (&s->cond);
+	}
+	pthread_mutex_destroy (&c->mutex);
+	delete c;
+}
+
+/**
+ * Reader thread of a stream: schedules data as it arrives.
+ * @param[in]	in Stream.
+ */
+static void *reader (void *in)
+{
+	stream *s = (stream *) in;
+	while (1) {
+		pthread_mutex_lock (&s->mutex);
+		while (s->queued >= MAXQUEUED && !s->dead)
+			pthread_cond_wait (&s->cond, &s->mutex);
+		bool dead = s->dead;
+		pthread_mutex_unlock (&s->mutex);
+		if (dead)
+			break;
+
+		chunk c;
+		c.data = new char[CHUNK];
+		c.size = read (s->from, c.data, CHUNK);
+		if (c.size < 0)
+			c.size = 0;
+
+		// transmitted after data before it, then delayed
+		unsigned long long t = now ();
+		if (s->sent > t)
+			t = s->sent;
+		if (s->s->rate > 0)
+			t += (unsigned long long) (c.size / s->s->rate);
+		s->sent = t;
+		double d = s->s->delay;
+		if (s->s->jitter > 0)
+			d += s->s->jitter *
+			     (2.0 * rand_r (&s->seed) / RAND_MAX - 1);
+		c.due = t + (d > 0 ? (unsigned long long) d : 0);
+		if (c.due < s->last)
+			c.due = s->last;
+		s->last = c.due;
+
+		pthread_mutex_lock (&s->mutex);
+		s->queue.push_back (c);
+		s->queued += c.size;
+		pthread_cond_broadcast (&s->cond);
+		pthread_mutex_unlock (&s->mutex);
+		if (c.size == 0)
+			break;
+	}
+	finish (s->conn);
+	return NULL;
+}
+
+/**
+ * Writer thread of a stream: sends data when due.
+ * @param[in]	in Stream.
+ */
+static void *writer (void *in)
+{
+	stream *s = (stream *) in;
+	while (1) {
+		pthread_mutex_lock (&s->mutex);
+		while (s->queue.empty ())
+			pthread_cond_wait (&s->cond, &s->mutex);
+		chunk c = s->queue.front ();
+		pthread_mutex_unlock (&s->mutex);
+
+		timespec ts;
+		ts.tv_sec = c.due / 1000000000ULL;
+		ts.tv_nsec = c.due % 1000000000ULL;
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL) != 0)
+			;
+
+		if (c.size == 0) {
+			// end of data: passed on, other direction goes on
+			shutdown (s->to, SHUT_WR);
+			break;
+		}
+		int done = 0;
+		while (done < c.size) {
+			int n = write (s->to, c.data + done, c.size - done);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+
+		pthread_mutex_lock (&s->mutex);
+		s->queue.pop_front ();
+		s->queued -= c.size;
+		if (done < c.size)
+			s->dead = true;
+		pthread_cond_broadcast (&s->cond);
+		pthread_mutex_unlock (&s->mutex);
+		delete[] c.data;
+		if (done < c.size) {
+			// destination failed: stop reader
+			shutdown (s->from, SHUT_RD);
+			break;
+		}
+	}
+	finish (s->conn);
+	return NULL;
+}
+
+/**
+ * Acceptor thread of a route: forwards every connection accepted.
+ * @param[in]	in Route.
+ */
+static void *acceptor (void *in)
+{
+	route *r = (route *) in;
+	while (1) {
+		int csd = accept (r->sd, NULL, NULL);
+		if (csd == -1) {
+			printf ("Dm_shape: Unable to accept connection\n");
+			exit (1);
+		}
+		int ssd = socket (AF_INET, SOCK_STREAM, 0);
+		if (ssd == -1 || connect (ssd, (sockaddr *) &r->server,
+					  sizeof(sockaddr_in)) == -1) {
+			// client sees the same failure as without proxy
+			if (ssd != -1)
+				close (ssd);
+			close (csd);
+			continue;
+		}
+		// proxy itself adds no delay
+		int opt = 1;
+		setsockopt (csd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+		setsockopt (ssd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+
+		connection *c = new connection;
+		pthread_mutex_init (&c->mutex, 0);
+		c->running = 4;
+		for (int i = 0; i < 2; i++) {
+			stream *s = &c->streams[i];
+			s->from = i == UP ? csd : ssd;
+			s->to = i == UP ? ssd : csd;
+			s->s = &shapes[i];
+			s->conn = c;
+			pthread_mutex_init (&s->mutex, 0);
+			pthread_cond_init (&s->cond, 0);
+			s->queued = 0;
+			s->dead = false;
+			s->sent = 0;
+			s->last = 0;
+			s->seed = csd * 2 + i;
+		}
+		pthread_t tid;
+		for (int i = 0; i < 2; i++) {
+			pthread_create (&tid, 0, reader, &c->streams[i]);
+			pthread_detach (tid);
+			pthread_create (&tid, 0, writer, &c->streams[i]);
+			pthread_detach (tid);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Parses an option value for both directions: "up/down", or one value for
+ * both.
+ * @param[in]	arg Option value.
+ * @param[in]	unit Factor values are multiplied by.
+ * @param[out]	up Client to server value.
+ * @param[out]	down Server to client value.
+ * @return	0 on success, -1 on error.
+ */
+static int parse (char *arg, double unit, double *up, double *down)
+{
+	char *end;
+	*up = strtod (arg, &end) * unit;
+	*down = *up;
+	if (*end == '/')
+		*down = strtod (end + 1, &end) * unit;
+	if (*end != '\0' || end == arg || *up < 0 || *down < 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Dm_shape main function, usage is:
+ *
+ * dm_shape [-d ms] [-j ms] [-b mbit] port:address:server_port...
+ *
+ * Values of options are for both directions, or given as up/down for client
+ * to server and server to client direction, e.g. -d 5/20.
+ *
+ * @param[in]	port:address:server_port Local port and server it forwards
+ *		to; one per server.
+ * @param[in]	-d One-way delay in milliseconds (default 0).
+ * @param[in]	-j Jitter in milliseconds: delay varies uniformly by up to
+ *		this much either way (default 0).
+ * @param[in]	-b Bandwidth in megabits per second (default 0, no limit).
+ */
+int main (int argc, char *argv[])
+{
+	int c;
+	while ((c = getopt (argc, argv, "d:j:b:")) != -1) {
+		int ret;
+		if (c == 'd') {
+			ret = parse (optarg, 1e6, &shapes[UP].delay,
+				     &shapes[DOWN].delay);
+		} else if (c == 'j') {
+			ret = parse (optarg, 1e6, &shapes[UP].jitter,
+				     &shapes[DOWN].jitter);
+		} else if (c == 'b') {
+			// megabits per second to bytes per nanosecond
+			ret = parse (optarg, 1e6 / 8 / 1e9, &shapes[UP].rate,
+				     &shapes[DOWN].rate);
+		} else {
+			ret = -1;
+		}
+		if (ret == -1) {
+			printf ("Dm_shape: Bad arguments\n");
+			exit (1);
+		}
+	}
+	if (optind == argc) {
+		printf ("Dm_shape: Bad arguments\n");
+		exit (1);
+	}
+
+	vector<route *> routes;
+	for (int i = optind; i < argc; i++) {
+		char address[64];
+		int port, server_port;
+		if (sscanf (argv[i], "%d:%63[^:]:%d", &port, address,
+			    &server_port) != 3) {
+			printf ("Dm_shape: Bad arguments\n");
+			exit (1);
+		}
+
+		route *r = new route;
+		memset ((void *) &r->server, 0, sizeof(sockaddr_in));
+		r->server.sin_family = AF_INET;
+		r->server.sin_port = htons (server_port);
+		if (inet_pton (AF_INET, address, &r->server.sin_addr) != 1) {
+			printf ("Dm_shape: Bad address %s\n", address);
+			exit (1);
+		}
+
+		sockaddr_in s_addr;
+		memset ((void *) &s_addr, 0, sizeof(sockaddr_in));
+		s_addr.sin_family = AF_INET;
+		s_addr.sin_addr.s_addr = INADDR_ANY;
+		s_addr.sin_port = htons (port);
+		r->sd = socket (AF_INET, SOCK_STREAM, 0);
+		int opt = 1;
+		if (r->sd == -1 || setsockopt (r->sd, SOL_SOCKET, SO_REUSEADDR,
+					       &opt, sizeof(int)) == -1 ||
+		    bind (r->sd, (sockaddr *) &s_addr,
+			  sizeof(sockaddr_in)) == -1 ||
+		    listen (r->sd, BACKLOG) == -1) {
+			printf ("Dm_shape: Unable to listen on port %d\n",
+				port);
+			exit (1);
+		}
+		routes.push_back (r);
+	}
+
+	pthread_t tid;
+	for (unsigned int i = 1; i < routes.size (); i++)
+		pthread_create (&tid, 0, acceptor, routes[i]);
+	acceptor (routes[0]);
+}
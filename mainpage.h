@@ -24,13 +24,24 @@
  * More than one Server can be instantiated, and they provide different portions
  * of a Distributed Memory.
  *
- * Server and clients interact with a simple protocol.
+ * A Server may stream every write to replica Servers. Clients can then read
+ * replicated blocks from any copy, while writes still go to the primary Server.
+ *
+ * Ranges of blocks can be moved between running Servers. Clients are redirected
+ * to the new owner and keep their mappings.
+ *
+ * Server and clients interact with a simple protocol. Every message is a frame:
+ * a header with protocol version, type, tag and payload length, followed by
+ * the payload (see frame.h). Clients open each connection with a HELLO request,
+ * which negotiates block size and capabilities.
  * Client Requests:
  * - Map request: message <MAP, ID>
  * - Unmap request: message <UNMAP, ID>
  * - Update request: message <UPDATE, ID>
  * - Write request: message <WRITE, ID, data>
  * - Wait request: message <WAIT, ID>
+ * - Read range request: message <READ_RANGE, ID, offset, length>
+ * - Write range request: message <WRITE_RANGE, ID, offset, length, data>
  *
  * Server replies:
  * - Map reply: message <OK, data>
@@ -39,6 +50,8 @@
  * - Write reply: message <OK>
  * - Generic error reply: message <ERROR>
  * - Write error reply: message <ERROR, INVALID> or message <ERROR, UNMAPPED>
+ * - Read range replies: message <OK, data> or message <UPDATED>
+ * - Write range replies: same as write replies
  *
  * All messages are defined in msg.h file.
  *
@@ -7,141 +7,722 @@
  * @date June 2010
  */
 
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
 #include "block.h"
+#include "scan.h"
+
+int Block::sampling = 0;
+
+bool Block::elide = false;
+
+bool Block::lagging = false;
+
+/**
+ * Data of blocks never written, shared by all of them.
+ */
+static char zero_page[DIMBLOCK];
+
+/**
+ * Returns monotonic time.
+ * @return	Time in nanoseconds.
+ */
+static unsigned long long clock_ns ()
+{
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 Block::Block ()
 {
-	data = new char[DIMBLOCK];
-	memset (data, 0, DIMBLOCK);
+	// storage is allocated on first write
+	data = zero_page;
 	curr_version = 0;
 	pthread_mutex_init (&mutex, 0);
 	pthread_cond_init (&waitcond, 0);
 	blockwait = 0;
+	moved = false;
+	reads = 0;
+	writes = 0;
+	prof = NULL;
+	if (sampling > 0)
+		// value initialization: all counters are zero
+		prof = new lock_profile ();
 }
 
 Block::~Block ()
 {
-	delete[] data;
+	if (data != zero_page)
+		delete[] data;
+	delete prof;
 }
 
-int Block::bmap (int sd, char *buf)
+void Block::own ()
 {
-	pthread_mutex_lock (&mutex);
+	if (data != zero_page)
+		return;
 
-	if (cmap.find (sd) != cmap.end ()) {
-		// if block is not mapped to client sd: error
-		pthread_mutex_unlock (&mutex);
+	data = new char[DIMBLOCK];
+	memset (data, 0, DIMBLOCK);
+}
+
+void Block::lock (client_id cid)
+{
+	if (prof == NULL) {
+		pthread_mutex_lock (&mutex);
+		return;
+	}
+
+	// only a busy mutex is timed: waiting costs far more than the clock
+	if (pthread_mutex_trylock (&mutex) != 0) {
+		unsigned long long start = clock_ns ();
+		pthread_mutex_lock (&mutex);
+		unsigned long long waited = clock_ns () - start;
+		prof->contended++;
+		prof->wait_ns += waited;
+		if (waited > prof->max_wait_ns)
+			prof->max_wait_ns = waited;
+		// holder is still the client that made this thread wait, or
+		// the last of them
+		prof->blame[prof->holder] += waited;
+	}
+	prof->acquisitions++;
+	prof->holder = cid;
+	prof->since = prof->acquisitions % sampling == 0 ? clock_ns () : 0;
+}
+
+void Block::end_hold ()
+{
+	if (prof == NULL || prof->since == 0)
+		return;
+
+	unsigned long long held = clock_ns () - prof->since;
+	prof->sampled++;
+	prof->hold_ns += held;
+	if (held > prof->max_hold_ns)
+		prof->max_hold_ns = held;
+	prof->since = 0;
+}
+
+void Block::unlock ()
+{
+	end_hold ();
+	pthread_mutex_unlock (&mutex);
+}
+
+int Block::await (client_id cid, const timespec *until)
+{
+	int ret;
+	if (prof == NULL) {
+		if (until == NULL)
+			return pthread_cond_wait (&waitcond, &mutex);
+		return pthread_cond_timedwait (&waitcond, &mutex, until);
+	}
+
+	// mutex is released while waiting: a sampled hold ends here
+	end_hold ();
+	if (until == NULL)
+		ret = pthread_cond_wait (&waitcond, &mutex);
+	else
+		ret = pthread_cond_timedwait (&waitcond, &mutex, until);
+	prof->wakeups++;
+	prof->holder = cid;
+	return ret;
+}
+
+/**
+ * Computes the time limit of a wait on a condition variable.
+ * @param[out]	ts Absolute time limit, on CLOCK_REALTIME.
+ * @param[in]	seconds Seconds from now.
+ * @return	No value is returned.
+ */
+static void deadline (timespec *ts, int seconds)
+{
+	clock_gettime (CLOCK_REALTIME, ts);
+	ts->tv_sec += seconds;
+}
+
+int Block::bmap (client_id cid, char *buf)
+{
+	lock (cid);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	if (cmap.find (cid) != cmap.end ()) {
+		// if block is not mapped to client cid: error
+		unlock ();
 		return -1;
 	}
 
-	cmap[sd] = curr_version;
+	cmap[cid] = curr_version;
 	memcpy (buf, data, DIMBLOCK);
+	reads++;
 
-	pthread_mutex_unlock (&mutex);
+	unlock ();
 
 	return 0;
 }
 
-int Block::unmap (int sd)
+int Block::unmap (client_id cid)
 {
-	pthread_mutex_lock (&mutex);
+	lock (cid);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
 
-	if (cmap.find (sd) == cmap.end ()) {
-		// if block is not mapped to client sd: error
-		pthread_mutex_unlock (&mutex);
+	if (cmap.find (cid) == cmap.end ()) {
+		// if block is not mapped to client cid: error
+		unlock ();
 		return -1;
 	}
 
-	cmap.erase (sd);
+	cmap.erase (cid);
+	served.erase (cid);
 
-	pthread_mutex_unlock (&mutex);
+	unlock ();
 
 	return 0;
 }
 
-int Block::write (int sd, char *buf)
+bool Block::resent (client_id cid, int serial)
+{
+	if (serial == 0)
+		return false;
+	map<client_id, int>::iterator it = served.find (cid);
+	return it != served.end () && it->second == serial;
+}
+
+int Block::write (client_id cid, char *buf, int serial)
+{
+	return write_range (cid, buf, 0, DIMBLOCK, serial);
+}
+
+int Block::write_range (client_id cid, char *buf, int offset, int length,
+			int serial)
 {
-	pthread_mutex_lock (&mutex);
+	lock (cid);
 
-	if (cmap.find (sd) == cmap.end ()) {
-		// if block is not mapped to client sd: error
-		pthread_mutex_unlock (&mutex);
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	if (cmap.find (cid) == cmap.end ()) {
+		// if block is not mapped to client cid: error
+		unlock ();
 		return -1;
 	}
 
-	if (cmap[sd] != curr_version) {
-		// if block is invalid for client sd
-		pthread_mutex_unlock (&mutex);
+	if (resent (cid, serial)) {
+		// write already applied, only its reply was lost: it may
+		// have been overwritten since
+		unlock ();
+		return 0;
+	}
+
+	if (cmap[cid] != curr_version) {
+		// if block is invalid for client cid
+		unlock ();
 		return -2;
 	}
 
+	if (serial != 0)
+		served[cid] = serial;
+
+	if (elide && memcmp (data + offset, buf, length) == 0) {
+		// nothing changes: every valid copy stays valid, client's
+		// one included
+		unlock ();
+		return 1;
+	}
+
 	curr_version++;
-	cmap[sd]++;
-	memcpy (data, buf, DIMBLOCK);
+	cmap[cid]++;
+	own ();
+	memcpy (data + offset, buf, length);
+	writes++;
 
 	if (blockwait != 0)
 		// all clients waiting for their copies to become invalid must
 		// be waken up. all their local copies are invalidated
 		pthread_cond_broadcast (&waitcond);
 
-	pthread_mutex_unlock (&mutex);
+	unlock ();
 
 	return 0;
 }
 
-int Block::update (int sd, char *buf)
+int Block::update (client_id cid, char *buf, int serial)
 {
-	pthread_mutex_lock (&mutex);
+	lock (cid);
 
-	if (cmap.find (sd) == cmap.end ()) {
-		// if block is not mapped to client sd: error
-		pthread_mutex_unlock (&mutex);
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	if (cmap.find (cid) == cmap.end ()) {
+		// if block is not mapped to client cid: error
+		unlock ();
 		return -1;
 	}
 
-	if (cmap[sd] == curr_version) {
-		// block is already up to date for client sd
-		pthread_mutex_unlock (&mutex);
+	reads++;
+	if (cmap[cid] == curr_version && !resent (cid, serial)) {
+		// block is already up to date for client cid. A resent update
+		// transfers data again, client didn't get it
+		unlock ();
 		return 1;
 	}
 
-	cmap[sd] = curr_version;
+	cmap[cid] = curr_version;
+	if (serial != 0)
+		served[cid] = serial;
 	memcpy (buf, data, DIMBLOCK);
 
-	pthread_mutex_unlock (&mutex);
+	unlock ();
+
+	return 0;
+}
+
+int Block::read_range (client_id cid, char *buf, int offset, int length)
+{
+	lock (cid);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	if (cmap.find (cid) == cmap.end ()) {
+		// if block is not mapped to client cid: error
+		unlock ();
+		return -1;
+	}
+
+	reads++;
+	if (cmap[cid] == curr_version) {
+		// block is already up to date for client cid
+		unlock ();
+		return 1;
+	}
+
+	// client's version is left untouched: only a slice is transferred
+	memcpy (buf, data + offset, length);
+
+	unlock ();
 
 	return 0;
 }
 
-int Block::wait (int sd)
+int Block::wait (client_id cid, int seconds)
 {
-	pthread_mutex_lock (&mutex);
+	timespec until;
+	if (seconds >= 0)
+		deadline (&until, seconds);
+	lock (cid);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
 
-	if (cmap.find (sd) == cmap.end ()) {
-		// if block is not mapped to client sd: error
-		pthread_mutex_unlock (&mutex);
+	if (cmap.find (cid) == cmap.end ()) {
+		// if block is not mapped to client cid: error
+		unlock ();
 		return -1;
 	}
 
 	// if is enough, because once curr_version has been incremented it
 	// cannot be decremented.
-	if (cmap[sd] == curr_version) {
+	bool expired = false;
+	if (cmap[cid] == curr_version) {
 		blockwait++;
-		pthread_cond_wait (&waitcond, &mutex);
+		expired = await (cid, seconds >= 0 ? &until : NULL) ==
+			  ETIMEDOUT;
 		blockwait--;
 	}
 
-	pthread_mutex_unlock (&mutex);
+	if (moved) {
+		// block moved while waiting: client will wait on new server
+		unlock ();
+		return -4;
+	}
+
+	if (expired && cmap[cid] == curr_version) {
+		unlock ();
+		return -6;
+	}
+
+	unlock ();
 
 	return 0;
 }
 
-void Block::clean (int sd)
+void Block::clean (client_id cid)
 {
-	pthread_mutex_lock (&mutex);
+	lock (cid);
 
-	if (cmap.find (sd) != cmap.end ())
-		cmap.erase (sd);
+	if (cmap.find (cid) != cmap.end ())
+		cmap.erase (cid);
+	served.erase (cid);
 
-	pthread_mutex_unlock (&mutex);
+	unlock ();
+}
+
+int Block::snapshot (char *buf)
+{
+	lock (ANONYMOUS);
+
+	if (moved) {
+		unlock ();
+		return -1;
+	}
+
+	memcpy (buf, data, DIMBLOCK);
+	int version = curr_version;
+
+	unlock ();
+
+	return version;
+}
+
+void Block::replicate (int version, char *buf)
+{
+	lock (ANONYMOUS);
+
+	// writes on different blocks of primary may be streamed in any order,
+	// older data must not overwrite newer one
+	if (version > curr_version) {
+		curr_version = version;
+		own ();
+		memcpy (data, buf, DIMBLOCK);
+		writes++;
+
+		if (blockwait != 0)
+			pthread_cond_broadcast (&waitcond);
+	}
+
+	unlock ();
+}
+
+int Block::vupdate (int version, char *buf, int *curr)
+{
+	lock (ANONYMOUS);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	if (__atomic_load_n (&lagging, __ATOMIC_RELAXED)) {
+		// data may be stale: client reads from primary server
+		unlock ();
+		return -5;
+	}
+
+	reads++;
+	if (version >= curr_version) {
+		// client's block is up to date, or this replica lags behind
+		unlock ();
+		return 1;
+	}
+
+	*curr = curr_version;
+	memcpy (buf, data, DIMBLOCK);
+
+	unlock ();
+
+	return 0;
+}
+
+int Block::vwrite (int version, char *buf)
+{
+	lock (ANONYMOUS);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	if (version != curr_version) {
+		// client's block is invalid
+		unlock ();
+		return -2;
+	}
+
+	curr_version++;
+	own ();
+	memcpy (data, buf, DIMBLOCK);
+	writes++;
+
+	if (blockwait != 0)
+		pthread_cond_broadcast (&waitcond);
+
+	unlock ();
+
+	return 0;
+}
+
+int Block::vwait (int version, int seconds)
+{
+	timespec until;
+	if (seconds >= 0)
+		deadline (&until, seconds);
+	lock (ANONYMOUS);
+
+	// while is needed: a replica may be waken up by data still older than
+	// client's version
+	bool expired = false;
+	blockwait++;
+	while (version >= curr_version && !moved && !expired &&
+	       !__atomic_load_n (&lagging, __ATOMIC_RELAXED))
+		expired = await (ANONYMOUS, seconds >= 0 ? &until : NULL) ==
+			  ETIMEDOUT;
+	blockwait--;
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	if (version >= curr_version) {
+		unlock ();
+		if (expired && !__atomic_load_n (&lagging, __ATOMIC_RELAXED))
+			return -6;
+		// replica lost its primary server: no newer version may come
+		return -5;
+	}
+
+	unlock ();
+
+	return 0;
+}
+
+void Block::wake ()
+{
+	lock (ANONYMOUS);
+	if (blockwait != 0)
+		pthread_cond_broadcast (&waitcond);
+	unlock ();
+}
+
+int Block::stale (client_id cid)
+{
+	lock (cid);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	map<client_id, int>::iterator it = cmap.find (cid);
+	int ret = it == cmap.end () ? 2 : it->second != curr_version;
+
+	unlock ();
+
+	return ret;
+}
+
+int Block::scan (Scan *s, int length)
+{
+	lock (ANONYMOUS);
+
+	if (moved) {
+		// block is now owned by another server
+		unlock ();
+		return -4;
+	}
+
+	reads++;
+	s->run (data, length);
+
+	unlock ();
+
+	return 0;
+}
+
+/**
+ * Stores an integer in network byte order.
+ * @param[out]	buf Destination buffer.
+ * @param[in]	n Value to be stored.
+ * @return	Pointer to first byte following stored value.
+ */
+static char *put_int (char *buf, int n)
+{
+	n = htonl (n);
+	memcpy (buf, &n, sizeof(int));
+	return buf + sizeof(int);
+}
+
+/**
+ * Reads an integer stored in network byte order.
+ * @param[in]	buf Source buffer.
+ * @param[out]	n Read value.
+ * @return	Pointer to first byte following read value.
+ */
+static char *get_int (char *buf, int *n)
+{
+	memcpy (n, buf, sizeof(int));
+	*n = ntohl (*n);
+	return buf + sizeof(int);
+}
+
+int Block::migrate (int (*transfer) (char *state, int size, void *arg),
+		    void *arg)
+{
+	lock (ANONYMOUS);
+
+	if (moved) {
+		unlock ();
+		return 1;
+	}
+
+	// state format: <version, n, data, n * <client high, client low,
+	// version>, m, m * <client high, client low, serial>>. Serials let
+	// the new owner recognize requests resent after their reply was lost
+	int size = (3 + 3 * cmap.size () + 3 * served.size ()) * sizeof(int) +
+		   DIMBLOCK;
+	char *state = new char[size];
+	char *p = put_int (state, curr_version);
+	p = put_int (p, cmap.size ());
+	memcpy (p, data, DIMBLOCK);
+	p += DIMBLOCK;
+	for (map<client_id, int>::iterator it = cmap.begin ();
+	     it != cmap.end (); it++) {
+		p = put_int (p, (int) (it->first >> 32));
+		p = put_int (p, (int) it->first);
+		p = put_int (p, it->second);
+	}
+	p = put_int (p, served.size ());
+	for (map<client_id, int>::iterator it = served.begin ();
+	     it != served.end (); it++) {
+		p = put_int (p, (int) (it->first >> 32));
+		p = put_int (p, (int) it->first);
+		p = put_int (p, it->second);
+	}
+
+	// block stays locked during transfer: clients requests are served
+	// either here, before transfer, or on the other server after it
+	int ret = transfer (state, size, arg);
+	delete[] state;
+	if (ret == -1) {
+		unlock ();
+		return -1;
+	}
+
+	moved = true;
+	cmap.clear ();
+	served.clear ();
+	if (data != zero_page)
+		delete[] data;
+	data = NULL;
+
+	if (blockwait != 0)
+		// waiting clients must be redirected
+		pthread_cond_broadcast (&waitcond);
+
+	unlock ();
+
+	return 0;
+}
+
+int Block::adopt (char *state, int size)
+{
+	int version, n, m;
+	if (size < (int) (3 * sizeof(int)) + DIMBLOCK)
+		return -1;
+	char *p = get_int (state, &version);
+	p = get_int (p, &n);
+	if (n < 0 || n > size ||
+	    size < (int) ((3 + 3 * n) * sizeof(int)) + DIMBLOCK)
+		return -1;
+	get_int (p + DIMBLOCK + 3 * n * sizeof(int), &m);
+	if (m < 0 || m > size ||
+	    size != (int) ((3 + 3 * n + 3 * m) * sizeof(int)) + DIMBLOCK)
+		return -1;
+
+	lock (ANONYMOUS);
+
+	// block may come back to a server it was moved from
+	if (data == NULL)
+		data = zero_page;
+	own ();
+	moved = false;
+	curr_version = version;
+	memcpy (data, p, DIMBLOCK);
+	p += DIMBLOCK;
+	cmap.clear ();
+	for (int i = 0; i < n; i++) {
+		int high, low, v;
+		p = get_int (p, &high);
+		p = get_int (p, &low);
+		p = get_int (p, &v);
+		client_id cid = ((client_id) high << 32) |
+				(unsigned int) low;
+		cmap[cid] = v;
+	}
+	p += sizeof(int);
+	served.clear ();
+	for (int i = 0; i < m; i++) {
+		int high, low, serial;
+		p = get_int (p, &high);
+		p = get_int (p, &low);
+		p = get_int (p, &serial);
+		client_id cid = ((client_id) high << 32) |
+				(unsigned int) low;
+		served[cid] = serial;
+	}
+
+	unlock ();
+
+	return 0;
+}
+
+int Block::activity (unsigned long long *r, unsigned long long *w,
+		     int *waiting)
+{
+	lock (ANONYMOUS);
+
+	if (moved) {
+		unlock ();
+		return -1;
+	}
+
+	*r = reads;
+	*w = writes;
+	*waiting = blockwait;
+
+	unlock ();
+
+	return 0;
+}
+
+int Block::contention (lock_profile *p)
+{
+	if (prof == NULL)
+		return -1;
+
+	lock (ANONYMOUS);
+	*p = *prof;
+	unlock ();
+
+	return 0;
 }
@@ -15,12 +15,97 @@
 #include <string.h>
 using namespace std;
 
+class Scan;
+
 /**
  * @def DIMBLOCK
  * Block dimension in bytes.
  */
 #define DIMBLOCK 128
 
+/**
+ * Client identifier. A client is identified by the token it sends in its HELLO
+ * request, so that it is recognized by every server, even after its blocks
+ * have been moved. A client which sent no HELLO request is identified by its
+ * socket descriptor.
+ */
+typedef long long client_id;
+
+/**
+ * @def ANONYMOUS
+ * Client identifier of operations made on behalf of no client: versioned
+ * requests, replication, migration and reports.
+ */
+#define ANONYMOUS ((client_id) -1)
+
+/**
+ * @struct lock_profile block.h "block.h"
+ * @brief Lock contention of a block, recorded in profiling mode.
+ *
+ * Every acquisition is counted. An acquisition finding the mutex busy is
+ * timed, and its wait is blamed on the client which held the mutex last.
+ * Hold time is measured on one acquisition in Block::sampling only, so that
+ * uncontended operations pay no clock reads.
+ */
+struct lock_profile {
+	/**
+	 * Acquisitions of block mutex.
+	 */
+	unsigned long long acquisitions;
+
+	/**
+	 * Acquisitions which found mutex busy.
+	 */
+	unsigned long long contended;
+
+	/**
+	 * Total time waited on busy mutex, in nanoseconds.
+	 */
+	unsigned long long wait_ns;
+
+	/**
+	 * Longest wait on busy mutex, in nanoseconds.
+	 */
+	unsigned long long max_wait_ns;
+
+	/**
+	 * Acquisitions whose hold time was measured.
+	 */
+	unsigned long long sampled;
+
+	/**
+	 * Total hold time of sampled acquisitions, in nanoseconds.
+	 */
+	unsigned long long hold_ns;
+
+	/**
+	 * Longest hold time of sampled acquisitions, in nanoseconds.
+	 */
+	unsigned long long max_hold_ns;
+
+	/**
+	 * Returns from waits on condition variable.
+	 */
+	unsigned long long wakeups;
+
+	/**
+	 * Client holding mutex, or which held it last.
+	 */
+	client_id holder;
+
+	/**
+	 * Time current holder acquired mutex in nanoseconds, 0 if its hold
+	 * time is not sampled.
+	 */
+	unsigned long long since;
+
+	/**
+	 * Time in nanoseconds other clients waited for each client to release
+	 * mutex.
+	 */
+	map<client_id, unsigned long long> blame;
+};
+
 /**
  * @class Block block.h "block.h"
  * @brief Manages operations on a distributed memory block.
@@ -29,21 +114,30 @@ using namespace std;
  * can be performed by several threads at the same time. So a mutex semaphore is
  * provided. A condition variable is also provided, to ensure that a client
  * blocks while performing a wait operation until block is modified.
+ *
+ * Once a block has been moved to another server, all operations requested by
+ * clients return -4, so that clients can be redirected.
  */
 class Block {
 
 	/**
-	 * Data stored in memory block.
+	 * Data stored in memory block. Blocks never written share a page of
+	 * zeros, storage of their own is allocated by own().
 	 */
 	char *data;
 
 	/**
 	 * Maps a client identification with the version stored in client's
 	 * local memory (which may be different from current block version).
-	 * Clients are identified through their socket number, which doesn't
-	 * change while connection is up (connection with client is persistent).
 	 */
-	map<int, int> cmap;
+	map<client_id, int> cmap;
+
+	/**
+	 * Serial of the last update or write served to each client which
+	 * sent one. A request resent with the same serial, because its reply
+	 * was lost, is answered as it was the first time.
+	 */
+	map<client_id, int> served;
 
 	/**
 	 * Current block version. Identifies valid or invalid client blocks, if
@@ -67,10 +161,100 @@ class Block {
 	 * Number of clients (or threads) blocked on condition variable
 	 */
 	int blockwait;
+
+	/**
+	 * True if block has been moved to another server. A moved block keeps
+	 * no data, all operations on it return -4.
+	 */
+	bool moved;
+
+	/**
+	 * Read requests served: map, update, read range and versioned update.
+	 */
+	unsigned long long reads;
+
+	/**
+	 * Writes stored, from clients or from primary server.
+	 */
+	unsigned long long writes;
+
+	/**
+	 * Lock contention, NULL unless profiling.
+	 */
+	lock_profile *prof;
+
+	/**
+	 * Locks block mutex on behalf of a client, recording contention if
+	 * profiling.
+	 * @param[in]	cid Client identifier.
+	 * @return	No value is returned.
+	 */
+	void lock (client_id cid);
+
+	/**
+	 * Records hold time of current holder, if sampled. Block mutex must
+	 * be held.
+	 * @return	No value is returned.
+	 */
+	void end_hold ();
+
+	/**
+	 * Tells whether a request is resent, i.e. it has the serial of the
+	 * last update or write served to client. Block mutex must be held.
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	serial Serial of request, 0 if none.
+	 * @return	True if request has already been served.
+	 */
+	bool resent (client_id cid, int serial);
+
+	/**
+	 * Unlocks block mutex, recording hold time if sampled.
+	 * @return	No value is returned.
+	 */
+	void unlock ();
+
+	/**
+	 * Waits on condition variable on behalf of a client, block mutex
+	 * must be held. Wakeups are counted if profiling.
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	until Absolute time limit on CLOCK_REALTIME, NULL for
+	 *		none.
+	 * @return	0 when woken up, ETIMEDOUT if time limit expired.
+	 */
+	int await (client_id cid, const timespec *until = NULL);
+
+	/**
+	 * Gives block storage of its own, if it still shares the page of
+	 * zeros. Must be called with block mutex held, before data is
+	 * modified.
+	 * @return	No value is returned.
+	 */
+	void own ();
 public:
+	/**
+	 * One acquisition every sampling has its hold time measured, 0 if
+	 * locks are not profiled. Only blocks created afterwards are profiled.
+	 */
+	static int sampling;
+
+	/**
+	 * If true, a write leaving data unchanged succeeds without changing
+	 * version: no client's copy is invalidated and no waiting client is
+	 * waken up. Versioned writes are not affected, since their clients
+	 * count on version being incremented.
+	 */
+	static bool elide;
+
+	/**
+	 * True on a replica whose primary server went quiet (see LEASE): its
+	 * data may be stale, so versioned reads and waits are refused.
+	 */
+	static bool lagging;
+
 	/**
 	 * Block constructor. Initializes Block data structures. Data in block
-	 * are set to zero, and so is current version.
+	 * are zero, and so is current version; no storage is allocated until
+	 * block is written.
 	 * @return	No value is returned.
 	 */
 	Block ();
@@ -83,58 +267,214 @@ public:
 
 	/**
 	 * Maps client to block.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @param[out]	buf In it is stored block data.
 	 * @return	0 on success, -1 on error (if block is already mapped to
 	 *		that client).
 	 */
-	int bmap (int sd, char *buf);
+	int bmap (client_id cid, char *buf);
 
 	/**
 	 * Unmaps client from block.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @return	0 on success, -1 on error (if block is not mapped to
 	 *		that client).
 	 */
-	int unmap (int sd);
+	int unmap (client_id cid);
 
 	/**
 	 * Writes data in block.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @param[in]	buf Contains data to be stored.
-	 * @return	0 on success. On error -1 is returned if block isn't
-	 *		mapped to that client. -2 is returned if version
-	 *		associated to that client is different from current
-	 *		version (invalid block).
+	 * @param[in]	serial Serial of request, 0 if none. A write resent
+	 *		with the serial of the last one served to the client
+	 *		is not applied again.
+	 * @return	0 on success, also for a resent write, 1 if write was
+	 *		elided because data is unchanged (see elide). On error
+	 *		-1 is returned if block isn't mapped to that client. -2
+	 *		is returned if version associated to that client is
+	 *		different from current version (invalid block).
+	 */
+	int write (client_id cid, char *buf, int serial = 0);
+
+	/**
+	 * Writes a slice of data in block. Validation is the same as write(),
+	 * only length bytes starting at offset are modified. Range must be
+	 * inside the block, no check is done.
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	buf Contains data to be stored (length bytes).
+	 * @param[in]	offset First byte of the range inside the block.
+	 * @param[in]	length Number of bytes in the range.
+	 * @param[in]	serial As for write().
+	 * @return	As write().
 	 */
-	int write (int sd, char *buf);
+	int write_range (client_id cid, char *buf, int offset, int length,
+			 int serial = 0);
 
 	/**
 	 * Updates client's local block.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @param[out]	buf Filled with updated data.
+	 * @param[in]	serial Serial of request, 0 if none. An update resent
+	 *		with the serial of the last one served to the client
+	 *		transfers data again.
+	 * @return	1 if block is already up to date (current version and
+	 * 		client's version are the same). 0 on success, and data
+	 *		is stored in buf. On error -1 is returned if block isn't
+	 *		mapped to that client.
+	 */
+	int update (client_id cid, char *buf, int serial = 0);
+
+	/**
+	 * Reads a slice of block data. Unlike update(), client's version is
+	 * not changed, because the rest of client's local block is still
+	 * stale. Range must be inside the block, no check is done.
+	 * @param[in]	cid Client identifier.
+	 * @param[out]	buf Filled with length bytes of data.
+	 * @param[in]	offset First byte of the range inside the block.
+	 * @param[in]	length Number of bytes in the range.
 	 * @return	1 if block is already up to date (current version and
 	 * 		client's version are the same). 0 on success, and data
 	 *		is stored in buf. On error -1 is returned if block isn't
 	 *		mapped to that client.
 	 */
-	int update (int sd, char *buf);
+	int read_range (client_id cid, char *buf, int offset, int length);
 
 	/**
 	 * Waits for data to become invalid.
-	 * @param[in]	sd Client's socket descriptor used for identification.
-	 * @return	0 on success, when block becomes invalid. On error -1 is
-	 *		returned if block isn't mapped to that client.
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	seconds Time limit, -1 for none.
+	 * @return	0 on success, when block becomes invalid, -6 if time
+	 *		limit expired first. On error -1 is returned if block
+	 *		isn't mapped to that client.
 	 */
-	int wait (int sd);
+	int wait (client_id cid, int seconds = -1);
 
 	/**
-	 * Removes client's entry, identified by socket sd, from cmap. Used if
+	 * Removes client's entry, identified by cid, from cmap. Used if
 	 * client disconnects or crashes without unmapping blocks.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @return	No value is returned.
 	 */
-	void clean (int sd);
+	void clean (client_id cid);
+
+	/**
+	 * Copies current block data. No client identification is needed, used
+	 * to stream block content to replicas.
+	 * @param[out]	buf Filled with current data.
+	 * @return	Current block version, -1 if block has been moved.
+	 */
+	int snapshot (char *buf);
+
+	/**
+	 * Stores data received from primary server. Data is stored only if it
+	 * is newer than current data, so replicas never go back in time.
+	 * Clients waiting on block are waken up.
+	 * @param[in]	version Block version on primary server.
+	 * @param[in]	buf Contains data to be stored.
+	 * @return	No value is returned.
+	 */
+	void replicate (int version, char *buf);
+
+	/**
+	 * Updates a local block whose version is known by the client. Client
+	 * isn't registered in cmap.
+	 * @param[in]	version Version held by client, -1 if none.
+	 * @param[out]	buf Filled with updated data.
+	 * @param[out]	curr Filled with version of data stored in buf.
+	 * @return	1 if client's version is not older than current version
+	 *		(client's block is up to date or a replica is lagging
+	 *		behind). 0 on success, and data is stored in buf. -5
+	 *		if replica has lost its primary server (see lagging).
+	 */
+	int vupdate (int version, char *buf, int *curr);
+
+	/**
+	 * Writes data in block if client's version is the current one. Client
+	 * isn't registered in cmap.
+	 * @param[in]	version Version held by client.
+	 * @param[in]	buf Contains data to be stored.
+	 * @return	0 on success, -2 if version held by client is different
+	 *		from current version (invalid block).
+	 */
+	int vwrite (int version, char *buf);
+
+	/**
+	 * Waits for block version to become newer than client's version.
+	 * Client isn't registered in cmap.
+	 * @param[in]	version Version held by client.
+	 * @param[in]	seconds Time limit, -1 for none.
+	 * @return	0 on success, -4 if block has been moved, -5 if replica
+	 *		has lost its primary server, also while waiting, -6 if
+	 *		time limit expired.
+	 */
+	int vwait (int version, int seconds = -1);
+
+	/**
+	 * Wakes up clients waiting on block, so that they check again what
+	 * they are waiting for.
+	 * @return	No value is returned.
+	 */
+	void wake ();
+
+	/**
+	 * Tells whether client's local block is stale.
+	 * @param[in]	cid Client identifier.
+	 * @return	1 if block is mapped to client and its version differs
+	 *		from current version, 0 if it is mapped and current, 2
+	 *		if it is not mapped to client, -4 if block has been
+	 *		moved.
+	 */
+	int stale (client_id cid);
+
+	/**
+	 * Runs a scan kernel over block data. Client isn't registered in
+	 * cmap.
+	 * @param[in,out]	s Kernel state, updated with block data.
+	 * @param[in]	length Number of bytes scanned from start of block.
+	 * @return	0 on success, -4 if block has been moved.
+	 */
+	int scan (Scan *s, int length);
+
+	/**
+	 * Moves block to another server. Block state (version, data, client
+	 * map and serials served) is serialized and passed to transfer
+	 * function while block is locked, so no operation can take place in
+	 * the meanwhile. If transfer succeeds block is marked as moved and
+	 * clients waiting on it are waken up.
+	 * @param[in]	transfer Function which sends state to the other server.
+	 *		It must return 0 on success, -1 on error.
+	 * @param[in]	arg Argument passed to transfer function.
+	 * @return	0 on success, 1 if block was already moved, -1 on error
+	 *		(if transfer fails).
+	 */
+	int migrate (int (*transfer) (char *state, int size, void *arg),
+		     void *arg);
+
+	/**
+	 * Restores block state serialized by migrate() on another server.
+	 * @param[in]	state Serialized block state.
+	 * @param[in]	size Size of serialized state in bytes.
+	 * @return	0 on success, -1 on error (malformed state).
+	 */
+	int adopt (char *state, int size);
+
+	/**
+	 * Returns access counters and number of waiting clients.
+	 * @param[out]	r Filled with number of read requests served.
+	 * @param[out]	w Filled with number of writes stored.
+	 * @param[out]	waiting Filled with number of clients waiting on block.
+	 * @return	0 on success, -1 if block has been moved.
+	 */
+	int activity (unsigned long long *r, unsigned long long *w,
+		      int *waiting);
+
+	/**
+	 * Returns lock contention of block.
+	 * @param[out]	p Filled with contention recorded since block creation.
+	 * @return	0 on success, -1 if block is not profiled.
+	 */
+	int contention (lock_profile *p);
 };
 
 #endif // BLOCK_H
@@ -12,14 +12,378 @@
 DM_client::DM_client ()
 {
 	dim = 0;
+	token = 0;
+	timeout = 60000;
+	looping = false;
+	stopping = false;
+	depth = 0;
+	wb_size = 0;
+	wb_interval = 0;
+	wb_running = false;
+	wb_stop = false;
+	serials = 0;
+	last = 0;
+	stride = 0;
+	run = 0;
+	pthread_rwlock_init (&lock, NULL);
+	pthread_mutex_init (&pmutex, NULL);
+	pthread_mutex_init (&fmutex, NULL);
+	pthread_mutex_init (&wmutex, NULL);
+	pthread_cond_init (&wcond, NULL);
+	pthread_cond_init (&tcond, NULL);
 }
 
-DM_client::~DM_client () 
+DM_client::~DM_client ()
 {
-	for (int i = 0; DM.find (i) != DM.end (); i++) {
-		close (DM[i]->sd);
-		delete DM[i];
+	if (wb_running) {
+		pthread_mutex_lock (&wmutex);
+		wb_stop = true;
+		pthread_cond_signal (&tcond);
+		pthread_mutex_unlock (&wmutex);
+		pthread_join (flusher, NULL);
 	}
+	// queued writes are not lost
+	flush_queue ();
+
+	pthread_mutex_lock (&fmutex);
+	drain ();
+	pthread_mutex_unlock (&fmutex);
+	for (unsigned int i = 0; i < regions.size (); i++)
+		delete regions[i];
+	if (looping) {
+		pthread_mutex_lock (&pmutex);
+		stopping = true;
+		pthread_mutex_unlock (&pmutex);
+		char c = 0;
+		if (write (wake[1], &c, 1) == 1)
+			pthread_join (loop, NULL);
+		close (wake[0]);
+		close (wake[1]);
+	}
+	for (unsigned int i = 0; i < servers.size (); i++) {
+		for (unsigned int j = 0; j < servers[i]->idle.size (); j++)
+			close (servers[i]->idle[j]);
+		pthread_mutex_destroy (&servers[i]->mutex);
+		delete servers[i];
+	}
+	pthread_rwlock_destroy (&lock);
+	pthread_mutex_destroy (&pmutex);
+	pthread_mutex_destroy (&fmutex);
+	pthread_mutex_destroy (&wmutex);
+	pthread_cond_destroy (&wcond);
+	pthread_cond_destroy (&tcond);
+}
+
+/**
+ * Fills a socket address structure.
+ * @param[out]	sa Structure to be filled.
+ * @param[in]	address Address in dotted notation.
+ * @param[in]	port Port.
+ * @return	No value is returned.
+ */
+static void make_address (sockaddr_in *sa, char *address, int port)
+{
+	memset ((void *) sa, 0, sizeof(sockaddr_in));
+	sa->sin_family = AF_INET;
+	sa->sin_port = htons (port);
+	inet_pton (AF_INET, address, &sa->sin_addr);
+}
+
+/**
+ * Closes a connection on which a request failed. The connection is not given
+ * back, because a late reply would be taken as reply to another request.
+ * @param[in]	sd Socket descriptor.
+ * @return	Always -1.
+ */
+static int drop (int sd)
+{
+	close (sd);
+	return -1;
+}
+
+/**
+ * Receives the header of the reply to a request.
+ * @param[in]	sd Socket descriptor.
+ * @param[in]	tag Tag of request.
+ * @param[out]	f Reply header.
+ * @return	0 on success, -1 on error or if reply is not for request.
+ */
+static int recv_reply (int sd, int tag, frame *f)
+{
+	if (recv_frame (sd, f) != 0 || f->tag != tag)
+		return -1;
+	return 0;
+}
+
+/**
+ * Receives the payload of the reply to a write: the reason, if write failed.
+ * @param[in]	sd Socket descriptor.
+ * @param[in]	f Reply header.
+ * @param[out]	result 0 if write succeeded, -2 if block was invalid, -1
+ *		otherwise.
+ * @return	0 on success, -1 on error.
+ */
+static int recv_written (int sd, frame *f, int *result)
+{
+	*result = f->opcode == OK ? 0 : -1;
+	if (f->opcode == ERROR && f->length == sizeof(int)) {
+		int why;
+		if (recv_msg (sd, &why, sizeof(int)) == -1)
+			return -1;
+		if (ntohl (why) == INVALID)
+			*result = -2;
+		return 0;
+	}
+	return skip_msg (sd, f->length);
+}
+
+/**
+ * Receives the payload of the reply to a versioned update or wait which didn't
+ * succeed: the reason, if replica refused.
+ * @param[in]	sd Socket descriptor.
+ * @param[in]	f Reply header.
+ * @param[out]	lagging True if replica lost its primary server.
+ * @return	0 on success, -1 on error.
+ */
+static int recv_refused (int sd, frame *f, bool *lagging)
+{
+	*lagging = false;
+	if (f->opcode == ERROR && f->length == sizeof(int)) {
+		int why;
+		if (recv_msg (sd, &why, sizeof(int)) == -1)
+			return -1;
+		*lagging = ntohl (why) == LAGGING;
+		return 0;
+	}
+	return skip_msg (sd, f->length);
+}
+
+int DM_client::open_connection (sockaddr_in *address, int *caps)
+{
+	int sd = socket (AF_INET, SOCK_STREAM, 0);
+	if (sd == -1)
+		return -1;
+
+	int ret = connect (sd, (sockaddr *) address, sizeof(sockaddr_in));
+	if (ret == -1)
+		return drop (sd);
+	// set once: replies which may take longer are awaited with poll()
+	timeval t;
+	t.tv_sec = timeout / 1000;
+	t.tv_usec = (timeout % 1000) * 1000;
+	ret = setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(timeval));
+	if (ret == -1)
+		return drop (sd);
+
+	// identify client on server, agree on block size and capabilities
+	Message<4> msg (HELLO, 0);
+	msg.set (0, (int) (token >> 32));
+	msg.set (1, (int) token);
+	msg.set (2, dim);
+	msg.set (3, CAPABILITIES);
+	ret = send_msg (sd, msg.data (), msg.size ());
+	if (ret == -1)
+		return drop (sd);
+	frame f;
+	int res[2];
+	if (recv_reply (sd, 0, &f) == -1 || f.length != 2 * sizeof(int) ||
+	    recv_msg (sd, res, 2 * sizeof(int)) == -1 || f.opcode != OK)
+		return drop (sd);
+
+	// block size is taken from first server if not configured
+	if (dim == 0)
+		dim = ntohl (res[0]);
+	if (ntohl (res[0]) != (unsigned int) dim)
+		return drop (sd);
+	if (caps != NULL)
+		*caps = ntohl (res[1]);
+
+	return sd;
+}
+
+server *DM_client::find_server (sockaddr_in *address)
+{
+	for (unsigned int i = 0; i < servers.size (); i++) {
+		if (servers[i]->address.sin_addr.s_addr ==
+		    address->sin_addr.s_addr &&
+		    servers[i]->address.sin_port == address->sin_port)
+			return servers[i];
+	}
+	return NULL;
+}
+
+server *DM_client::open_server (sockaddr_in *address)
+{
+	// only one server structure per server
+	pthread_rwlock_rdlock (&lock);
+	server *srv = find_server (address);
+	pthread_rwlock_unlock (&lock);
+	if (srv != NULL)
+		return srv;
+
+	// first connection is opened now, so that an unreachable server is
+	// detected at once. Other threads keep using the lock meanwhile
+	int caps;
+	int sd = open_connection (address, &caps);
+	if (sd == -1)
+		return NULL;
+
+	pthread_rwlock_wrlock (&lock);
+	srv = find_server (address);
+	if (srv != NULL) {
+		// another thread connected first: connection joins its pool
+		pthread_rwlock_unlock (&lock);
+		release (srv, sd);
+		return srv;
+	}
+	srv = new server;
+	srv->address = *address;
+	srv->caps = caps;
+	srv->next = 0;
+	srv->idle.push_back (sd);
+	pthread_mutex_init (&srv->mutex, NULL);
+	servers.push_back (srv);
+	pthread_rwlock_unlock (&lock);
+
+	return srv;
+}
+
+int DM_client::acquire (server *srv)
+{
+	// a connection broken while idle is found out when a request is sent
+	// or its reply read on it
+	pthread_mutex_lock (&srv->mutex);
+	if (!srv->idle.empty ()) {
+		int sd = srv->idle.back ();
+		srv->idle.pop_back ();
+		pthread_mutex_unlock (&srv->mutex);
+		return sd;
+	}
+	pthread_mutex_unlock (&srv->mutex);
+
+	// all connections busy: pool grows up to the number of threads
+	// talking to the server at the same time
+	return open_connection (&srv->address, NULL);
+}
+
+void DM_client::release (server *srv, int sd)
+{
+	pthread_mutex_lock (&srv->mutex);
+	srv->idle.push_back (sd);
+	pthread_mutex_unlock (&srv->mutex);
+}
+
+int DM_client::submit (server *srv, void *head, int hsize, void *data,
+		       int dsize)
+{
+	int sd = acquire (srv);
+	if (sd == -1)
+		return -1;
+	if (send_msgv (sd, head, hsize, data, dsize) == 0)
+		return sd;
+
+	// connection broke while idle, and server got no whole request
+	drop (sd);
+	sd = open_connection (&srv->address, NULL);
+	if (sd == -1)
+		return -1;
+	if (send_msgv (sd, head, hsize, data, dsize) == -1)
+		return drop (sd);
+
+	return sd;
+}
+
+int DM_client::query (server *srv, void *head, int hsize, void *data,
+		      int dsize, int tag, frame *f)
+{
+	int sd = submit (srv, head, hsize, data, dsize);
+	if (sd == -1)
+		return -1;
+	if (await_msg (sd, -1) == 0 && recv_reply (sd, tag, f) == 0)
+		return sd;
+
+	// server closed connection while idle, or restarted
+	drop (sd);
+	sd = open_connection (&srv->address, NULL);
+	if (sd == -1)
+		return -1;
+	if (send_msgv (sd, head, hsize, data, dsize) == -1 ||
+	    await_msg (sd, -1) == -1 || recv_reply (sd, tag, f) == -1)
+		return drop (sd);
+
+	return sd;
+}
+
+int DM_client::lookup (block_id ID, lblock *lb, server **srv)
+{
+	// a prefetched update or a queued write must not overlap with another
+	// request
+	int result;
+	settle (ID, &result);
+	write_queued (ID);
+
+	return find_block (ID, lb, srv);
+}
+
+int DM_client::find_block (block_id ID, lblock *lb, server **srv)
+{
+	pthread_rwlock_rdlock (&lock);
+	lblock *entry = LM.find (ID);
+	*srv = route (ID);
+	if (entry == NULL || *srv == NULL) {
+		pthread_rwlock_unlock (&lock);
+		return -1;
+	}
+	*lb = *entry;
+	pthread_rwlock_unlock (&lock);
+
+	return 0;
+}
+
+void DM_client::set_version (block_id ID, int version)
+{
+	pthread_rwlock_wrlock (&lock);
+	lblock *lb = LM.find (ID);
+	if (lb != NULL)
+		lb->version = version;
+	pthread_rwlock_unlock (&lock);
+}
+
+void DM_client::set_behind (block_id ID, bool behind)
+{
+	pthread_rwlock_wrlock (&lock);
+	lblock *lb = LM.find (ID);
+	if (lb != NULL)
+		lb->behind = behind;
+	pthread_rwlock_unlock (&lock);
+}
+
+void DM_client::forget (block_id ID)
+{
+	pthread_rwlock_wrlock (&lock);
+	LM.erase (ID);
+	pthread_rwlock_unlock (&lock);
+}
+
+/**
+ * Generates a random token identifying a client on every server. Highest bit
+ * is set, so that a token never equals a socket descriptor, which servers use
+ * to identify clients sending no token.
+ * @return	Generated token.
+ */
+static long long make_token ()
+{
+	long long token = 0;
+	FILE *fp = fopen ("/dev/urandom", "r");
+	if (fp == NULL || fread (&token, sizeof(token), 1, fp) != 1) {
+		timeval t;
+		gettimeofday (&t, NULL);
+		token = ((long long) t.tv_sec << 32) ^ t.tv_usec ^ getpid ();
+	}
+	if (fp != NULL)
+		fclose (fp);
+
+	return token | (1LL << 63);
 }
 
 int DM_client::dm_init (char *config_file)
@@ -30,9 +394,13 @@ int DM_client::dm_init (char *config_file)
 
 	char s[81];
 	char tmp[81];
+	char address[81] = "";
 	int port;
-	char *address;
 	char *ret;
+	server *srv = NULL;
+	sockaddr_in sa;
+
+	token = make_token ();
 
 	// configuration file parsing
 	while (feof (fp) == 0) {
@@ -41,12 +409,24 @@ int DM_client::dm_init (char *config_file)
 			continue;
 		if (s[0] == '#')
 			continue;
+		// values must not include line terminator
+		s[strcspn (s, "\r\n")] = '\0';
 		if (strstr (s, "DIMBLOCK=") != 	NULL) {
 			strcpy (tmp, &s[9]);
 			dim = atoi (tmp);
+		} else if (strstr (s, "Prefetch=") != NULL) {
+			depth = atoi (&s[9]);
+		} else if (strstr (s, "WriteBack=") != NULL) {
+			wb_size = atoi (&s[10]);
+		} else if (strstr (s, "Timeout=") != NULL) {
+			timeout = atoi (&s[8]) * 1000;
+		} else if (strstr (s, "FlushInterval=") != NULL) {
+			wb_interval = atoi (&s[14]);
+		} else if (strstr (s, "Placement=") != NULL) {
+			if (placement.set_mode (&s[10]) == -1)
+				return -1;
 		} else if (strstr (s, "Address=") != NULL) {
-			strcpy (tmp, &s[8]);
-			address = &tmp[0];
+			strcpy (address, &s[8]);
 		} else if (strstr (s, "Port=") != NULL) {
 			strcpy (tmp, &s[5]);
 			port = atoi (tmp);
@@ -54,261 +434,1722 @@ int DM_client::dm_init (char *config_file)
 			strcpy (tmp, &s[3]);
 			char *p = strtok (tmp, "-");
 			char *q = strtok (NULL, "-");
-			int first = atoi (p);
-			int last = atoi (q);
-			server *srv = new server;
-			memset ((void *) &srv->address, 0, sizeof(sockaddr_in));
-			srv->sd = socket (AF_INET, SOCK_STREAM, 0);
-			if (srv->sd == -1)
+			block_id first = strtoll (p, NULL, 10);
+			block_id last = strtoll (q, NULL, 10);
+			make_address (&sa, address, port);
+			srv = open_server (&sa);
+			if (srv == NULL)
 				return -1;
 
-			srv->address.sin_family = AF_INET;
-			srv->address.sin_port = htons (port);
-			inet_pton (AF_INET, address, &srv->address.sin_addr);
-
-			int ret = connect (srv->sd, (sockaddr *) &srv->address,
-					   sizeof(sockaddr_in));
-			if (ret == -1)
+			snprintf (tmp, sizeof(tmp), "%s:%d", address, port);
+			placement.add_server (tmp, first, last);
+			owners.push_back (srv);
+		} else if (strstr (s, "Replica=") != NULL) {
+			// replica of the last server read
+			strcpy (tmp, &s[8]);
+			char *p = strchr (tmp, ':');
+			if (srv == NULL || p == NULL)
 				return -1;
-			timeval t;
-			t.tv_sec = 60;
-			t.tv_usec = 0;
-			ret = setsockopt (srv->sd, SOL_SOCKET, SO_RCVTIMEO, &t,
-					  sizeof(timeval));
-			if (ret == -1)
+			*p = '\0';
+			make_address (&sa, tmp, atoi (p + 1));
+			server *rep = open_server (&sa);
+			if (rep == NULL)
 				return -1;
 
-			for (int i = first; i <= last; i++) {
-				DM[i] = srv;
-			}
+			srv->replicas.push_back (rep);
 		}
 	}
 
 	fclose (fp);
+
+	if (wb_size > 0 && wb_interval > 0) {
+		if (pthread_create (&flusher, NULL, flush_thread, this) != 0)
+			return -1;
+		wb_running = true;
+	}
+
 	return 0;
 }
 
-int DM_client::dm_block_map (int ID, void *address)
+int DM_client::send_request (int sd, int type, lblock *lb)
 {
-	// DM_client not initialized
-	if (DM.empty ())
-		return -3;
+	// low half of block id is the tag of the request, a PREFETCH is an
+	// UPDATE
+	Message<2> msg (type == PREFETCH ? UPDATE : type, (int) lb->ID,
+			type == WRITE ? dim : 0);
+	msg.set_id (0, lb->ID);
+	msg.set_flags (lb->serial);
 
-	// ID not in server list
-	if (DM.find (ID) == DM.end ())
-		return -1;
+	// send request to server, with block if any
+	if (type == WRITE)
+		return send_msgv (sd, msg.data (), msg.size (), lb->data, dim);
+	return send_msg (sd, msg.data (), msg.size ());
+}
 
-	// ID already mapped
-	if (LM.find (ID) != LM.end ())
-		return -2;
+int DM_client::read_reply (int sd, int type, lblock *lb, bool *broken,
+			   int limit)
+{
+	*broken = true;
 
-	//address = new char[dim];
-	LM[ID] = (char *) address;
+	// a WAIT lasts until block changes, longer than socket's timeout
+	if (type == WAIT && await_msg (sd, limit) == -1)
+		return errno == ETIMEDOUT ? -4 : -1;
 
-	int sd = DM[ID]->sd;
+	// receive response from server
+	frame f;
+	if (recv_reply (sd, (int) lb->ID, &f) == -1)
+		return -1;
 
-	// construct buffer to send
-	int size = 2 * sizeof(int);
-	char buf[size];
-	build_reqhdr (buf, MAP, ID);
+	if (f.opcode == REDIRECT) {
+		// block moved: request must be repeated on its new owner
+		if (redirect (lb->ID, sd, f.length) == -1)
+			return -1;
+		*broken = false;
+		return 1;
+	}
 
-	// send request to server
-	int ret = send_msg (sd, buf, size);
-	if (ret == -1)
+	int ret = 0;
+	// payload left to read
+	int size = f.length;
+	if (type == MAP || type == UPDATE || type == PREFETCH) {
+		if (f.opcode == OK && size == dim) {
+			if (recv_msg (sd, lb->data, dim) == -1)
+				return -1;
+			size = 0;
+			if (type == PREFETCH)
+				ret = 2;
+		} else if (f.opcode != UPDATED || type == MAP) {
+			ret = -1;
+		}
+	} else if (type == WRITE) {
+		if (recv_written (sd, &f, &ret) == -1)
+			return -1;
+		size = 0;
+	} else if (f.opcode != OK) {
+		ret = -1;
+	}
+	if (skip_msg (sd, size) == -1)
 		return -1;
 
-	// receive response from server
-	int resp;
-	size = sizeof(int);
-	ret = recv_msg (sd, &resp, size);
-	if (ret == -1)
-		return -1;
-	resp = ntohl (resp);
-	if (resp != OK)
-		return -1;
-	ret = recv_msg (sd, address, dim);
-	if (ret == -1)
+	*broken = false;
+	return ret;
+}
+
+int DM_client::issue (int type, lblock *lb, server *srv)
+{
+	int sd = acquire (srv);
+	if (sd == -1)
 		return -1;
+	lb->serial = 0;
+	if (type == UPDATE || type == PREFETCH || type == WRITE) {
+		// serial 0 means none
+		do {
+			lb->serial = __atomic_add_fetch (&serials, 1,
+							 __ATOMIC_RELAXED) &
+				     0x7fffffff;
+		} while (lb->serial == 0);
+	}
+	if (send_request (sd, type, lb) == 0)
+		return sd;
 
-	return 0;
+	// connection broke while idle, and server got no whole request
+	drop (sd);
+	return resend (type, lb, srv);
 }
 
-int DM_client::dm_block_unmap (int ID)
+int DM_client::resend (int type, lblock *lb, server *srv)
 {
-	// DM_client not initialized
-	if (DM.empty ())
-		return -3;
-	if (LM.find (ID) == LM.end ())
-		return -1;
-	if (DM.find (ID) == DM.end ())
+	int sd = open_connection (&srv->address, NULL);
+	if (sd == -1)
 		return -1;
+	if (send_request (sd, type, lb) == -1)
+		return drop (sd);
 
-	int sd = DM[ID]->sd;
+	return sd;
+}
 
-	// construct buffer to send
-	int size = 2 * sizeof(int);
-	char buf[size];
-	build_reqhdr (buf, UNMAP, ID);
+int DM_client::complete (int type, lblock *lb, server *srv, int sd, int limit)
+{
+	bool broken;
+	int ret = read_reply (sd, type, lb, &broken, limit);
+	if (broken) {
+		drop (sd);
+		// time limit of a WAIT expired
+		if (ret == -4)
+			return -4;
+		return resume (type, lb, srv);
+	}
+	release (srv, sd);
 
-	// send request to server
-	int ret = send_msg (sd, buf, size);
-	if (ret == -1)
-		return -1;
+	return ret;
+}
 
-	// receive response from server
-	int resp;
-	size = sizeof(int);
-	ret = recv_msg (sd, &resp, size);
-	if (ret == -1)
-		return -1;
-	resp = ntohl (resp);
-	if (resp != OK)
+int DM_client::resume (int type, lblock *lb, server *srv)
+{
+	if (type != UPDATE && type != PREFETCH && type != WRITE)
 		return -1;
 
-	//delete[] (char *) LM[ID];
-	LM.erase (ID);
+	// server which served the request already answers as it did then
+	int sd = resend (type, lb, srv);
+	if (sd == -1)
+		return -1;
+	bool broken;
+	int ret = read_reply (sd, type, lb, &broken);
+	if (broken)
+		return drop (sd);
+	release (srv, sd);
 
-	return 0;
+	return ret;
 }
 
-int DM_client::dm_block_update (int ID)
+int DM_client::dm_block_map (block_id ID, void *address)
 {
 	// DM_client not initialized
-	if (DM.empty ())
+	if (owners.empty ())
 		return -3;
-	if (LM.find (ID) == LM.end ())
-		return -1;
-	if (DM.find (ID) == DM.end ())
-		return -1;
 
-	int sd = DM[ID]->sd;
-
-	// construct buffer to send
-	int size = 2 * sizeof(int);
-	char buf[size];
-	build_reqhdr (buf, UPDATE, ID);
-
-	// send request to server
-	int ret = send_msg (sd, buf, size);
-	if (ret == -1)
+	pthread_rwlock_wrlock (&lock);
+	// ID not in server list
+	server *srv = route (ID);
+	if (srv == NULL) {
+		pthread_rwlock_unlock (&lock);
 		return -1;
+	}
 
-	// receive response from server
-	int resp;
-	size = sizeof(int);
-	ret = recv_msg (sd, &resp, size);
-	if (ret == -1)
-		return -1;
-	resp = ntohl (resp);
-	if (resp != OK && resp != UPDATED)
-		return -1;
-	if (resp == UPDATED)
-		return 0;
+	// ID already mapped, or being mapped by another thread
+	if (LM.find (ID) != NULL) {
+		pthread_rwlock_unlock (&lock);
+		return -2;
+	}
 
-	ret = recv_msg (sd, LM[ID], dim);
+	//address = new char[dim];
+	lblock *lb = LM.insert (ID);
+	lb->data = (char *) address;
+	lblock entry = *lb;
+	pthread_rwlock_unlock (&lock);
 
-	return 0;
+	int ret;
+	if (!srv->replicas.empty ()) {
+		// replicated block: no mapping on servers
+		ret = replica_update (&entry, srv);
+	} else {
+		int sd = issue (MAP, &entry, srv);
+		if (sd == -1)
+			ret = -1;
+		else
+			ret = complete (MAP, &entry, srv, sd);
+	}
+
+	if (ret != 0)
+		// mapping failed or block moved: local entry is removed
+		forget (ID);
+	if (ret == 1)
+		// block moved: map it on its new owner
+		return dm_block_map (ID, address);
+	return ret;
 }
 
-int DM_client::dm_block_write (int ID)
+int DM_client::dm_block_unmap (block_id ID)
 {
 	// DM_client not initialized
-	if (DM.empty ())
+	if (owners.empty ())
 		return -3;
-	if (LM.find (ID) == LM.end ())
+	lblock lb;
+	server *srv;
+	if (lookup (ID, &lb, &srv) == -1)
 		return -1;
-	if (DM.find (ID) == DM.end ())
+
+	if (!srv->replicas.empty ()) {
+		// replicated block: only local data is released
+		forget (ID);
+		return 0;
+	}
+
+	int sd = issue (UNMAP, &lb, srv);
+	if (sd == -1)
 		return -1;
+	int ret = complete (UNMAP, &lb, srv, sd);
+	if (ret == 1)
+		// block moved: repeat request on its new owner
+		return dm_block_unmap (ID);
+	if (ret == 0)
+		//delete[] (char *) LM[ID];
+		forget (ID);
+	return ret;
+}
 
-	int sd = DM[ID]->sd;
+int DM_client::dm_block_update (block_id ID)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
 
-	// construct buffer to send
-	int size = 2 * sizeof(int);
-	char buf[size];
-	build_reqhdr (buf, WRITE, ID);
+	int ret;
+	bool hit = settle (ID, &ret);
+	prefetch (ID);
+	if (hit && ret != -1)
+		// block has been updated in advance
+		return 0;
 
-	// send first request to server
-	int ret = send_msg (sd, buf, size);
-	if (ret == -1)
-		return -1;
-	// send block
-	ret = send_msg (sd, LM[ID], dim);
-	if (ret == -1)
+	lblock lb;
+	server *srv;
+	if (lookup (ID, &lb, &srv) == -1)
 		return -1;
 
-	// receive response from server
-	int resp;
-	size = sizeof(int);
-	ret = recv_msg (sd, &resp, size);
-	if (ret == -1)
-		return -1;
-	resp = ntohl (resp);
-	if (resp != OK) {
-		int why;
-		ret = recv_msg (sd, &why, size);
-		if (ret == -1)
-			return -1;
-		why = ntohl (why);
-		if (why == UNMAPPED)
-			return -1;
-		if (why == INVALID)
-			return -2;
-	}
+	if (!srv->replicas.empty ())
+		return replica_update (&lb, srv);
 
-	return 0;
+	int sd = issue (UPDATE, &lb, srv);
+	if (sd == -1)
+		return -1;
+	ret = complete (UPDATE, &lb, srv, sd);
+	if (ret == 1)
+		// block moved: repeat request on its new owner
+		return dm_block_update (ID);
+	return ret;
 }
 
-int DM_client::dm_block_wait (int ID)
+int DM_client::dm_block_write (block_id ID)
 {
 	// DM_client not initialized
-	if (DM.empty ())
+	if (owners.empty ())
 		return -3;
-	if (LM.find (ID) == LM.end ())
-		return -1;
-	if (DM.find (ID) == DM.end ())
-		return -1;
 
-	int sd = DM[ID]->sd;
+	int ret;
+	settle (ID, &ret);
+	if (wb_size > 0)
+		return queue_write (ID);
+	return write_now (ID);
+}
 
-	// set timeout to 0, otherwise client would wait only 60 seconds
-	timeval t;
-	t.tv_sec = 0;
-	t.tv_usec = 0;
-	int ret = setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
-	if (ret == -1)
+int DM_client::write_now (block_id ID)
+{
+	lblock lb;
+	server *srv;
+	if (find_block (ID, &lb, &srv) == -1)
 		return -1;
 
-	// construct buffer to send
-	int size = 2 * sizeof(int);
-	char buf[size];
-	build_reqhdr (buf, WAIT, ID);
+	if (!srv->replicas.empty ())
+		return replica_write (&lb, srv);
 
-	// send request to server
-	ret = send_msg (sd, buf, size);
-	if (ret == -1)
+	int sd = issue (WRITE, &lb, srv);
+	if (sd == -1)
 		return -1;
+	int ret = complete (WRITE, &lb, srv, sd);
+	if (ret == 1)
+		// block moved: repeat request on its new owner
+		return write_now (ID);
+	return ret;
+}
 
-	// receive response from server
-	int resp;
-	size = sizeof(int);
-	ret = recv_msg (sd, &resp, size);
-	if (ret == -1)
+int DM_client::queue_write (block_id ID)
+{
+	lblock lb;
+	server *srv;
+	if (find_block (ID, &lb, &srv) == -1)
 		return -1;
+	if (!srv->replicas.empty ())
+		// replicated blocks are written at once
+		return replica_write (&lb, srv);
 
-	// re-set timeout to 60 seconds
-	t.tv_sec = 60;
-	t.tv_usec = 0;
-	ret = setsockopt (sd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
-	if (ret == -1)
-		return -1;
+	pthread_mutex_lock (&wmutex);
+	// an older write of the block still being sent must reach server first
+	while (flushing.find (ID) != flushing.end ())
+		pthread_cond_wait (&wcond, &wmutex);
+	queued.insert (ID);
+	bool full = (int) queued.size () >= wb_size;
+	pthread_mutex_unlock (&wmutex);
 
-	resp = ntohl (resp);
-	if (resp != OK)
-		return -1;
+	if (full)
+		flush_queue ();
 	return 0;
 }
 
-int DM_client::dm_block_dim ()
+void DM_client::write_queued (block_id ID)
 {
-	return dim;
+	if (wb_size <= 0)
+		return;
+
+	pthread_mutex_lock (&wmutex);
+	while (flushing.find (ID) != flushing.end ())
+		pthread_cond_wait (&wcond, &wmutex);
+	bool found = queued.erase (ID) > 0;
+	if (found)
+		flushing.insert (ID);
+	pthread_mutex_unlock (&wmutex);
+	if (!found)
+		return;
+
+	int ret = write_now (ID);
+
+	pthread_mutex_lock (&wmutex);
+	if (ret < 0)
+		failures.push_back (make_pair (ID, ret));
+	flushing.erase (ID);
+	pthread_cond_broadcast (&wcond);
+	pthread_mutex_unlock (&wmutex);
+}
+
+void DM_client::flush_queue ()
+{
+	pthread_mutex_lock (&wmutex);
+	vector<block_id> ids (queued.begin (), queued.end ());
+	queued.clear ();
+	flushing.insert (ids.begin (), ids.end ());
+	pthread_mutex_unlock (&wmutex);
+	if (ids.empty ())
+		return;
+
+	vector<pair<block_id, int> > failed;
+	write_batch (ids, &failed);
+
+	pthread_mutex_lock (&wmutex);
+	failures.insert (failures.end (), failed.begin (), failed.end ());
+	for (unsigned int i = 0; i < ids.size (); i++)
+		flushing.erase (ids[i]);
+	pthread_cond_broadcast (&wcond);
+	pthread_mutex_unlock (&wmutex);
+}
+
+void DM_client::write_batch (vector<block_id> &ids,
+			      vector<pair<block_id, int> > *failed)
+{
+	// group blocks by owner
+	vector<server *> srvs;
+	vector<vector<lblock> > groups;
+	pthread_rwlock_rdlock (&lock);
+	for (unsigned int i = 0; i < ids.size (); i++) {
+		lblock *lb = LM.find (ids[i]);
+		server *srv = route (ids[i]);
+		if (lb == NULL || srv == NULL) {
+			failed->push_back (make_pair (ids[i], -1));
+			continue;
+		}
+		unsigned int j = 0;
+		while (j < srvs.size () && srvs[j] != srv)
+			j++;
+		if (j == srvs.size ()) {
+			srvs.push_back (srv);
+			groups.push_back (vector<lblock> ());
+		}
+		groups[j].push_back (*lb);
+	}
+	pthread_rwlock_unlock (&lock);
+
+	unsigned int n = srvs.size ();
+	vector<int> sds (n, -1);
+	// writes of each server whose reply has been read
+	vector<unsigned int> done (n, 0);
+	vector<unsigned int> sent (n, 0);
+	vector<int> moved;
+	bool left = true;
+	while (left) {
+		// send a batch of writes to every server, without waiting for
+		// replies, so that servers work in parallel
+		for (unsigned int j = 0; j < n; j++) {
+			unsigned int end = done[j] + FLUSHBATCH;
+			if (end > groups[j].size ())
+				end = groups[j].size ();
+			sent[j] = done[j];
+			if (done[j] == end)
+				continue;
+			if (sds[j] == -1) {
+				// first write is sent again if connection
+				// broke while idle
+				sds[j] = issue (WRITE, &groups[j][sent[j]],
+						srvs[j]);
+				if (sds[j] != -1)
+					sent[j]++;
+			}
+			while (sds[j] != -1 && sent[j] < end &&
+			       send_request (sds[j], WRITE,
+					     &groups[j][sent[j]]) == 0)
+				sent[j]++;
+			if (sent[j] < end) {
+				// connection lost: writes not answered yet fail
+				if (sds[j] != -1)
+					sds[j] = drop (sds[j]);
+				for (unsigned int k = done[j];
+				     k < groups[j].size (); k++)
+					failed->push_back (make_pair (
+						groups[j][k].ID, -1));
+				done[j] = sent[j] = groups[j].size ();
+			}
+		}
+
+		// then read replies, in the order writes were sent
+		left = false;
+		for (unsigned int j = 0; j < n; j++) {
+			for (; done[j] < sent[j]; done[j]++) {
+				lblock *lb = &groups[j][done[j]];
+				bool broken;
+				int ret = read_reply (sds[j], WRITE, lb,
+						      &broken);
+				if (broken) {
+					sds[j] = drop (sds[j]);
+					for (unsigned int k = done[j];
+					     k < groups[j].size (); k++)
+						failed->push_back (make_pair (
+							groups[j][k].ID, -1));
+					done[j] = groups[j].size ();
+					break;
+				}
+				if (ret == 1)
+					moved.push_back (lb->ID);
+				else if (ret < 0)
+					failed->push_back (make_pair (lb->ID,
+								      ret));
+			}
+			if (done[j] < groups[j].size ())
+				left = true;
+		}
+	}
+
+	for (unsigned int j = 0; j < n; j++)
+		if (sds[j] != -1)
+			release (srvs[j], sds[j]);
+
+	// blocks moved meanwhile are written on their new owner
+	for (unsigned int i = 0; i < moved.size (); i++) {
+		int ret = write_now (moved[i]);
+		if (ret < 0)
+			failed->push_back (make_pair (moved[i], ret));
+	}
+}
+
+int DM_client::dm_flush (vector<pair<block_id, int> > *failed)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+
+	flush_queue ();
+
+	// writes being flushed by other threads are waited for too
+	pthread_mutex_lock (&wmutex);
+	while (!flushing.empty ())
+		pthread_cond_wait (&wcond, &wmutex);
+	vector<pair<block_id, int> > results;
+	results.swap (failures);
+	pthread_mutex_unlock (&wmutex);
+
+	if (failed != NULL)
+		*failed = results;
+	if (results.empty ())
+		return 0;
+	return -1;
+}
+
+void *DM_client::flush_thread (void *in)
+{
+	DM_client *dm = (DM_client *) in;
+
+	pthread_mutex_lock (&dm->wmutex);
+	while (!dm->wb_stop) {
+		timeval now;
+		gettimeofday (&now, NULL);
+		long long ns = (now.tv_usec * 1000LL) +
+			       (dm->wb_interval % 1000) * 1000000LL;
+		timespec t;
+		t.tv_sec = now.tv_sec + dm->wb_interval / 1000 +
+			   ns / 1000000000;
+		t.tv_nsec = ns % 1000000000;
+		pthread_cond_timedwait (&dm->tcond, &dm->wmutex, &t);
+		if (dm->wb_stop)
+			break;
+		pthread_mutex_unlock (&dm->wmutex);
+		dm->flush_queue ();
+		pthread_mutex_lock (&dm->wmutex);
+	}
+	pthread_mutex_unlock (&dm->wmutex);
+
+	return NULL;
+}
+
+int DM_client::dm_block_wait (block_id ID)
+{
+	return dm_block_wait_for (ID, -1);
+}
+
+int DM_client::dm_block_wait_for (block_id ID, int limit)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+
+	// block was invalid when it was prefetched
+	int ret;
+	if (settle (ID, &ret) && ret == 2)
+		return 0;
+
+	lblock lb;
+	server *srv;
+	if (lookup (ID, &lb, &srv) == -1)
+		return -1;
+
+	if (!srv->replicas.empty ())
+		return replica_wait (&lb, srv, limit);
+
+	// connection is held by this thread until block becomes invalid,
+	// other threads use other connections. If time limit expires, the
+	// connection is closed: server still has the request
+	int sd = issue (WAIT, &lb, srv);
+	if (sd == -1)
+		return -1;
+	ret = complete (WAIT, &lb, srv, sd, limit);
+	if (ret == 1)
+		// block moved: repeat request on its new owner
+		return dm_block_wait_for (ID, limit);
+	return ret;
+}
+
+void DM_client::prefetch (block_id ID)
+{
+	if (depth <= 0)
+		return;
+
+	pthread_mutex_lock (&fmutex);
+	if (ID - last == stride && stride != 0) {
+		run++;
+	} else {
+		// stride broken: blocks fetched ahead are not going to be used
+		drain ();
+		stride = ID - last;
+		run = 1;
+	}
+	last = ID;
+
+	// stride is trusted after it has been seen twice
+	if (run < 2) {
+		pthread_mutex_unlock (&fmutex);
+		return;
+	}
+
+	for (int k = 1; k <= depth; k++) {
+		block_id next = ID + k * stride;
+		if (prefetched.find (next) != prefetched.end ())
+			continue;
+
+		pthread_rwlock_rdlock (&lock);
+		server *srv = route (next);
+		bool mapped = LM.find (next) != NULL;
+		pthread_rwlock_unlock (&lock);
+		if (srv == NULL || !mapped || !srv->replicas.empty ())
+			continue;
+		if (wb_size > 0) {
+			// local data of a queued write must not be overwritten
+			pthread_mutex_lock (&wmutex);
+			bool dirty = queued.find (next) != queued.end () ||
+				     flushing.find (next) != flushing.end ();
+			pthread_mutex_unlock (&wmutex);
+			if (dirty)
+				continue;
+		}
+
+		DM_future *future = new DM_future;
+		if (submit (PREFETCH, next, NULL, future) != 0) {
+			delete future;
+			continue;
+		}
+		prefetched[next] = future;
+	}
+	pthread_mutex_unlock (&fmutex);
+}
+
+bool DM_client::settle (block_id ID, int *result)
+{
+	if (depth <= 0)
+		return false;
+
+	pthread_mutex_lock (&fmutex);
+	map<block_id, DM_future *>::iterator it = prefetched.find (ID);
+	if (it == prefetched.end ()) {
+		pthread_mutex_unlock (&fmutex);
+		return false;
+	}
+	DM_future *future = it->second;
+	prefetched.erase (it);
+	pthread_mutex_unlock (&fmutex);
+
+	*result = future->wait ();
+	delete future;
+	return true;
+}
+
+void DM_client::drain ()
+{
+	for (map<block_id, DM_future *>::iterator it = prefetched.begin ();
+	     it != prefetched.end (); it++) {
+		it->second->wait ();
+		delete it->second;
+	}
+	prefetched.clear ();
+}
+
+/**
+ * @struct sync_call distmem.cpp
+ * @brief Asynchronous request run as a synchronous one on a thread of its own.
+ */
+struct sync_call {
+	/**
+	 * Client issuing request.
+	 */
+	DM_client *client;
+
+	/**
+	 * Request type: MAP, UPDATE, WRITE or WAIT.
+	 */
+	int type;
+
+	/**
+	 * Block id.
+	 */
+	block_id ID;
+
+	/**
+	 * Local address, for MAP.
+	 */
+	void *address;
+
+	/**
+	 * Future completed with result.
+	 */
+	DM_future *future;
+};
+
+void *DM_client::sync_thread (void *in)
+{
+	sync_call *call = (sync_call *) in;
+	DM_client *dm = call->client;
+	int ret;
+	if (call->type == MAP)
+		ret = dm->dm_block_map (call->ID, call->address);
+	else if (call->type == UPDATE)
+		ret = dm->dm_block_update (call->ID);
+	else if (call->type == WRITE)
+		ret = dm->dm_block_write (call->ID);
+	else
+		ret = dm->dm_block_wait (call->ID);
+
+	DM_future *future = call->future;
+	delete call;
+	future->finish (ret);
+	return NULL;
+}
+
+void *DM_client::loop_thread (void *in)
+{
+	((DM_client *) in)->event_loop ();
+	return NULL;
+}
+
+int DM_client::submit (int type, block_id ID, void *address, DM_future *future)
+{
+	future->reset ();
+
+	// DM_client not initialized
+	if (owners.empty ()) {
+		future->finish (-3);
+		return -3;
+	}
+
+	lblock lb;
+	server *srv;
+	pthread_rwlock_wrlock (&lock);
+	srv = route (ID);
+	lblock *entry = LM.find (ID);
+	int ret = 0;
+	if (srv == NULL)
+		ret = -1;
+	else if (type == MAP && entry != NULL)
+		ret = -2;
+	else if (type != MAP && entry == NULL)
+		ret = -1;
+	else if (type == MAP && srv->replicas.empty ()) {
+		entry = LM.insert (ID);
+		entry->data = (char *) address;
+	}
+	if (ret == 0 && entry != NULL)
+		lb = *entry;
+	pthread_rwlock_unlock (&lock);
+	if (ret != 0) {
+		future->finish (ret);
+		return ret;
+	}
+
+	if (!srv->replicas.empty ()) {
+		// replicated blocks are read from several copies: request runs
+		// as a synchronous one on a thread of its own
+		sync_call *call = new sync_call;
+		call->client = this;
+		call->type = type;
+		call->ID = ID;
+		call->address = address;
+		call->future = future;
+		pthread_t tid;
+		if (pthread_create (&tid, NULL, sync_thread, call) != 0) {
+			delete call;
+			future->finish (-1);
+			return -1;
+		}
+		pthread_detach (tid);
+		return 0;
+	}
+
+	int sd = issue (type, &lb, srv);
+	if (sd == -1) {
+		if (type == MAP)
+			forget (ID);
+		future->finish (-1);
+		return -1;
+	}
+
+	// reply will be read by event loop
+	pending p;
+	p.type = type;
+	p.lb = lb;
+	p.srv = srv;
+	p.sd = sd;
+	p.address = address;
+	p.future = future;
+	pthread_mutex_lock (&pmutex);
+	if (!looping) {
+		if (pipe (wake) == -1 ||
+		    pthread_create (&loop, NULL, loop_thread, this) != 0) {
+			pthread_mutex_unlock (&pmutex);
+			close (sd);
+			if (type == MAP)
+				forget (ID);
+			future->finish (-1);
+			return -1;
+		}
+		looping = true;
+	}
+	pendings.push_back (p);
+	pthread_mutex_unlock (&pmutex);
+	char c = 0;
+	ret = write (wake[1], &c, 1);
+
+	return 0;
+}
+
+void DM_client::event_loop ()
+{
+	vector<pollfd> fds;
+	vector<pending> ready;
+	while (1) {
+		// wake pipe first, then a connection for each pending request
+		fds.clear ();
+		pollfd pfd;
+		pfd.fd = wake[0];
+		pfd.events = POLLIN;
+		fds.push_back (pfd);
+		pthread_mutex_lock (&pmutex);
+		if (stopping) {
+			pthread_mutex_unlock (&pmutex);
+			return;
+		}
+		for (unsigned int i = 0; i < pendings.size (); i++) {
+			pfd.fd = pendings[i].sd;
+			fds.push_back (pfd);
+		}
+		pthread_mutex_unlock (&pmutex);
+
+		int ret = poll (&fds[0], fds.size (), -1);
+		if (ret == -1)
+			continue;
+		if (fds[0].revents != 0) {
+			char buf[64];
+			ret = read (wake[0], buf, sizeof(buf));
+		}
+
+		// take requests whose reply has arrived
+		ready.clear ();
+		pthread_mutex_lock (&pmutex);
+		for (unsigned int i = 1; i < fds.size (); i++) {
+			if (fds[i].revents == 0)
+				continue;
+			for (unsigned int j = 0; j < pendings.size (); j++) {
+				if (pendings[j].sd == fds[i].fd) {
+					ready.push_back (pendings[j]);
+					pendings.erase (pendings.begin () + j);
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock (&pmutex);
+
+		for (unsigned int i = 0; i < ready.size (); i++) {
+			pending *p = &ready[i];
+			ret = complete (p->type, &p->lb, p->srv, p->sd);
+			if (ret != 0 && p->type == MAP)
+				forget (p->lb.ID);
+			if (ret == 1)
+				// block moved: repeat request on its new owner
+				submit (p->type, p->lb.ID, p->address,
+					p->future);
+			else
+				p->future->finish (ret);
+		}
+	}
+}
+
+int DM_client::dm_block_map_async (block_id ID, void *address,
+				   DM_future *future)
+{
+	return submit (MAP, ID, address, future);
+}
+
+int DM_client::dm_block_update_async (block_id ID, DM_future *future)
+{
+	int ret;
+	if (settle (ID, &ret) && ret != -1) {
+		// block has been updated in advance
+		future->reset ();
+		future->finish (0);
+		return 0;
+	}
+	write_queued (ID);
+	return submit (UPDATE, ID, NULL, future);
+}
+
+int DM_client::dm_block_write_async (block_id ID, DM_future *future)
+{
+	int ret;
+	settle (ID, &ret);
+	write_queued (ID);
+	return submit (WRITE, ID, NULL, future);
+}
+
+int DM_client::dm_block_wait_async (block_id ID, DM_future *future)
+{
+	int ret;
+	if (settle (ID, &ret) && ret == 2) {
+		// block was invalid when it was prefetched
+		future->reset ();
+		future->finish (0);
+		return 0;
+	}
+	write_queued (ID);
+	return submit (WAIT, ID, NULL, future);
+}
+
+int DM_client::dm_block_read_range (block_id ID, int offset, int length)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+	lblock lb;
+	server *srv;
+	if (lookup (ID, &lb, &srv) == -1)
+		return -1;
+	if (offset < 0 || length <= 0 || offset > dim - length)
+		return -1;
+	if (!srv->replicas.empty () || !(srv->caps & CAP_RANGE))
+		return -1;
+
+	// send request to server
+	Message<4> msg (READ_RANGE, (int) ID);
+	msg.set_id (0, ID);
+	msg.set (2, offset);
+	msg.set (3, length);
+	int sd = submit (srv, msg.data (), msg.size ());
+	if (sd == -1)
+		return -1;
+
+	// receive response from server
+	frame f;
+	if (recv_reply (sd, (int) ID, &f) == -1)
+		return drop (sd);
+	if (f.opcode == REDIRECT) {
+		// block moved: repeat request on its new owner
+		if (redirect (ID, sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		return dm_block_read_range (ID, offset, length);
+	}
+	if (f.opcode != OK || f.length != length) {
+		if (skip_msg (sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		if (f.opcode == UPDATED)
+			return 0;
+		return -1;
+	}
+
+	int ret = recv_msg (sd, lb.data + offset, length);
+	if (ret == -1)
+		return drop (sd);
+	release (srv, sd);
+
+	return 0;
+}
+
+int DM_client::dm_block_write_range (block_id ID, int offset, int length)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+	lblock lb;
+	server *srv;
+	if (lookup (ID, &lb, &srv) == -1)
+		return -1;
+	if (offset < 0 || length <= 0 || offset > dim - length)
+		return -1;
+	if (!srv->replicas.empty () || !(srv->caps & CAP_RANGE))
+		return -1;
+
+	// send request to server, with only the requested slice of the block
+	Message<4> msg (WRITE_RANGE, (int) ID, length);
+	msg.set_id (0, ID);
+	msg.set (2, offset);
+	msg.set (3, length);
+	int sd = submit (srv, msg.data (), msg.size (), lb.data + offset,
+			 length);
+	if (sd == -1)
+		return -1;
+
+	// receive response from server
+	frame f;
+	if (recv_reply (sd, (int) ID, &f) == -1)
+		return drop (sd);
+	if (f.opcode == REDIRECT) {
+		// block moved: repeat request on its new owner
+		if (redirect (ID, sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		return dm_block_write_range (ID, offset, length);
+	}
+	int ret;
+	if (recv_written (sd, &f, &ret) == -1)
+		return drop (sd);
+	release (srv, sd);
+
+	return ret;
+}
+
+Region *DM_client::find_region (void *address)
+{
+	Region *r = NULL;
+	pthread_rwlock_rdlock (&lock);
+	for (unsigned int i = 0; i < regions.size (); i++)
+		if (regions[i]->address () == address)
+			r = regions[i];
+	pthread_rwlock_unlock (&lock);
+
+	return r;
+}
+
+int DM_client::fan_out (int type, vector<block_id> &ids, vector<int> *results)
+{
+	DM_future *f = new DM_future[ids.size ()];
+	for (unsigned int i = 0; i < ids.size (); i++) {
+		if (type == UPDATE)
+			dm_block_update_async (ids[i], &f[i]);
+		else
+			dm_block_write_async (ids[i], &f[i]);
+	}
+
+	int ret = 0;
+	results->resize (ids.size ());
+	for (unsigned int i = 0; i < ids.size (); i++) {
+		(*results)[i] = f[i].wait ();
+		if (ret == 0)
+			ret = (*results)[i];
+	}
+	delete[] f;
+
+	return ret;
+}
+
+int DM_client::dm_region_map (block_id first, int n, void **address)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+
+	Region *r = new Region;
+	if (r->init (first, n, dim) == -1) {
+		delete r;
+		return -1;
+	}
+
+	DM_future *f = new DM_future[n];
+	for (int i = 0; i < n; i++)
+		dm_block_map_async (first + i, r->block (i), &f[i]);
+	int ret = 0;
+	for (int i = 0; i < n; i++) {
+		int res = f[i].wait ();
+		if (res != 0 && ret == 0)
+			ret = res;
+	}
+	if (ret == 0)
+		ret = r->protect ();
+	if (ret != 0) {
+		// release blocks mapped by this call only
+		for (int i = 0; i < n; i++)
+			if (f[i].wait () == 0)
+				dm_block_unmap (first + i);
+		delete[] f;
+		delete r;
+		return ret;
+	}
+	delete[] f;
+
+	pthread_rwlock_wrlock (&lock);
+	regions.push_back (r);
+	pthread_rwlock_unlock (&lock);
+
+	*address = r->address ();
+	return 0;
+}
+
+int DM_client::dm_region_sync (void *address)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+	Region *r = find_region (address);
+	if (r == NULL)
+		return -1;
+
+	vector<block_id> ids;
+	r->collect (&ids);
+	if (ids.empty ())
+		return 0;
+
+	vector<int> results;
+	int ret = fan_out (WRITE, ids, &results);
+	for (unsigned int i = 0; i < ids.size (); i++)
+		if (results[i] != 0)
+			r->mark (ids[i]);
+
+	return ret;
+}
+
+int DM_client::dm_region_update (void *address)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+	Region *r = find_region (address);
+	if (r == NULL)
+		return -1;
+
+	// only stale blocks are updated, and blocks whose mapping server
+	// lost are mapped again
+	vector<block_id> ids, lost;
+	if (stale (r->first_block (), r->first_block () + r->size () - 1,
+		   &ids, &lost) == -1)
+		return -1;
+	if (ids.empty () && lost.empty ())
+		return 0;
+
+	// data is received directly into the region
+	if (r->unprotect () == -1)
+		return -1;
+	int ret = 0;
+	if (!ids.empty ()) {
+		vector<int> results;
+		ret = fan_out (UPDATE, ids, &results);
+	}
+	for (unsigned int i = 0; i < lost.size (); i++) {
+		int res = remap (lost[i]);
+		if (ret == 0)
+			ret = res;
+	}
+	if (r->protect () == -1)
+		return -1;
+
+	return ret;
+}
+
+int DM_client::dm_region_unmap (void *address)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+
+	Region *r = NULL;
+	pthread_rwlock_wrlock (&lock);
+	for (unsigned int i = 0; i < regions.size (); i++) {
+		if (regions[i]->address () == address) {
+			r = regions[i];
+			regions.erase (regions.begin () + i);
+			break;
+		}
+	}
+	pthread_rwlock_unlock (&lock);
+	if (r == NULL)
+		return -1;
+
+	int ret = 0;
+	for (int i = 0; i < r->size (); i++)
+		if (dm_block_unmap (r->first_block () + i) != 0)
+			ret = -1;
+	delete r;
+
+	return ret;
+}
+
+int DM_client::dm_stats (char *address, int port, int top, string *report)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+
+	sockaddr_in sa;
+	make_address (&sa, address, port);
+	server *srv = open_server (&sa);
+	if (srv == NULL || !(srv->caps & CAP_STATS))
+		return -1;
+	// send request to server: <STATS, top>
+	Message<1> msg (STATS, 0);
+	msg.set (0, top);
+	int sd = submit (srv, msg.data (), msg.size ());
+	if (sd == -1)
+		return -1;
+
+	// receive response from server: <OK, report>
+	frame f;
+	if (recv_reply (sd, 0, &f) == -1)
+		return drop (sd);
+	if (f.opcode != OK) {
+		if (skip_msg (sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		return -1;
+	}
+	char *buf = new char[f.length];
+	int ret = recv_msg (sd, buf, f.length);
+	if (ret == 0)
+		report->assign (buf, f.length);
+	delete[] buf;
+	if (ret == -1)
+		return drop (sd);
+	release (srv, sd);
+
+	return 0;
+}
+
+block_id DM_client::piece (block_id pos, block_id last, int max,
+			   server **srv)
+{
+	pthread_rwlock_rdlock (&lock);
+	*srv = route (pos);
+	block_id end = pos;
+	while (end < last && end - pos + 1 < max && route (end + 1) == *srv)
+		end++;
+	pthread_rwlock_unlock (&lock);
+
+	return end;
+}
+
+int DM_client::stale_blocks (server *srv, block_id ID, int blocks,
+			     vector<block_id> *ids, vector<block_id> *lost)
+{
+	// send request to server: <STALE, ID, blocks>
+	Message<3> msg (STALE, (int) ID);
+	msg.set_id (0, ID);
+	msg.set (2, blocks);
+	// receive response from server: <OK, blocks checked, stale bitmap,
+	// unmapped bitmap>
+	frame f;
+	int sd = query (srv, msg.data (), msg.size (), NULL, 0, (int) ID, &f);
+	if (sd == -1)
+		return -1;
+	if (f.opcode == REDIRECT) {
+		// block moved: caller routes the range again
+		if (redirect (ID, sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		return 0;
+	}
+	int max = sizeof(int) + 2 * ((blocks + 7) / 8);
+	if (f.opcode != OK || f.length < (int) sizeof(int) || f.length > max) {
+		if (skip_msg (sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		return -1;
+	}
+	char *buf = new char[f.length];
+	int ret = recv_msg (sd, buf, f.length);
+	if (ret == -1) {
+		delete[] buf;
+		return drop (sd);
+	}
+	release (srv, sd);
+
+	int checked = get_int (buf, 0);
+	int bytes = (checked + 7) / 8;
+	unsigned char *bitmap = (unsigned char *) buf + sizeof(int);
+	unsigned char *unmapped = bitmap + bytes;
+	if (checked <= 0 || checked > blocks ||
+	    f.length != (int) sizeof(int) + 2 * bytes) {
+		delete[] buf;
+		return -1;
+	}
+	pthread_rwlock_rdlock (&lock);
+	for (int i = 0; i < checked; i++) {
+		if (bitmap[i / 8] & (1 << (i % 8)))
+			ids->push_back (ID + i);
+		else if (unmapped[i / 8] & (1 << (i % 8)) &&
+			 LM.find (ID + i) != NULL)
+			// mapped here, not on server
+			lost->push_back (ID + i);
+	}
+	pthread_rwlock_unlock (&lock);
+	delete[] buf;
+
+	return checked;
+}
+
+int DM_client::stale (block_id first, block_id last, vector<block_id> *ids,
+		      vector<block_id> *lost)
+{
+	block_id pos = first;
+	while (pos <= last) {
+		server *srv;
+		block_id end = piece (pos, last, MAXSTALE, &srv);
+		if (srv == NULL)
+			return -1;
+
+		int blocks = end - pos + 1;
+		if (!srv->replicas.empty () || !(srv->caps & CAP_STALE)) {
+			// server can't tell: every mapped block is a candidate
+			pthread_rwlock_rdlock (&lock);
+			for (block_id i = pos; i <= end; i++)
+				if (LM.find (i) != NULL)
+					ids->push_back (i);
+			pthread_rwlock_unlock (&lock);
+			pos = end + 1;
+			continue;
+		}
+		int ret = stale_blocks (srv, pos, blocks, ids, lost);
+		if (ret == -1)
+			return -1;
+		pos += ret;
+	}
+
+	return 0;
+}
+
+int DM_client::dm_resync (block_id first, block_id last)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+	if (first > last)
+		return -1;
+
+	vector<block_id> ids, lost;
+	if (stale (first, last, &ids, &lost) == -1)
+		return -1;
+
+	int ret = 0;
+	if (!ids.empty ()) {
+		vector<int> results;
+		ret = fan_out (UPDATE, ids, &results);
+	}
+	for (unsigned int i = 0; i < lost.size (); i++) {
+		int res = remap (lost[i]);
+		if (ret == 0)
+			ret = res;
+	}
+	if (ret != 0)
+		return ret;
+
+	return ids.size () + lost.size ();
+}
+
+int DM_client::remap (block_id ID)
+{
+	lblock lb;
+	server *srv;
+	if (lookup (ID, &lb, &srv) == -1)
+		return -1;
+
+	int sd = issue (MAP, &lb, srv);
+	if (sd == -1)
+		return -1;
+	int ret = complete (MAP, &lb, srv, sd);
+	if (ret == 1)
+		// block moved: repeat request on its new owner
+		return remap (ID);
+	return ret;
+}
+
+int DM_client::scan_blocks (server *srv, block_id ID, int blocks, int tail,
+			    int kernel, int operand, unsigned char *set,
+			    int *res)
+{
+	// send request to server: <SCAN, ID, blocks, tail, kernel, operand,
+	// class>, class only for kernels on bytes
+	int size = operand == 0 ? SCANSET : 0;
+	Message<6> msg (SCAN, (int) ID, size);
+	msg.set_id (0, ID);
+	msg.set (2, blocks);
+	msg.set (3, tail);
+	msg.set (4, kernel);
+	msg.set (5, operand);
+	// receive response from server, a long range may take a while
+	frame f;
+	int sd = query (srv, msg.data (), msg.size (), size > 0 ? set : NULL,
+			size, (int) ID, &f);
+	if (sd == -1)
+		return -1;
+	if (f.opcode == REDIRECT) {
+		// block moved: caller routes the range again
+		if (redirect (ID, sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		return 1;
+	}
+	if (f.opcode != OK || f.length != SCANREPLY * (int) sizeof(int)) {
+		if (skip_msg (sd, f.length) == -1)
+			return drop (sd);
+		release (srv, sd);
+		return -1;
+	}
+	int buf[SCANREPLY];
+	if (recv_msg (sd, buf, sizeof(buf)) == -1)
+		return drop (sd);
+	release (srv, sd);
+
+	for (int i = 0; i < SCANREPLY; i++)
+		res[i] = get_int (buf, i);
+	return 0;
+}
+
+int DM_client::dm_scan (block_id first, long long length, int kernel,
+			int operand, const char *set, scan_result *result)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+	bool bytes = kernel == SCAN_COUNT || kernel == SCAN_FIND ||
+		     kernel == SCAN_RUNS;
+	if (length <= 0 || (bytes && set == NULL))
+		return -1;
+	if (!bytes && ((kernel != SCAN_SUM && kernel != SCAN_MINMAX) ||
+		       (operand != 1 && operand != (int) sizeof(int)) ||
+		       dim % operand != 0 || length % operand != 0))
+		return -1;
+
+	// class as a bit mask, sent with kernels on bytes
+	unsigned char mask[SCANSET];
+	memset (mask, 0, SCANSET);
+	if (bytes) {
+		for (const unsigned char *c = (const unsigned char *) set;
+		     *c != 0; c++)
+			mask[*c / 8] |= 1 << (*c % 8);
+		if (operand != 0)
+			for (int i = 0; i < SCANSET; i++)
+				mask[i] = ~mask[i];
+		operand = 0;
+	}
+
+	block_id last = first + (length - 1) / dim;
+	int tail = length - (last - first) * dim;
+	result->value = kernel == SCAN_FIND ? -1 : 0;
+	result->min = 0;
+	result->max = 0;
+	bool any = false;
+	bool in = false;
+
+	// pieces are scanned in order, so that offsets and runs can be joined
+	block_id pos = first;
+	while (pos <= last) {
+		server *srv;
+		block_id end = piece (pos, last, MAXSCAN, &srv);
+		if (srv == NULL || !(srv->caps & CAP_SCAN))
+			return -1;
+
+		int blocks = end - pos + 1;
+		int res[SCANREPLY];
+		int ret = scan_blocks (srv, pos, blocks, end == last ? tail :
+				       dim, kernel, operand, mask, res);
+		if (ret == 1)
+			continue;
+		if (ret == -1 || res[0] <= 0 || res[0] > blocks)
+			return -1;
+
+		long long value = ((long long) res[1] << 32) |
+				  (unsigned int) res[2];
+		if (kernel == SCAN_FIND) {
+			if (value != -1) {
+				result->value = (pos - first) * dim + value;
+				return 0;
+			}
+		} else if (kernel == SCAN_RUNS) {
+			// a run crossing pieces was counted by both
+			result->value += value;
+			if (in && (res[5] & SCAN_FIRST))
+				result->value--;
+			in = (res[5] & SCAN_LAST) != 0;
+		} else if (kernel == SCAN_MINMAX) {
+			if (!any || res[3] < result->min)
+				result->min = res[3];
+			if (!any || res[4] > result->max)
+				result->max = res[4];
+			any = true;
+		} else {
+			result->value += value;
+		}
+		pos += res[0];
+	}
+
+	return 0;
+}
+
+int DM_client::dm_block_dim ()
+{
+	return dim;
+}
+
+server *DM_client::reader (server *srv)
+{
+	pthread_mutex_lock (&srv->mutex);
+	unsigned int n = srv->next++ % (srv->replicas.size () + 1);
+	pthread_mutex_unlock (&srv->mutex);
+	if (n == 0)
+		return srv;
+	return srv->replicas[n - 1];
+}
+
+int DM_client::replica_update (lblock *lb, server *srv, bool primary)
+{
+	server *copy = primary || lb->behind ? srv : reader (srv);
+	if (!(copy->caps & CAP_VERSIONED))
+		return -1;
+	// send request to server
+	Message<3> msg (VUPDATE, (int) lb->ID);
+	msg.set_id (0, lb->ID);
+	msg.set (2, lb->version);
+	int sd = submit (copy, msg.data (), msg.size ());
+	if (sd == -1)
+		return -1;
+
+	// receive response from server: <OK, version, data>
+	frame f;
+	if (recv_reply (sd, (int) lb->ID, &f) == -1)
+		return drop (sd);
+	if (f.opcode != OK || f.length != (int) sizeof(int) + dim) {
+		bool lagging;
+		if (recv_refused (sd, &f, &lagging) == -1)
+			return drop (sd);
+		release (copy, sd);
+		if (lagging && copy != srv)
+			// replica may be stale: primary server is asked
+			return replica_update (lb, srv, true);
+		if (f.opcode != UPDATED)
+			return -1;
+		// local block is up to date, or this copy lags behind
+		if (copy == srv && lb->behind)
+			set_behind (lb->ID, false);
+		return 0;
+	}
+
+	int version;
+	int ret = recv_msg (sd, &version, sizeof(int));
+	if (ret == -1)
+		return drop (sd);
+	ret = recv_msg (sd, lb->data, dim);
+	if (ret == -1)
+		return drop (sd);
+	release (copy, sd);
+	set_version (lb->ID, ntohl (version));
+	if (copy == srv && lb->behind)
+		set_behind (lb->ID, false);
+
+	return 0;
+}
+
+int DM_client::replica_write (lblock *lb, server *srv)
+{
+	// writes are accepted by primary server only
+	if (!(srv->caps & CAP_VERSIONED))
+		return -1;
+	// send request to server, with block
+	Message<3> msg (VWRITE, (int) lb->ID, dim);
+	msg.set_id (0, lb->ID);
+	msg.set (2, lb->version);
+	int sd = submit (srv, msg.data (), msg.size (), lb->data, dim);
+	if (sd == -1)
+		return -1;
+
+	// receive response from server
+	frame f;
+	int ret;
+	if (recv_reply (sd, (int) lb->ID, &f) == -1 ||
+	    recv_written (sd, &f, &ret) == -1)
+		return drop (sd);
+	release (srv, sd);
+	if (ret == -2)
+		// a newer version exists, which replicas may not have yet
+		set_behind (lb->ID, true);
+	if (ret != 0)
+		return ret;
+
+	// local data is now the current version
+	set_version (lb->ID, lb->version + 1);
+
+	return 0;
+}
+
+int DM_client::replica_wait (lblock *lb, server *srv, int limit,
+			       bool primary)
+{
+	server *copy = primary ? srv : reader (srv);
+	if (!(copy->caps & CAP_VERSIONED))
+		return -1;
+	// send request to server
+	Message<3> msg (VWAIT, (int) lb->ID);
+	msg.set_id (0, lb->ID);
+	msg.set (2, lb->version);
+	int sd = submit (copy, msg.data (), msg.size ());
+	if (sd == -1)
+		return -1;
+
+	// receive response from server
+	if (await_msg (sd, limit) == -1) {
+		bool expired = errno == ETIMEDOUT;
+		drop (sd);
+		return expired ? -4 : -1;
+	}
+	frame f;
+	bool lagging;
+	if (recv_reply (sd, (int) lb->ID, &f) == -1 ||
+	    recv_refused (sd, &f, &lagging) == -1)
+		return drop (sd);
+	release (copy, sd);
+
+	if (lagging && copy != srv)
+		// replica won't see newer versions: wait goes on on primary
+		return replica_wait (lb, srv, limit, true);
+	if (f.opcode != OK)
+		return -1;
+	return 0;
+}
+
+server *DM_client::route (block_id ID)
+{
+	int index = placement.owner (ID);
+	if (index == -1)
+		return NULL;
+	return owners[index];
+}
+
+int DM_client::owner_index (server *srv)
+{
+	for (unsigned int i = 0; i < owners.size (); i++)
+		if (owners[i] == srv)
+			return i;
+
+	owners.push_back (srv);
+	return owners.size () - 1;
+}
+
+void DM_client::relocate (block_id first, block_id last, server *src,
+			  int index)
+{
+	if (placement.get_mode () == RANGE && route (first) == src &&
+	    route (last) == src) {
+		// contiguous placement: the whole range was on src
+		placement.move (first, last, index);
+		return;
+	}
+	for (block_id i = first; i <= last; i++) {
+		if (route (i) == src)
+			placement.move (i, i, index);
+		if (i == last)
+			break;
+	}
+}
+
+int DM_client::redirect (block_id ID, int sd, int length)
+{
+	// receive new owner's address and port, and range moved with ID
+	int buf[6];
+	if (length != 6 * sizeof(int))
+		return -1;
+	int ret = recv_msg (sd, buf, 6 * sizeof(int));
+	if (ret == -1)
+		return -1;
+	block_id first = get_id (buf, 2);
+	block_id last = get_id (buf, 4);
+	if (ID < first || ID > last)
+		return -1;
+
+	sockaddr_in sa;
+	memset ((void *) &sa, 0, sizeof(sockaddr_in));
+	sa.sin_family = AF_INET;
+	// address is already in network byte order
+	sa.sin_addr.s_addr = buf[0];
+	sa.sin_port = htons (ntohl (buf[1]));
+
+	server *srv = open_server (&sa);
+	if (srv == NULL)
+		return -1;
+
+	pthread_rwlock_wrlock (&lock);
+	server *src = route (ID);
+	if (placement.get_mode () != RANGE || route (first) != src ||
+	    route (last) != src) {
+		// blocks are rerouted one by one: only those around ID
+		if (first < ID - MAXREROUTE / 2)
+			first = ID - MAXREROUTE / 2;
+		if (last > ID + MAXREROUTE / 2)
+			last = ID + MAXREROUTE / 2;
+	}
+	relocate (first, last, src, owner_index (srv));
+	pthread_rwlock_unlock (&lock);
+	return 0;
+}
+
+int DM_client::dm_migrate (block_id first, block_id last, char *address,
+			   int port)
+{
+	// DM_client not initialized
+	if (owners.empty ())
+		return -3;
+	pthread_rwlock_rdlock (&lock);
+	server *src = route (first);
+	pthread_rwlock_unlock (&lock);
+	if (src == NULL || first > last || !(src->caps & CAP_MIGRATE))
+		return -1;
+
+	sockaddr_in sa;
+	make_address (&sa, address, port);
+	// send request to server: <MIGRATE, first, last, address, port>
+	Message<6> msg (MIGRATE, (int) first);
+	msg.set_id (0, first);
+	msg.set_id (2, last);
+	msg.set (4, ntohl (sa.sin_addr.s_addr));
+	msg.set (5, port);
+	int sd = submit (src, msg.data (), msg.size ());
+	if (sd == -1)
+		return -1;
+
+	// receive response from server, moving a large range may take long
+	frame f;
+	if (await_msg (sd, -1) == -1 ||
+	    recv_reply (sd, (int) first, &f) == -1 ||
+	    skip_msg (sd, f.length) == -1)
+		return drop (sd);
+	release (src, sd);
+
+	if (f.opcode != OK)
+		return -1;
+
+	// blocks owned by the server just left are now on new owner, other
+	// clients will learn it through redirects
+	server *dst = open_server (&sa);
+	if (dst == NULL)
+		return -1;
+	pthread_rwlock_wrlock (&lock);
+	relocate (first, last, src, owner_index (dst));
+	pthread_rwlock_unlock (&lock);
+
+	return 0;
 }
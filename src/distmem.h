@@ -12,32 +12,155 @@
 #define DISTMEM_H
 
 #include <map>
+#include <set>
+#include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include "frame.h"
+#include "future.h"
+#include "lmap.h"
 #include "msg.h"
+#include "placement.h"
+#include "region.h"
 #include "utility.h"
 using namespace std;
 
+/**
+ * @def PREFETCH
+ * Request type used by DM_client for updates sent ahead of time. Sent as
+ * UPDATE, result is 2 if block data has been transferred.
+ */
+#define PREFETCH	100
+
+/**
+ * @def FLUSHBATCH
+ * Maximum number of queued writes sent on a connection before their replies
+ * are read.
+ */
+#define FLUSHBATCH	256
+
+/**
+ * @def MAXSCAN
+ * Maximum number of blocks scanned by a single SCAN request, so that a large
+ * range doesn't hold a server thread for long.
+ */
+#define MAXSCAN		65536
+
+/**
+ * @def MAXREROUTE
+ * Maximum number of blocks rerouted one by one on a redirect, when the moved
+ * range cannot be rerouted as a whole (see DM_client::relocate()).
+ */
+#define MAXREROUTE	65536
+
+/**
+ * @struct scan_result distmem.h "distmem.h"
+ * @brief Result of dm_scan().
+ */
+struct scan_result {
+	/**
+	 * Count for SCAN_COUNT and SCAN_RUNS, sum for SCAN_SUM, offset of
+	 * first byte found or -1 for SCAN_FIND.
+	 */
+	long long value;
+
+	/**
+	 * Smallest element, for SCAN_MINMAX.
+	 */
+	int min;
+
+	/**
+	 * Largest element, for SCAN_MINMAX.
+	 */
+	int max;
+};
+
 /**
  * @struct server distmem.h "distmem.h"
  * @brief Identifies a distributed memory Server in DM_client class.
  */
 struct server {
 	/**
-	 * Socket descriptor used for communication with server.
+	 * Structure containing server's address and port.
+	 */
+	sockaddr_in address;
+
+	/**
+	 * Idle connections to server. A request takes one connection and
+	 * gives it back when done, so that requests of different threads
+	 * never share a connection. A new connection is opened when none is
+	 * idle.
+	 */
+	vector<int> idle;
+
+	/**
+	 * Mutex protecting idle and next.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Replicas of the server, read from configuration file. If not empty,
+	 * blocks owned by the server are replicated: reads are spread among
+	 * server and its replicas, writes go to server only.
+	 */
+	vector<server *> replicas;
+
+	/**
+	 * Counter used to choose, round robin, which copy serves next read.
+	 */
+	unsigned int next;
+
+	/**
+	 * Capabilities of server known to client (CAP_ flags in msg.h), from
+	 * the reply to HELLO.
+	 */
+	int caps;
+};
+
+/**
+ * @struct pending distmem.h "distmem.h"
+ * @brief Asynchronous request waiting for its reply in DM_client's event loop.
+ */
+struct pending {
+	/**
+	 * Request type: MAP, UPDATE, WRITE, WAIT or PREFETCH.
+	 */
+	int type;
+
+	/**
+	 * Copy of local entry of block.
+	 */
+	lblock lb;
+
+	/**
+	 * Server request has been sent to.
+	 */
+	server *srv;
+
+	/**
+	 * Connection reply will be read from.
 	 */
 	int sd;
 
 	/**
-	 * Structure containing server's address and port.
+	 * Local address, for MAP.
 	 */
-	sockaddr_in address;
+	void *address;
+
+	/**
+	 * Future completed with result.
+	 */
+	DM_future *future;
 };
 
 /**
@@ -47,6 +170,10 @@ struct server {
  * 
  * Usage: A client needs to allocate only one DM_client object. Two DM_client
  * objects will be considered by server as two separate clients.
+ * DM_client is thread safe: threads of a client share its mappings, and
+ * their requests run in parallel on separate connections. All connections of
+ * a DM_client are seen by servers as one client. Concurrent requests on the
+ * same block are allowed, as they are for separate clients.
  * First of all declare a DM_client object and initialize it:
  *
  * DM_client dm;
@@ -56,8 +183,69 @@ struct server {
  * It is now possible to perform operations on distributed memory. Remember that
  * if DM_client object has not been initialized all operations will return an
  * error (-3 value), all functions except dm_block_wait() have timeout set to 60
- * seconds. If server does not reply until timeout the function will return
- * error (-1).
+ * seconds, or to the value of an optional Timeout=seconds line in configuration
+ * file. If server does not reply until timeout the function will return error
+ * (-1). dm_block_wait_for() waits for a block with its own time limit.
+ * The timeout is set once on each connection; waits poll() the connection
+ * instead of changing it.
+ *
+ * Blocks are placed on servers as stated by Placement= line in configuration
+ * file (see Placement class): by contiguous ranges (default), striped or by
+ * consistent hashing.
+ *
+ * Servers listed in configuration file may have replicas (Replica=address:port
+ * lines following the ID= line). Blocks of such servers are replicated: they
+ * are not mapped on servers, instead the client keeps the version of each
+ * local block. Map, update and wait are spread among server and replicas, and
+ * a copy lagging behind never makes a local block older. Writes go to the
+ * primary server, which accepts them only if the local version is the current
+ * one. Range operations are not available on replicated blocks.
+ *
+ * Map, update, write and wait have asynchronous variants, which send the
+ * request and return at once. Result is delivered through a DM_future, which
+ * can be waited for or run a callback. Replies are read by an event loop
+ * thread polling all server connections, started on first asynchronous
+ * request, so a client can have requests in flight on every server while it
+ * computes:
+ *
+ * DM_future f[n];
+ *
+ * for (i = 0; i < n; i++) dm.dm_block_update_async(i, &f[i]);
+ *
+ * for (i = 0; i < n; i++) f[i].wait();
+ *
+ * Requests on blocks of replicated servers run on a thread of their own.
+ *
+ * An optional Prefetch=K line in configuration file enables prefetching: when
+ * dm_block_update() is called on blocks at a constant stride (1, 2, ..., or
+ * n, n-1, ...), updates of the next K mapped blocks along the stride are sent
+ * asynchronously, and a following dm_block_update() on one of them finds data
+ * already in the local block. A prefetched block is updated at prefetch time,
+ * so a block being walked must not be modified locally before its
+ * dm_block_update(). dm_block_wait() on a prefetched block which was invalid
+ * returns at once, as it would have done without prefetching. Blocks of
+ * replicated servers are not prefetched.
+ *
+ * An optional WriteBack=N line enables write-back: dm_block_write() queues
+ * the block and returns 0 at once. Repeated writes of a queued block collapse
+ * into one, which sends local data as it is at flush time. Queued writes are
+ * sent when N blocks are queued, every FlushInterval=ms milliseconds if that
+ * line is present, on dm_flush(), before any other request on the same block,
+ * and when DM_client is destroyed. They are sent as a batch: writes to a
+ * server follow each other on one connection, and replies are read after.
+ * dm_flush() reports which writes failed. Writes of replicated blocks are not
+ * queued.
+ *
+ * A range of blocks can be mapped as a region (see dm_region_map()): the
+ * library allocates page aligned local memory and catches the first write to
+ * each page, so that dm_region_sync() writes only the blocks modified since
+ * last sync. Blocks of a region must be synchronized with dm_region_sync()
+ * and dm_region_update(), not with single block operations.
+ *
+ * Blocks may be moved between servers while clients are running (see
+ * dm_migrate()). A request on a moved block is redirected by the old owner,
+ * and the client repeats it on the new owner, updating its distributed memory
+ * map.
  */
 class DM_client {
 	/**
@@ -66,27 +254,642 @@ class DM_client {
 	int dim;
 
 	/**
-	 * Distributed memory map. For each block indicates where to locate it
-	 * (server address) and how to reach it (server socket). In order to
-	 * minimize memory allocation, server structure is allocated only once.
-	 * Blocks owned by the same server point to the same server structure.
+	 * Local memory map. For each block mapped by the client indicates the
+	 * local address and, for blocks of replicated servers, the version of
+	 * local data. Contains only mapped blocks.
+	 */
+	LMap LM;
+
+	/**
+	 * Distributed memory map: block placement among servers, as read from
+	 * configuration file, plus blocks moved since then. Gives the index in
+	 * owners of the server owning a block, without storing anything per
+	 * block.
 	 */
-	map<int, server *> DM;
+	Placement placement;
 
 	/**
-	 * Local memory map. For each block mapped by the client indicates the
-	 * local address. Contains only mapped blocks.
+	 * Servers owning blocks, numbered as in placement. Servers are listed
+	 * in configuration file order, followed by servers learnt through
+	 * redirects. In order to minimize memory allocation, server structure
+	 * is allocated only once.
+	 */
+	vector<server *> owners;
+
+	/**
+	 * All servers the client is connected to, primaries and replicas.
+	 */
+	vector<server *> servers;
+
+	/**
+	 * Token identifying the client on every server, so that its mappings
+	 * follow blocks moved between servers and are shared by all of its
+	 * connections.
+	 */
+	long long token;
+
+	/**
+	 * Read-write lock protecting LM, placement, owners and servers. It is
+	 * never held while waiting for a server.
+	 */
+	pthread_rwlock_t lock;
+
+	/**
+	 * Opens a connection to a server and identifies client on it with
+	 * its token. Block size is checked, or learned from server if it has
+	 * not been configured.
+	 * @param[in]	address Server address and port.
+	 * @param[out]	caps If not NULL, capabilities of server known to
+	 *		client.
+	 * @return	Socket descriptor on success, -1 on error or if server
+	 * 		has another block size.
+	 */
+	int open_connection (sockaddr_in *address, int *caps);
+
+	/**
+	 * Looks for the server structure of a given address. Must be called
+	 * with lock held.
+	 * @param[in]	address Server address and port.
+	 * @return	Server structure, NULL if client has none.
+	 */
+	server *find_server (sockaddr_in *address);
+
+	/**
+	 * Returns server structure for a given address, opening connection
+	 * if client is not connected to it yet. Connection is opened without
+	 * holding lock, so it must be called without lock held.
+	 * @param[in]	address Server address and port.
+	 * @return	Server structure on success, NULL on error.
+	 */
+	server *open_server (sockaddr_in *address);
+
+	/**
+	 * Takes an idle connection to a server, opening a new one if none is
+	 * idle.
+	 * @param[in]	srv Server structure.
+	 * @return	Socket descriptor on success, -1 on error.
+	 */
+	int acquire (server *srv);
+
+	/**
+	 * Gives back a connection taken with acquire().
+	 * @param[in]	srv Server structure.
+	 * @param[in]	sd Socket descriptor.
+	 * @return	No value is returned.
+	 */
+	void release (server *srv, int sd);
+
+	/**
+	 * Takes a connection to a server and sends a request on it. If the
+	 * connection broke while idle, request is sent again on a new one.
+	 * @param[in]	srv Server structure.
+	 * @param[in]	head Request.
+	 * @param[in]	hsize Size of request.
+	 * @param[in]	data Data following request, NULL if none.
+	 * @param[in]	dsize Size of data.
+	 * @return	Socket descriptor reply will be read from, -1 on error.
+	 */
+	int submit (server *srv, void *head, int hsize, void *data = NULL,
+		    int dsize = 0);
+
+	/**
+	 * Sends a request which changes nothing on server, as submit(), and
+	 * receives the header of its reply, waiting with no time limit. If
+	 * connection breaks before, e.g. because server restarted while it
+	 * was idle, request is asked again once on a new connection.
+	 * @param[in]	srv Server structure.
+	 * @param[in]	head Request.
+	 * @param[in]	hsize Size of request.
+	 * @param[in]	data Data following request, NULL if none.
+	 * @param[in]	dsize Size of data.
+	 * @param[in]	tag Tag of request.
+	 * @param[out]	f Header of reply.
+	 * @return	Socket descriptor rest of reply will be read from, -1 on
+	 *		error.
+	 */
+	int query (server *srv, void *head, int hsize, void *data, int dsize,
+		   int tag, frame *f);
+
+	/**
+	 * Asynchronous requests waiting for their reply.
+	 */
+	vector<pending> pendings;
+
+	/**
+	 * Mutex protecting pendings, looping and stopping.
+	 */
+	pthread_mutex_t pmutex;
+
+	/**
+	 * Event loop thread.
+	 */
+	pthread_t loop;
+
+	/**
+	 * Pipe waking event loop when a request is added or client is
+	 * destroyed.
+	 */
+	int wake[2];
+
+	/**
+	 * True if event loop thread is running.
+	 */
+	bool looping;
+
+	/**
+	 * True when event loop must terminate.
+	 */
+	bool stopping;
+
+	/**
+	 * Number of blocks updated ahead, 0 if prefetching is disabled. Read
+	 * from configuration file.
+	 */
+	int depth;
+
+	/**
+	 * Prefetched blocks, each with the future of its update. Contains
+	 * blocks ahead of the current stride only.
+	 */
+	map<block_id, DM_future *> prefetched;
+
+	/**
+	 * Mutex protecting prefetched, last, stride and run.
+	 */
+	pthread_mutex_t fmutex;
+
+	/**
+	 * Last block updated.
+	 */
+	block_id last;
+
+	/**
+	 * Distance between the last two blocks updated.
+	 */
+	block_id stride;
+
+	/**
+	 * Number of consecutive updates at the same stride.
+	 */
+	int run;
+
+	/**
+	 * Detects a constant stride in updates and sends updates of the next
+	 * blocks along it. If stride is broken, prefetched blocks are
+	 * forgotten.
+	 * @param[in]	ID Block being updated.
+	 * @return	No value is returned.
+	 */
+	void prefetch (block_id ID);
+
+	/**
+	 * Waits for the prefetch of a block, if any, and forgets it. Must be
+	 * called before any request on a block.
+	 * @param[in]	ID Block id.
+	 * @param[out]	result Result of prefetched update: 2 if block data has
+	 *		been transferred, 0 if local block was up to date, -1
+	 *		on error.
+	 * @return	True if block had been prefetched.
+	 */
+	bool settle (block_id ID, int *result);
+
+	/**
+	 * Waits for all prefetches and forgets them. Must be called with
+	 * fmutex held.
+	 * @return	No value is returned.
+	 */
+	void drain ();
+
+	/**
+	 * Maximum number of queued writes, 0 if write-back is disabled. Read
+	 * from configuration file.
+	 */
+	int wb_size;
+
+	/**
+	 * Milliseconds between flushes of queued writes, 0 if they are not
+	 * flushed periodically. Read from configuration file.
+	 */
+	int wb_interval;
+
+	/**
+	 * Milliseconds a request may take, waits excepted. Read from
+	 * configuration file, 60 seconds by default.
+	 */
+	int timeout;
+
+	/**
+	 * Blocks whose write is queued.
+	 */
+	set<block_id> queued;
+
+	/**
+	 * Blocks whose write is being sent.
+	 */
+	set<block_id> flushing;
+
+	/**
+	 * Failed writes, each with its result, not reported by dm_flush()
+	 * yet.
+	 */
+	vector<pair<block_id, int> > failures;
+
+	/**
+	 * Mutex protecting queued, flushing, failures and wb_stop.
+	 */
+	pthread_mutex_t wmutex;
+
+	/**
+	 * Condition variable signalled when writes have been sent.
+	 */
+	pthread_cond_t wcond;
+
+	/**
+	 * Condition variable waking flusher thread when it must terminate.
+	 */
+	pthread_cond_t tcond;
+
+	/**
+	 * Thread flushing queued writes every wb_interval milliseconds.
+	 */
+	pthread_t flusher;
+
+	/**
+	 * True if flusher thread is running.
+	 */
+	bool wb_running;
+
+	/**
+	 * True when flusher thread must terminate.
+	 */
+	bool wb_stop;
+
+	/**
+	 * Serial of the last UPDATE or WRITE request issued.
+	 */
+	int serials;
+
+	/**
+	 * Regions mapped by client.
 	 */
-	map<int, char *> LM;
+	vector<Region *> regions;
+
+	/**
+	 * Finds a region.
+	 * @param[in]	address Region address.
+	 * @return	Region, NULL if no region starts at address.
+	 */
+	Region *find_region (void *address);
+
+	/**
+	 * Sends an asynchronous request for each block in a list and waits
+	 * for all of them.
+	 * @param[in]	type UPDATE or WRITE.
+	 * @param[in]	ids Block ids.
+	 * @param[out]	results Result of each request.
+	 * @return	0 on success, otherwise the first error.
+	 */
+	int fan_out (int type, vector<block_id> &ids, vector<int> *results);
+
+	/**
+	 * Writes a block at once.
+	 * @param[in]	ID Block id.
+	 * @return	As dm_block_write().
+	 */
+	int write_now (block_id ID);
+
+	/**
+	 * Queues write of a block, flushing queue if it is full.
+	 * @param[in]	ID Block id.
+	 * @return	0 on success, -1 if block is not mapped. Writes of
+	 * 		replicated blocks are done at once, result is as for
+	 * 		dm_block_write().
+	 */
+	int queue_write (block_id ID);
+
+	/**
+	 * Sends queued write of a block, if any, and waits for a write of the
+	 * block being sent. Must be called before any request on a block.
+	 * @param[in]	ID Block id.
+	 * @return	No value is returned.
+	 */
+	void write_queued (block_id ID);
+
+	/**
+	 * Sends all queued writes.
+	 * @return	No value is returned.
+	 */
+	void flush_queue ();
+
+	/**
+	 * Writes blocks as a batch.
+	 * @param[in]	ids Blocks to write.
+	 * @param[out]	failed Failed writes, each with its result.
+	 * @return	No value is returned.
+	 */
+	void write_batch (vector<block_id> &ids,
+			  vector<pair<block_id, int> > *failed);
+
+	/**
+	 * Thread flushing queued writes periodically.
+	 * @param[in]	in Client.
+	 */
+	static void *flush_thread (void *in);
+
+	/**
+	 * Takes a connection to a server and sends a MAP, UNMAP, UPDATE, WRITE
+	 * or WAIT request on it. An UPDATE or WRITE gets a new serial, stored
+	 * in lb, so that server recognizes it if it must be resent.
+	 * @param[in]	type Request type.
+	 * @param[in]	lb Copy of local entry of block.
+	 * @param[in]	srv Server owning the block.
+	 * @return	Socket descriptor reply will be read from, -1 on error.
+	 */
+	int issue (int type, lblock *lb, server *srv);
+
+	/**
+	 * Sends a request again, with the same serial, on a new connection.
+	 * @param[in]	type Request type.
+	 * @param[in]	lb Copy of local entry of block, as sent by issue().
+	 * @param[in]	srv Server owning the block.
+	 * @return	Socket descriptor reply will be read from, -1 on error.
+	 */
+	int resend (int type, lblock *lb, server *srv);
+
+	/**
+	 * Reads the reply to a request sent with issue() and gives back the
+	 * connection.
+	 * @param[in]	type Request type.
+	 * @param[in]	lb Copy of local entry of block.
+	 * @param[in]	srv Server request has been sent to.
+	 * @param[in]	sd Socket descriptor returned by issue().
+	 * @param[in]	limit Milliseconds to wait for the reply to a WAIT, -1
+	 *		for no limit.
+	 * @return	Result of request, as for synchronous operations, or 1
+	 * 		if block has moved and request must be repeated, or 2
+	 * 		for a PREFETCH which transferred block data.
+	 */
+	int complete (int type, lblock *lb, server *srv, int sd,
+		      int limit = -1);
+
+	/**
+	 * Repeats on a new connection a request whose connection broke before
+	 * its reply was read. Server may have served it: it is resent with
+	 * the same serial, so that server transfers data again for an UPDATE
+	 * or PREFETCH, and doesn't apply a WRITE twice. Other requests are not
+	 * repeated.
+	 * @param[in]	type Request type.
+	 * @param[in]	lb Copy of local entry of block.
+	 * @param[in]	srv Server request has been sent to.
+	 * @return	As complete(), -1 if request is not repeated.
+	 */
+	int resume (int type, lblock *lb, server *srv);
+
+	/**
+	 * Starts an asynchronous request.
+	 * @param[in]	type Request type: MAP, UPDATE, WRITE, WAIT or PREFETCH.
+	 * @param[in]	ID Block id.
+	 * @param[in]	address Local address, for MAP.
+	 * @param[out]	future Future completed with result.
+	 * @return	0 if request has been sent, otherwise the error future
+	 * 		has been completed with.
+	 */
+	int submit (int type, block_id ID, void *address, DM_future *future);
+
+	/**
+	 * Event loop: waits for replies to asynchronous requests and completes
+	 * their futures, until client is destroyed.
+	 * @return	No value is returned.
+	 */
+	void event_loop ();
+
+	/**
+	 * Thread running event_loop().
+	 * @param[in]	in Client.
+	 */
+	static void *loop_thread (void *in);
+
+	/**
+	 * Thread running an asynchronous request as a synchronous one.
+	 * @param[in]	in Request, freed when done.
+	 */
+	static void *sync_thread (void *in);
+
+	/**
+	 * Sends a MAP, UNMAP, UPDATE, WRITE, WAIT or PREFETCH request on a
+	 * connection.
+	 * @param[in]	sd Socket descriptor.
+	 * @param[in]	type Request type.
+	 * @param[in]	lb Copy of local entry of block.
+	 * @return	0 on success, -1 on error.
+	 */
+	int send_request (int sd, int type, lblock *lb);
+
+	/**
+	 * Reads the reply to a request sent with send_request().
+	 * @param[in]	sd Socket descriptor.
+	 * @param[in]	type Request type.
+	 * @param[in]	lb Copy of local entry of block.
+	 * @param[out]	broken True if connection is no longer usable.
+	 * @param[in]	limit As for complete().
+	 * @return	As complete().
+	 */
+	int read_reply (int sd, int type, lblock *lb, bool *broken,
+			int limit = -1);
+
+	/**
+	 * Copies the local entry of a mapped block and finds its owner, after
+	 * prefetch and queued write of the block, if any, are done.
+	 * @param[in]	ID Block id.
+	 * @param[out]	lb Copy of local entry.
+	 * @param[out]	srv Owner server.
+	 * @return	0 on success, -1 if block is not mapped or has no owner.
+	 */
+	int lookup (block_id ID, lblock *lb, server **srv);
+
+	/**
+	 * Copies the local entry of a mapped block and finds its owner.
+	 * @param[in]	ID Block id.
+	 * @param[out]	lb Copy of local entry.
+	 * @param[out]	srv Owner server.
+	 * @return	0 on success, -1 if block is not mapped or has no owner.
+	 */
+	int find_block (block_id ID, lblock *lb, server **srv);
+
+	/**
+	 * Sets the version of local data of a mapped block.
+	 * @param[in]	ID Block id.
+	 * @param[in]	version Version of local data.
+	 * @return	No value is returned.
+	 */
+	void set_version (block_id ID, int version);
+
+	/**
+	 * Records whether local data of a mapped block is known to be older
+	 * than primary server's.
+	 * @param[in]	ID Block id.
+	 * @param[in]	behind True if local data is older.
+	 * @return	No value is returned.
+	 */
+	void set_behind (block_id ID, bool behind);
+
+	/**
+	 * Removes a block from local memory map.
+	 * @param[in]	ID Block id.
+	 * @return	No value is returned.
+	 */
+	void forget (block_id ID);
+
+	/**
+	 * Finds the server owning a block. Must be called with lock held.
+	 * @param[in]	ID Block id.
+	 * @return	Owner server, NULL if no server owns the block.
+	 */
+	server *route (block_id ID);
+
+	/**
+	 * Returns the index of a server in owners, adding it if needed. Must
+	 * be called with lock held for writing.
+	 * @param[in]	srv Server structure.
+	 * @return	Index of server.
+	 */
+	int owner_index (server *srv);
+
+	/**
+	 * Routes blocks of a range owned by a server to another one. With
+	 * RANGE placement, a range wholly owned by the server is rerouted as a
+	 * whole, otherwise its blocks are rerouted one by one. Must be called
+	 * with lock held for writing.
+	 * @param[in]	first First block id.
+	 * @param[in]	last Last block id.
+	 * @param[in]	src Server blocks are moved from.
+	 * @param[in]	index Index of server blocks are moved to.
+	 * @return	No value is returned.
+	 */
+	void relocate (block_id first, block_id last, server *src, int index);
+
+	/**
+	 * Reads the rest of a REDIRECT reply and routes block identified by ID,
+	 * and the blocks moved with it, to their new owner.
+	 * @param[in]	ID Block id.
+	 * @param[in]	sd Socket descriptor REDIRECT reply has been read from.
+	 * @param[in]	length Payload size of reply.
+	 * @return	0 on success, -1 on error.
+	 */
+	int redirect (block_id ID, int sd, int length);
+
+	/**
+	 * Finds the end of a piece of a range: consecutive blocks on the same
+	 * server.
+	 * @param[in]	pos First block id of piece.
+	 * @param[in]	last Last block id of range.
+	 * @param[in]	max Maximum number of blocks in piece.
+	 * @param[out]	srv Filled with server owning piece, NULL if none.
+	 * @return	Last block id of piece.
+	 */
+	block_id piece (block_id pos, block_id last, int max, server **srv);
+
+	/**
+	 * Sends a STALE request for blocks of a server and reads its reply.
+	 * @param[in]	srv Server owning first block.
+	 * @param[in]	ID First block id.
+	 * @param[in]	blocks Number of blocks, at most MAXSTALE.
+	 * @param[out]	ids Stale blocks are appended to it.
+	 * @param[out]	lost Blocks mapped by client which server doesn't
+	 *		know as mapped are appended to it.
+	 * @return	Number of blocks checked, 0 if first block has been
+	 *		moved and routing updated, -1 on error.
+	 */
+	int stale_blocks (server *srv, block_id ID, int blocks,
+			  vector<block_id> *ids, vector<block_id> *lost);
+
+	/**
+	 * Finds mapped blocks of a range which are stale. On servers with
+	 * replicas, which don't track copies of clients, every mapped block
+	 * is taken as stale.
+	 * @param[in]	first First block id.
+	 * @param[in]	last Last block id.
+	 * @param[out]	ids Stale blocks are appended to it.
+	 * @param[out]	lost Mapped blocks whose mapping server lost, e.g.
+	 *		after restarting, are appended to it.
+	 * @return	0 on success, -1 on error.
+	 */
+	int stale (block_id first, block_id last, vector<block_id> *ids,
+		   vector<block_id> *lost);
+
+	/**
+	 * Maps again on its server a block mapped by client, whose mapping
+	 * server lost. Local copy is refreshed.
+	 * @param[in]	ID Block id.
+	 * @return	0 on success, -1 on error.
+	 */
+	int remap (block_id ID);
+
+	/**
+	 * Sends a SCAN request for blocks of a server and reads its reply.
+	 * @param[in]	srv Server owning first block.
+	 * @param[in]	ID First block id.
+	 * @param[in]	blocks Number of blocks.
+	 * @param[in]	tail Number of bytes scanned in last block.
+	 * @param[in]	kernel Scan kernel.
+	 * @param[in]	operand Element size, or 0 for kernels on bytes.
+	 * @param[in]	set Class mask for kernels on bytes.
+	 * @param[out]	res Filled with SCANREPLY fields of reply.
+	 * @return	0 on success, 1 if first block has been moved and
+	 *		routing updated, -1 on error.
+	 */
+	int scan_blocks (server *srv, block_id ID, int blocks, int tail,
+			 int kernel, int operand, unsigned char *set,
+			 int *res);
+
+	/**
+	 * Chooses which copy of a replicated server serves next read.
+	 * @param[in]	srv Primary server.
+	 * @return	Primary server or one of its replicas.
+	 */
+	server *reader (server *srv);
+
+	/**
+	 * Updates a replicated block from one of its copies. A replica which
+	 * lost its primary server refuses, and primary server is asked. So it
+	 * is if local data is known to be older than primary server's, since
+	 * a replica lagging behind would take it as up to date.
+	 * @param[in]	lb Copy of local entry.
+	 * @param[in]	srv Primary server owning the block.
+	 * @param[in]	primary True to ask primary server only.
+	 * @return	0 on success, -1 on error.
+	 */
+	int replica_update (lblock *lb, server *srv, bool primary = false);
+
+	/**
+	 * Writes a replicated block on its primary server.
+	 * @param[in]	lb Copy of local entry.
+	 * @param[in]	srv Primary server owning the block.
+	 * @return	0 on success, -2 if block is invalid, -1 on error.
+	 */
+	int replica_write (lblock *lb, server *srv);
+
+	/**
+	 * Waits for a replicated block to become invalid on one of its copies.
+	 * A replica which lost its primary server refuses, also while waiting,
+	 * and wait goes on on primary server.
+	 * @param[in]	lb Copy of local entry.
+	 * @param[in]	srv Primary server owning the block.
+	 * @param[in]	limit Milliseconds to wait, -1 for no limit.
+	 * @param[in]	primary True to wait on primary server only.
+	 * @return	0 on success, -1 on error, -4 if time limit expired.
+	 */
+	int replica_wait (lblock *lb, server *srv, int limit,
+			  bool primary = false);
 public:
 	/**
-	 * DM_client Constructor. Initializes dim to 0.
+	 * DM_client Constructor. Initializes dim to 0 and lock.
 	 */
 	DM_client ();
 
 	/**
 	 * DM_client Destructor. Closes server sockets and deallocates server
-	 * structures.
+	 * structures. No request may be running.
 	 */
 	~DM_client ();
 
@@ -94,7 +897,8 @@ public:
 	 * Initializes distributed memory map DM with the content of a
 	 * configuration file. Opens connections with distributed memory
 	 * servers. This operation must be done before all other operations
-	 * otherwise they will return error.
+	 * otherwise they will return error, and before other threads use
+	 * DM_client.
 	 * @param[in]	config_file Path to configuration file.
 	 * @return	0 on success, -1 on error.
 	 */
@@ -110,7 +914,7 @@ public:
 	 * @return	0 on success, -1 on error, -2 if block is already
 	 *		mapped, -3 if DM_client has not been initialized.
 	 */
-	int dm_block_map (int ID, void *address);
+	int dm_block_map (block_id ID, void *address);
 
 	/**
 	 * Unmaps block identified by ID.
@@ -118,7 +922,7 @@ public:
 	 * @return	0 on success, -1 on error, -3 if DM_client has not been
 	 * 		initialized.
 	 */
-	int dm_block_unmap (int ID);
+	int dm_block_unmap (block_id ID);
 
 	/**
 	 * Updates content of block identified by ID.
@@ -126,15 +930,29 @@ public:
 	 * @return	0 on success, -1 on error, -3 if DM_client has not been
 	 * 		initialized.
 	 */
-	int dm_block_update (int ID);
+	int dm_block_update (block_id ID);
 
 	/**
 	 * Writes data in local block identified by ID to distributed memory.
+	 * With write-back enabled write is queued: 0 is returned and result
+	 * is reported by dm_flush().
 	 * @param[in]	ID Block id.
 	 * @return	0 on success, -2 if block is invalid, -1 on error, -3 if
 	 * 		DM_client has not been initialized.
 	 */
-	int dm_block_write (int ID);
+	int dm_block_write (block_id ID);
+
+	/**
+	 * Sends all queued writes and waits for them, also for those being
+	 * sent by other threads. Reports writes failed since last
+	 * dm_flush(), also those sent before it was called.
+	 * @param[out]	failed If not NULL, filled with failed writes, each
+	 *		as a pair <block id, result>. Results are as for
+	 *		dm_block_write().
+	 * @return	0 if no write failed, -1 if a write failed, -3 if
+	 * 		DM_client has not been initialized.
+	 */
+	int dm_flush (vector<pair<block_id, int> > *failed);
 
 	/**
 	 * Waits for block identified by ID to become invalid.
@@ -142,7 +960,194 @@ public:
 	 * @return	0 on success, -1 on error, -3 if DM_client has not been
 	 * 		initialized.
 	 */
-	int dm_block_wait (int ID);
+	int dm_block_wait (block_id ID);
+
+	/**
+	 * Waits for block identified by ID to become invalid, for at most
+	 * limit milliseconds.
+	 * @param[in]	ID Block id.
+	 * @param[in]	limit Milliseconds to wait, -1 for no limit.
+	 * @return	0 on success, -1 on error, -3 if DM_client has not been
+	 * 		initialized, -4 if time limit expired.
+	 */
+	int dm_block_wait_for (block_id ID, int limit);
+
+	/**
+	 * Asynchronous dm_block_map(). Local block must not be read until
+	 * request is completed.
+	 * @param[in]	ID Block id.
+	 * @param[out]	address Local memory address in which block data will be
+	 *		stored.
+	 * @param[out]	future Future completed with dm_block_map() result.
+	 * @return	0 if request has been sent, otherwise the error future
+	 * 		has been completed with.
+	 */
+	int dm_block_map_async (block_id ID, void *address, DM_future *future);
+
+	/**
+	 * Asynchronous dm_block_update(). Local block must not be read until
+	 * request is completed.
+	 * @param[in]	ID Block id.
+	 * @param[out]	future Future completed with dm_block_update() result.
+	 * @return	0 if request has been sent, otherwise the error future
+	 * 		has been completed with.
+	 */
+	int dm_block_update_async (block_id ID, DM_future *future);
+
+	/**
+	 * Asynchronous dm_block_write(). Local block must not be modified
+	 * until request is completed.
+	 * @param[in]	ID Block id.
+	 * @param[out]	future Future completed with dm_block_write() result.
+	 * @return	0 if request has been sent, otherwise the error future
+	 * 		has been completed with.
+	 */
+	int dm_block_write_async (block_id ID, DM_future *future);
+
+	/**
+	 * Asynchronous dm_block_wait().
+	 * @param[in]	ID Block id.
+	 * @param[out]	future Future completed with dm_block_wait() result.
+	 * @return	0 if request has been sent, otherwise the error future
+	 * 		has been completed with.
+	 */
+	int dm_block_wait_async (block_id ID, DM_future *future);
+
+	/**
+	 * Maps n consecutive blocks, starting at first, in page aligned local
+	 * memory allocated by the library. Writes to the region are tracked.
+	 * @param[in]	first First block id.
+	 * @param[in]	n Number of blocks.
+	 * @param[out]	address Start of region. Block first + i is at
+	 *		address + i * dm_block_dim().
+	 * @return	0 on success, -1 on error, -2 if a block is already
+	 *		mapped, -3 if DM_client has not been initialized. On
+	 *		error no block is left mapped.
+	 */
+	int dm_region_map (block_id first, int n, void **address);
+
+	/**
+	 * Writes the blocks of a region modified since it was mapped or last
+	 * synchronized. Blocks whose write fails remain dirty.
+	 * @param[in]	address Start of region.
+	 * @return	0 on success, -2 if a block is invalid, -1 on error, -3
+	 * 		if DM_client has not been initialized.
+	 */
+	int dm_region_sync (void *address);
+
+	/**
+	 * Updates blocks of a region changed since they were last updated,
+	 * asking servers which ones first (see dm_resync()). Region must not
+	 * be written by other threads meanwhile. Blocks modified locally
+	 * remain dirty.
+	 * @param[in]	address Start of region.
+	 * @return	0 on success, -1 on error, -3 if DM_client has not been
+	 * 		initialized.
+	 */
+	int dm_region_update (void *address);
+
+	/**
+	 * Unmaps all blocks of a region and frees its memory. Modified blocks
+	 * not synchronized are lost.
+	 * @param[in]	address Start of region.
+	 * @return	0 on success, -1 on error, -3 if DM_client has not been
+	 * 		initialized.
+	 */
+	int dm_region_unmap (void *address);
+
+	/**
+	 * Reads length bytes starting at offset of block identified by ID
+	 * from distributed memory. Only that slice of the local block is
+	 * modified. The local block is not marked as up to date, a following
+	 * dm_block_update() will still transfer the whole block.
+	 * @param[in]	ID Block id.
+	 * @param[in]	offset First byte of the range inside the block.
+	 * @param[in]	length Number of bytes in the range.
+	 * @return	0 on success, -1 on error (also if range exceeds block
+	 * 		dimension), -3 if DM_client has not been initialized.
+	 */
+	int dm_block_read_range (block_id ID, int offset, int length);
+
+	/**
+	 * Writes length bytes starting at offset of local block identified by
+	 * ID to distributed memory. Local block must be valid, as for
+	 * dm_block_write().
+	 * @param[in]	ID Block id.
+	 * @param[in]	offset First byte of the range inside the block.
+	 * @param[in]	length Number of bytes in the range.
+	 * @return	0 on success, -2 if block is invalid, -1 on error (also
+	 * 		if range exceeds block dimension), -3 if DM_client has
+	 * 		not been initialized.
+	 */
+	int dm_block_write_range (block_id ID, int offset, int length);
+
+	/**
+	 * Moves blocks in [first, last] from their server to another server,
+	 * while other clients keep working on them. All blocks in range must
+	 * be owned by the same server, which must have no replicas. Clients
+	 * are redirected to the new owner when they access a moved block,
+	 * their mappings and versions are preserved.
+	 * @param[in]	first First block id.
+	 * @param[in]	last Last block id.
+	 * @param[in]	address New owner's address in dotted notation.
+	 * @param[in]	port New owner's port.
+	 * @return	0 on success, -1 on error, -3 if DM_client has not been
+	 * 		initialized.
+	 */
+	int dm_migrate (block_id first, block_id last, char *address, int port);
+
+	/**
+	 * Asks a server for a report of its metrics: connections, bytes,
+	 * waiting clients, count, errors and latency of each request type,
+	 * and most accessed blocks. The report is text, one metric per line.
+	 * @param[in]	address Server's address in dotted notation.
+	 * @param[in]	port Server's port.
+	 * @param[in]	top Number of most accessed blocks reported.
+	 * @param[out]	report Filled with report.
+	 * @return	0 on success, -1 on error, -3 if DM_client has not been
+	 * 		initialized.
+	 */
+	int dm_stats (char *address, int port, int top, string *report);
+
+	/**
+	 * Updates the mapped blocks of a range which changed since they were
+	 * last updated, e.g. after a long pause. Servers are asked which
+	 * blocks are stale, one request per MAXSTALE blocks, so unchanged
+	 * blocks cost no round trip; stale ones are updated concurrently.
+	 * Blocks whose mapping a server lost, e.g. after restarting, are
+	 * mapped again. Blocks of regions must be refreshed with
+	 * dm_region_update().
+	 * @param[in]	first First block id.
+	 * @param[in]	last Last block id.
+	 * @return	Number of blocks updated or mapped again on success,
+	 *		otherwise the first error returned by a block, as for
+	 *		dm_block_update(), -3 if DM_client has not been
+	 *		initialized.
+	 */
+	int dm_resync (block_id first, block_id last);
+
+	/**
+	 * Runs a kernel over length bytes of memory, starting at block first,
+	 * on the servers owning the blocks: only results are transferred.
+	 * Blocks need not be mapped, and local copies are neither read nor
+	 * changed. Each block is scanned atomically, the whole range is not.
+	 * @param[in]	first First block id.
+	 * @param[in]	length Number of bytes.
+	 * @param[in]	kernel SCAN_COUNT, SCAN_FIND or SCAN_RUNS, which test
+	 *		bytes against a class, SCAN_SUM or SCAN_MINMAX, which
+	 *		read elements (see msg.h).
+	 * @param[in]	operand For kernels on bytes, 0 if class is made of
+	 *		bytes in set, 1 if of bytes not in set. For the others,
+	 *		element size: 1 for unsigned bytes, 4 for integers.
+	 * @param[in]	set Bytes of class, as a string. Ignored by kernels on
+	 *		elements.
+	 * @param[out]	result Filled with result.
+	 * @return	0 on success, -1 on error (also if a server doesn't
+	 *		support scans, or integers would cross blocks), -3 if
+	 *		DM_client has not been initialized.
+	 */
+	int dm_scan (block_id first, long long length, int kernel,
+		     int operand, const char *set, scan_result *result);
 
 	/**
 	 * Returns block dimension.
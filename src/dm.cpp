@@ -7,71 +7,745 @@
  * @date June 2010
  */
 
+#include <algorithm>
+#include <sys/socket.h>
 #include "dm.h"
+#include "msg.h"
+#include "scan.h"
+#include "utility.h"
 
-DM::DM () {}
+/**
+ * Reads the monotonic clock, which doesn't jump when system time is set.
+ * @return	Seconds since an unspecified point.
+ */
+static time_t monotonic_s ()
+{
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * Transfer function of Block::migrate() which sends state nowhere.
+ * @param[in]	state Serialized block state.
+ * @param[in]	size Size of serialized state in bytes.
+ * @param[in]	arg Unused.
+ * @return	0.
+ */
+static int discard (char *state, int size, void *arg)
+{
+	return 0;
+}
+
+DM::DM ()
+{
+	first = 0;
+	last = -1;
+	placed = false;
+	self = 0;
+	lazy = false;
+	replica = false;
+	unchanged = 0;
+	grace = 0;
+	heard_at = 0;
+	gone = new Block ();
+	gone->migrate (discard, NULL);
+	pthread_rwlock_init (&lock, 0);
+	pthread_mutex_init (&cmutex, 0);
+}
 
 DM::~DM ()
 {
-	for (int i = first; i <= last; i++)
-		delete dm_map[i];
+	for (map<block_id, Block *>::iterator it = dm_map.begin ();
+	     it != dm_map.end (); it++)
+		delete it->second;
+	delete gone;
 }
 
-void DM::init (int f, int l)
+void DM::init (block_id f, block_id l, Placement *p, int s, bool z)
 {
 	first = f;
 	last = l;
-	for (int i = first; i <= last; i++)
-		dm_map[i] = new Block();
+	placed = p != NULL;
+	if (placed)
+		placement = *p;
+	self = s;
+	lazy = z;
+	if (lazy || first > last)
+		return;
+
+	// loop ends on last, so that last may be the largest int
+	for (block_id i = first; ; i++) {
+		if (owns (i))
+			dm_map[i] = new Block();
+		if (i == last)
+			break;
+	}
+}
+
+bool DM::owns (block_id ID)
+{
+	return ID >= first && ID <= last &&
+	       (!placed || placement.owner (ID) == self);
+}
+
+int DM::map_client (client_id cid, block_id ID, char *buf)
+{
+	Block *b = lookup (ID);
+	if (b == NULL)
+		return -1;
+
+	int ret = b->bmap (cid, buf);
+	return ret;
 }
 
-int DM::map_client (int sd, int ID, char *buf)
+int DM::unmap_client (client_id cid, block_id ID)
 {
-	if (dm_map.find (ID) == dm_map.end ())
+	Block *b = lookup (ID);
+	if (b == NULL)
 		return -1;
 
-	int ret = dm_map[ID]->bmap (sd, buf);
+	int ret = b->unmap (cid);
 	return ret;
 }
 
-int DM::unmap_client (int sd, int ID)
+int DM::write_block (client_id cid, block_id ID, char *buf, int serial)
+{
+	Block *b = lookup (ID);
+	if (replica || b == NULL)
+		return -1;
+
+	int ret = b->write (cid, buf, serial);
+	if (ret == 1) {
+		// replicas already hold this data
+		__atomic_fetch_add (&unchanged, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (ret == 0)
+		push (ID);
+	return ret;
+}
+
+int DM::write_block_range (client_id cid, block_id ID, char *buf,
+			   int offset, int length)
+{
+	Block *b = lookup (ID);
+	if (replica || b == NULL)
+		return -1;
+
+	int ret = b->write_range (cid, buf, offset, length);
+	if (ret == 1) {
+		__atomic_fetch_add (&unchanged, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (ret == 0)
+		push (ID);
+	return ret;
+}
+
+int DM::update_block (client_id cid, block_id ID, char *buf, int serial)
+{
+	Block *b = lookup (ID);
+	if (b == NULL)
+		return -1;
+
+	int ret = b->update (cid, buf, serial);
+	return ret;
+}
+
+int DM::read_block_range (client_id cid, block_id ID, char *buf,
+			  int offset, int length)
+{
+	Block *b = lookup (ID);
+	if (b == NULL)
+		return -1;
+
+	int ret = b->read_range (cid, buf, offset, length);
+	return ret;
+}
+
+int DM::wait_block (client_id cid, block_id ID, int seconds)
+{
+	Block *b = lookup (ID);
+	if (b == NULL)
+		return -1;
+
+	int ret = b->wait (cid, seconds);
+	return ret;
+}
+
+void DM::clean (client_id cid)
+{
+	// blocks adopted from other servers may lay outside [first, last]
+	pthread_rwlock_rdlock (&lock);
+	for (map<block_id, Block *>::iterator it = dm_map.begin ();
+	     it != dm_map.end (); it++)
+		it->second->clean (cid);
+	pthread_rwlock_unlock (&lock);
+}
+
+void DM::attach (client_id cid)
+{
+	pthread_mutex_lock (&cmutex);
+	connections[cid]++;
+	suspended.erase (cid);
+	pthread_mutex_unlock (&cmutex);
+}
+
+void DM::detach (client_id cid, bool resumable)
+{
+	pthread_mutex_lock (&cmutex);
+	bool last = --connections[cid] <= 0;
+	if (last)
+		connections.erase (cid);
+	// a client which lost its connections may come back with the same
+	// token: mappings are kept, and so are the versions of its copies
+	bool suspend = last && resumable && grace > 0;
+	if (suspend)
+		suspended[cid] = monotonic_s () + grace;
+	// other connections of the client still use its mappings. They are
+	// released holding the mutex, as in expire(), so that a connection
+	// of the client attached meanwhile doesn't lose its new mappings
+	if (last && !suspend)
+		clean (cid);
+	pthread_mutex_unlock (&cmutex);
+}
+
+void DM::set_grace (int seconds)
+{
+	grace = seconds;
+}
+
+void DM::expire ()
+{
+	time_t now = monotonic_s ();
+	// mappings are released holding the mutex, so that a client coming
+	// back meanwhile finds none rather than part of them
+	pthread_mutex_lock (&cmutex);
+	map<client_id, time_t>::iterator it = suspended.begin ();
+	while (it != suspended.end ()) {
+		if (it->second <= now) {
+			clean (it->first);
+			suspended.erase (it++);
+		} else {
+			it++;
+		}
+	}
+	pthread_mutex_unlock (&cmutex);
+}
+
+void DM::push (block_id ID)
+{
+	if (replicas.empty ())
+		return;
+
+	// a snapshot is sent instead of client's data, so a write range
+	// reaches replicas as a whole block. version and data are consistent
+	// even if another write happened in the meanwhile
+	char buf[DIMBLOCK];
+	int version = lookup (ID)->snapshot (buf);
+	if (version != -1)
+		replicas.push (ID, version, buf);
+}
+
+void DM::set_replica ()
+{
+	replica = true;
+	// nothing is served before primary server is heard
+	Block::lagging = true;
+}
+
+bool DM::is_replica ()
+{
+	return replica;
+}
+
+void DM::heard ()
+{
+	if (!replica)
+		return;
+	__atomic_store_n (&heard_at, monotonic_s (), __ATOMIC_RELAXED);
+	if (__atomic_load_n (&Block::lagging, __ATOMIC_RELAXED))
+		__atomic_store_n (&Block::lagging, false, __ATOMIC_RELAXED);
+}
+
+void DM::check_lease ()
+{
+	time_t last = __atomic_load_n (&heard_at, __ATOMIC_RELAXED);
+	if (replica && !__atomic_load_n (&Block::lagging, __ATOMIC_RELAXED) &&
+	    monotonic_s () - last > LEASE)
+		lapse ();
+}
+
+void DM::lapse ()
+{
+	if (!replica)
+		return;
+	__atomic_store_n (&Block::lagging, true, __ATOMIC_RELAXED);
+	// waiters check the flag under block lock, so none misses the wakeup
+	pthread_rwlock_rdlock (&lock);
+	for (map<block_id, Block *>::iterator it = dm_map.begin ();
+	     it != dm_map.end (); it++)
+		it->second->wake ();
+	pthread_rwlock_unlock (&lock);
+}
+
+void DM::beat ()
+{
+	replicas.beat ();
+}
+
+int DM::add_replica (char *address, int port)
+{
+	return replicas.add (address, port);
+}
+
+int DM::replicate_block (block_id ID, int version, char *buf)
+{
+	Block *b = lookup (ID);
+	if (!replica || b == NULL)
+		return -1;
+
+	b->replicate (version, buf);
+	return 0;
+}
+
+int DM::vupdate_block (block_id ID, int version, char *buf, int *curr)
 {
-	if (dm_map.find (ID) == dm_map.end ())
+	Block *b = lookup (ID);
+	if (b == NULL)
 		return -1;
 
-	int ret = dm_map[ID]->unmap (sd);
+	int ret = b->vupdate (version, buf, curr);
 	return ret;
 }
 
-int DM::write_block (int sd, int ID, char *buf)
+int DM::vwrite_block (block_id ID, int version, char *buf)
 {
-	if (dm_map.find (ID) == dm_map.end ())
+	Block *b = lookup (ID);
+	if (replica || b == NULL)
 		return -1;
 
-	int ret = dm_map[ID]->write (sd, buf);
+	int ret = b->vwrite (version, buf);
+	if (ret == 0)
+		push (ID);
 	return ret;
 }
 
-int DM::update_block (int sd, int ID, char *buf)
+int DM::vwait_block (block_id ID, int version, int seconds)
 {
-	if (dm_map.find (ID) == dm_map.end ())
+	Block *b = lookup (ID);
+	if (b == NULL)
 		return -1;
 
-	int ret = dm_map[ID]->update (sd, buf);
+	int ret = b->vwait (version, seconds);
 	return ret;
 }
 
-int DM::wait_block (int sd, int ID)
+int DM::stale_blocks (client_id cid, block_id ID, int blocks,
+			unsigned char *bitmap, unsigned char *unmapped,
+			int *checked)
+{
+	*checked = 0;
+	for (int i = 0; i < blocks; i++) {
+		Block *b = find (ID + i);
+		int ret = 0;
+		if (b != NULL) {
+			ret = b->stale (cid);
+		} else {
+			pthread_rwlock_rdlock (&lock);
+			ret = vacant (ID + i);
+			pthread_rwlock_unlock (&lock);
+			if (ret == 0)
+				// created on first access: not mapped yet
+				ret = 2;
+		}
+		if (ret < 0)
+			// range goes on elsewhere: client asks its owner next
+			return i > 0 ? 0 : ret;
+		if (ret == 1)
+			bitmap[i / 8] |= 1 << (i % 8);
+		else if (ret == 2)
+			unmapped[i / 8] |= 1 << (i % 8);
+		(*checked)++;
+	}
+
+	return 0;
+}
+
+int DM::scan_range (block_id ID, int blocks, int tail, Scan *s,
+		    int *scanned)
+{
+	// blocks never accessed in lazy mode hold zeros, as the shared page
+	static const char zeros[DIMBLOCK] = { 0 };
+
+	*scanned = 0;
+	for (int i = 0; i < blocks; i++) {
+		int length = i == blocks - 1 ? tail : DIMBLOCK;
+		Block *b = find (ID + i);
+		int ret = 0;
+		if (b != NULL) {
+			ret = b->scan (s, length);
+		} else {
+			pthread_rwlock_rdlock (&lock);
+			ret = vacant (ID + i);
+			pthread_rwlock_unlock (&lock);
+			if (ret == 0)
+				s->run (zeros, length);
+		}
+		if (ret != 0)
+			// range goes on elsewhere: client asks its owner next
+			return i > 0 ? 0 : ret;
+		(*scanned)++;
+	}
+
+	return 0;
+}
+
+Block *DM::find (block_id ID)
+{
+	Block *b = NULL;
+
+	pthread_rwlock_rdlock (&lock);
+	map<block_id, Block *>::iterator it = dm_map.find (ID);
+	if (it != dm_map.end ())
+		b = it->second;
+	pthread_rwlock_unlock (&lock);
+
+	return b;
+}
+
+Block *DM::lookup (block_id ID)
 {
-	if (dm_map.find (ID) == dm_map.end ())
+	Block *b = find (ID);
+	if (b != NULL)
+		return b;
+
+	// created once: another thread may have created it meanwhile. A moved
+	// block is never created again, it stays in dm_map marked as moved
+	pthread_rwlock_wrlock (&lock);
+	int ret = vacant (ID);
+	if (ret == 0) {
+		Block *&nb = dm_map[ID];
+		if (nb == NULL)
+			nb = new Block ();
+		b = nb;
+	} else if (ret == -4) {
+		// never created here: its new owner creates it
+		b = gone;
+	}
+	pthread_rwlock_unlock (&lock);
+
+	return b;
+}
+
+int DM::vacant (block_id ID)
+{
+	// most recent move of the range decides
+	for (int i = forwards.size () - 1; i >= 0; i--) {
+		if (ID >= forwards[i].first && ID <= forwards[i].last)
+			return forwards[i].address.sin_port == 0 ? 0 : -4;
+	}
+
+	return lazy && owns (ID) ? 0 : -1;
+}
+
+/**
+ * @struct move_arg dm.cpp
+ * @brief Argument of transfer(), identifies block and new owner.
+ */
+struct move_arg {
+	/**
+	 * Socket descriptor of connection with new owner.
+	 */
+	int sd;
+
+	/**
+	 * Block ID.
+	 */
+	block_id ID;
+};
+
+/**
+ * Sends a block state to its new owner with message <MOVE, ID, state>
+ * and waits for reply. Called by Block::migrate() while block is locked.
+ * @param[in]	state Serialized block state.
+ * @param[in]	size Size of serialized state in bytes.
+ * @param[in]	arg A move_arg structure.
+ * @return	0 on success, -1 on error.
+ */
+static int transfer (char *state, int size, void *arg)
+{
+	move_arg *m = (move_arg *) arg;
+
+	// tag is the low half of block id
+	Message<2> msg (MOVE, (int) m->ID, size);
+	msg.set_id (0, m->ID);
+	int ret = send_msgv (m->sd, msg.data (), msg.size (), state, size);
+	if (ret == -1)
+		return -1;
+
+	frame f;
+	ret = recv_frame (m->sd, &f);
+	if (ret != 0 || f.tag != (int) m->ID ||
+	    skip_msg (m->sd, f.length) == -1 || f.opcode != OK)
 		return -1;
 
-	int ret = dm_map[ID]->wait (sd);
+	return 0;
+}
+
+/**
+ * Hands blocks in [f, l] never created by this server over to their new owner
+ * with message <ADOPT, f, l>, and waits for reply.
+ * @param[in]	sd Socket descriptor of connection with new owner.
+ * @param[in]	f First id of range.
+ * @param[in]	l Last id of range.
+ * @return	0 on success, -1 on error.
+ */
+static int hand_over (int sd, block_id f, block_id l)
+{
+	// tag is the low half of first id
+	Message<4> msg (ADOPT, (int) f);
+	msg.set_id (0, f);
+	msg.set_id (2, l);
+	int ret = send_msg (sd, msg.data (), msg.size ());
+	if (ret == -1)
+		return -1;
+
+	frame fr;
+	ret = recv_frame (sd, &fr);
+	if (ret != 0 || fr.tag != (int) f ||
+	    skip_msg (sd, fr.length) == -1 || fr.opcode != OK)
+		return -1;
+
+	return 0;
+}
+
+int DM::migrate (block_id f, block_id l, sockaddr_in *dest)
+{
+	// replicas would keep serving blocks they cannot be updated on
+	if (replica || !replicas.empty ())
+		return -1;
+
+	int sd = socket (AF_INET, SOCK_STREAM, 0);
+	if (sd == -1)
+		return -1;
+	int ret = connect (sd, (sockaddr *) dest, sizeof(sockaddr_in));
+	if (ret == -1) {
+		close (sd);
+		return -1;
+	}
+
+	// forward is set before moving any block: clients finding a moved
+	// block must know where it is
+	moved_range fw;
+	fw.first = f;
+	fw.last = l;
+	fw.address = *dest;
+	pthread_rwlock_wrlock (&lock);
+	// ranges in which blocks may not be created yet: this server's own
+	// one if lazy, and those it adopted
+	vector<moved_range> vacants;
+	if (lazy && max (f, first) <= min (l, last)) {
+		moved_range r;
+		r.first = max (f, first);
+		r.last = min (l, last);
+		vacants.push_back (r);
+	}
+	for (unsigned int i = 0; i < forwards.size (); i++) {
+		if (forwards[i].address.sin_port == 0 &&
+		    max (f, forwards[i].first) <= min (l, forwards[i].last)) {
+			moved_range r;
+			r.first = max (f, forwards[i].first);
+			r.last = min (l, forwards[i].last);
+			vacants.push_back (r);
+		}
+	}
+	forwards.push_back (fw);
+	// no block is created in range from now on: existing ones are moved
+	vector<block_id> ids;
+	for (map<block_id, Block *>::iterator it = dm_map.lower_bound (f);
+	     it != dm_map.end () && it->first <= l; it++)
+		ids.push_back (it->first);
+	pthread_rwlock_unlock (&lock);
+
+	ret = 0;
+	for (unsigned int i = 0; i < ids.size (); i++) {
+		move_arg m;
+		m.sd = sd;
+		m.ID = ids[i];
+		if (find (ids[i])->migrate (transfer, &m) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+
+	// blocks never created are handed over last: new owner must not
+	// create one which is still here
+	for (unsigned int i = 0; ret == 0 && i < vacants.size (); i++)
+		ret = hand_over (sd, vacants[i].first, vacants[i].last);
+
+	close (sd);
+	return ret;
+}
+
+int DM::adopt_block (block_id ID, char *state, int size)
+{
+	pthread_rwlock_wrlock (&lock);
+	map<block_id, Block *>::iterator it = dm_map.find (ID);
+	Block *b;
+	if (it != dm_map.end ()) {
+		b = it->second;
+	} else {
+		b = new Block ();
+		dm_map[ID] = b;
+	}
+	pthread_rwlock_unlock (&lock);
+
+	int ret = b->adopt (state, size);
+	return ret;
+}
+
+void DM::adopt_range (block_id f, block_id l)
+{
+	moved_range r;
+	r.first = f;
+	r.last = l;
+	memset ((void *) &r.address, 0, sizeof(sockaddr_in));
+	pthread_rwlock_wrlock (&lock);
+	forwards.push_back (r);
+	pthread_rwlock_unlock (&lock);
+}
+
+int DM::redirect (block_id ID, sockaddr_in *dest, block_id *f,
+		  block_id *l)
+{
+	int ret = -1;
+
+	pthread_rwlock_rdlock (&lock);
+	for (int i = forwards.size () - 1; i >= 0; i--) {
+		if (ID >= forwards[i].first && ID <= forwards[i].last) {
+			if (forwards[i].address.sin_port == 0)
+				// range came back to this server
+				break;
+			*dest = forwards[i].address;
+			// a block adopted from another server is redirected
+			// alone
+			*f = max (forwards[i].first, first);
+			*l = min (forwards[i].last, last);
+			if (ID < *f || ID > *l) {
+				*f = ID;
+				*l = ID;
+			}
+			ret = 0;
+			break;
+		}
+	}
+	pthread_rwlock_unlock (&lock);
+
 	return ret;
 }
 
-void DM::clean (int sd)
+/**
+ * Orders blocks by accesses, most accessed first.
+ * @param[in]	a First block.
+ * @param[in]	b Second block.
+ * @return	True if a has more accesses than b.
+ */
+static bool hotter (const block_activity &a, const block_activity &b)
+{
+	return a.reads + a.writes > b.reads + b.writes;
+}
+
+int DM::activity (int top, vector<block_activity> *hot)
+{
+	int waiters = 0;
+	hot->clear ();
+	pthread_rwlock_rdlock (&lock);
+	for (map<block_id, Block *>::iterator it = dm_map.begin ();
+	     it != dm_map.end (); it++) {
+		block_activity a;
+		int waiting;
+		if (it->second->activity (&a.reads, &a.writes, &waiting) == -1)
+			continue;
+		waiters += waiting;
+		if (a.reads + a.writes == 0 || top <= 0)
+			continue;
+		a.ID = it->first;
+		hot->push_back (a);
+		// only the top blocks are kept, so memory stays bounded
+		if ((int) hot->size () >= 2 * top) {
+			partial_sort (hot->begin (), hot->begin () + top,
+				      hot->end (), hotter);
+			hot->resize (top);
+		}
+	}
+	pthread_rwlock_unlock (&lock);
+
+	int n = (int) hot->size () < top ? hot->size () : top;
+	partial_sort (hot->begin (), hot->begin () + n, hot->end (), hotter);
+	hot->resize (n);
+	return waiters;
+}
+
+/**
+ * Orders blocks by total wait on their mutex, longest first.
+ * @param[in]	a First block.
+ * @param[in]	b Second block.
+ * @return	True if a has been waited longer than b.
+ */
+static bool contended (const block_contention &a, const block_contention &b)
+{
+	return a.profile.wait_ns > b.profile.wait_ns;
+}
+
+int DM::contention (int top, vector<block_contention> *hot,
+		    map<client_id, unsigned long long> *culprits)
+{
+	if (Block::sampling == 0)
+		return -1;
+
+	hot->clear ();
+	culprits->clear ();
+	pthread_rwlock_rdlock (&lock);
+	for (map<block_id, Block *>::iterator it = dm_map.begin ();
+	     it != dm_map.end (); it++) {
+		block_contention c;
+		if (it->second->contention (&c.profile) == -1 ||
+		    c.profile.contended == 0)
+			continue;
+		for (map<client_id, unsigned long long>::iterator
+		     b = c.profile.blame.begin ();
+		     b != c.profile.blame.end (); b++)
+			(*culprits)[b->first] += b->second;
+		if (top <= 0)
+			continue;
+		c.ID = it->first;
+		hot->push_back (c);
+		// only the top blocks are kept, so memory stays bounded
+		if ((int) hot->size () >= 2 * top) {
+			partial_sort (hot->begin (), hot->begin () + top,
+				      hot->end (), contended);
+			hot->resize (top);
+		}
+	}
+	pthread_rwlock_unlock (&lock);
+
+	int n = (int) hot->size () < top ? hot->size () : top;
+	partial_sort (hot->begin (), hot->begin () + n, hot->end (), contended);
+	hot->resize (n);
+	return 0;
+}
+
+unsigned long long DM::elided ()
+{
+	return __atomic_load_n (&unchanged, __ATOMIC_RELAXED);
+}
+
+int DM::suspended_clients ()
 {
-	for (int i = first; i <= last; i++)
-		dm_map[i]->clean (sd);
+	pthread_mutex_lock (&cmutex);
+	int n = suspended.size ();
+	pthread_mutex_unlock (&cmutex);
+	return n;
 }
@@ -13,9 +13,73 @@
 #define DM_H
 
 #include <map>
+#include <vector>
+#include <time.h>
+#include <netinet/in.h>
 #include "block.h"
+#include "placement.h"
+#include "replica.h"
 using namespace std;
 
+/**
+ * @struct moved_range dm.h "dm.h"
+ * @brief Range of blocks moved to another server.
+ */
+struct moved_range {
+	/**
+	 * First id of moved range.
+	 */
+	block_id first;
+
+	/**
+	 * Last id of moved range.
+	 */
+	block_id last;
+
+	/**
+	 * Address and port of the server now owning the range, port 0 if
+	 * range has been adopted by this server.
+	 */
+	sockaddr_in address;
+};
+
+/**
+ * @struct block_activity dm.h "dm.h"
+ * @brief Access counters of a block.
+ */
+struct block_activity {
+	/**
+	 * Block id.
+	 */
+	block_id ID;
+
+	/**
+	 * Read requests served.
+	 */
+	unsigned long long reads;
+
+	/**
+	 * Writes stored.
+	 */
+	unsigned long long writes;
+};
+
+/**
+ * @struct block_contention dm.h "dm.h"
+ * @brief Lock contention of a block.
+ */
+struct block_contention {
+	/**
+	 * Block id.
+	 */
+	block_id ID;
+
+	/**
+	 * Contention recorded on block.
+	 */
+	lock_profile profile;
+};
+
 /**
  * @class DM dm.h "dm.h"
  * @brief Manages operations on distributed memory.
@@ -24,27 +88,159 @@ using namespace std;
  * distributed memory and stores all data in blocks.
  * Blocks are objects of class Block and they are identified by a unique integer
  * between all distributed memory servers.
+ *
+ * Blocks can be moved to another server while clients keep working on them
+ * (see migrate()). All operations on a moved block return -4, redirect() then
+ * tells where the block is now.
  */
 class DM {
 
 	/**
 	 * First id in distributed memory.
 	 */
-	int first;
+	block_id first;
 
 	/**
 	 * Last id in distributed memory.
 	 */
-	int last;
+	block_id last;
+
+	/**
+	 * Block placement among servers, used if placed is true.
+	 */
+	Placement placement;
+
+	/**
+	 * True if only blocks placed on server self are created.
+	 */
+	bool placed;
+
+	/**
+	 * Index of this server in placement.
+	 */
+	int self;
+
+	/**
+	 * True if blocks are created on first access instead of at start.
+	 */
+	bool lazy;
 
 	/**
 	 * Maps blocks with their id. Blocks are identified through a unique
 	 * integer between all distributed memory servers.
 	 */
-	map<int, Block *> dm_map;
+	map<block_id, Block *> dm_map;
+
+	/**
+	 * Ranges of blocks moved to other servers or adopted from them, most
+	 * recent last.
+	 */
+	vector<moved_range> forwards;
+
+	/**
+	 * Stands for blocks never created in a range moved to another server.
+	 * It is marked as moved, so that requests on them are redirected
+	 * without creating them.
+	 */
+	Block *gone;
+
+	/**
+	 * Read-write lock protecting dm_map and forwards, which change when
+	 * blocks are moved from or to this server.
+	 */
+	pthread_rwlock_t lock;
+
+	/**
+	 * Number of open connections of each client. A client may have many
+	 * connections, all identified by the same token.
+	 */
+	map<client_id, int> connections;
+
+	/**
+	 * Seconds a client's mappings outlive its last connection, 0 if they
+	 * are released at once.
+	 */
+	int grace;
+
+	/**
+	 * Clients whose last connection has been closed, with the time, in
+	 * seconds of the monotonic clock, their mappings will be released at
+	 * unless they connect again.
+	 */
+	map<client_id, time_t> suspended;
+
+	/**
+	 * Mutex protecting connections and suspended.
+	 */
+	pthread_mutex_t cmutex;
+
+	/**
+	 * Finds block identified by ID, without creating it.
+	 * @param[in]	ID Block ID.
+	 * @return	Block, NULL if block doesn't exist or hasn't been
+	 *		created yet.
+	 */
+	Block *find (block_id ID);
+
+	/**
+	 * Finds block identified by ID. In lazy mode a block of this server
+	 * not created yet is created, and so is a block of an adopted range.
+	 * @param[in]	ID Block ID.
+	 * @return	Block, gone if block was never created and its range has
+	 *		been moved, NULL if block id doesn't exist.
+	 */
+	Block *lookup (block_id ID);
+
+	/**
+	 * Tells what becomes of a block not created yet. Must be called with
+	 * lock held.
+	 * @param[in]	ID Block ID.
+	 * @return	0 if block is created on first access, -4 if its range
+	 *		has been moved to another server, -1 if block id doesn't
+	 *		exist.
+	 */
+	int vacant (block_id ID);
+
+	/**
+	 * Tells whether block identified by ID belongs to this server, moved
+	 * blocks and blocks adopted from other servers aside.
+	 * @param[in]	ID Block ID.
+	 * @return	True if ID is in [first, last] and placed on server.
+	 */
+	bool owns (block_id ID);
+
+	/**
+	 * True if memory is a replica of a primary server. Client writes are
+	 * rejected, data changes only through replicate_block().
+	 */
+	bool replica;
+
+	/**
+	 * Streams successful writes to replica servers, if any.
+	 */
+	Replicator replicas;
+
+	/**
+	 * Time of the last message from primary server, in seconds of the
+	 * monotonic clock. Used only if memory is a replica.
+	 */
+	time_t heard_at;
+
+	/**
+	 * Writes which left data unchanged and were elided (see
+	 * Block::elide).
+	 */
+	unsigned long long unchanged;
+
+	/**
+	 * Sends current content of block ID to replica servers.
+	 * @param[in]	ID Block ID.
+	 * @return	No value is returned.
+	 */
+	void push (block_id ID);
 public:
 	/**
-	 * Distributed memory constructor. No operations.
+	 * Distributed memory constructor. Memory is not a replica.
 	 * @return	No value is returned.
 	 */
 	DM ();
@@ -56,74 +252,378 @@ public:
 	~DM ();
 
 	/**
-	 * Initializes all blocks.
+	 * Initializes all blocks. Blocks never written share a page of zeros,
+	 * so they cost only their metadata (see Block).
 	 * @param[in]	f First id in memory.
 	 * @param[in]	l Last id in memory.
+	 * @param[in]	p Block placement among servers. If not NULL, only
+	 *		blocks in [f, l] placed on server s are created.
+	 * @param[in]	s Index of this server in placement.
+	 * @param[in]	z If true, no block is created now: each one is
+	 *		created on first access, so that a large and sparsely
+	 *		used range costs nothing at start.
 	 * @return	No value is returned.
 	 */
-	void init (int f, int l);
+	void init (block_id f, block_id l, Placement *p, int s, bool z);
 
 	/**
-	 * Maps ID block to client identified by socket descriptor sd. If
+	 * Maps ID block to client identified by cid. If
 	 * no error occurs buf is filled with block data.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @param[in]	ID Block ID.
 	 * @param[out]	buf In it is stored block data.
 	 * @return	0 on success, -1 on error (if block is already mapped to
 	 *		that client or if block id doesn't exist).
 	 */
-	int map_client (int sd, int ID, char *buf);
+	int map_client (client_id cid, block_id ID, char *buf);
 
 	/**
-	 * Unmaps ID block from client identified by socket descriptor sd.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * Unmaps ID block from client identified by cid.
+	 * @param[in]	cid Client identifier.
 	 * @param[in]	ID Block ID.
 	 * @return	0 on success, -1 on error (if block is already mapped to
 	 *		that client or if block id doesn't exist).
 	 */
-	int unmap_client (int sd, int ID);
+	int unmap_client (client_id cid, block_id ID);
 
 	/**
 	 * Writes data in block.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @param[in]	ID Block ID.
 	 * @param[in]	buf Contains data to be stored.
+	 * @param[in]	serial Serial of request, 0 if none (see
+	 *		Block::write()).
 	 * @return	0 on success. On error -1 is returned if block isn't
-	 *		mapped to that client or if block id doesn't exist. -2
-	 *		is returned if version associated to that client is
-	 *		different from current version (invalid block).
+	 *		mapped to that client, if block id doesn't exist or if
+	 *		memory is a replica. -2 is returned if version
+	 *		associated to that client is different from current
+	 *		version (invalid block).
 	 */
-	int write_block (int sd, int ID, char *buf);
+	int write_block (client_id cid, block_id ID, char *buf, int serial = 0);
+
+	/**
+	 * Writes a slice of data in block.
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	ID Block ID.
+	 * @param[in]	buf Contains data to be stored (length bytes).
+	 * @param[in]	offset First byte of the range inside the block.
+	 * @param[in]	length Number of bytes in the range.
+	 * @return	0 on success. On error -1 is returned if block isn't
+	 *		mapped to that client, if block id doesn't exist or if
+	 *		memory is a replica. -2 is returned if version
+	 *		associated to that client is different from current
+	 *		version (invalid block).
+	 */
+	int write_block_range (client_id cid, block_id ID, char *buf,
+			       int offset, int length);
 
 	/**
 	 * Updates client's local block.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @param[in]	ID Block ID.
 	 * @param[out]	buf Filled with updated data.
+	 * @param[in]	serial Serial of request, 0 if none (see
+	 *		Block::update()).
 	 * @return	1 if block is already up to date (current version and
 	 * 		client's version are the same). 0 on success, and data
 	 *		is stored in buf. On error -1 is returned if block isn't
 	 *		mapped to that client or if block id doesn't exist.
 	 */
-	int update_block (int sd, int ID, char *buf);
+	int update_block (client_id cid, block_id ID, char *buf,
+			  int serial = 0);
+
+	/**
+	 * Reads a slice of block data without changing client's version.
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	ID Block ID.
+	 * @param[out]	buf Filled with length bytes of data.
+	 * @param[in]	offset First byte of the range inside the block.
+	 * @param[in]	length Number of bytes in the range.
+	 * @return	1 if block is already up to date (current version and
+	 * 		client's version are the same). 0 on success, and data
+	 *		is stored in buf. On error -1 is returned if block isn't
+	 *		mapped to that client or if block id doesn't exist.
+	 */
+	int read_block_range (client_id cid, block_id ID, char *buf,
+			      int offset, int length);
 
 	/**
 	 * Waits for block data to become invalid.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
 	 * @param[in]	ID Block ID.
-	 * @return	0 on success, when block becomes invalid. On error -1 is
-	 *		returned if block isn't mapped to that client or if
-	 *		block id doesn't exist.
+	 * @param[in]	seconds Time limit, -1 for none.
+	 * @return	0 on success, when block becomes invalid, -6 if time
+	 *		limit expired first. On error -1 is returned if block
+	 *		isn't mapped to that client or if block id doesn't
+	 *		exist.
 	 */
-	int wait_block (int sd, int ID);
+	int wait_block (client_id cid, block_id ID, int seconds = -1);
 
 	/**
-	 * Unmaps all memory blocks from client identified by sd. Used if
+	 * Unmaps all memory blocks from client identified by cid. Used if
 	 * client disconnects or crashes without unmapping blocks.
-	 * @param[in]	sd Client's socket descriptor used for identification.
+	 * @param[in]	cid Client identifier.
+	 * @return	No value is returned.
+	 */
+	void clean (client_id cid);
+
+	/**
+	 * Records a new connection of client identified by cid. A suspended
+	 * client resumes its mappings.
+	 * @param[in]	cid Client identifier.
+	 * @return	No value is returned.
+	 */
+	void attach (client_id cid);
+
+	/**
+	 * Records that a connection of client identified by cid has been
+	 * closed. When the last one is closed, all memory blocks are unmapped
+	 * from client (see clean()), or, for a client which may connect again
+	 * within the grace period, it is suspended (see expire()).
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	resumable True if client is identified by a token, so
+	 *		that its new connections are recognized.
+	 * @return	No value is returned.
+	 */
+	void detach (client_id cid, bool resumable = false);
+
+	/**
+	 * Sets how long mappings of a client outlive its last connection, so
+	 * that a client reconnecting after a network failure finds them.
+	 * @param[in]	seconds Grace period, 0 to release mappings at once.
+	 * @return	No value is returned.
+	 */
+	void set_grace (int seconds);
+
+	/**
+	 * Unmaps all memory blocks from suspended clients whose grace period
+	 * has ended. Called periodically.
+	 * @return	No value is returned.
+	 */
+	void expire ();
+
+	/**
+	 * Sets memory as a replica of a primary server. Must be called before
+	 * any client connects.
+	 * @return	No value is returned.
+	 */
+	void set_replica ();
+
+	/**
+	 * Checks whether memory is a replica of a primary server.
+	 * @return	true if memory is a replica, false otherwise.
+	 */
+	bool is_replica ();
+
+	/**
+	 * Records a message from primary server: a replica serves versioned
+	 * reads for LEASE seconds afterwards. Does nothing if memory is not a
+	 * replica.
+	 * @return	No value is returned.
+	 */
+	void heard ();
+
+	/**
+	 * Stops serving versioned reads if primary server has been quiet for
+	 * LEASE seconds. Called periodically on replicas.
 	 * @return	No value is returned.
 	 */
-	void clean (int sd);
+	void check_lease ();
+
+	/**
+	 * Stops serving versioned reads until primary server is heard again,
+	 * and wakes up clients waiting on blocks, which are told to ask the
+	 * primary server. Does nothing if memory is not a replica.
+	 * @return	No value is returned.
+	 */
+	void lapse ();
+
+	/**
+	 * Sends a heartbeat to replica servers, if any. Called every second.
+	 * @return	No value is returned.
+	 */
+	void beat ();
+
+	/**
+	 * Adds a replica server. All following successful writes will be
+	 * streamed to it.
+	 * @param[in]	address Replica address in dotted notation.
+	 * @param[in]	port Replica port.
+	 * @return	0 on success, -1 on error.
+	 */
+	int add_replica (char *address, int port);
+
+	/**
+	 * Stores data received from primary server in block. Only allowed if
+	 * memory is a replica.
+	 * @param[in]	ID Block ID.
+	 * @param[in]	version Block version on primary server.
+	 * @param[in]	buf Contains data to be stored.
+	 * @return	0 on success, -1 on error (if block id doesn't exist or
+	 *		memory is not a replica).
+	 */
+	int replicate_block (block_id ID, int version, char *buf);
+
+	/**
+	 * Updates a local block whose version is known by the client, no
+	 * mapping is needed.
+	 * @param[in]	ID Block ID.
+	 * @param[in]	version Version held by client, -1 if none.
+	 * @param[out]	buf Filled with updated data.
+	 * @param[out]	curr Filled with version of data stored in buf.
+	 * @return	1 if client's version is not older than current version.
+	 *		0 on success, and data is stored in buf. -1 on error (if
+	 *		block id doesn't exist), -5 if memory is a replica which
+	 *		lost its primary server.
+	 */
+	int vupdate_block (block_id ID, int version, char *buf, int *curr);
+
+	/**
+	 * Writes data in block if client's version is the current one, no
+	 * mapping is needed.
+	 * @param[in]	ID Block ID.
+	 * @param[in]	version Version held by client.
+	 * @param[in]	buf Contains data to be stored.
+	 * @return	0 on success. On error -1 is returned if block id
+	 *		doesn't exist or memory is a replica. -2 is returned if
+	 *		version held by client is different from current version
+	 *		(invalid block).
+	 */
+	int vwrite_block (block_id ID, int version, char *buf);
+
+	/**
+	 * Waits for block version to become newer than client's version, no
+	 * mapping is needed.
+	 * @param[in]	ID Block ID.
+	 * @param[in]	version Version held by client.
+	 * @param[in]	seconds Time limit, -1 for none.
+	 * @return	0 on success, -1 on error (if block id doesn't exist),
+	 *		-5 if memory is a replica which lost its primary server,
+	 *		-6 if time limit expired.
+	 */
+	int vwait_block (block_id ID, int version, int seconds = -1);
+
+	/**
+	 * Finds blocks of a range which are mapped to client identified by cid
+	 * and stale, and those which are not mapped to it. Blocks not created
+	 * yet are not mapped. Check stops before the first block moved or not
+	 * owned by this server.
+	 * @param[in]	cid Client identifier.
+	 * @param[in]	ID First block ID.
+	 * @param[in]	blocks Number of blocks.
+	 * @param[out]	bitmap Bit i % 8 of byte i / 8 set if block ID + i is
+	 *		stale, must be zeroed by caller.
+	 * @param[out]	unmapped Bit i % 8 of byte i / 8 set if block ID + i
+	 *		is not mapped to client, must be zeroed by caller.
+	 * @param[out]	checked Filled with number of blocks checked.
+	 * @return	0 on success, -4 if first block has been moved, -1 on
+	 *		error (if first block id doesn't exist).
+	 */
+	int stale_blocks (client_id cid, block_id ID, int blocks,
+			  unsigned char *bitmap, unsigned char *unmapped,
+			  int *checked);
+
+	/**
+	 * Runs a scan kernel over a range of blocks, in order, no mapping is
+	 * needed. Each block is locked only while it is scanned, so the
+	 * result is not a snapshot of the whole range. Blocks not created yet
+	 * are scanned as zeros, and are not created. Scan stops before the
+	 * first block moved or not owned by this server.
+	 * @param[in]	ID First block ID.
+	 * @param[in]	blocks Number of blocks.
+	 * @param[in]	tail Number of bytes scanned in last block.
+	 * @param[in,out]	s Kernel state.
+	 * @param[out]	scanned Filled with number of blocks scanned.
+	 * @return	0 on success, -4 if first block has been moved, -1 on
+	 *		error (if first block id doesn't exist).
+	 */
+	int scan_range (block_id ID, int blocks, int tail, Scan *s,
+			int *scanned);
+
+	/**
+	 * Moves blocks in [f, l] to another server, one at a time. Each block
+	 * is locked only while its state is transferred: clients keep working
+	 * on other blocks, and are redirected once a block has been moved.
+	 * Blocks not owned by this server are skipped, and so are blocks a
+	 * lazy server never created: new owner creates them instead. Not
+	 * allowed on replicas or on servers with replicas.
+	 * @param[in]	f First id of range.
+	 * @param[in]	l Last id of range.
+	 * @param[in]	dest Address and port of the new owner.
+	 * @return	0 on success, -1 on error (some blocks may have been
+	 *		moved anyway).
+	 */
+	int migrate (block_id f, block_id l, sockaddr_in *dest);
+
+	/**
+	 * Takes ownership of a block moved from another server.
+	 * @param[in]	ID Block ID.
+	 * @param[in]	state Block state serialized by Block::migrate().
+	 * @param[in]	size Size of serialized state in bytes.
+	 * @return	0 on success, -1 on error (malformed state).
+	 */
+	int adopt_block (block_id ID, char *state, int size);
+
+	/**
+	 * Takes ownership of blocks in [f, l] which the server they are moved
+	 * from never created: each one is created on first access.
+	 * @param[in]	f First id of range.
+	 * @param[in]	l Last id of range.
+	 * @return	No value is returned.
+	 */
+	void adopt_range (block_id f, block_id l);
+
+	/**
+	 * Tells which server owns a block moved from this server, and the
+	 * range moved with it, so that clients reroute the whole range at
+	 * once. Range is limited to ids in [first, last] of this server.
+	 * @param[in]	ID Block ID.
+	 * @param[out]	dest Filled with address and port of the new owner.
+	 * @param[out]	f Filled with first id of moved range.
+	 * @param[out]	l Filled with last id of moved range.
+	 * @return	0 on success, -1 if block has not been moved.
+	 */
+	int redirect (block_id ID, sockaddr_in *dest, block_id *f,
+		      block_id *l);
+
+	/**
+	 * Finds the most accessed blocks, and counts waiting clients. Every
+	 * block is locked in turn, so this is meant for occasional reports.
+	 * @param[in]	top Number of blocks wanted.
+	 * @param[out]	hot Filled with at most top blocks, most accessed
+	 *		(reads plus writes) first. Blocks never accessed are
+	 *		left out.
+	 * @return	Number of clients waiting on blocks of this server.
+	 */
+	int activity (int top, vector<block_activity> *hot);
+
+	/**
+	 * Finds the most contended blocks, and the clients which made others
+	 * wait the most. Only meaningful if locks are profiled (see
+	 * Block::sampling).
+	 * @param[in]	top Number of blocks wanted.
+	 * @param[out]	hot Filled with at most top blocks, longest total wait
+	 *		first. Blocks never contended are left out.
+	 * @param[out]	culprits Filled with time in nanoseconds other clients
+	 *		waited for each client, summed over all blocks.
+	 * @return	0 on success, -1 if locks are not profiled.
+	 */
+	int contention (int top, vector<block_contention> *hot,
+			map<client_id, unsigned long long> *culprits);
+
+	/**
+	 * Returns the number of writes elided so far because they left data
+	 * unchanged.
+	 * @return	Number of elided writes.
+	 */
+	unsigned long long elided ();
+
+	/**
+	 * Returns the number of suspended clients, whose mappings are kept
+	 * until they connect again or their grace period ends.
+	 * @return	Number of suspended clients.
+	 */
+	int suspended_clients ();
 };
 
 #endif // DM_H
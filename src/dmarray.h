@@ -0,0 +1,401 @@
+/**
+ * @file dmarray.h
+ * @brief Header file containing DM_array and DM_span class templates, typed
+ * 	  views over distributed memory for clients.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef DMARRAY_H
+#define DMARRAY_H
+
+#include "distmem.h"
+
+template <class T> class DM_span;
+
+/**
+ * @class DM_array dmarray.h "dmarray.h"
+ * @brief Array of elements of type T stored in a range of consecutive blocks.
+ *
+ * The blocks are mapped as one contiguous local buffer, so elements are
+ * accessed in place and may span block boundaries. Element i is at byte
+ * i * sizeof(T) of the range. Synchronization works on element ranges: only
+ * the blocks covering them are updated or written, with requests to all
+ * servers in flight at once.
+ *
+ * DM_client dm;
+ *
+ * dm.dm_init(config_file);
+ *
+ * DM_array<int> a;
+ *
+ * a.map(&dm, 0, 1000);
+ *
+ * a.update(10, 5); a[12]++; a.write(12, 1);
+ *
+ * T must be a type that can be copied with memcpy.
+ */
+template <class T>
+class DM_array {
+
+	/**
+	 * Client blocks are mapped through, NULL if array is not mapped.
+	 */
+	DM_client *dm;
+
+	/**
+	 * First block id.
+	 */
+	block_id first;
+
+	/**
+	 * Number of blocks.
+	 */
+	size_t blocks;
+
+	/**
+	 * Block dimension.
+	 */
+	int dim;
+
+	/**
+	 * Number of elements.
+	 */
+	size_t count;
+
+	/**
+	 * Local buffer, blocks * dim bytes.
+	 */
+	char *buf;
+
+	/**
+	 * Sends an asynchronous request for each block covering an element
+	 * range and waits for all of them.
+	 * @param[in]	type UPDATE or WRITE.
+	 * @param[in]	from First element.
+	 * @param[in]	n Number of elements.
+	 * @return	0 on success, otherwise the first error returned by a
+	 * 		block, as for dm_block_update() or dm_block_write().
+	 */
+	int sync (int type, size_t from, size_t n)
+	{
+		if (dm == NULL || from > count || n > count - from)
+			return -1;
+		if (n == 0)
+			return 0;
+
+		size_t b = (from * sizeof(T)) / dim;
+		size_t e = ((from + n) * sizeof(T) - 1) / dim;
+		DM_future *f = new DM_future[e - b + 1];
+		for (size_t i = b; i <= e; i++) {
+			if (type == UPDATE)
+				dm->dm_block_update_async (first + i,
+							   &f[i - b]);
+			else
+				dm->dm_block_write_async (first + i, &f[i - b]);
+		}
+
+		int ret = 0;
+		for (size_t i = b; i <= e; i++) {
+			int r = f[i - b].wait ();
+			if (ret == 0)
+				ret = r;
+		}
+		delete[] f;
+
+		return ret;
+	}
+
+	friend class DM_span<T>;
+
+	// arrays own their mappings and cannot be copied
+	DM_array (const DM_array &);
+	DM_array &operator= (const DM_array &);
+public:
+	/**
+	 * DM_array constructor. Array is not mapped.
+	 * @return	No value is returned.
+	 */
+	DM_array ()
+	{
+		dm = NULL;
+		first = 0;
+		blocks = 0;
+		dim = 0;
+		count = 0;
+		buf = NULL;
+	}
+
+	/**
+	 * DM_array destructor. Unmaps blocks.
+	 * @return	No value is returned.
+	 */
+	~DM_array ()
+	{
+		unmap ();
+	}
+
+	/**
+	 * Maps the blocks holding n elements, starting at block first, and
+	 * fills array with their content.
+	 * @param[in]	client Initialized client.
+	 * @param[in]	first_block First block id.
+	 * @param[in]	n Number of elements.
+	 * @return	0 on success, -1 on error (also if array is already
+	 * 		mapped), -2 if a block is already mapped by client, -3
+	 * 		if client has not been initialized. On error no block is
+	 * 		left mapped.
+	 */
+	int map (DM_client *client, block_id first_block, size_t n)
+	{
+		if (dm != NULL || n == 0)
+			return -1;
+		dim = client->dm_block_dim ();
+		if (dim == 0)
+			return -3;
+
+		blocks = (n * sizeof(T) + dim - 1) / dim;
+		buf = new char[blocks * dim];
+		DM_future *f = new DM_future[blocks];
+		for (size_t i = 0; i < blocks; i++)
+			client->dm_block_map_async (first_block + i,
+						    buf + i * dim, &f[i]);
+
+		int ret = 0;
+		for (size_t i = 0; i < blocks; i++) {
+			int r = f[i].wait ();
+			if (r != 0 && ret == 0)
+				ret = r;
+		}
+		if (ret != 0) {
+			// release blocks mapped by this call only
+			for (size_t i = 0; i < blocks; i++) {
+				if (f[i].wait () != 0)
+					continue;
+				client->dm_block_unmap (first_block + i);
+			}
+			delete[] f;
+			delete[] buf;
+			buf = NULL;
+			return ret;
+		}
+		delete[] f;
+
+		dm = client;
+		first = first_block;
+		count = n;
+		return 0;
+	}
+
+	/**
+	 * Unmaps blocks and frees local buffer.
+	 * @return	0 on success, -1 if a block could not be unmapped.
+	 */
+	int unmap ()
+	{
+		if (dm == NULL)
+			return 0;
+
+		int ret = 0;
+		for (size_t i = 0; i < blocks; i++)
+			if (dm->dm_block_unmap (first + i) != 0)
+				ret = -1;
+		delete[] buf;
+		buf = NULL;
+		dm = NULL;
+
+		return ret;
+	}
+
+	/**
+	 * Returns element i. No check is done.
+	 * @param[in]	i Element index.
+	 * @return	Reference to element in local buffer.
+	 */
+	T &operator[] (size_t i)
+	{
+		return ((T *) buf)[i];
+	}
+
+	/**
+	 * Returns the number of elements.
+	 * @return	Number of elements, 0 if array is not mapped.
+	 */
+	size_t size ()
+	{
+		return count;
+	}
+
+	/**
+	 * Returns local buffer.
+	 * @return	Pointer to first element.
+	 */
+	T *data ()
+	{
+		return (T *) buf;
+	}
+
+	/**
+	 * Returns the id of the block holding the first byte of an element.
+	 * @param[in]	i Element index.
+	 * @return	Block id.
+	 */
+	block_id block_of (size_t i)
+	{
+		return first + (i * sizeof(T)) / dim;
+	}
+
+	/**
+	 * Updates the blocks covering elements in [from, from + n).
+	 * @param[in]	from First element.
+	 * @param[in]	n Number of elements.
+	 * @return	0 on success, -1 on error.
+	 */
+	int update (size_t from, size_t n)
+	{
+		return sync (UPDATE, from, n);
+	}
+
+	/**
+	 * Updates all blocks.
+	 * @return	0 on success, -1 on error.
+	 */
+	int update ()
+	{
+		return sync (UPDATE, 0, count);
+	}
+
+	/**
+	 * Writes the blocks covering elements in [from, from + n). Other
+	 * elements in those blocks are written too.
+	 * @param[in]	from First element.
+	 * @param[in]	n Number of elements.
+	 * @return	0 on success, -2 if a block is invalid, -1 on error.
+	 */
+	int write (size_t from, size_t n)
+	{
+		return sync (WRITE, from, n);
+	}
+
+	/**
+	 * Writes all blocks.
+	 * @return	0 on success, -2 if a block is invalid, -1 on error.
+	 */
+	int write ()
+	{
+		return sync (WRITE, 0, count);
+	}
+
+	/**
+	 * Returns a view of elements in [from, from + n). No data is copied.
+	 * @param[in]	from First element.
+	 * @param[in]	n Number of elements.
+	 * @return	View, empty if range exceeds array.
+	 */
+	DM_span<T> span (size_t from, size_t n)
+	{
+		if (from > count || n > count - from)
+			return DM_span<T> (this, 0, 0);
+		return DM_span<T> (this, from, n);
+	}
+};
+
+/**
+ * @class DM_span dmarray.h "dmarray.h"
+ * @brief View of a range of elements of a DM_array.
+ *
+ * A span refers to the array's local buffer and is valid while the array is
+ * mapped. Its synchronization operations touch only the blocks covering the
+ * span.
+ */
+template <class T>
+class DM_span {
+
+	/**
+	 * Array viewed.
+	 */
+	DM_array<T> *array;
+
+	/**
+	 * First element of the span in array.
+	 */
+	size_t from;
+
+	/**
+	 * Number of elements.
+	 */
+	size_t count;
+public:
+	/**
+	 * DM_span constructor.
+	 * @param[in]	a Array viewed.
+	 * @param[in]	f First element.
+	 * @param[in]	n Number of elements.
+	 * @return	No value is returned.
+	 */
+	DM_span (DM_array<T> *a, size_t f, size_t n)
+	{
+		array = a;
+		from = f;
+		count = n;
+	}
+
+	/**
+	 * Returns element i of the span. No check is done.
+	 * @param[in]	i Element index, relative to span.
+	 * @return	Reference to element in local buffer.
+	 */
+	T &operator[] (size_t i)
+	{
+		return array->data ()[from + i];
+	}
+
+	/**
+	 * Returns the number of elements.
+	 * @return	Number of elements.
+	 */
+	size_t size ()
+	{
+		return count;
+	}
+
+	/**
+	 * Returns first element.
+	 * @return	Pointer to first element in local buffer.
+	 */
+	T *begin ()
+	{
+		return array->data () + from;
+	}
+
+	/**
+	 * Returns end of span.
+	 * @return	Pointer past last element in local buffer.
+	 */
+	T *end ()
+	{
+		return array->data () + from + count;
+	}
+
+	/**
+	 * Updates the blocks covering the span.
+	 * @return	0 on success, -1 on error.
+	 */
+	int update ()
+	{
+		return array->sync (UPDATE, from, count);
+	}
+
+	/**
+	 * Writes the blocks covering the span.
+	 * @return	0 on success, -2 if a block is invalid, -1 on error.
+	 */
+	int write ()
+	{
+		return array->sync (WRITE, from, count);
+	}
+};
+
+#endif // DMARRAY_H
@@ -0,0 +1,48 @@
+/**
+ * @file dmstat.cpp
+ * @brief Administration tool. Prints the metrics of a server: connections,
+ * bytes, waiting clients, count, errors and latency of each request type, and
+ * most accessed blocks.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include "distmem.h"
+
+/**
+ * Dmstat main function, usage is:
+ *
+ * dmstat config_file address port [top]
+ *
+ * @param[in]	config_file A valid Distributed Memory configuration file.
+ * @param[in]	address Server's address in dotted notation.
+ * @param[in]	port Server's port.
+ * @param[in]	top Number of most accessed blocks printed (default 10).
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 4 && argc != 5) {
+		printf ("Dmstat: Bad arguments\n");
+		exit (1);
+	}
+
+	DM_client dm;
+	int ret = dm.dm_init (argv[1]);
+	if (ret == -1) {
+		printf ("Dmstat: Unable to initialize DM\n");
+		exit (1);
+	}
+
+	string report;
+	int top = argc == 5 ? atoi (argv[4]) : 10;
+	ret = dm.dm_stats (argv[2], atoi (argv[3]), top, &report);
+	if (ret < 0) {
+		printf ("Dmstat: Unable to get server metrics\n");
+		exit (1);
+	}
+	printf ("%s", report.c_str ());
+
+	exit (0);
+}
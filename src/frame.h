@@ -0,0 +1,259 @@
+/**
+ * @file frame.h
+ * @brief Header file containing protocol frame layout, encoders and decoders.
+ *
+ * Every message, request or reply, is a frame: a fixed header followed by
+ * length bytes of payload. Header fields, in network byte order, are:
+ * - magic (2 bytes): MAGIC
+ * - version (1 byte): PROTOVERSION
+ * - opcode (1 byte): request or reply type, as defined in msg.h
+ * - flags (4 bytes): serial of an UPDATE or WRITE request, so that a server
+ *   recognizes it if resent after its reply was lost, 0 otherwise
+ * - tag (4 bytes): chosen by sender of a request, echoed by its reply
+ * - length (4 bytes): payload size in bytes
+ *
+ * A request payload starts with at least one 4-byte argument, followed by data
+ * if any. Block requests start with the block id, which takes two arguments
+ * (64 bits, high half first). Sizes of fixed parts are known at compile time,
+ * so that encoders need no allocation.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "msg.h"
+
+/**
+ * @def MAGIC
+ * First two bytes of every frame.
+ */
+#define MAGIC		0x444d
+/**
+ * @def PROTOVERSION
+ * Protocol version.
+ */
+#define PROTOVERSION	3
+/**
+ * @def FRAMEHDR
+ * Size in bytes of frame header.
+ */
+#define FRAMEHDR	16
+
+/**
+ * @struct frame frame.h "frame.h"
+ * @brief Decoded frame header.
+ */
+struct frame {
+	/**
+	 * Request or reply type.
+	 */
+	int opcode;
+
+	/**
+	 * Flags.
+	 */
+	int flags;
+
+	/**
+	 * Tag of request.
+	 */
+	int tag;
+
+	/**
+	 * Payload size in bytes.
+	 */
+	int length;
+};
+
+/**
+ * Stores a 4-byte field in network byte order.
+ * @param[out]	buffer Start of fields.
+ * @param[in]	i Field index.
+ * @param[in]	value Field value.
+ * @return	No value is returned.
+ */
+inline void put_int (void *buffer, int i, int value)
+{
+	value = htonl (value);
+	memcpy ((char *) buffer + i * sizeof(int), &value, sizeof(int));
+}
+
+/**
+ * Loads a 4-byte field stored in network byte order.
+ * @param[in]	buffer Start of fields.
+ * @param[in]	i Field index.
+ * @return	Field value.
+ */
+inline int get_int (const void *buffer, int i)
+{
+	int value;
+	memcpy (&value, (const char *) buffer + i * sizeof(int), sizeof(int));
+	return ntohl (value);
+}
+
+/**
+ * Stores a block id in two 4-byte fields, high half first.
+ * @param[out]	buffer Start of fields.
+ * @param[in]	i Index of first field.
+ * @param[in]	ID Block id.
+ * @return	No value is returned.
+ */
+inline void put_id (void *buffer, int i, block_id ID)
+{
+	put_int (buffer, i, (int) (ID >> 32));
+	put_int (buffer, i + 1, (int) ID);
+}
+
+/**
+ * Joins the halves of a block id, as stored by put_id().
+ * @param[in]	high First field.
+ * @param[in]	low Second field.
+ * @return	Block id.
+ */
+inline block_id make_id (int high, int low)
+{
+	return ((block_id) high << 32) | (unsigned int) low;
+}
+
+/**
+ * Loads a block id stored by put_id().
+ * @param[in]	buffer Start of fields.
+ * @param[in]	i Index of first field.
+ * @return	Block id.
+ */
+inline block_id get_id (const void *buffer, int i)
+{
+	return make_id (get_int (buffer, i), get_int (buffer, i + 1));
+}
+
+/**
+ * Encodes a frame header.
+ * @param[out]	buffer Buffer of at least FRAMEHDR bytes.
+ * @param[in]	opcode Request or reply type.
+ * @param[in]	tag Tag.
+ * @param[in]	length Payload size in bytes.
+ * @return	No value is returned.
+ */
+inline void encode_frame (void *buffer, int opcode, int tag, int length)
+{
+	unsigned char *buf = (unsigned char *) buffer;
+	buf[0] = MAGIC >> 8;
+	buf[1] = MAGIC & 0xff;
+	buf[2] = PROTOVERSION;
+	buf[3] = opcode;
+	put_int (buf + 4, 0, 0);
+	put_int (buf + 4, 1, tag);
+	put_int (buf + 4, 2, length);
+}
+
+/**
+ * Decodes a frame header.
+ * @param[in]	buffer Buffer of FRAMEHDR bytes.
+ * @param[out]	f Decoded header, also when version is wrong, so that an
+ *		error can be sent with its tag.
+ * @return	0 on success, -1 if buffer is not a frame, -2 if it has
+ * 		another protocol version.
+ */
+inline int decode_frame (const void *buffer, frame *f)
+{
+	const unsigned char *buf = (const unsigned char *) buffer;
+	if (buf[0] != (MAGIC >> 8) || buf[1] != (MAGIC & 0xff))
+		return -1;
+
+	f->opcode = buf[3];
+	f->flags = get_int (buf + 4, 0);
+	f->tag = get_int (buf + 4, 1);
+	f->length = get_int (buf + 4, 2);
+	if (buf[2] != PROTOVERSION)
+		return -2;
+	if (f->length < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * @class Message frame.h "frame.h"
+ * @brief Encoder of a frame whose payload starts with N 4-byte arguments.
+ *
+ * Header and arguments are laid out in a buffer of size known at compile
+ * time. Data following the arguments, if any, is sent separately.
+ */
+template <int N>
+class Message {
+
+	/**
+	 * Encoded header and arguments.
+	 */
+	char buf[FRAMEHDR + N * sizeof(int)];
+public:
+	/**
+	 * Message constructor. Arguments must be set with set().
+	 * @param[in]	opcode Request or reply type.
+	 * @param[in]	tag Tag.
+	 * @param[in]	data Size in bytes of data following the arguments.
+	 * @return	No value is returned.
+	 */
+	Message (int opcode, int tag, int data = 0)
+	{
+		encode_frame (buf, opcode, tag, N * sizeof(int) + data);
+	}
+
+	/**
+	 * Sets an argument.
+	 * @param[in]	i Argument index.
+	 * @param[in]	value Argument value.
+	 * @return	No value is returned.
+	 */
+	void set (int i, int value)
+	{
+		put_int (buf + FRAMEHDR, i, value);
+	}
+
+	/**
+	 * Sets flags of header.
+	 * @param[in]	flags Flags.
+	 * @return	No value is returned.
+	 */
+	void set_flags (int flags)
+	{
+		put_int (buf + 4, 0, flags);
+	}
+
+	/**
+	 * Sets a block id, taking arguments i and i + 1.
+	 * @param[in]	i Index of first argument.
+	 * @param[in]	ID Block id.
+	 * @return	No value is returned.
+	 */
+	void set_id (int i, block_id ID)
+	{
+		put_id (buf + FRAMEHDR, i, ID);
+	}
+
+	/**
+	 * Returns encoded buffer.
+	 * @return	Start of header.
+	 */
+	char *data ()
+	{
+		return buf;
+	}
+
+	/**
+	 * Returns size of header and arguments.
+	 * @return	Size in bytes.
+	 */
+	int size ()
+	{
+		return sizeof(buf);
+	}
+};
+
+#endif // FRAME_H
@@ -0,0 +1,80 @@
+/**
+ * @file future.cpp
+ * @brief File containing DM_future class definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <stdlib.h>
+#include "future.h"
+
+DM_future::DM_future ()
+{
+	result = 0;
+	done = false;
+	callback = NULL;
+	arg = NULL;
+	pthread_mutex_init (&mutex, NULL);
+	pthread_cond_init (&cond, NULL);
+}
+
+DM_future::DM_future (dm_callback cb, void *cb_arg)
+{
+	result = 0;
+	done = false;
+	callback = cb;
+	arg = cb_arg;
+	pthread_mutex_init (&mutex, NULL);
+	pthread_cond_init (&cond, NULL);
+}
+
+DM_future::~DM_future ()
+{
+	pthread_mutex_destroy (&mutex);
+	pthread_cond_destroy (&cond);
+}
+
+void DM_future::reset ()
+{
+	pthread_mutex_lock (&mutex);
+	done = false;
+	pthread_mutex_unlock (&mutex);
+}
+
+void DM_future::finish (int res)
+{
+	// future may be destroyed as soon as done is set
+	dm_callback cb = callback;
+	void *cb_arg = arg;
+
+	pthread_mutex_lock (&mutex);
+	result = res;
+	done = true;
+	pthread_cond_broadcast (&cond);
+	pthread_mutex_unlock (&mutex);
+
+	if (cb != NULL)
+		cb (res, cb_arg);
+}
+
+int DM_future::wait ()
+{
+	pthread_mutex_lock (&mutex);
+	while (!done)
+		pthread_cond_wait (&cond, &mutex);
+	int res = result;
+	pthread_mutex_unlock (&mutex);
+
+	return res;
+}
+
+bool DM_future::ready ()
+{
+	pthread_mutex_lock (&mutex);
+	bool res = done;
+	pthread_mutex_unlock (&mutex);
+
+	return res;
+}
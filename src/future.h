@@ -0,0 +1,118 @@
+/**
+ * @file future.h
+ * @brief Header file containing DM_future class declaration.
+ *
+ * A DM_future object holds the result of an asynchronous DM_client request.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <pthread.h>
+
+/**
+ * Completion callback of an asynchronous request.
+ * @param[in]	result Result of request, as returned by the synchronous
+ *		operation.
+ * @param[in]	arg Argument given to DM_future constructor.
+ */
+typedef void (*dm_callback) (int result, void *arg);
+
+class DM_client;
+
+/**
+ * @class DM_future future.h "future.h"
+ * @brief Result of an asynchronous request.
+ *
+ * A future is given to an asynchronous DM_client operation, which completes
+ * it when server replies. The caller may wait for the result, poll it, or
+ * have a callback run on completion. Callbacks run on DM_client's event loop
+ * thread, and should not block. A future must not be destroyed, or given to
+ * another request, before it is completed; it may be destroyed inside its
+ * callback.
+ */
+class DM_future {
+
+	/**
+	 * Result of request, valid when done is true.
+	 */
+	int result;
+
+	/**
+	 * True when request is completed.
+	 */
+	bool done;
+
+	/**
+	 * Callback run on completion, NULL if none.
+	 */
+	dm_callback callback;
+
+	/**
+	 * Argument of callback.
+	 */
+	void *arg;
+
+	/**
+	 * Mutex protecting result and done.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Condition variable signalled on completion.
+	 */
+	pthread_cond_t cond;
+
+	/**
+	 * Prepares future for a new request.
+	 * @return	No value is returned.
+	 */
+	void reset ();
+
+	/**
+	 * Completes future, waking waiting threads and running callback.
+	 * @param[in]	res Result of request.
+	 * @return	No value is returned.
+	 */
+	void finish (int res);
+
+	friend class DM_client;
+public:
+	/**
+	 * DM_future constructor. No callback.
+	 * @return	No value is returned.
+	 */
+	DM_future ();
+
+	/**
+	 * DM_future constructor.
+	 * @param[in]	cb Callback run on completion.
+	 * @param[in]	cb_arg Argument of callback.
+	 * @return	No value is returned.
+	 */
+	DM_future (dm_callback cb, void *cb_arg);
+
+	/**
+	 * DM_future destructor.
+	 * @return	No value is returned.
+	 */
+	~DM_future ();
+
+	/**
+	 * Waits for request to be completed.
+	 * @return	Result of request.
+	 */
+	int wait ();
+
+	/**
+	 * Tells whether request has been completed, without waiting.
+	 * @return	True if request has been completed.
+	 */
+	bool ready ();
+};
+
+#endif // FUTURE_H
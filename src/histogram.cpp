@@ -0,0 +1,115 @@
+/**
+ * @file histogram.cpp
+ * @brief File containing Histogram class definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <string.h>
+#include "histogram.h"
+
+Histogram::Histogram ()
+{
+	clear ();
+}
+
+void Histogram::clear ()
+{
+	memset (counts, 0, sizeof(counts));
+	n = 0;
+	sum = 0;
+	low = 0;
+	high = 0;
+}
+
+int Histogram::bucket (unsigned long long value)
+{
+	if (value < HSUB)
+		return value;
+
+	// position of highest bit, at least 4 since HSUB is 16
+	int msb = 63 - __builtin_clzll (value);
+	int b = (msb - 3) * HSUB + ((value >> (msb - 4)) & (HSUB - 1));
+	if (b >= HBUCKETS)
+		return HBUCKETS - 1;
+	return b;
+}
+
+unsigned long long Histogram::bound (int b)
+{
+	if (b < HSUB)
+		return b;
+
+	int msb = b / HSUB + 3;
+	unsigned long long sub = b % HSUB;
+	return ((HSUB + sub + 1) << (msb - 4)) - 1;
+}
+
+void Histogram::add (unsigned long long value)
+{
+	counts[bucket (value)]++;
+	if (n == 0 || value < low)
+		low = value;
+	if (value > high)
+		high = value;
+	n++;
+	sum += value;
+}
+
+void Histogram::merge (const Histogram &h)
+{
+	if (h.n == 0)
+		return;
+	for (int i = 0; i < HBUCKETS; i++)
+		counts[i] += h.counts[i];
+	if (n == 0 || h.low < low)
+		low = h.low;
+	if (h.high > high)
+		high = h.high;
+	n += h.n;
+	sum += h.sum;
+}
+
+unsigned long long Histogram::count ()
+{
+	return n;
+}
+
+double Histogram::mean ()
+{
+	if (n == 0)
+		return 0;
+	return (double) sum / n;
+}
+
+unsigned long long Histogram::min ()
+{
+	return low;
+}
+
+unsigned long long Histogram::max ()
+{
+	return high;
+}
+
+unsigned long long Histogram::percentile (double p)
+{
+	if (n == 0)
+		return 0;
+
+	// rank of the value looked for, from 1
+	unsigned long long rank = (unsigned long long) (p / 100 * n + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	unsigned long long seen = 0;
+	for (int i = 0; i < HBUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= rank)
+			return bound (i) < high ? bound (i) : high;
+	}
+	return high;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file histogram.h
+ * @brief Header file containing Histogram class declaration.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/**
+ * @def HSUB
+ * Number of buckets per power of two, bounds relative error of percentiles
+ * to 1 / HSUB.
+ */
+#define HSUB		16
+/**
+ * @def HBUCKETS
+ * Number of buckets: values up to 2^48 are counted exactly, larger ones go to
+ * the last bucket.
+ */
+#define HBUCKETS	(HSUB + (48 - 4) * HSUB)
+
+/**
+ * @class Histogram histogram.h "histogram.h"
+ * @brief Log-linear histogram of latencies or other non-negative values.
+ *
+ * Values below HSUB have a bucket each; above, every power of two is split in
+ * HSUB buckets. Adding a value costs a few instructions and no allocation,
+ * so a thread can keep its own histogram in a hot path and merge it later.
+ * A Histogram has no pointers and can be copied as raw memory, e.g. through a
+ * pipe. It is not thread safe.
+ */
+class Histogram {
+
+	/**
+	 * Count of values per bucket.
+	 */
+	unsigned long long counts[HBUCKETS];
+
+	/**
+	 * Number of values.
+	 */
+	unsigned long long n;
+
+	/**
+	 * Sum of values.
+	 */
+	unsigned long long sum;
+
+	/**
+	 * Smallest value.
+	 */
+	unsigned long long low;
+
+	/**
+	 * Largest value.
+	 */
+	unsigned long long high;
+
+	/**
+	 * Returns the bucket of a value.
+	 * @param[in]	value Value.
+	 * @return	Bucket index.
+	 */
+	static int bucket (unsigned long long value);
+
+	/**
+	 * Returns the largest value counted in a bucket.
+	 * @param[in]	b Bucket index.
+	 * @return	Upper bound of bucket.
+	 */
+	static unsigned long long bound (int b);
+public:
+	/**
+	 * Histogram constructor. Histogram is empty.
+	 * @return	No value is returned.
+	 */
+	Histogram ();
+
+	/**
+	 * Empties histogram.
+	 * @return	No value is returned.
+	 */
+	void clear ();
+
+	/**
+	 * Counts a value.
+	 * @param[in]	value Value.
+	 * @return	No value is returned.
+	 */
+	void add (unsigned long long value);
+
+	/**
+	 * Adds the values of another histogram.
+	 * @param[in]	h Histogram.
+	 * @return	No value is returned.
+	 */
+	void merge (const Histogram &h);
+
+	/**
+	 * Returns the number of values.
+	 * @return	Number of values.
+	 */
+	unsigned long long count ();
+
+	/**
+	 * Returns the mean of values.
+	 * @return	Mean, 0 if histogram is empty.
+	 */
+	double mean ();
+
+	/**
+	 * Returns the smallest value.
+	 * @return	Smallest value, 0 if histogram is empty.
+	 */
+	unsigned long long min ();
+
+	/**
+	 * Returns the largest value.
+	 * @return	Largest value, 0 if histogram is empty.
+	 */
+	unsigned long long max ();
+
+	/**
+	 * Returns a percentile.
+	 * @param[in]	p Percentile, from 0 to 100.
+	 * @return	Upper bound of the bucket holding the percentile, never
+	 * 		above largest value; 0 if histogram is empty.
+	 */
+	unsigned long long percentile (double p);
+};
+
+#endif // HISTOGRAM_H
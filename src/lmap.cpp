@@ -0,0 +1,123 @@
+/**
+ * @file lmap.cpp
+ * @brief File containing LMap class definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <string.h>
+#include "lmap.h"
+
+/**
+ * @def LMAP_INIT
+ * Initial capacity of an LMap, must be a power of two.
+ */
+#define LMAP_INIT 64
+
+LMap::LMap ()
+{
+	capacity = LMAP_INIT;
+	count = 0;
+	table = new lblock[capacity];
+	memset ((void *) table, 0, capacity * sizeof(lblock));
+}
+
+LMap::~LMap ()
+{
+	delete[] table;
+}
+
+unsigned int LMap::slot (block_id ID)
+{
+	// multiplicative hashing: consecutive ids land on different slots.
+	// High half is folded in, so it costs nothing to ids below 2^32
+	return ((unsigned int) (ID ^ (ID >> 32)) * 2654435761u) &
+	       (capacity - 1);
+}
+
+void LMap::grow ()
+{
+	lblock *old = table;
+	unsigned int n = capacity;
+
+	capacity *= 2;
+	table = new lblock[capacity];
+	memset ((void *) table, 0, capacity * sizeof(lblock));
+	for (unsigned int i = 0; i < n; i++) {
+		if (!old[i].used)
+			continue;
+		unsigned int j = slot (old[i].ID);
+		while (table[j].used)
+			j = (j + 1) & (capacity - 1);
+		table[j] = old[i];
+	}
+
+	delete[] old;
+}
+
+lblock *LMap::find (block_id ID)
+{
+	for (unsigned int i = slot (ID); table[i].used;
+	     i = (i + 1) & (capacity - 1))
+		if (table[i].ID == ID)
+			return &table[i];
+
+	return NULL;
+}
+
+lblock *LMap::insert (block_id ID)
+{
+	lblock *lb = find (ID);
+	if (lb != NULL)
+		return lb;
+
+	if (2 * (count + 1) > capacity)
+		grow ();
+
+	unsigned int i = slot (ID);
+	while (table[i].used)
+		i = (i + 1) & (capacity - 1);
+	table[i].ID = ID;
+	table[i].data = NULL;
+	table[i].version = -1;
+	table[i].serial = 0;
+	table[i].behind = false;
+	table[i].used = true;
+	count++;
+
+	return &table[i];
+}
+
+void LMap::erase (block_id ID)
+{
+	lblock *lb = find (ID);
+	if (lb == NULL)
+		return;
+
+	// backward shift deletion: entries following the removed one are
+	// moved back, so that no probing sequence is broken
+	unsigned int i = lb - table;
+	unsigned int j = i;
+	while (1) {
+		j = (j + 1) & (capacity - 1);
+		if (!table[j].used)
+			break;
+		unsigned int k = slot (table[j].ID);
+		// entry in j may fill hole in i only if its home slot k is not
+		// cyclically in (i, j]
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && (k <= i && k > j))) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].used = false;
+	count--;
+}
+
+unsigned int LMap::size ()
+{
+	return count;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file lmap.h
+ * @brief Header file containing LMap class declaration.
+ *
+ * An LMap object stores the blocks a client has mapped in local memory.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef LMAP_H
+#define LMAP_H
+
+#include "msg.h"
+
+/**
+ * @struct lblock lmap.h "lmap.h"
+ * @brief A block mapped in client's local memory.
+ */
+struct lblock {
+	/**
+	 * Block id.
+	 */
+	block_id ID;
+
+	/**
+	 * Local memory address in which block data is stored.
+	 */
+	char *data;
+
+	/**
+	 * Version of local data, -1 if none. Kept only for replicated blocks.
+	 */
+	int version;
+
+	/**
+	 * Serial of the UPDATE or WRITE request being sent for a copy of the
+	 * entry, 0 if none (see DM_client::issue()).
+	 */
+	int serial;
+
+	/**
+	 * True if local data is known to be older than primary server's, e.g.
+	 * because a write was refused. Kept only for replicated blocks, which
+	 * are then updated from primary server, as replicas may lag behind.
+	 */
+	bool behind;
+
+	/**
+	 * True if entry is in use.
+	 */
+	bool used;
+};
+
+/**
+ * @class LMap lmap.h "lmap.h"
+ * @brief Flat hash table of locally mapped blocks.
+ *
+ * Entries are stored in a single array with open addressing and linear
+ * probing, so a lookup usually touches one cache line and never allocates.
+ * Table grows when it is more than half full. Pointers returned by find()
+ * and insert() are valid until next insert() or erase().
+ */
+class LMap {
+
+	/**
+	 * Array of entries.
+	 */
+	lblock *table;
+
+	/**
+	 * Number of entries in table, always a power of two.
+	 */
+	unsigned int capacity;
+
+	/**
+	 * Number of entries in use.
+	 */
+	unsigned int count;
+
+	/**
+	 * Returns the slot in which probing for ID starts.
+	 * @param[in]	ID Block id.
+	 * @return	Slot index.
+	 */
+	unsigned int slot (block_id ID);
+
+	/**
+	 * Doubles table capacity.
+	 * @return	No value is returned.
+	 */
+	void grow ();
+public:
+	/**
+	 * LMap constructor. Allocates an empty table.
+	 * @return	No value is returned.
+	 */
+	LMap ();
+
+	/**
+	 * LMap destructor. Frees table, not local memory of blocks.
+	 * @return	No value is returned.
+	 */
+	~LMap ();
+
+	/**
+	 * Finds a mapped block.
+	 * @param[in]	ID Block id.
+	 * @return	Entry of block, NULL if block is not mapped.
+	 */
+	lblock *find (block_id ID);
+
+	/**
+	 * Adds a block. Entry is created with no local address and version
+	 * -1; if block is already in table the existing entry is returned.
+	 * @param[in]	ID Block id.
+	 * @return	Entry of block.
+	 */
+	lblock *insert (block_id ID);
+
+	/**
+	 * Removes a block, if present.
+	 * @param[in]	ID Block id.
+	 * @return	No value is returned.
+	 */
+	void erase (block_id ID);
+
+	/**
+	 * Returns the number of mapped blocks.
+	 * @return	Number of mapped blocks.
+	 */
+	unsigned int size ();
+};
+
+#endif // LMAP_H
@@ -4,20 +4,80 @@
  * interaction with clients.
  * 
  * A Distributed Memory Server will wait for incoming connections by clients.
- * Once a client has connected it can perform operations with a simple protocol:
- * - Map request: message <MAP, ID>
- * - Unmap request: message <UNMAP, ID>
- * - Update request: message <UPDATE, ID>
- * - Write request: message <WRITE, ID, data>
- * - Wait request: message <WAIT, ID>
+ * Once a client has connected it can perform operations with a simple protocol.
+ * Every message is a frame (see frame.h): a header carrying type, tag and
+ * payload length, followed by the payload. Request payloads are:
+ * - Map request: <MAP, ID>
+ * - Unmap request: <UNMAP, ID>
+ * - Update request: <UPDATE, ID>
+ * - Write request: <WRITE, ID, data>
+ * - Wait request: <WAIT, ID>
+ * - Read range request: <READ_RANGE, ID, offset, length>
+ * - Write range request: <WRITE_RANGE, ID, offset, length, data>
+ * - Versioned update request: <VUPDATE, ID, version>
+ * - Versioned write request: <VWRITE, ID, version, data>
+ * - Versioned wait request: <VWAIT, ID, version>
+ * - Stats request: <STATS, number of blocks>
+ * - Scan request: <SCAN, ID, blocks, bytes in last block, kernel, operand,
+ *   class>
+ * - Stale request: <STALE, ID, blocks>
  *
- * Server can then reply:
- * - Map reply: message <OK, data>
- * - Unmap reply: message <OK>
- * - Update replies: message <OK, data> or message <UPDATED>
- * - Write reply: message <OK>
- * - Generic error reply: message <ERROR>
- * - Write error reply: message <ERROR, INVALID> or message <ERROR, UNMAPPED>
+ * Server can then reply, with the tag of the request:
+ * - Map reply: <OK, data>
+ * - Unmap reply: <OK>
+ * - Update replies: <OK, data> or <UPDATED>
+ * - Write reply: <OK>
+ * - Generic error reply: <ERROR>
+ * - Write error reply: <ERROR, INVALID> or <ERROR, UNMAPPED>
+ * - Read range replies: <OK, data> or <UPDATED>
+ * - Write range replies: same as write replies
+ * - Versioned update replies: <OK, version, data> or <UPDATED>
+ * - Versioned write replies: same as write replies
+ * - Versioned wait reply: <OK>
+ * - Stats reply: <OK, report>, report is text (see Stats::report())
+ * - Scan reply: <OK, blocks scanned, value high, value low, min, max, flags>
+ * - Stale reply: <OK, blocks checked, stale bitmap, unmapped bitmap>, bit
+ *   i % 8 of byte i / 8 of stale bitmap is set if block ID + i is mapped by
+ *   client and stale, of unmapped bitmap if it isn't mapped by client
+ *
+ * A malformed or unknown request gets <ERROR> and its payload is skipped, so
+ * the connection stays usable. A frame with another protocol version gets
+ * <ERROR> and the connection is closed.
+ *
+ * Versioned requests don't need the block to be mapped: client states the
+ * version it holds. They are used for replicated blocks, which can be read from
+ * replica servers and written on primary server only.
+ *
+ * A primary server introduces itself to each replica with message <HELLO, 0,
+ * 0, block size, CAP_PRIMARY>, which a server not started as a replica refuses.
+ * On that connection only, it streams every successful write with message
+ * <REPLICATE, ID, version, data>, which has no reply, and <HEARTBEAT> every
+ * second; from anyone else, both get <ERROR>. A replica which hasn't heard
+ * from its primary for LEASE seconds, or whose connection with it is closed,
+ * replies <ERROR, LAGGING> to versioned updates and waits, also to those
+ * already waiting, and clients ask the primary instead.
+ *
+ * Clients identify themselves on every server with message <HELLO, token high,
+ * token low, block size, capabilities>, replied with <OK, block size,
+ * capabilities>, so that their mappings survive blocks being moved between
+ * servers. A client may open many connections with the same token: they share
+ * its mappings, which are released when the last one is closed, or, with a
+ * grace period, only if the client doesn't connect again within it. A range of
+ * blocks is moved with message <MIGRATE, first, last, address, port>; the
+ * server sends each block to its new owner with message <MOVE, ID, state>,
+ * then hands over ranges of blocks a lazy server never created with message
+ * <ADOPT, first, last>.
+ * Afterwards any request on a moved block gets reply <REDIRECT, address,
+ * port, first, last>, where [first, last] is the range moved with the block,
+ * and the client repeats it on the new owner.
+ *
+ * Range requests carry only length bytes of data, starting at offset inside
+ * the block.
+ *
+ * Scan requests run a kernel (see msg.h) over blocks in [ID, ID + blocks),
+ * the last one only up to the given number of bytes, and send back only its
+ * result. Operand is the element size of SCAN_SUM and SCAN_MINMAX, 1 or 4;
+ * kernels on bytes are followed by a class mask of SCANSET bytes.
  *
  * All messages are defined in msg.h file.
  *
@@ -26,24 +86,260 @@
  * @date June 2010
  */
 
+#include <signal.h>
 #include <stdlib.h>
+#include <vector>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include "dm.h"
+#include "frame.h"
 #include "msg.h"
+#include "scan.h"
+#include "stats.h"
+#include "trace.h"
 #include "utility.h"
 
 #include <stdio.h> // only for printf
 
 #define BACKLOG 10
 
+/**
+ * @def MAXSTATE
+ * Maximum size in bytes of a block state received with a MOVE request.
+ */
+#define MAXSTATE (1 << 24)
+
+/**
+ * @def MAXTOP
+ * Maximum number of most accessed blocks in a STATS reply.
+ */
+#define MAXTOP 1000
+
+/**
+ * @def WAITCHECK
+ * Seconds between checks that a waiting client is still connected: a client
+ * whose wait timed out closes its connection.
+ */
+#define WAITCHECK 1
+
+/**
+ * @def DUMPTOP
+ * Number of most accessed blocks in periodic reports.
+ */
+#define DUMPTOP 10
+
 /**
  * Distributed memory object. Declared global because it must be accessed by all
  * threads.
  */
 DM mem;
 
+/**
+ * Server metrics, updated by all threads.
+ */
+Stats stats;
+
+/**
+ * Trace of requests, off unless a trace file is given.
+ */
+Tracer tracer;
+
+/**
+ * Sends a reply frame, counting it in metrics of current thread.
+ * @param[in]	st Metrics of current thread.
+ * @param[in]	sd Client socket descriptor.
+ * @param[in]	opcode Reply type.
+ * @param[in]	tag Tag of request.
+ * @param[in]	payload Payload, may be NULL if length is 0.
+ * @param[in]	length Payload size in bytes.
+ * @return	0 on success, -1 on error.
+ */
+int reply (ThreadStats *st, int sd, int opcode, int tag, void *payload,
+	   int length)
+{
+	int outcome = opcode;
+	if (opcode == ERROR && length == sizeof(int))
+		// rejected write: reason tells whether copy was invalid
+		outcome = get_int (payload, 0);
+	st->reply (opcode, FRAMEHDR + length, outcome);
+	return send_frame (sd, opcode, tag, payload, length);
+}
+
+/**
+ * Sends reply <REDIRECT, address, port, first, last> for a block moved to
+ * another server, with the range moved with it. Address is in network byte
+ * order, as in sockaddr_in structure.
+ * @param[in]	st Metrics of current thread.
+ * @param[in]	sd Client socket descriptor.
+ * @param[in]	tag Tag of request.
+ * @param[in]	id Moved block's id.
+ * @return	0 on success, -1 on error.
+ */
+int send_redirect (ThreadStats *st, int sd, int tag, block_id id)
+{
+	sockaddr_in dest;
+	block_id first, last;
+	if (mem.redirect (id, &dest, &first, &last) == -1)
+		return reply (st, sd, ERROR, tag, NULL, 0);
+
+	int res[6];
+	res[0] = dest.sin_addr.s_addr;
+	res[1] = htonl (ntohs (dest.sin_port));
+	put_id (res, 2, first);
+	put_id (res, 4, last);
+	return reply (st, sd, REDIRECT, tag, res, sizeof(res));
+}
+
+/**
+ * Sends reply to a write: <OK>, or <ERROR, reason>.
+ * @param[in]	st Metrics of current thread.
+ * @param[in]	sd Client socket descriptor.
+ * @param[in]	tag Tag of request.
+ * @param[in]	ret Result of write: 0, -1 if block is not mapped, -2 if it is
+ *		invalid.
+ * @return	0 on success, -1 on error.
+ */
+int send_written (ThreadStats *st, int sd, int tag, int ret)
+{
+	if (ret == 0)
+		return reply (st, sd, OK, tag, NULL, 0);
+
+	int why = htonl (ret == -2 ? INVALID : UNMAPPED);
+	return reply (st, sd, ERROR, tag, &why, sizeof(int));
+}
+
+/**
+ * Sends reply <ERROR, LAGGING> to a versioned read on a replica which lost its
+ * primary server.
+ * @param[in]	st Metrics of current thread.
+ * @param[in]	sd Client socket descriptor.
+ * @param[in]	tag Tag of request.
+ * @return	0 on success, -1 on error.
+ */
+int send_lagging (ThreadStats *st, int sd, int tag)
+{
+	int why = htonl (LAGGING);
+	return reply (st, sd, ERROR, tag, &why, sizeof(int));
+}
+
+/**
+ * Returns the number of 4-byte arguments a request payload starts with. A
+ * block id takes two of them.
+ * @param[in]	type Request type.
+ * @return	Number of arguments, -1 for an unknown request.
+ */
+int arguments (int type)
+{
+	if (type == MAP || type == UNMAP || type == UPDATE || type == WRITE ||
+	    type == WAIT || type == MOVE)
+		return 2;
+	if (type == VUPDATE || type == VWRITE || type == VWAIT ||
+	    type == REPLICATE || type == STALE)
+		return 3;
+	if (type == READ_RANGE || type == WRITE_RANGE || type == HELLO ||
+	    type == ADOPT)
+		return 4;
+	if (type == MIGRATE || type == SCAN)
+		return 6;
+	if (type == STATS)
+		return 1;
+	if (type == HEARTBEAT)
+		return 0;
+	return -1;
+}
+
+/**
+ * Checks the size of data following the arguments of a request.
+ * @param[in]	type Request type.
+ * @param[in]	args Arguments.
+ * @param[in]	size Size of data in bytes.
+ * @return	True if request is well formed.
+ */
+bool well_formed (int type, int *args, int size)
+{
+	if (type == WRITE || type == VWRITE || type == REPLICATE)
+		return size == DIMBLOCK;
+	if (type == READ_RANGE || type == WRITE_RANGE) {
+		int offset = args[2];
+		int length = args[3];
+		if (offset < 0 || length <= 0 || length > DIMBLOCK ||
+		    offset > DIMBLOCK - length)
+			return false;
+		return size == (type == WRITE_RANGE ? length : 0);
+	}
+	if (type == MOVE)
+		return size > 0 && size <= MAXSTATE;
+	if (type == STALE)
+		return args[2] > 0 && args[2] <= MAXSTALE && size == 0;
+	if (type == SCAN) {
+		int blocks = args[2];
+		int tail = args[3];
+		int kernel = args[4];
+		int width = args[5];
+		if (blocks <= 0 || tail <= 0 || tail > DIMBLOCK)
+			return false;
+		if (kernel == SCAN_SUM || kernel == SCAN_MINMAX)
+			return (width == 1 || width == sizeof(int)) &&
+			       tail % width == 0 && size == 0;
+		if (kernel == SCAN_COUNT || kernel == SCAN_FIND ||
+		    kernel == SCAN_RUNS)
+			return size == SCANSET;
+		return false;
+	}
+	return size == 0;
+}
+
+/**
+ * Makes a report of server metrics (see Stats::report()), with records lost
+ * by trace if tracing.
+ * @param[in]	top Number of blocks reported.
+ * @param[out]	out Report.
+ * @return	No value is returned.
+ */
+void make_report (int top, string *out)
+{
+	stats.report (&mem, top, out);
+	if (tracer.enabled ()) {
+		char line[64];
+		snprintf (line, sizeof(line), "trace_dropped %llu\n",
+			  tracer.lost ());
+		*out += line;
+	}
+}
+
+/**
+ * Adds a request served to trace.
+ * @param[in]	tb Ring buffer of connection.
+ * @param[in,out]	r Record, with time and connection set.
+ * @param[in]	type Request type.
+ * @param[in]	args Arguments of request.
+ * @param[in]	n Number of arguments read.
+ * @param[in]	cid Client identifier.
+ * @param[in]	outcome Outcome of request, -1 if there was no reply.
+ * @param[in]	ns Time taken to serve request, in nanoseconds.
+ * @return	No value is returned.
+ */
+void trace (TraceBuffer *tb, trace_record *r, int type, int *args, int n,
+	    client_id cid, int outcome, unsigned long long ns)
+{
+	r->latency = ns < 0xffffffffULL ? ns : 0xffffffffULL;
+	r->client = (unsigned int) (cid ^ (cid >> 32));
+	r->ID = 0;
+	if (n > 1)
+		r->ID = make_id (args[0], args[1]);
+	else if (n > 0)
+		r->ID = args[0];
+	r->arg = n > 2 ? args[2] : 0;
+	r->length = 0;
+	if (type == READ_RANGE || type == WRITE_RANGE)
+		r->length = args[3];
+	r->opcode = type;
+	r->outcome = outcome;
+	r->reserved = 0;
+	tb->put (*r);
+}
+
 /**
  * Thread that handles all communications with one client, and all client's
  * operations on distributed memory object mem.
@@ -52,163 +348,560 @@ DM mem;
 void *thread (void *in)
 {
 	intptr_t sd = (intptr_t) in;
-	int ret, type, id, resp;
-	char req[2 * sizeof(int)];
+	int ret, type, tag;
+	block_id id;
+	frame f;
+	int args[6];
+	// client is identified by its socket until it sends its token
+	client_id cid = sd;
+	// true once cid is counted among the connections of its client. A
+	// client sending its token first never owns blocks as a socket, so
+	// handing the connection over costs nothing
+	bool attached = false;
+	// true if peer is the primary server of this replica
+	bool primary = false;
+	ThreadStats *st = stats.attach ();
+	trace_record rec;
+	TraceBuffer *tb = NULL;
+	if (tracer.enabled ())
+		tb = tracer.attach (&rec.connection);
 
 	while (1) {
-		ret = recv_msg (sd, &req[0], 2 * sizeof(int));
-		if (ret == -1)
+		ret = recv_frame (sd, &f);
+		if (ret == -2 && skip_msg (sd, f.length) == 0)
+			// other protocol version: peer is told before closing
+			send_frame (sd, ERROR, f.tag, NULL, 0);
+		if (ret != 0)
 			break;
 
-		memcpy (&type, req, sizeof(int));
-		memcpy (&id, req + sizeof(int), sizeof(int));
-		type = ntohl (type);
-		id = ntohl (id);
+		// request is timed from its header to its reply
+		unsigned long long start = monotonic_ns ();
+		if (tb != NULL)
+			rec.time = trace_time ();
+		type = f.opcode;
+		tag = f.tag;
+		int n = arguments (type);
+		if (n == -1 || f.length < n * (int) sizeof(int)) {
+			// error: unknown or short request, skipped
+			if (skip_msg (sd, f.length) == -1)
+				break;
+			if (reply (st, sd, ERROR, tag, NULL, 0) == -1)
+				break;
+			if (tb != NULL)
+				trace (tb, &rec, type, args, 0, cid,
+				       st->outcome (), monotonic_ns () - start);
+			st->record (type, FRAMEHDR + f.length,
+				    monotonic_ns () - start);
+			continue;
+		}
+		ret = recv_msg (sd, args, n * sizeof(int));
+		if (ret == -1)
+			break;
+		for (int i = 0; i < n; i++)
+			args[i] = ntohl (args[i]);
+		// block requests start with block id
+		id = n > 1 ? make_id (args[0], args[1]) : 0;
+		int size = f.length - n * sizeof(int);
+		if (!well_formed (type, args, size)) {
+			// error: data does not match request, skipped
+			if (skip_msg (sd, size) == -1)
+				break;
+			if (!(primary && (type == REPLICATE ||
+					  type == HEARTBEAT)) &&
+			    reply (st, sd, ERROR, tag, NULL, 0) == -1)
+				// messages from primary expect no reply
+				break;
+			if (tb != NULL)
+				trace (tb, &rec, type, args, n, cid,
+				       st->outcome (), monotonic_ns () - start);
+			st->record (type, FRAMEHDR + f.length,
+				    monotonic_ns () - start);
+			continue;
+		}
 
+		if (!attached && type != HELLO) {
+			mem.attach (cid);
+			attached = true;
+		}
 		if (type == MAP) {
 			// map request
-			char buf[DIMBLOCK]; 
-			ret = mem.map_client (sd, id, buf);
-			char res[sizeof(int)];
-			if (ret == -1) {
-				build_resphdr (res, ERROR);
-				ret = send_msg (sd, res, sizeof(int));
-				if (ret == -1)
-					break;
-
-				continue;
-			}
-			build_resphdr (res, OK);
-			ret = send_msg (sd, res, sizeof(int));
+			char buf[DIMBLOCK];
+			ret = mem.map_client (cid, id, buf);
+			if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else if (ret == -1)
+				ret = reply (st, sd, ERROR, tag, NULL, 0);
+			else
+				ret = reply (st, sd, OK, tag, buf, DIMBLOCK);
+		} else if (type == UNMAP) {
+			// unmap request
+			ret = mem.unmap_client (cid, id);
+			if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else
+				ret = reply (st, sd, ret == 0 ? OK : ERROR,
+					     tag, NULL, 0);
+		} else if (type == UPDATE) {
+			// update request
+			char buf[DIMBLOCK];
+			ret = mem.update_block (cid, id, buf, f.flags);
+			if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else if (ret == 0)
+				ret = reply (st, sd, OK, tag, buf, DIMBLOCK);
+			else
+				ret = reply (st, sd, ret == 1 ? UPDATED :
+					     ERROR, tag, NULL, 0);
+		} else if (type == WRITE) {
+			// write request
+			char buf[DIMBLOCK];
+			ret = recv_msg (sd, buf, DIMBLOCK);
 			if (ret == -1)
 				break;
 
-			ret = send_msg (sd, buf, DIMBLOCK);
+			ret = mem.write_block (cid, id, buf, f.flags);
+			if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else
+				ret = send_written (st, sd, tag, ret);
+		} else if (type == WAIT) {
+			// wait request, given up if client closes connection
+			do {
+				ret = mem.wait_block (cid, id, WAITCHECK);
+			} while (ret == -6 && !hung_up (sd));
+			if (ret == -6)
+				// client is gone
+				ret = -1;
+			else if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else
+				ret = reply (st, sd, ret == 0 ? OK : ERROR,
+					     tag, NULL, 0);
+		} else if (type == READ_RANGE) {
+			// read range request
+			int offset = args[2];
+			int length = args[3];
+			char buf[DIMBLOCK];
+			ret = mem.read_block_range (cid, id, buf, offset,
+						    length);
+			if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else if (ret == 0)
+				ret = reply (st, sd, OK, tag, buf, length);
+			else
+				ret = reply (st, sd, ret == 1 ? UPDATED :
+					     ERROR, tag, NULL, 0);
+		} else if (type == WRITE_RANGE) {
+			// write range request
+			int offset = args[2];
+			int length = args[3];
+			char buf[DIMBLOCK];
+			ret = recv_msg (sd, buf, length);
 			if (ret == -1)
 				break;
 
-			continue;
-		} else if (type == UNMAP) {
-			// unmap request
-			char buf[sizeof(int)];
-			ret = mem.unmap_client (sd, id);
-			if (ret == 0)
-				build_resphdr (buf, OK);
+			ret = mem.write_block_range (cid, id, buf, offset,
+						     length);
+			if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
 			else
-				build_resphdr (buf, ERROR);
-			ret = send_msg (sd, buf, sizeof(int));
+				ret = send_written (st, sd, tag, ret);
+		} else if (type == REPLICATE) {
+			// replicate request, from primary server
+			char buf[DIMBLOCK];
+			ret = recv_msg (sd, buf, DIMBLOCK);
 			if (ret == -1)
 				break;
 
-			continue;
-		} else if (type == UPDATE) {
-			// update request
-			char buf[DIMBLOCK];
-			char res[sizeof(int)];
-			ret = mem.update_block (sd, id, buf);
-			if (ret == 0) {
-				build_resphdr (res, OK);
-				ret = send_msg (sd, res, sizeof(int));
-				if (ret == -1)
-					break;
-
-				ret = send_msg (sd, buf, DIMBLOCK);
-				if (ret == -1)
-					break;
-			} else if (ret == 1) {
-				build_resphdr (res, UPDATED);
-				ret = send_msg (sd, res, sizeof(int));
-				if (ret == -1)
-					break;
+			if (!primary) {
+				// error: peer is not the primary server
+				ret = reply (st, sd, ERROR, tag, NULL, 0);
 			} else {
-				build_resphdr (res, ERROR);
-				ret = send_msg (sd, res, sizeof(int));
+				ret = mem.replicate_block (id, args[2], buf);
 				if (ret == -1)
+					// error: no reply is expected
 					break;
+				mem.heard ();
 			}
-			continue;
-		} else if (type == WRITE) {
-			// write request
+		} else if (type == HEARTBEAT) {
+			// heartbeat, from primary server: no reply
+			if (!primary)
+				// error: peer is not the primary server
+				ret = reply (st, sd, ERROR, tag, NULL, 0);
+			else
+				mem.heard ();
+		} else if (type == VUPDATE) {
+			// versioned update request, reply carries version
+			char buf[sizeof(int) + DIMBLOCK];
+			int curr;
+			ret = mem.vupdate_block (id, args[2], buf + sizeof(int),
+						 &curr);
+			if (ret == -4) {
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			} else if (ret == 0) {
+				put_int (buf, 0, curr);
+				ret = reply (st, sd, OK, tag, buf,
+					     sizeof(buf));
+			} else if (ret == -5) {
+				// replica lost its primary server
+				ret = send_lagging (st, sd, tag);
+			} else {
+				ret = reply (st, sd, ret == 1 ? UPDATED :
+					     ERROR, tag, NULL, 0);
+			}
+		} else if (type == VWRITE) {
+			// versioned write request
 			char buf[DIMBLOCK];
 			ret = recv_msg (sd, buf, DIMBLOCK);
 			if (ret == -1)
 				break;
 
-			char res[sizeof(int)];
-			ret = mem.write_block (sd, id, buf);
-			if (ret == 0) {
-				build_resphdr (res, OK);
-				ret = send_msg (sd, res, sizeof(int));
-				if (ret == -1)
-					break;
-			} else if (ret == -1) {
-				build_resphdr (res, ERROR);
-				ret = send_msg (sd, res, sizeof(int));
-				if (ret == -1)
-					break;
+			ret = mem.vwrite_block (id, args[2], buf);
+			if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else
+				ret = send_written (st, sd, tag, ret);
+		} else if (type == VWAIT) {
+			// versioned wait request, given up if client closes
+			// connection
+			do {
+				ret = mem.vwait_block (id, args[2], WAITCHECK);
+			} while (ret == -6 && !hung_up (sd));
+			if (ret == -6)
+				// client is gone
+				ret = -1;
+			else if (ret == -4)
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			else if (ret == -5)
+				// replica lost its primary server
+				ret = send_lagging (st, sd, tag);
+			else
+				ret = reply (st, sd, ret == 0 ? OK : ERROR,
+					     tag, NULL, 0);
+		} else if (type == HELLO) {
+			// hello request: <token high, token low, block size,
+			// capabilities>
+			int res[2];
+			res[0] = htonl (DIMBLOCK);
+			res[1] = htonl (args[3] & CAPABILITIES);
+			if ((args[2] != 0 && args[2] != DIMBLOCK) ||
+			    (args[3] & CAP_PRIMARY && !mem.is_replica ())) {
+				// error: client expects another block size, or
+				// a primary server connects to a non replica
+				ret = reply (st, sd, ERROR, tag, res,
+					     2 * sizeof(int));
+			} else if (args[3] & CAP_PRIMARY) {
+				// primary server: its messages are accepted
+				// on this connection only, which owns no block
+				primary = true;
+				mem.heard ();
+				res[1] = htonl (CAP_PRIMARY);
+				ret = reply (st, sd, OK, tag, res,
+					     2 * sizeof(int));
+			} else {
+				// connection now belongs to the client owning
+				// the token, which may have other connections.
+				// Blocks mapped before as a socket are cleaned
+				if (attached)
+					mem.detach (cid);
+				cid = make_id (args[0], args[1]);
+				mem.attach (cid);
+				attached = true;
+				ret = reply (st, sd, OK, tag, res,
+					     2 * sizeof(int));
+			}
+		} else if (type == MIGRATE) {
+			// migrate request: <first, last, address, port>
+			sockaddr_in dest;
+			memset ((void *) &dest, 0, sizeof(sockaddr_in));
+			dest.sin_family = AF_INET;
+			// address was sent in network byte order
+			dest.sin_addr.s_addr = htonl (args[4]);
+			dest.sin_port = htons (args[5]);
 
-				build_resphdr (res, UNMAPPED);
-				ret = send_msg (sd, res, sizeof(int));
-				if (ret == -1)
-					break;
-			} else if (ret == -2) {
-				build_resphdr (res, ERROR);
-				ret = send_msg (sd, res, sizeof(int));
-				if (ret == -1)
-					break;
+			ret = mem.migrate (id, make_id (args[2], args[3]),
+					   &dest);
+			ret = reply (st, sd, ret == 0 ? OK : ERROR, tag,
+				     NULL, 0);
+		} else if (type == MOVE) {
+			// move request, from the server block is moved from
+			char *state = new char[size];
+			ret = recv_msg (sd, state, size);
+			if (ret == -1) {
+				delete[] state;
+				break;
+			}
 
-				build_resphdr (res, INVALID);
-				ret = send_msg (sd, res, sizeof(int));
+			ret = mem.adopt_block (id, state, size);
+			delete[] state;
+			ret = reply (st, sd, ret == 0 ? OK : ERROR, tag,
+				     NULL, 0);
+		} else if (type == ADOPT) {
+			// adopt request, from the server blocks are moved
+			// from: <first, last>
+			mem.adopt_range (id, make_id (args[2], args[3]));
+			ret = reply (st, sd, OK, tag, NULL, 0);
+		} else if (type == STATS) {
+			// stats request: <number of blocks>, report is text
+			string report;
+			make_report (args[0] < MAXTOP ? args[0] : MAXTOP,
+				     &report);
+			ret = reply (st, sd, OK, tag, (void *) report.data (),
+				     report.size ());
+		} else if (type == SCAN) {
+			// scan request: <blocks, bytes in last block, kernel,
+			// operand, class>
+			unsigned char set[SCANSET];
+			if (size > 0) {
+				ret = recv_msg (sd, set, size);
 				if (ret == -1)
 					break;
 			}
-			continue;
-		} else if (type == WAIT) {
-			// wait request
-			char buf[sizeof(int)];
-			ret = mem.wait_block (sd, id);
-			if (ret == 0)
-				build_resphdr (buf, OK);
-			else
-				build_resphdr (buf, ERROR);
-			ret = send_msg (sd, buf, sizeof(int));
-			if (ret == -1)
-				break;
 
-			continue;
-		} else {
-			// error: unrecognizable msg
-			break;
+			Scan s (args[4], args[5], set);
+			int scanned;
+			ret = mem.scan_range (id, args[2], args[3], &s,
+					      &scanned);
+			if (ret == -4) {
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			} else if (ret == 0) {
+				int res[SCANREPLY];
+				put_int (res, 0, scanned);
+				s.store (res, 1);
+				ret = reply (st, sd, OK, tag, res, sizeof(res));
+			} else {
+				ret = reply (st, sd, ERROR, tag, NULL, 0);
+			}
+		} else if (type == STALE) {
+			// stale request: <blocks>, reply carries two bitmaps
+			int blocks = args[2];
+			int bitmap = (blocks + 7) / 8;
+			int length = sizeof(int) + 2 * bitmap;
+			char *res = new char[length];
+			memset (res, 0, length);
+			unsigned char *stale = (unsigned char *) res +
+					       sizeof(int);
+			unsigned char *unmapped = new unsigned char[bitmap];
+			memset (unmapped, 0, bitmap);
+			int checked;
+			ret = mem.stale_blocks (cid, id, blocks, stale,
+						unmapped, &checked);
+			if (ret == -4) {
+				// block moved to another server
+				ret = send_redirect (st, sd, tag, id);
+			} else if (ret == 0) {
+				// bitmaps are as long as blocks checked
+				int bytes = (checked + 7) / 8;
+				put_int (res, 0, checked);
+				memcpy (res + sizeof(int) + bytes, unmapped,
+					bytes);
+				ret = reply (st, sd, OK, tag, res, sizeof(int) +
+					     2 * bytes);
+			} else {
+				ret = reply (st, sd, ERROR, tag, NULL, 0);
+			}
+			delete[] unmapped;
+			delete[] res;
 		}
+		if (ret == -1)
+			break;
+		unsigned long long ns = monotonic_ns () - start;
+		if (tb != NULL)
+			trace (tb, &rec, type, args, n, cid, st->outcome (),
+			       ns);
+		st->record (type, FRAMEHDR + f.length, ns);
 	}
 
-	// cleaning operation always done. a client can crash or disconnect
-	// without errors but we are note sure that all client's blocks are
-	// unmapped
-	mem.clean (sd);
+	// cleaning operation always done when client's last connection is
+	// closed. a client can crash or disconnect without errors but we are
+	// note sure that all client's blocks are unmapped. A client which sent
+	// its token may only have lost its connections: cleaning waits for
+	// the grace period
+	if (attached)
+		mem.detach (cid, cid != sd);
+	if (primary)
+		// replica won't receive writes anymore
+		mem.lapse ();
+	stats.detach (st);
+	if (tb != NULL)
+		tracer.detach (tb);
 	close (sd);
 }
 
 /**
- * Server main function, input parameters are:
- * @param[in]	argv[0] Server port.
- * @param[in]	argv[1]	First block id.
- * @param[in]	argv[2] Last block id.
+ * Thread that prints a report of server metrics periodically.
+ * @param[in]	in Period in seconds.
+ */
+void *dump (void *in)
+{
+	intptr_t period = (intptr_t) in;
+	while (1) {
+		sleep (period);
+		string report;
+		make_report (DUMPTOP, &report);
+		printf ("%s\n", report.c_str ());
+		fflush (stdout);
+	}
+}
+
+/**
+ * Thread that releases mappings of clients which didn't connect again within
+ * the grace period.
+ * @param[in]	in Unused.
+ */
+void *reaper (void *in)
+{
+	while (1) {
+		sleep (1);
+		mem.expire ();
+	}
+}
+
+/**
+ * Thread that sends heartbeats to replicas of a primary server, and makes a
+ * replica stop serving reads when its primary goes quiet.
+ * @param[in]	in Unused.
+ */
+void *lease (void *in)
+{
+	while (1) {
+		sleep (1);
+		mem.beat ();
+		mem.check_lease ();
+	}
+}
+
+/**
+ * Server main function, usage is:
+ *
+ * server [-R] [-r address:port]... [-c config_file -i index] [-s seconds]
+ *	  [-p sampling] [-t trace_file] [-l] [-u] [-g seconds] port first last
+ *
+ * @param[in]	port Server port.
+ * @param[in]	first First block id.
+ * @param[in]	last Last block id.
+ * @param[in]	-R Server is a replica: it accepts data only from its primary
+ *		server, clients can only read.
+ * @param[in]	-r Address and port of a replica server. Every successful
+ *		write is streamed to it. Can be repeated, replicas must be
+ *		already running.
+ * @param[in]	-c Configuration file, the same used by clients. Needed with
+ *		stripe or hash placement: only blocks in [first, last] placed
+ *		on this server are created.
+ * @param[in]	-i Index of this server in configuration file, starting from
+ *		0. Needed with -c.
+ * @param[in]	-s Period in seconds of a report of server metrics, printed
+ *		on standard output. Same report is sent to STATS requests.
+ * @param[in]	-p Profiles block locks: contended acquisitions are timed
+ *		and blamed on the client holding the lock, and one
+ *		acquisition every sampling has its hold time measured. Most
+ *		contended blocks are added to reports.
+ * @param[in]	-t Trace file: every request served is recorded in it (see
+ *		trace.h), to be replayed with dm_replay.
+ * @param[in]	-l Lazy allocation: blocks are created on first access
+ *		instead of at start, for large and sparsely used ranges.
+ * @param[in]	-u Unchanged writes are elided: a write whose data equals
+ *		block data succeeds without invalidating other clients'
+ *		copies or waking up waiting clients.
+ * @param[in]	-g Grace period in seconds: mappings of a client outlive
+ *		its last connection for this long, so that a client
+ *		reconnecting after a network failure resumes them. By
+ *		default they are released at once.
  */
 int main (int argc, char *argv[])
 {
-	if (argc != 4) {
+	int c;
+	bool replica = false;
+	vector<char *> replicas;
+	char *config_file = NULL;
+	int self = -1;
+	int period = 0;
+	char *trace_file = NULL;
+	bool lazy = false;
+	int grace = 0;
+	while ((c = getopt (argc, argv, "Rr:c:i:s:p:t:lug:")) != -1) {
+		if (c == 'R') {
+			replica = true;
+		} else if (c == 'r') {
+			replicas.push_back (optarg);
+		} else if (c == 'c') {
+			config_file = optarg;
+		} else if (c == 'i') {
+			self = atoi (optarg);
+		} else if (c == 's') {
+			period = atoi (optarg);
+		} else if (c == 'p') {
+			Block::sampling = atoi (optarg);
+		} else if (c == 't') {
+			trace_file = optarg;
+		} else if (c == 'l') {
+			lazy = true;
+		} else if (c == 'u') {
+			Block::elide = true;
+		} else if (c == 'g') {
+			grace = atoi (optarg);
+		} else {
+			printf ("Server: Bad arguments\n");
+			exit (1);
+		}
+	}
+
+	if (argc - optind != 3 || (config_file != NULL && self < 0) ||
+	    period < 0 || Block::sampling < 0 || grace < 0) {
 		printf ("Server: Bad arguments\n");
 		exit (1);
 	}
 
 	// initialization
-	int port = atoi (argv[1]);
-	int first = atoi (argv[2]);
-	int last = atoi (argv[3]);
+	int port = atoi (argv[optind]);
+	block_id first = strtoll (argv[optind + 1], NULL, 10);
+	block_id last = strtoll (argv[optind + 2], NULL, 10);
 	pthread_t tid;
 
-	mem.init (first, last);
+	// a peer closing its connection must not kill the server
+	signal (SIGPIPE, SIG_IGN);
+
+	Placement placement;
+	if (config_file != NULL) {
+		if (placement.load (config_file) == -1) {
+			printf ("Server: Unable to read configuration file\n");
+			exit (1);
+		}
+		mem.init (first, last, &placement, self, lazy);
+	} else {
+		mem.init (first, last, NULL, 0, lazy);
+	}
+	if (replica)
+		mem.set_replica ();
+	mem.set_grace (grace);
+	if (trace_file != NULL && tracer.open (trace_file, DIMBLOCK) == -1) {
+		printf ("Server: Unable to create trace file\n");
+		exit (1);
+	}
+	for (unsigned int i = 0; i < replicas.size (); i++) {
+		char *p = strchr (replicas[i], ':');
+		if (p == NULL) {
+			printf ("Server: Bad arguments\n");
+			exit (1);
+		}
+		*p = '\0';
+		if (mem.add_replica (replicas[i], atoi (p + 1)) == -1) {
+			printf ("Server: Unable to connect to replica %s\n",
+				replicas[i]);
+			exit (1);
+		}
+	}
 
 	// create listening socket
 	sockaddr_in s_addr;
@@ -240,6 +933,13 @@ int main (int argc, char *argv[])
 		exit (1);
 	}
 
+	if (period > 0)
+		pthread_create (&tid, 0, dump, (void *) (intptr_t) period);
+	if (grace > 0)
+		pthread_create (&tid, 0, reaper, NULL);
+	if (replica || !replicas.empty ())
+		pthread_create (&tid, 0, lease, NULL);
+
 	while (1) {
 		sockaddr_in c_addr;
 		int len = sizeof(sockaddr_in);
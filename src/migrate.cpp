@@ -0,0 +1,47 @@
+/**
+ * @file migrate.cpp
+ * @brief Administration tool. Moves a range of blocks from its server to
+ * another server, while clients keep working on them.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include "distmem.h"
+
+/**
+ * Migrate main function, usage is:
+ *
+ * migrate config_file first last address port
+ *
+ * @param[in]	config_file A valid Distributed Memory configuration file.
+ * @param[in]	first First block id of range.
+ * @param[in]	last Last block id of range.
+ * @param[in]	address New owner's address in dotted notation.
+ * @param[in]	port New owner's port.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 6) {
+		printf ("Migrate: Bad arguments\n");
+		exit (1);
+	}
+
+	DM_client dm;
+	int ret = dm.dm_init (argv[1]);
+	if (ret == -1) {
+		printf ("Migrate: Unable to initialize DM\n");
+		exit (1);
+	}
+
+	ret = dm.dm_migrate (strtoll (argv[2], NULL, 10),
+			     strtoll (argv[3], NULL, 10), argv[4],
+			     atoi (argv[5]));
+	if (ret < 0) {
+		printf ("Migrate: Unable to move blocks\n");
+		exit (1);
+	}
+
+	exit (0);
+}
@@ -10,6 +10,12 @@
 #ifndef MSG_H
 #define MSG_H
 
+/**
+ * Block identifier. Sent as two 4-byte arguments, high half first (see
+ * put_id()).
+ */
+typedef long long block_id;
+
 /**
  * @def MAP
  * Map request type.
@@ -48,19 +54,230 @@
 #define ERROR		6
 /**
  * @def UPDATED
- * Updated response type (only for UPDATE requests).
+ * Updated response type (only for UPDATE and READ_RANGE requests).
  */
 #define UPDATED		7
 
 /**
  * @def UNMAPPED
- * Unmapped error reason (only for WRITE requests).
+ * Unmapped error reason (only for WRITE and WRITE_RANGE requests), payload of
+ * ERROR reply.
  */
 #define UNMAPPED	8
 /**
  * @def INVALID
- * Invalid error reason (only for WRITE requests).
+ * Invalid error reason (only for WRITE and WRITE_RANGE requests).
  */
 #define INVALID		9
 
+/**
+ * @def READ_RANGE
+ * Read range request type. Transfers only a slice of a block.
+ */
+#define READ_RANGE	10
+/**
+ * @def WRITE_RANGE
+ * Write range request type. Transfers only a slice of a block.
+ */
+#define WRITE_RANGE	11
+
+/**
+ * @def REPLICATE
+ * Replicate request type. Sent by a primary server to its replicas after
+ * every successful write, no reply is sent back.
+ */
+#define REPLICATE	12
+/**
+ * @def VUPDATE
+ * Versioned update request type. Client states the version it holds, no
+ * mapping is needed. Used for replicated blocks.
+ */
+#define VUPDATE		13
+/**
+ * @def VWRITE
+ * Versioned write request type. Write succeeds only if stated version is the
+ * current one, no mapping is needed. Used for replicated blocks.
+ */
+#define VWRITE		14
+/**
+ * @def VWAIT
+ * Versioned wait request type. Waits until block version is newer than stated
+ * version, no mapping is needed. Used for replicated blocks.
+ */
+#define VWAIT		15
+
+/**
+ * @def HELLO
+ * Hello request type. Carries the token identifying the client on every
+ * server, the block size client expects (0 if any) and its capabilities.
+ * Must be the first request sent by a client on a connection. Reply carries
+ * server's block size and the capabilities both sides have; it is ERROR if
+ * block sizes differ.
+ */
+#define HELLO		16
+/**
+ * @def MIGRATE
+ * Migrate request type. Asks a server to move a range of blocks to another
+ * server.
+ */
+#define MIGRATE		17
+/**
+ * @def MOVE
+ * Move request type. Sent by a server to the new owner of a block, carries
+ * block state.
+ */
+#define MOVE		18
+/**
+ * @def REDIRECT
+ * Redirect response type. Block has been moved, reply carries address and port
+ * of the server now owning it, and the range of blocks moved with it.
+ */
+#define REDIRECT	19
+/**
+ * @def STATS
+ * Stats request type. Asks a server for a report of its metrics, with the
+ * given number of most accessed blocks. Reply carries the report as text.
+ */
+#define STATS		20
+/**
+ * @def SCAN
+ * Scan request type. Runs a kernel over a range of blocks, no mapping is
+ * needed. Reply carries the number of blocks scanned, fewer than asked if the
+ * range continues on another server, and the result (see SCANREPLY).
+ */
+#define SCAN		21
+/**
+ * @def STALE
+ * Stale request type. Asks which blocks of a range are mapped by client and
+ * stale, i.e. changed since client's last update. Reply carries the number of
+ * blocks checked, fewer than asked if the range continues on another server,
+ * a bitmap of stale blocks and one of blocks not mapped by client.
+ */
+#define STALE		22
+/**
+ * @def MAXSTALE
+ * Maximum number of blocks of a STALE request.
+ */
+#define MAXSTALE	65536
+/**
+ * @def HEARTBEAT
+ * Heartbeat request type. Sent by a primary server to its replicas every
+ * second, no reply is sent back.
+ */
+#define HEARTBEAT	23
+/**
+ * @def LAGGING
+ * Lagging error reason (only for VUPDATE and VWAIT requests): replica hasn't
+ * heard from its primary server for LEASE seconds, and client must ask the
+ * primary server.
+ */
+#define LAGGING		24
+/**
+ * @def ADOPT
+ * Adopt request type. Sent by a server to the new owner of a range of blocks
+ * it never created, which creates them on first access.
+ */
+#define ADOPT		25
+/**
+ * @def LEASE
+ * Seconds a replica serves versioned reads after the last message from its
+ * primary server.
+ */
+#define LEASE		3
+
+/**
+ * @def SCAN_COUNT
+ * Scan kernel: number of bytes in class.
+ */
+#define SCAN_COUNT	0
+/**
+ * @def SCAN_FIND
+ * Scan kernel: offset of first byte in class from start of range, -1 if
+ * none.
+ */
+#define SCAN_FIND	1
+/**
+ * @def SCAN_RUNS
+ * Scan kernel: number of runs of consecutive bytes in class, e.g. words if
+ * class is made of all bytes but separators.
+ */
+#define SCAN_RUNS	2
+/**
+ * @def SCAN_SUM
+ * Scan kernel: sum of elements, unsigned bytes or 4-byte integers.
+ */
+#define SCAN_SUM	3
+/**
+ * @def SCAN_MINMAX
+ * Scan kernel: smallest and largest element, unsigned bytes or 4-byte
+ * integers.
+ */
+#define SCAN_MINMAX	4
+/**
+ * @def SCANSET
+ * Size in bytes of the class mask following arguments of SCAN requests whose
+ * kernel works on bytes.
+ */
+#define SCANSET		32
+/**
+ * @def SCANREPLY
+ * Number of 4-byte fields of a SCAN reply: blocks scanned, value high and
+ * low, min, max and flags.
+ */
+#define SCANREPLY	6
+/**
+ * @def SCAN_FIRST
+ * Scan reply flag: first byte of range is in class.
+ */
+#define SCAN_FIRST	0x1
+/**
+ * @def SCAN_LAST
+ * Scan reply flag: last byte of range is in class.
+ */
+#define SCAN_LAST	0x2
+
+/**
+ * @def CAP_RANGE
+ * Capability: READ_RANGE and WRITE_RANGE requests.
+ */
+#define CAP_RANGE	0x1
+/**
+ * @def CAP_VERSIONED
+ * Capability: VUPDATE, VWRITE and VWAIT requests, i.e. replicated blocks.
+ */
+#define CAP_VERSIONED	0x2
+/**
+ * @def CAP_MIGRATE
+ * Capability: MIGRATE requests and REDIRECT replies.
+ */
+#define CAP_MIGRATE	0x4
+/**
+ * @def CAP_STATS
+ * Capability: STATS requests.
+ */
+#define CAP_STATS	0x8
+/**
+ * @def CAP_SCAN
+ * Capability: SCAN requests.
+ */
+#define CAP_SCAN	0x10
+/**
+ * @def CAP_STALE
+ * Capability: STALE requests.
+ */
+#define CAP_STALE	0x20
+/**
+ * @def CAP_PRIMARY
+ * Capability claimed in HELLO by a primary server on its connection to a
+ * replica server, which accepts REPLICATE and HEARTBEAT only on it. Refused
+ * by servers which are not replicas.
+ */
+#define CAP_PRIMARY	0x40
+/**
+ * @def CAPABILITIES
+ * Capabilities implemented by this version of server and client library.
+ */
+#define CAPABILITIES	(CAP_RANGE | CAP_VERSIONED | CAP_MIGRATE | \
+			 CAP_STATS | CAP_SCAN | CAP_STALE)
+
 #endif // MSG_H
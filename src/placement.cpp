@@ -0,0 +1,222 @@
+/**
+ * @file placement.cpp
+ * @brief File containing Placement class definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <algorithm>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "placement.h"
+
+/**
+ * Integer finalizer (from MurmurHash3). Every input bit affects every output
+ * bit, so that similar inputs are spread all over the hash ring.
+ * @param[in]	h Value to mix.
+ * @return	32 bit hash.
+ */
+static unsigned int mix (unsigned int h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+/**
+ * FNV-1a hash of a string, used to place servers on the hash ring.
+ * @param[in]	s String to hash.
+ * @return	32 bit hash.
+ */
+static unsigned int hash_name (const char *s)
+{
+	unsigned int h = 2166136261u;
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char) *s;
+		h *= 16777619u;
+	}
+	return mix (h);
+}
+
+Placement::Placement ()
+{
+	mode = RANGE;
+}
+
+int Placement::set_mode (char *name)
+{
+	if (strcmp (name, "range") == 0)
+		mode = RANGE;
+	else if (strcmp (name, "stripe") == 0)
+		mode = STRIPE;
+	else if (strcmp (name, "hash") == 0)
+		mode = HASH;
+	else
+		return -1;
+
+	return 0;
+}
+
+int Placement::get_mode ()
+{
+	return mode;
+}
+
+int Placement::add_server (char *name, block_id first, block_id last)
+{
+	int index = firsts.size ();
+	firsts.push_back (first);
+	lasts.push_back (last);
+	ranges.insert (upper_bound (ranges.begin (), ranges.end (),
+				    make_pair (first, index)),
+		       make_pair (first, index));
+
+	char point[100];
+	for (int i = 0; i < VNODES; i++) {
+		snprintf (point, sizeof(point), "%s#%d", name, i);
+		ring.push_back (make_pair (hash_name (point), index));
+	}
+	sort (ring.begin (), ring.end ());
+
+	return index;
+}
+
+int Placement::owner (block_id ID)
+{
+	int n = firsts.size ();
+	if (n == 0)
+		return -1;
+
+	if (!moves.empty ()) {
+		// last moved range starting at or before ID
+		map<block_id, pair<block_id, int> >::iterator m;
+		m = moves.upper_bound (ID);
+		if (m != moves.begin ()) {
+			--m;
+			if (ID <= m->second.first)
+				return m->second.second;
+		}
+	}
+
+	int index;
+	if (mode == RANGE) {
+		// last range starting at or before ID
+		vector<pair<block_id, int> >::iterator it;
+		it = upper_bound (ranges.begin (), ranges.end (),
+				  make_pair (ID, n));
+		if (it == ranges.begin ())
+			return -1;
+		index = (--it)->second;
+	} else if (mode == STRIPE) {
+		index = ID % n;
+		if (index < 0)
+			index += n;
+	} else {
+		// first point following the hash of ID, wrapping around. High
+		// half is folded in, ids below 2^32 hash as they always did
+		vector<pair<unsigned int, int> >::iterator it;
+		unsigned int h = mix ((unsigned int) (ID ^ (ID >> 32)));
+		it = lower_bound (ring.begin (), ring.end (),
+				  make_pair (h, -1));
+		if (it == ring.end ())
+			it = ring.begin ();
+		index = it->second;
+	}
+
+	// ID= range bounds the ids a server accepts
+	if (ID < firsts[index] || ID > lasts[index])
+		return -1;
+	return index;
+}
+
+void Placement::move (block_id first, block_id last, int index)
+{
+	// cut away moved ranges overlapping [first, last]
+	map<block_id, pair<block_id, int> >::iterator m;
+	m = moves.upper_bound (first);
+	if (m != moves.begin ())
+		--m;
+	while (m != moves.end () && m->first <= last) {
+		block_id f = m->first;
+		block_id l = m->second.first;
+		int i = m->second.second;
+		if (l < first) {
+			m++;
+			continue;
+		}
+		moves.erase (m++);
+		if (f < first)
+			moves[f] = make_pair (first - 1, i);
+		if (l > last)
+			moves[last + 1] = make_pair (l, i);
+	}
+
+	// merge with adjacent ranges moved to the same server
+	m = moves.find (last + 1);
+	if (last < LLONG_MAX && m != moves.end () &&
+	    m->second.second == index) {
+		last = m->second.first;
+		moves.erase (m);
+	}
+	m = moves.lower_bound (first);
+	if (m != moves.begin ()) {
+		--m;
+		if (m->second.first == first - 1 && m->second.second == index) {
+			m->second.first = last;
+			return;
+		}
+	}
+	moves[first] = make_pair (last, index);
+}
+
+int Placement::size ()
+{
+	return firsts.size ();
+}
+
+int Placement::load (char *config_file)
+{
+	FILE *fp = fopen (config_file, "r");
+	if (fp == NULL)
+		return -1;
+
+	char s[81];
+	char address[81] = "";
+	char name[200];
+	int port = 0;
+
+	while (fgets (s, 80, fp) != NULL) {
+		if (s[0] == '#')
+			continue;
+		s[strcspn (s, "\r\n")] = '\0';
+		if (strstr (s, "Placement=") != NULL) {
+			if (set_mode (&s[10]) == -1) {
+				fclose (fp);
+				return -1;
+			}
+		} else if (strstr (s, "Address=") != NULL) {
+			strcpy (address, &s[8]);
+		} else if (strstr (s, "Port=") != NULL) {
+			port = atoi (&s[5]);
+		} else if (strstr (s, "ID=") != NULL) {
+			char *q = strchr (&s[3], '-');
+			if (q == NULL) {
+				fclose (fp);
+				return -1;
+			}
+			snprintf (name, sizeof(name), "%s:%d", address, port);
+			add_server (name, strtoll (&s[3], NULL, 10),
+				    strtoll (q + 1, NULL, 10));
+		}
+	}
+
+	fclose (fp);
+	return 0;
+}
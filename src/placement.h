@@ -0,0 +1,158 @@
+/**
+ * @file placement.h
+ * @brief Header file containing Placement class declaration.
+ *
+ * A Placement object tells which server owns a block. It is shared by servers
+ * and client library, so both agree on where blocks are.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <map>
+#include <vector>
+#include "msg.h"
+using namespace std;
+
+/**
+ * @def RANGE
+ * Range placement: each server owns the contiguous range listed in its ID=
+ * line.
+ */
+#define RANGE		0
+/**
+ * @def STRIPE
+ * Striped placement: block ID is owned by server ID mod N.
+ */
+#define STRIPE		1
+/**
+ * @def HASH
+ * Consistent hashing placement: block ID is owned by the server whose point on
+ * the hash ring follows the hash of ID.
+ */
+#define HASH		2
+
+/**
+ * @def VNODES
+ * Number of points each server has on the hash ring.
+ */
+#define VNODES		64
+
+/**
+ * @class Placement placement.h "placement.h"
+ * @brief Maps block ids to servers.
+ *
+ * Servers are numbered in the order they appear in configuration file. With
+ * RANGE placement a server owns the blocks in its ID= range. With STRIPE and
+ * HASH placements the ID= range only bounds the ids a server accepts, and
+ * blocks are spread among all servers, so that sequential scans and hot
+ * regions hit every server. With HASH placement adding a server moves only
+ * about 1/N of the blocks, because a server is placed on the ring by its
+ * address and port, not by its position in configuration file.
+ *
+ * Blocks moved away from their placement (see DM::migrate()) are recorded as
+ * ranges with a new owner, which take precedence over placement mode. Lookups
+ * take O(log N) time and memory does not depend on the number of blocks.
+ */
+class Placement {
+
+	/**
+	 * Placement mode: RANGE, STRIPE or HASH.
+	 */
+	int mode;
+
+	/**
+	 * First block id of each server's ID= range.
+	 */
+	vector<block_id> firsts;
+
+	/**
+	 * Last block id of each server's ID= range.
+	 */
+	vector<block_id> lasts;
+
+	/**
+	 * ID= ranges sorted by first block id. Each entry is the first block
+	 * id of a range and the server owning it. Used by RANGE placement,
+	 * ranges must not overlap.
+	 */
+	vector<pair<block_id, int> > ranges;
+
+	/**
+	 * Blocks moved away from their placement. Each entry maps the first
+	 * block id of a range to the last block id and the new owner. Ranges
+	 * do not overlap, adjacent ranges with the same owner are merged.
+	 */
+	map<block_id, pair<block_id, int> > moves;
+
+	/**
+	 * Hash ring, sorted by point. Each entry is a point and the server
+	 * owning it.
+	 */
+	vector<pair<unsigned int, int> > ring;
+public:
+	/**
+	 * Placement constructor. Mode is RANGE, no servers.
+	 * @return	No value is returned.
+	 */
+	Placement ();
+
+	/**
+	 * Sets placement mode.
+	 * @param[in]	name Mode name: "range", "stripe" or "hash".
+	 * @return	0 on success, -1 on error (unknown mode).
+	 */
+	int set_mode (char *name);
+
+	/**
+	 * Returns placement mode.
+	 * @return	RANGE, STRIPE or HASH.
+	 */
+	int get_mode ();
+
+	/**
+	 * Adds a server. Servers must be added in configuration file order.
+	 * @param[in]	name Server name, "address:port".
+	 * @param[in]	first First block id of server's ID= range.
+	 * @param[in]	last Last block id of server's ID= range.
+	 * @return	Index of added server.
+	 */
+	int add_server (char *name, block_id first, block_id last);
+
+	/**
+	 * Finds the owner of a block.
+	 * @param[in]	ID Block id.
+	 * @return	Index of owner server, -1 if no server owns the block.
+	 */
+	int owner (block_id ID);
+
+	/**
+	 * Records that blocks in [first, last] are now owned by a server,
+	 * whatever placement mode says.
+	 * @param[in]	first First block id.
+	 * @param[in]	last Last block id.
+	 * @param[in]	index Index of new owner server.
+	 * @return	No value is returned.
+	 */
+	void move (block_id first, block_id last, int index);
+
+	/**
+	 * Returns the number of servers.
+	 * @return	Number of servers.
+	 */
+	int size ();
+
+	/**
+	 * Reads placement mode and servers from a configuration file, as
+	 * DM_client::dm_init() does.
+	 * @param[in]	config_file Path to configuration file.
+	 * @return	0 on success, -1 on error.
+	 */
+	int load (char *config_file);
+};
+
+#endif // PLACEMENT_H
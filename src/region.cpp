@@ -0,0 +1,201 @@
+/**
+ * @file region.cpp
+ * @brief File containing Region class definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "region.h"
+
+/**
+ * Regions tracked by the fault handler. Read by the handler without locks, a
+ * slot is cleared before its region is freed.
+ */
+static Region * volatile tracked[MAXREGIONS];
+
+/**
+ * Mutex protecting changes to tracked and installed.
+ */
+static pthread_mutex_t tracked_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * True once the fault handler has been installed.
+ */
+static bool installed = false;
+
+/**
+ * Action for SIGSEGV before the fault handler was installed.
+ */
+static struct sigaction previous;
+
+Region::Region ()
+{
+	start = NULL;
+	length = 0;
+	page = sysconf (_SC_PAGESIZE);
+	first = 0;
+	blocks = 0;
+	dim = 0;
+	dirty = NULL;
+	slot = -1;
+}
+
+Region::~Region ()
+{
+	if (slot != -1) {
+		pthread_mutex_lock (&tracked_mutex);
+		tracked[slot] = NULL;
+		pthread_mutex_unlock (&tracked_mutex);
+	}
+	if (start != NULL)
+		munmap (start, length);
+	delete[] dirty;
+}
+
+void Region::handler (int sig, siginfo_t *si, void *ctx)
+{
+	char *addr = (char *) si->si_addr;
+	for (int i = 0; i < MAXREGIONS; i++) {
+		Region *r = tracked[i];
+		if (r == NULL || addr < r->start ||
+		    addr >= r->start + r->length)
+			continue;
+
+		// first write to a clean page
+		size_t p = (addr - r->start) / r->page;
+		r->dirty[p] = 1;
+		mprotect (r->start + p * r->page, r->page,
+			  PROT_READ | PROT_WRITE);
+		return;
+	}
+
+	// not a region: fault handled as if handler was not installed
+	if (previous.sa_flags & SA_SIGINFO) {
+		previous.sa_sigaction (sig, si, ctx);
+	} else if (previous.sa_handler == SIG_DFL ||
+		   previous.sa_handler == SIG_IGN) {
+		// faulting instruction is executed again, with default action
+		signal (sig, SIG_DFL);
+	} else {
+		previous.sa_handler (sig);
+	}
+}
+
+int Region::init (block_id first_block, int n, int block_dim)
+{
+	if (start != NULL || n <= 0 || block_dim <= 0)
+		return -1;
+
+	first = first_block;
+	blocks = n;
+	dim = block_dim;
+	length = (((size_t) n * dim + page - 1) / page) * page;
+	void *mem = mmap (NULL, length, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return -1;
+	start = (char *) mem;
+	dirty = new char[length / page];
+	memset ((void *) dirty, 0, length / page);
+
+	pthread_mutex_lock (&tracked_mutex);
+	if (!installed) {
+		struct sigaction sa;
+		memset (&sa, 0, sizeof(sa));
+		sa.sa_sigaction = handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset (&sa.sa_mask);
+		if (sigaction (SIGSEGV, &sa, &previous) == -1) {
+			pthread_mutex_unlock (&tracked_mutex);
+			return -1;
+		}
+		installed = true;
+	}
+	for (int i = 0; i < MAXREGIONS && slot == -1; i++) {
+		if (tracked[i] == NULL) {
+			slot = i;
+			tracked[i] = this;
+		}
+	}
+	pthread_mutex_unlock (&tracked_mutex);
+	if (slot == -1)
+		return -1;
+
+	return 0;
+}
+
+char *Region::address ()
+{
+	return start;
+}
+
+char *Region::block (int i)
+{
+	return start + (size_t) i * dim;
+}
+
+block_id Region::first_block ()
+{
+	return first;
+}
+
+int Region::size ()
+{
+	return blocks;
+}
+
+int Region::protect ()
+{
+	size_t pages = length / page;
+	for (size_t p = 0; p < pages; p++)
+		if (!dirty[p] && mprotect (start + p * page, page,
+					   PROT_READ) == -1)
+			return -1;
+
+	return 0;
+}
+
+int Region::unprotect ()
+{
+	return mprotect (start, length, PROT_READ | PROT_WRITE);
+}
+
+void Region::collect (vector<block_id> *ids)
+{
+	size_t pages = length / page;
+	int last = -1;
+	for (size_t p = 0; p < pages; p++) {
+		if (!dirty[p])
+			continue;
+
+		// page is clean from now on: a write after protection is
+		// caught again, a write before it is sent with the block
+		dirty[p] = 0;
+		mprotect (start + p * page, page, PROT_READ);
+
+		int b = (p * page) / dim;
+		int e = ((p + 1) * page - 1) / dim;
+		if (b <= last)
+			b = last + 1;
+		if (e >= blocks)
+			e = blocks - 1;
+		for (int i = b; i <= e; i++)
+			ids->push_back (first + i);
+		if (e > last)
+			last = e;
+	}
+}
+
+void Region::mark (block_id ID)
+{
+	size_t b = (size_t) (ID - first) * dim;
+	for (size_t p = b / page; p <= (b + dim - 1) / page; p++)
+		dirty[p] = 1;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file region.h
+ * @brief Header file containing Region class declaration.
+ *
+ * A Region object is the local memory of a range of blocks mapped by a
+ * client, in which writes are tracked.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <vector>
+#include "msg.h"
+using namespace std;
+
+/**
+ * @def MAXREGIONS
+ * Maximum number of regions tracked at the same time in a process.
+ */
+#define MAXREGIONS	64
+
+/**
+ * @class Region region.h "region.h"
+ * @brief Page aligned local memory of a block range, with dirty tracking.
+ *
+ * Blocks are stored back to back in memory allocated with mmap. Clean pages
+ * are write protected: the first write to a page raises SIGSEGV, which is
+ * caught by a handler shared by all regions of the process. The handler marks
+ * the page dirty and makes it writable, so that following writes run at full
+ * speed. Faults outside regions are passed to the previous handler.
+ *
+ * Dirty tracking works at page granularity: a block is dirty if one of the
+ * pages it overlaps is dirty. Only writes by the process are caught; the
+ * kernel writing into a protected page (e.g. recv()) fails instead, so
+ * regions are made writable while data is received into them.
+ */
+class Region {
+
+	/**
+	 * Start of memory, page aligned.
+	 */
+	char *start;
+
+	/**
+	 * Size of memory in bytes, a multiple of page size.
+	 */
+	size_t length;
+
+	/**
+	 * Page size.
+	 */
+	size_t page;
+
+	/**
+	 * First block id.
+	 */
+	block_id first;
+
+	/**
+	 * Number of blocks.
+	 */
+	int blocks;
+
+	/**
+	 * Block dimension.
+	 */
+	int dim;
+
+	/**
+	 * One flag per page, set by the fault handler.
+	 */
+	volatile char *dirty;
+
+	/**
+	 * Slot of region in fault handler's table, -1 if not tracked.
+	 */
+	int slot;
+
+	/**
+	 * Fault handler.
+	 * @param[in]	sig Signal number.
+	 * @param[in]	si Signal information, holding the fault address.
+	 * @param[in]	ctx Context.
+	 */
+	static void handler (int sig, siginfo_t *si, void *ctx);
+public:
+	/**
+	 * Region constructor. No memory is allocated.
+	 * @return	No value is returned.
+	 */
+	Region ();
+
+	/**
+	 * Region destructor. Stops tracking and frees memory.
+	 * @return	No value is returned.
+	 */
+	~Region ();
+
+	/**
+	 * Allocates memory for a block range and starts tracking it. Memory
+	 * is writable until protect() is called.
+	 * @param[in]	first_block First block id.
+	 * @param[in]	n Number of blocks.
+	 * @param[in]	block_dim Block dimension.
+	 * @return	0 on success, -1 on error.
+	 */
+	int init (block_id first_block, int n, int block_dim);
+
+	/**
+	 * Returns start of memory.
+	 * @return	Start of memory.
+	 */
+	char *address ();
+
+	/**
+	 * Returns the local address of a block.
+	 * @param[in]	i Block index in region, from 0.
+	 * @return	Local address.
+	 */
+	char *block (int i);
+
+	/**
+	 * Returns first block id.
+	 * @return	First block id.
+	 */
+	block_id first_block ();
+
+	/**
+	 * Returns the number of blocks.
+	 * @return	Number of blocks.
+	 */
+	int size ();
+
+	/**
+	 * Write protects all clean pages.
+	 * @return	0 on success, -1 on error.
+	 */
+	int protect ();
+
+	/**
+	 * Makes all pages writable, without marking them dirty.
+	 * @return	0 on success, -1 on error.
+	 */
+	int unprotect ();
+
+	/**
+	 * Finds dirty blocks, then marks their pages clean and write protects
+	 * them. A write following this call is caught again.
+	 * @param[out]	ids Ids of dirty blocks.
+	 * @return	No value is returned.
+	 */
+	void collect (vector<block_id> *ids);
+
+	/**
+	 * Marks the pages of a block dirty, e.g. because its write failed.
+	 * @param[in]	ID Block id.
+	 * @return	No value is returned.
+	 */
+	void mark (block_id ID);
+};
+
+#endif // REGION_H
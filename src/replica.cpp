@@ -0,0 +1,121 @@
+/**
+ * @file replica.cpp
+ * @brief File containing Replicator class definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <stdio.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "block.h"
+#include "msg.h"
+#include "replica.h"
+#include "utility.h"
+
+Replicator::Replicator ()
+{
+	pthread_mutex_init (&mutex, 0);
+}
+
+Replicator::~Replicator ()
+{
+	for (unsigned int i = 0; i < replicas.size (); i++)
+		close (replicas[i]);
+}
+
+int Replicator::add (char *address, int port)
+{
+	sockaddr_in r_addr;
+	memset ((void *) &r_addr, 0, sizeof(sockaddr_in));
+	r_addr.sin_family = AF_INET;
+	r_addr.sin_port = htons (port);
+	if (inet_pton (AF_INET, address, &r_addr.sin_addr) != 1)
+		return -1;
+
+	int sd = socket (AF_INET, SOCK_STREAM, 0);
+	if (sd == -1)
+		return -1;
+
+	int ret = connect (sd, (sockaddr *) &r_addr, sizeof(sockaddr_in));
+	if (ret == -1) {
+		close (sd);
+		return -1;
+	}
+
+	// introduce this server as the primary: <HELLO, token high, token
+	// low, block size, capabilities>. A server which is not a replica
+	// refuses it
+	Message<4> msg (HELLO, 0);
+	msg.set_id (0, 0);
+	msg.set (2, DIMBLOCK);
+	msg.set (3, CAP_PRIMARY);
+	frame f;
+	int res[2];
+	if (send_msg (sd, msg.data (), msg.size ()) == -1 ||
+	    recv_frame (sd, &f) != 0 || f.length != sizeof(res) ||
+	    recv_msg (sd, res, sizeof(res)) == -1 || f.opcode != OK ||
+	    !(ntohl (res[1]) & CAP_PRIMARY)) {
+		close (sd);
+		return -1;
+	}
+
+	pthread_mutex_lock (&mutex);
+	replicas.push_back (sd);
+	pthread_mutex_unlock (&mutex);
+
+	return 0;
+}
+
+bool Replicator::empty ()
+{
+	return replicas.empty ();
+}
+
+void Replicator::push (block_id ID, int version, char *buf)
+{
+	Message<3> msg (REPLICATE, (int) ID, DIMBLOCK);
+	msg.set_id (0, ID);
+	msg.set (2, version);
+
+	pthread_mutex_lock (&mutex);
+
+	for (unsigned int i = 0; i < replicas.size (); ) {
+		int ret = send_msgv (replicas[i], msg.data (), msg.size (), buf,
+				     DIMBLOCK);
+		if (ret == -1) {
+			lose (i);
+			continue;
+		}
+		i++;
+	}
+
+	pthread_mutex_unlock (&mutex);
+}
+
+void Replicator::beat ()
+{
+	pthread_mutex_lock (&mutex);
+
+	for (unsigned int i = 0; i < replicas.size (); ) {
+		if (send_frame (replicas[i], HEARTBEAT, 0, NULL, 0) == -1) {
+			lose (i);
+			continue;
+		}
+		i++;
+	}
+
+	pthread_mutex_unlock (&mutex);
+}
+
+void Replicator::lose (unsigned int i)
+{
+	// replica is unreachable: it won't receive any other update. Closing
+	// the connection tells it at once, otherwise it stops serving reads
+	// when heartbeats stop coming
+	printf ("Server: Replica lost, no more updates sent\n");
+	close (replicas[i]);
+	replicas.erase (replicas.begin () + i);
+}
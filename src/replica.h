@@ -0,0 +1,95 @@
+/**
+ * @file replica.h
+ * @brief Header file containing Replicator class declaration.
+ *
+ * A Replicator object streams every write performed on a primary Distributed
+ * Memory server to its replica servers.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <vector>
+#include <pthread.h>
+using namespace std;
+
+/**
+ * @class Replicator replica.h "replica.h"
+ * @brief Streams block writes from a primary server to its replicas.
+ *
+ * Each replica is reached through a persistent connection, opened when the
+ * primary server starts, so replicas must be started before their primary.
+ * Every message is <REPLICATE, ID, version, data>, replicas don't reply. A
+ * replica which cannot be reached anymore is dropped; it stops serving reads
+ * when it misses heartbeats (see beat()).
+ * Writes performed by several threads are sent in mutual exclusion, so
+ * messages are never interleaved on a connection.
+ */
+class Replicator {
+
+	/**
+	 * Socket descriptors of connections with replicas.
+	 */
+	vector<int> replicas;
+
+	/**
+	 * Mutual exclusion semaphore.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Drops an unreachable replica. Caller holds mutex.
+	 * @param[in]	i Index of replica.
+	 * @return	No value is returned.
+	 */
+	void lose (unsigned int i);
+public:
+	/**
+	 * Replicator constructor. No replicas are set.
+	 * @return	No value is returned.
+	 */
+	Replicator ();
+
+	/**
+	 * Replicator destructor. Closes connections with replicas.
+	 * @return	No value is returned.
+	 */
+	~Replicator ();
+
+	/**
+	 * Opens connection with a replica server, and introduces this server
+	 * as its primary.
+	 * @param[in]	address Replica address in dotted notation.
+	 * @param[in]	port Replica port.
+	 * @return	0 on success, -1 on error.
+	 */
+	int add (char *address, int port);
+
+	/**
+	 * Checks whether some replica is set.
+	 * @return	true if no replica is set, false otherwise.
+	 */
+	bool empty ();
+
+	/**
+	 * Sends block content to all replicas.
+	 * @param[in]	ID Block ID.
+	 * @param[in]	version Block version.
+	 * @param[in]	buf Block data.
+	 * @return	No value is returned.
+	 */
+	void push (block_id ID, int version, char *buf);
+
+	/**
+	 * Sends a heartbeat to all replicas, so that they keep serving reads
+	 * while no write happens.
+	 * @return	No value is returned.
+	 */
+	void beat ();
+};
+
+#endif // REPLICA_H
@@ -0,0 +1,213 @@
+/**
+ * @file scan.cpp
+ * @brief File containing Scan class definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <string.h>
+#include "frame.h"
+#include "scan.h"
+
+Scan::Scan (int k, int operand, const unsigned char *set)
+{
+	kernel = k;
+	width = operand;
+	few = -1;
+	outside = false;
+	value = kernel == SCAN_FIND ? -1 : 0;
+	low = 0;
+	high = 0;
+	empty = true;
+	scanned = 0;
+	flags = 0;
+	if (kernel != SCAN_COUNT && kernel != SCAN_FIND && kernel != SCAN_RUNS)
+		return;
+
+	int members = 0;
+	for (int b = 0; b < 256; b++) {
+		table[b] = (set[b / 8] >> (b % 8)) & 1;
+		members += table[b];
+	}
+#ifdef __SSE2__
+	// a small class, or the complement of a large one, is compared byte
+	// by byte: whitespace and its complement take four comparisons
+	outside = members > 128;
+	if ((outside ? 256 - members : members) > SCANFEW)
+		return;
+	few = 0;
+	for (int b = 0; b < 256; b++)
+		if (table[b] != outside)
+			needles[few++] = _mm_set1_epi8 ((char) b);
+#endif
+}
+
+unsigned int Scan::classify (const unsigned char *p, int n)
+{
+	unsigned int bits = 0;
+#ifdef __SSE2__
+	if (few != -1 && n == 16) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *) p);
+		__m128i m = _mm_setzero_si128 ();
+		for (int i = 0; i < few; i++)
+			m = _mm_or_si128 (m, _mm_cmpeq_epi8 (v, needles[i]));
+		bits = _mm_movemask_epi8 (m);
+		return outside ? ~bits & 0xffff : bits;
+	}
+#endif
+	for (int i = 0; i < n; i++)
+		bits |= table[p[i]] << i;
+	return bits;
+}
+
+void Scan::extend (int x)
+{
+	if (empty || x < low)
+		low = x;
+	if (empty || x > high)
+		high = x;
+	empty = false;
+}
+
+void Scan::bytes (const unsigned char *p, int n)
+{
+	int i = 0;
+#ifdef __SSE2__
+	if (kernel == SCAN_SUM) {
+		// sums of absolute differences from zero: two 64-bit sums of
+		// eight bytes each
+		__m128i zero = _mm_setzero_si128 ();
+		__m128i acc = zero;
+		for (; i + 16 <= n; i += 16) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+			acc = _mm_add_epi64 (acc, _mm_sad_epu8 (v, zero));
+		}
+		long long part[2];
+		_mm_storeu_si128 ((__m128i *) part, acc);
+		value += part[0] + part[1];
+	} else if (n >= 16) {
+		__m128i lo = _mm_loadu_si128 ((const __m128i *) p);
+		__m128i hi = lo;
+		for (i = 16; i + 16 <= n; i += 16) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+			lo = _mm_min_epu8 (lo, v);
+			hi = _mm_max_epu8 (hi, v);
+		}
+		unsigned char l[16], h[16];
+		_mm_storeu_si128 ((__m128i *) l, lo);
+		_mm_storeu_si128 ((__m128i *) h, hi);
+		for (int j = 0; j < 16; j++) {
+			extend (l[j]);
+			extend (h[j]);
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		if (kernel == SCAN_SUM)
+			value += p[i];
+		else
+			extend (p[i]);
+	}
+}
+
+void Scan::integers (const unsigned char *p, int n)
+{
+	int i = 0;
+#ifdef __SSE2__
+	if (kernel == SCAN_SUM) {
+		// integers are sign extended to 64 bits, so sums don't wrap
+		__m128i acc = _mm_setzero_si128 ();
+		for (; i + 16 <= n; i += 16) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+			__m128i sign = _mm_srai_epi32 (v, 31);
+			acc = _mm_add_epi64 (acc, _mm_unpacklo_epi32 (v, sign));
+			acc = _mm_add_epi64 (acc, _mm_unpackhi_epi32 (v, sign));
+		}
+		long long part[2];
+		_mm_storeu_si128 ((__m128i *) part, acc);
+		value += part[0] + part[1];
+	} else if (n >= 16) {
+		// SSE2 has no signed minimum and maximum of 32-bit lanes:
+		// comparisons select them
+		__m128i lo = _mm_loadu_si128 ((const __m128i *) p);
+		__m128i hi = lo;
+		for (i = 16; i + 16 <= n; i += 16) {
+			__m128i v = _mm_loadu_si128 ((const __m128i *) (p + i));
+			__m128i lt = _mm_cmplt_epi32 (v, lo);
+			lo = _mm_or_si128 (_mm_and_si128 (lt, v),
+					   _mm_andnot_si128 (lt, lo));
+			__m128i gt = _mm_cmpgt_epi32 (v, hi);
+			hi = _mm_or_si128 (_mm_and_si128 (gt, v),
+					   _mm_andnot_si128 (gt, hi));
+		}
+		int l[4], h[4];
+		_mm_storeu_si128 ((__m128i *) l, lo);
+		_mm_storeu_si128 ((__m128i *) h, hi);
+		for (int j = 0; j < 4; j++) {
+			extend (l[j]);
+			extend (h[j]);
+		}
+	}
+#endif
+	for (; i + (int) sizeof(int) <= n; i += sizeof(int)) {
+		int x;
+		memcpy (&x, p + i, sizeof(int));
+		if (kernel == SCAN_SUM)
+			value += x;
+		else
+			extend (x);
+	}
+}
+
+void Scan::run (const char *data, int length)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	if (kernel == SCAN_SUM || kernel == SCAN_MINMAX) {
+		if (width == sizeof(int))
+			integers (p, length);
+		else
+			bytes (p, length);
+		scanned += length;
+		return;
+	}
+	if (kernel == SCAN_FIND && value != -1)
+		// found in an earlier block
+		return;
+
+	for (int i = 0; i < length; i += 16) {
+		int n = length - i < 16 ? length - i : 16;
+		unsigned int bits = classify (p + i, n);
+		if (kernel == SCAN_COUNT) {
+			value += __builtin_popcount (bits);
+		} else if (kernel == SCAN_FIND) {
+			if (bits != 0) {
+				value = scanned + i + __builtin_ctz (bits);
+				return;
+			}
+		} else {
+			// a run starts at a byte in class whose predecessor,
+			// possibly in the previous block, is not
+			if (scanned + i == 0 && (bits & 1))
+				flags |= SCAN_FIRST;
+			unsigned int prev = (flags & SCAN_LAST) ? 1 : 0;
+			value += __builtin_popcount (bits &
+						     ~(bits << 1 | prev));
+			if ((bits >> (n - 1)) & 1)
+				flags |= SCAN_LAST;
+			else
+				flags &= ~SCAN_LAST;
+		}
+	}
+	scanned += length;
+}
+
+void Scan::store (void *buffer, int i)
+{
+	put_int (buffer, i, (int) (value >> 32));
+	put_int (buffer, i + 1, (int) value);
+	put_int (buffer, i + 2, low);
+	put_int (buffer, i + 3, high);
+	put_int (buffer, i + 4, flags);
+}
@@ -0,0 +1,154 @@
+/**
+ * @file scan.h
+ * @brief Header file containing Scan class declaration.
+ *
+ * A Scan runs a kernel of a SCAN request over the blocks of a range, one
+ * block at a time, in block order. Kernels on bytes test membership of each
+ * byte in a class, given as a bit mask of SCANSET bytes; kernels on elements
+ * read bytes or 4-byte integers in host byte order. Kernels are vectorized
+ * with SSE2 where available.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef SCAN_H
+#define SCAN_H
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "msg.h"
+
+/**
+ * @def SCANFEW
+ * Classes of at most SCANFEW bytes, or of all bytes but SCANFEW, are tested
+ * with one vector comparison per byte of class instead of a table.
+ */
+#define SCANFEW		4
+
+/**
+ * @class Scan scan.h "scan.h"
+ * @brief State of a kernel run over a range of blocks.
+ */
+class Scan {
+
+	/**
+	 * Kernel, SCAN_COUNT to SCAN_MINMAX.
+	 */
+	int kernel;
+
+	/**
+	 * Element size in bytes of SCAN_SUM and SCAN_MINMAX, 1 or 4.
+	 */
+	int width;
+
+	/**
+	 * Class membership of each byte value, 1 if in class.
+	 */
+	unsigned char table[256];
+
+	/**
+	 * Number of bytes compared, -1 if class is tested with table.
+	 */
+	int few;
+
+	/**
+	 * True if compared bytes are those out of class.
+	 */
+	bool outside;
+
+#ifdef __SSE2__
+	/**
+	 * Compared bytes, repeated in every lane.
+	 */
+	__m128i needles[SCANFEW];
+#endif
+
+	/**
+	 * Count, sum, offset of first byte found (-1 if none) or number of
+	 * runs, depending on kernel.
+	 */
+	long long value;
+
+	/**
+	 * Smallest and largest element.
+	 */
+	int low, high;
+
+	/**
+	 * True until an element has been scanned.
+	 */
+	bool empty;
+
+	/**
+	 * Bytes scanned so far.
+	 */
+	long long scanned;
+
+	/**
+	 * SCAN_FIRST and SCAN_LAST flags.
+	 */
+	int flags;
+
+	/**
+	 * Tells which of up to 16 bytes are in class.
+	 * @param[in]	p First byte.
+	 * @param[in]	n Number of bytes, at most 16.
+	 * @return	Bit i set if byte i is in class.
+	 */
+	unsigned int classify (const unsigned char *p, int n);
+
+	/**
+	 * Takes an element into smallest and largest.
+	 * @param[in]	x Element.
+	 * @return	No value is returned.
+	 */
+	void extend (int x);
+
+	/**
+	 * Runs SCAN_SUM or SCAN_MINMAX on bytes.
+	 * @param[in]	p Data.
+	 * @param[in]	n Number of bytes.
+	 * @return	No value is returned.
+	 */
+	void bytes (const unsigned char *p, int n);
+
+	/**
+	 * Runs SCAN_SUM or SCAN_MINMAX on 4-byte integers.
+	 * @param[in]	p Data.
+	 * @param[in]	n Number of bytes, a multiple of 4.
+	 * @return	No value is returned.
+	 */
+	void integers (const unsigned char *p, int n);
+public:
+	/**
+	 * Scan constructor. Arguments must have been checked (see SCAN).
+	 * @param[in]	k Kernel.
+	 * @param[in]	operand Element size for SCAN_SUM and SCAN_MINMAX.
+	 * @param[in]	set Class mask for kernels on bytes, bit b of byte
+	 *		b / 8 set if byte value b is in class.
+	 * @return	No value is returned.
+	 */
+	Scan (int k, int operand, const unsigned char *set);
+
+	/**
+	 * Runs kernel over data following the data already scanned.
+	 * @param[in]	data Data.
+	 * @param[in]	length Number of bytes.
+	 * @return	No value is returned.
+	 */
+	void run (const char *data, int length);
+
+	/**
+	 * Stores result as fields of a SCAN reply: value high and low, min,
+	 * max and flags.
+	 * @param[out]	buffer Start of fields.
+	 * @param[in]	i Index of first field.
+	 * @return	No value is returned.
+	 */
+	void store (void *buffer, int i);
+};
+
+#endif // SCAN_H
@@ -0,0 +1,202 @@
+/**
+ * @file stats.cpp
+ * @brief File containing ThreadStats and Stats classes definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <functional>
+#include "stats.h"
+
+/**
+ * Names of request types in reports, NULL for reply types.
+ */
+static const char *names[NOPCODES] = {
+	"map", "unmap", "update", "write", "wait", NULL, NULL, NULL, NULL,
+	NULL, "read_range", "write_range", "replicate", "vupdate", "vwrite",
+	"vwait", "hello", "migrate", "move", NULL, "stats", "scan", "stale",
+	"heartbeat", NULL, "adopt"
+};
+
+unsigned long long monotonic_ns ()
+{
+	timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+ThreadStats::ThreadStats ()
+{
+	pthread_mutex_init (&mutex, 0);
+	memset (counts, 0, sizeof(counts));
+	memset (errors, 0, sizeof(errors));
+	bytes_in = 0;
+	bytes_out = 0;
+	pending = 0;
+	failed = false;
+	last = -1;
+}
+
+ThreadStats::~ThreadStats ()
+{
+	pthread_mutex_destroy (&mutex);
+}
+
+void ThreadStats::record (int opcode, int bytes, unsigned long long ns)
+{
+	pthread_mutex_lock (&mutex);
+	if (opcode >= 0 && opcode < NOPCODES) {
+		counts[opcode]++;
+		if (failed)
+			errors[opcode]++;
+		latency[opcode].add (ns);
+	}
+	bytes_in += bytes;
+	bytes_out += pending;
+	pthread_mutex_unlock (&mutex);
+
+	pending = 0;
+	failed = false;
+	last = -1;
+}
+
+void ThreadStats::merge (ThreadStats &t)
+{
+	for (int i = 0; i < NOPCODES; i++) {
+		counts[i] += t.counts[i];
+		errors[i] += t.errors[i];
+		latency[i].merge (t.latency[i]);
+	}
+	bytes_in += t.bytes_in;
+	bytes_out += t.bytes_out;
+}
+
+Stats::Stats ()
+{
+	pthread_mutex_init (&mutex, 0);
+	opened = 0;
+	start = monotonic_ns ();
+}
+
+Stats::~Stats ()
+{
+	pthread_mutex_destroy (&mutex);
+}
+
+ThreadStats *Stats::attach ()
+{
+	ThreadStats *t = new ThreadStats;
+	pthread_mutex_lock (&mutex);
+	threads.push_back (t);
+	opened++;
+	pthread_mutex_unlock (&mutex);
+	return t;
+}
+
+void Stats::detach (ThreadStats *t)
+{
+	pthread_mutex_lock (&mutex);
+	threads.remove (t);
+	pthread_mutex_lock (&t->mutex);
+	retired.merge (*t);
+	pthread_mutex_unlock (&t->mutex);
+	pthread_mutex_unlock (&mutex);
+	delete t;
+}
+
+void Stats::report (DM *mem, int top, string *out)
+{
+	// totals are collected in a private object, threads are locked one at
+	// a time and only while being copied
+	ThreadStats *total = new ThreadStats;
+	pthread_mutex_lock (&mutex);
+	total->merge (retired);
+	for (list<ThreadStats *>::iterator it = threads.begin ();
+	     it != threads.end (); it++) {
+		pthread_mutex_lock (&(*it)->mutex);
+		total->merge (**it);
+		pthread_mutex_unlock (&(*it)->mutex);
+	}
+	int open = threads.size ();
+	unsigned long long accepted = opened;
+	pthread_mutex_unlock (&mutex);
+
+	vector<block_activity> hot;
+	int waiters = mem->activity (top, &hot);
+	double uptime = (monotonic_ns () - start) / 1e9;
+
+	char line[256];
+	snprintf (line, sizeof(line), "uptime_s %.3f\nconnections_open %d\n"
+		  "connections_total %llu\nbytes_in %llu\nbytes_out %llu\n"
+		  "waiters %d\nwrites_unchanged %llu\nclients_suspended %d\n",
+		  uptime, open, accepted, total->bytes_in, total->bytes_out,
+		  waiters, mem->elided (), mem->suspended_clients ());
+	*out = line;
+	for (int i = 0; i < NOPCODES; i++) {
+		if (total->counts[i] == 0)
+			continue;
+		Histogram &h = total->latency[i];
+		snprintf (line, sizeof(line), "op %s count=%llu errors=%llu "
+			  "mean_us=%.2f p50_us=%.2f p99_us=%.2f p999_us=%.2f "
+			  "max_us=%.2f\n",
+			  names[i] != NULL ? names[i] : "other",
+			  total->counts[i], total->errors[i], h.mean () / 1e3,
+			  h.percentile (50) / 1e3, h.percentile (99) / 1e3,
+			  h.percentile (99.9) / 1e3, h.max () / 1e3);
+		*out += line;
+	}
+	for (unsigned int i = 0; i < hot.size (); i++) {
+		snprintf (line, sizeof(line), "block %lld reads=%llu "
+			  "writes=%llu reads_per_s=%.1f writes_per_s=%.1f\n",
+			  hot[i].ID, hot[i].reads, hot[i].writes,
+			  hot[i].reads / uptime, hot[i].writes / uptime);
+		*out += line;
+	}
+	delete total;
+
+	vector<block_contention> locks;
+	map<client_id, unsigned long long> culprits;
+	if (mem->contention (top, &locks, &culprits) == -1)
+		return;
+	for (unsigned int i = 0; i < locks.size (); i++) {
+		lock_profile &p = locks[i].profile;
+		// client which made others wait the most on this block
+		client_id worst = ANONYMOUS;
+		unsigned long long most = 0;
+		for (map<client_id, unsigned long long>::iterator
+		     it = p.blame.begin (); it != p.blame.end (); it++) {
+			if (it->second > most) {
+				worst = it->first;
+				most = it->second;
+			}
+		}
+		snprintf (line, sizeof(line), "lock %lld acquisitions=%llu "
+			  "contended=%llu wait_us=%.1f max_wait_us=%.1f "
+			  "mean_hold_us=%.2f max_hold_us=%.1f wakeups=%llu "
+			  "culprit=%lld\n", locks[i].ID, p.acquisitions,
+			  p.contended, p.wait_ns / 1e3, p.max_wait_ns / 1e3,
+			  p.sampled > 0 ? p.hold_ns / 1e3 / p.sampled : 0,
+			  p.max_hold_ns / 1e3, p.wakeups, worst);
+		*out += line;
+	}
+	vector<pair<unsigned long long, client_id> > ranked;
+	for (map<client_id, unsigned long long>::iterator
+	     it = culprits.begin (); it != culprits.end (); it++)
+		ranked.push_back (make_pair (it->second, it->first));
+	int n = (int) ranked.size () < top ? ranked.size () : top;
+	if (n <= 0)
+		return;
+	partial_sort (ranked.begin (), ranked.begin () + n, ranked.end (),
+		      greater<pair<unsigned long long, client_id> > ());
+	for (int i = 0; i < n; i++) {
+		snprintf (line, sizeof(line), "culprit %lld "
+			  "wait_caused_us=%.1f\n", ranked[i].second,
+			  ranked[i].first / 1e3);
+		*out += line;
+	}
+}
@@ -0,0 +1,226 @@
+/**
+ * @file stats.h
+ * @brief Header file containing ThreadStats and Stats classes declarations.
+ *
+ * Server metrics: every connection thread counts its requests, their errors,
+ * bytes and latencies in a ThreadStats object of its own, so that threads
+ * never contend. A Stats object collects them when a report is asked for.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <list>
+#include <string>
+#include <pthread.h>
+#include "dm.h"
+#include "histogram.h"
+#include "msg.h"
+using namespace std;
+
+/**
+ * @def NOPCODES
+ * Request types below NOPCODES are counted one by one.
+ */
+#define NOPCODES	26
+
+/**
+ * @class ThreadStats stats.h "stats.h"
+ * @brief Metrics of a connection thread.
+ *
+ * Only the owning thread updates a ThreadStats object. Its mutex is then
+ * never contended, except while a report is being made.
+ */
+class ThreadStats {
+
+	friend class Stats;
+
+	/**
+	 * Mutex protecting counters, latencies and bytes.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Requests of each type.
+	 */
+	unsigned long long counts[NOPCODES];
+
+	/**
+	 * Requests of each type replied with ERROR.
+	 */
+	unsigned long long errors[NOPCODES];
+
+	/**
+	 * Latency of requests of each type in nanoseconds, from request
+	 * received to reply sent.
+	 */
+	Histogram latency[NOPCODES];
+
+	/**
+	 * Bytes received.
+	 */
+	unsigned long long bytes_in;
+
+	/**
+	 * Bytes sent.
+	 */
+	unsigned long long bytes_out;
+
+	/**
+	 * Bytes of replies to current request, accessed by owning thread only.
+	 */
+	int pending;
+
+	/**
+	 * True if current request was replied with ERROR, accessed by owning
+	 * thread only.
+	 */
+	bool failed;
+
+	/**
+	 * Outcome of current request, accessed by owning thread only.
+	 */
+	int last;
+
+	/**
+	 * Adds the metrics of another thread. Caller must hold both mutexes.
+	 * @param[in]	t Thread metrics.
+	 * @return	No value is returned.
+	 */
+	void merge (ThreadStats &t);
+public:
+	/**
+	 * ThreadStats constructor. All counters are zero.
+	 * @return	No value is returned.
+	 */
+	ThreadStats ();
+
+	/**
+	 * ThreadStats destructor.
+	 * @return	No value is returned.
+	 */
+	~ThreadStats ();
+
+	/**
+	 * Notes a reply sent to current request.
+	 * @param[in]	opcode Reply type.
+	 * @param[in]	bytes Reply size in bytes, header included.
+	 * @param[in]	outcome Reply type, or reason of an error.
+	 * @return	No value is returned.
+	 */
+	void reply (int opcode, int bytes, int outcome)
+	{
+		pending += bytes;
+		if (opcode == ERROR)
+			failed = true;
+		last = outcome;
+	}
+
+	/**
+	 * Returns the outcome of current request, until it is recorded.
+	 * @return	Outcome of last reply, -1 if request had no reply.
+	 */
+	int outcome ()
+	{
+		return last;
+	}
+
+	/**
+	 * Counts a request once it has been served, with its replies.
+	 * @param[in]	opcode Request type.
+	 * @param[in]	bytes Request size in bytes, header included.
+	 * @param[in]	ns Time taken to serve request, in nanoseconds.
+	 * @return	No value is returned.
+	 */
+	void record (int opcode, int bytes, unsigned long long ns);
+};
+
+/**
+ * @class Stats stats.h "stats.h"
+ * @brief Server metrics, collected from connection threads.
+ */
+class Stats {
+
+	/**
+	 * Mutex protecting threads, retired and opened.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Metrics of running connection threads.
+	 */
+	list<ThreadStats *> threads;
+
+	/**
+	 * Metrics of connection threads already terminated.
+	 */
+	ThreadStats retired;
+
+	/**
+	 * Connections accepted since start.
+	 */
+	unsigned long long opened;
+
+	/**
+	 * Server start time, in nanoseconds.
+	 */
+	unsigned long long start;
+public:
+	/**
+	 * Stats constructor. Start time is now.
+	 * @return	No value is returned.
+	 */
+	Stats ();
+
+	/**
+	 * Stats destructor.
+	 * @return	No value is returned.
+	 */
+	~Stats ();
+
+	/**
+	 * Registers a connection thread.
+	 * @return	Metrics of thread, to be released with detach().
+	 */
+	ThreadStats *attach ();
+
+	/**
+	 * Unregisters a connection thread. Its metrics are kept in totals.
+	 * @param[in]	t Metrics of thread, returned by attach().
+	 * @return	No value is returned.
+	 */
+	void detach (ThreadStats *t);
+
+	/**
+	 * Makes a report of server metrics, one per line as "name value" or
+	 * "name key=value ...":
+	 * - uptime_s, connections_open, connections_total, bytes_in,
+	 *   bytes_out, waiters
+	 * - op name count=n errors=n mean_us=t p50_us=t p99_us=t p999_us=t
+	 *   max_us=t, for each request type seen
+	 * - block ID reads=n writes=n reads_per_s=r writes_per_s=r, for the
+	 *   top most accessed blocks; rates are averaged since start
+	 * - if locks are profiled, lock ID acquisitions=n contended=n
+	 *   wait_us=t max_wait_us=t mean_hold_us=t max_hold_us=t wakeups=n
+	 *   culprit=client, for the top most contended blocks, and culprit
+	 *   client wait_caused_us=t, for the top clients which made others
+	 *   wait the most
+	 * @param[in]	mem Distributed memory, for block metrics.
+	 * @param[in]	top Number of blocks reported.
+	 * @param[out]	out Report.
+	 * @return	No value is returned.
+	 */
+	void report (DM *mem, int top, string *out);
+};
+
+/**
+ * Returns monotonic time.
+ * @return	Time in nanoseconds.
+ */
+unsigned long long monotonic_ns ();
+
+#endif // STATS_H
@@ -0,0 +1,160 @@
+/**
+ * @file trace.cpp
+ * @brief File containing TraceBuffer and Tracer classes definitions.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+unsigned long long trace_time ()
+{
+	// wall clock, so that traces of different servers can be merged
+	timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+TraceBuffer::TraceBuffer ()
+{
+	head = 0;
+	tail = 0;
+	dropped = 0;
+	closed = false;
+}
+
+void TraceBuffer::put (const trace_record &r)
+{
+	// consumer frees slots by moving tail: acquire pairs with its release
+	unsigned int t = __atomic_load_n (&tail, __ATOMIC_ACQUIRE);
+	if (head - t == TRACERING) {
+		__atomic_fetch_add (&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ring[head % TRACERING] = r;
+	// record is complete before consumer can see it
+	__atomic_store_n (&head, head + 1, __ATOMIC_RELEASE);
+}
+
+int TraceBuffer::drain (FILE *file)
+{
+	unsigned int h = __atomic_load_n (&head, __ATOMIC_ACQUIRE);
+	int n = h - tail;
+	while (tail != h) {
+		// contiguous records up to head or to end of ring
+		unsigned int from = tail % TRACERING;
+		unsigned int count = h - tail;
+		if (count > TRACERING - from)
+			count = TRACERING - from;
+		fwrite (ring + from, sizeof(trace_record), count, file);
+		// slots are reused only after records have been copied
+		__atomic_store_n (&tail, tail + count, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+Tracer::Tracer ()
+{
+	file = NULL;
+	connections = 0;
+	dropped = 0;
+	pthread_mutex_init (&mutex, 0);
+}
+
+int Tracer::open (char *path, int block_size)
+{
+	file = fopen (path, "wb");
+	if (file == NULL)
+		return -1;
+
+	trace_header h;
+	h.magic = TRACEMAGIC;
+	h.version = TRACEVERSION;
+	h.record_size = sizeof(trace_record);
+	h.block_size = block_size;
+	if (fwrite (&h, sizeof(h), 1, file) != 1) {
+		fclose (file);
+		file = NULL;
+		return -1;
+	}
+	fflush (file);
+
+	pthread_t tid;
+	if (pthread_create (&tid, 0, flusher, this) != 0) {
+		fclose (file);
+		file = NULL;
+		return -1;
+	}
+	pthread_detach (tid);
+
+	return 0;
+}
+
+bool Tracer::enabled ()
+{
+	return file != NULL;
+}
+
+TraceBuffer *Tracer::attach (unsigned int *connection)
+{
+	TraceBuffer *b = new TraceBuffer;
+	pthread_mutex_lock (&mutex);
+	*connection = connections++;
+	buffers.push_back (b);
+	pthread_mutex_unlock (&mutex);
+	return b;
+}
+
+void Tracer::detach (TraceBuffer *b)
+{
+	pthread_mutex_lock (&mutex);
+	b->closed = true;
+	pthread_mutex_unlock (&mutex);
+}
+
+void Tracer::flush ()
+{
+	pthread_mutex_lock (&mutex);
+	list<TraceBuffer *>::iterator it = buffers.begin ();
+	while (it != buffers.end ()) {
+		TraceBuffer *b = *it;
+		b->drain (file);
+		if (b->closed) {
+			// producer is gone: nothing can be added after drain
+			dropped += b->dropped;
+			it = buffers.erase (it);
+			delete b;
+		} else {
+			it++;
+		}
+	}
+	fflush (file);
+	pthread_mutex_unlock (&mutex);
+}
+
+unsigned long long Tracer::lost ()
+{
+	pthread_mutex_lock (&mutex);
+	unsigned long long n = dropped;
+	for (list<TraceBuffer *>::iterator it = buffers.begin ();
+	     it != buffers.end (); it++)
+		n += __atomic_load_n (&(*it)->dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock (&mutex);
+	return n;
+}
+
+void *Tracer::flusher (void *in)
+{
+	Tracer *t = (Tracer *) in;
+	while (1) {
+		usleep (TRACEFLUSH * 1000);
+		t->flush ();
+	}
+	return NULL;
+}
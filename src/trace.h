@@ -0,0 +1,285 @@
+/**
+ * @file trace.h
+ * @brief Header file containing trace file format, TraceBuffer and Tracer
+ * classes declarations.
+ *
+ * A server started with a trace file records every request it serves. Trace
+ * file starts with a trace_header, followed by trace_record structures, all in
+ * host byte order. Records of a connection are in request order, records of
+ * different connections may be interleaved in any order: they are sorted by
+ * time when replayed (see dm_replay).
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <list>
+#include <stdio.h>
+#include <pthread.h>
+using namespace std;
+
+/**
+ * @def TRACEMAGIC
+ * First field of trace file header ("DMTR"). Read with another byte order it
+ * doesn't match.
+ */
+#define TRACEMAGIC	0x444d5452
+/**
+ * @def TRACEVERSION
+ * Version of trace file format.
+ */
+#define TRACEVERSION	2
+/**
+ * @def TRACERING
+ * Records in the ring buffer of a connection. Records which don't fit are
+ * dropped and counted.
+ */
+#define TRACERING	1024
+/**
+ * @def TRACEFLUSH
+ * Period in milliseconds of flushes of ring buffers to file.
+ */
+#define TRACEFLUSH	10
+
+/**
+ * @struct trace_header trace.h "trace.h"
+ * @brief Trace file header.
+ */
+struct trace_header {
+	/**
+	 * TRACEMAGIC.
+	 */
+	unsigned int magic;
+
+	/**
+	 * TRACEVERSION.
+	 */
+	unsigned int version;
+
+	/**
+	 * Size of a record in bytes.
+	 */
+	unsigned int record_size;
+
+	/**
+	 * Block size of traced server.
+	 */
+	unsigned int block_size;
+};
+
+/**
+ * @struct trace_record trace.h "trace.h"
+ * @brief A request served.
+ */
+struct trace_record {
+	/**
+	 * Time request was received, in nanoseconds since the epoch.
+	 */
+	unsigned long long time;
+
+	/**
+	 * Block id, or first argument of request.
+	 */
+	long long ID;
+
+	/**
+	 * Time taken to serve request in nanoseconds, at most 2^32 - 1.
+	 */
+	unsigned int latency;
+
+	/**
+	 * Connection number, from 0 in order of acceptance.
+	 */
+	unsigned int connection;
+
+	/**
+	 * Client fingerprint: high and low halves of client identifier
+	 * xor'ed. Connections of a client share it, on every server.
+	 */
+	unsigned int client;
+
+	/**
+	 * Offset for range requests, version for versioned requests,
+	 * argument following block id for others.
+	 */
+	int arg;
+
+	/**
+	 * Bytes of data for range requests, 0 for others.
+	 */
+	int length;
+
+	/**
+	 * Request type.
+	 */
+	unsigned char opcode;
+
+	/**
+	 * Outcome: reply type, or INVALID or UNMAPPED for rejected writes.
+	 * Tells whether client's copy was valid: UPDATED if it was, OK with
+	 * data if it was not.
+	 */
+	unsigned char outcome;
+
+	/**
+	 * Reserved, 0.
+	 */
+	unsigned short reserved;
+};
+
+/**
+ * @class TraceBuffer trace.h "trace.h"
+ * @brief Ring buffer of the records of a connection.
+ *
+ * A single producer, the connection thread, and a single consumer, the
+ * flusher thread, share the buffer without locks: each one only moves its own
+ * index, published with release and read with acquire ordering.
+ */
+class TraceBuffer {
+
+	friend class Tracer;
+
+	/**
+	 * Records.
+	 */
+	trace_record ring[TRACERING];
+
+	/**
+	 * Count of records put, written by producer only.
+	 */
+	unsigned int head;
+
+	/**
+	 * Count of records taken, written by consumer only.
+	 */
+	unsigned int tail;
+
+	/**
+	 * Records dropped because ring was full, written by producer only.
+	 */
+	unsigned long long dropped;
+
+	/**
+	 * True once producer has finished. Consumer frees buffer after
+	 * taking its last records.
+	 */
+	bool closed;
+
+	/**
+	 * Takes records out of ring. Called by consumer only.
+	 * @param[out]	file Trace file records are written to.
+	 * @return	Number of records taken.
+	 */
+	int drain (FILE *file);
+public:
+	/**
+	 * TraceBuffer constructor. Ring is empty.
+	 * @return	No value is returned.
+	 */
+	TraceBuffer ();
+
+	/**
+	 * Adds a record to ring, or drops it if ring is full. Called by
+	 * producer only, never blocks.
+	 * @param[in]	r Record.
+	 * @return	No value is returned.
+	 */
+	void put (const trace_record &r);
+};
+
+/**
+ * @class Tracer trace.h "trace.h"
+ * @brief Writes records of all connections to a trace file.
+ */
+class Tracer {
+
+	/**
+	 * Trace file, NULL if tracing is off.
+	 */
+	FILE *file;
+
+	/**
+	 * Mutex protecting buffers, connections, dropped and file writes.
+	 */
+	pthread_mutex_t mutex;
+
+	/**
+	 * Ring buffers of connections, including closed ones not drained yet.
+	 */
+	list<TraceBuffer *> buffers;
+
+	/**
+	 * Connections seen.
+	 */
+	unsigned int connections;
+
+	/**
+	 * Records dropped by closed connections.
+	 */
+	unsigned long long dropped;
+
+	/**
+	 * Flusher thread: drains ring buffers every TRACEFLUSH milliseconds.
+	 * @param[in]	in Tracer.
+	 */
+	static void *flusher (void *in);
+public:
+	/**
+	 * Tracer constructor. Tracing is off.
+	 * @return	No value is returned.
+	 */
+	Tracer ();
+
+	/**
+	 * Starts tracing: creates trace file and flusher thread.
+	 * @param[in]	path Trace file path.
+	 * @param[in]	block_size Block size of server.
+	 * @return	0 on success, -1 on error.
+	 */
+	int open (char *path, int block_size);
+
+	/**
+	 * Tells whether tracing is on.
+	 * @return	True if tracing.
+	 */
+	bool enabled ();
+
+	/**
+	 * Registers a connection.
+	 * @param[out]	connection Filled with connection number.
+	 * @return	Ring buffer of connection, to be released with detach().
+	 */
+	TraceBuffer *attach (unsigned int *connection);
+
+	/**
+	 * Unregisters a connection. Its ring buffer is drained and freed
+	 * later by flusher thread.
+	 * @param[in]	b Ring buffer returned by attach().
+	 * @return	No value is returned.
+	 */
+	void detach (TraceBuffer *b);
+
+	/**
+	 * Writes all buffered records to trace file.
+	 * @return	No value is returned.
+	 */
+	void flush ();
+
+	/**
+	 * Returns the number of records dropped so far.
+	 * @return	Records dropped because a ring buffer was full.
+	 */
+	unsigned long long lost ();
+};
+
+/**
+ * Returns time for trace records.
+ * @return	Nanoseconds since the epoch.
+ */
+unsigned long long trace_time ();
+
+#endif // TRACE_H
@@ -7,38 +7,111 @@
  * @date June 2010
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "msg.h"
 #include "utility.h"
 
-void build_reqhdr (void *buffer, int type, int id)
+int send_msg (int sd, void *buffer, int size)
 {
 	char *buf = (char *) buffer;
-	type = htonl (type);
-	int p = sizeof(int);
-	memcpy (buf, &type, p);
-	id = htonl (id);
-	memcpy (buf + p , &id, p);
+	int ret;
+	for (int wr = 0; wr != size; wr += ret) {
+		// a broken connection fails with EPIPE instead of raising
+		// SIGPIPE, which would kill a client not ignoring it
+		ret = send (sd, &buf[wr], size - wr, MSG_NOSIGNAL);
+		if (ret == -1)
+			return -1;
+	}
+	return 0;
 }
 
-void build_resphdr (void *buffer, int type)
+int send_msgv (int sd, void *head, int hsize, void *data, int dsize)
 {
-	char *buf = (char *) buffer;
-	type = htonl (type);
-	int p = sizeof(int);
-	memcpy (buf, &type, p);
+	iovec iov[2];
+	iov[0].iov_base = head;
+	iov[0].iov_len = hsize;
+	iov[1].iov_base = data;
+	iov[1].iov_len = dsize;
+	msghdr msg;
+	memset (&msg, 0, sizeof (msg));
+	int i = 0;
+	while (i < 2) {
+		msg.msg_iov = &iov[i];
+		msg.msg_iovlen = 2 - i;
+		// no SIGPIPE, as in send_msg()
+		int ret = sendmsg (sd, &msg, MSG_NOSIGNAL);
+		if (ret == -1)
+			return -1;
+		// skip buffers sent, then the part sent of the next one
+		while (i < 2 && ret >= (int) iov[i].iov_len) {
+			ret -= iov[i].iov_len;
+			i++;
+		}
+		if (i < 2) {
+			iov[i].iov_base = (char *) iov[i].iov_base + ret;
+			iov[i].iov_len -= ret;
+		}
+	}
+	return 0;
 }
 
-int send_msg (int sd, void *buffer, int size)
+int send_frame (int sd, int opcode, int tag, void *payload, int length)
 {
-	char *buf = (char *) buffer;
-	int ret;
-	for (int wr = 0; wr != size; wr += ret) {
-		ret = write (sd, &buf[wr], size - wr);
-		if (ret == -1)
+	char hdr[FRAMEHDR];
+	encode_frame (hdr, opcode, tag, length);
+	return send_msgv (sd, hdr, FRAMEHDR, payload, length);
+}
+
+int recv_frame (int sd, frame *f)
+{
+	char hdr[FRAMEHDR];
+	if (recv_msg (sd, hdr, FRAMEHDR) == -1)
+		return -1;
+	return decode_frame (hdr, f);
+}
+
+int skip_msg (int sd, int size)
+{
+	char buf[512];
+	while (size > 0) {
+		int n = size < (int) sizeof(buf) ? size : sizeof(buf);
+		if (recv_msg (sd, buf, n) == -1)
 			return -1;
+		size -= n;
 	}
 	return 0;
 }
 
+int await_msg (int sd, int timeout)
+{
+	pollfd pfd;
+	pfd.fd = sd;
+	pfd.events = POLLIN;
+	for (;;) {
+		int ret = poll (&pfd, 1, timeout);
+		if (ret > 0)
+			return 0;
+		if (ret == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		// a signal restarts the whole time limit
+		if (errno != EINTR)
+			return -1;
+	}
+}
+
+bool hung_up (int sd)
+{
+	char c;
+	int ret = recv (sd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return ret == 0 ||
+	       (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
 int recv_msg (int sd, void *buffer, int size)
 {
 	char *buf = (char *) buffer;
@@ -13,44 +13,73 @@
 #include <unistd.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include "frame.h"
 
 /**
- * Build a request header. Header format is <Type, Id>
- * Type can be:
- * - MAP
- * - UNMAP
- * - UPDATE
- * - WRITE
- * - WAIT
- *
- * @param[out]	buffer Buffer ready for sending.
- * @param[in]	type Request type.
- * @param[in]	id Requested block's id.
- * @return	No value is returned.
+ * Sends message through socket.
+ * @param[in]	sd A valid socket descriptor.
+ * @param[in]	buffer Buffer to send.
+ * @param[in]	size Number of bytes of buffer to send.
+ * @return	0 on success, -1 on error.
  */
-void build_reqhdr (void *buffer, int type, int id);
+int send_msg (int sd, void *buffer, int size);
 
 /**
- * Build a response header. Header format is <Type>
- * Type can be:
- * - OK
- * - UPDATED
- * - ERROR
- *
- * @param[out]	buffer Buffer ready for sending.
- * @param[in]	type Response type.
- * @return	No value is returned.
+ * Sends a message made of two buffers with one system call.
+ * @param[in]	sd A valid socket descriptor.
+ * @param[in]	head First buffer.
+ * @param[in]	hsize Number of bytes of first buffer.
+ * @param[in]	data Second buffer.
+ * @param[in]	dsize Number of bytes of second buffer, may be 0.
+ * @return	0 on success, -1 on error.
  */
-void build_resphdr (void *buffer, int type);
+int send_msgv (int sd, void *head, int hsize, void *data, int dsize);
 
 /**
- * Sends message through socket.
+ * Sends a frame with no arguments, e.g. a reply.
  * @param[in]	sd A valid socket descriptor.
- * @param[in]	buffer Buffer to send.
- * @param[in]	size Number of bytes of buffer to send.
+ * @param[in]	opcode Reply type.
+ * @param[in]	tag Tag of request replied to.
+ * @param[in]	payload Payload.
+ * @param[in]	length Payload size in bytes, may be 0.
  * @return	0 on success, -1 on error.
  */
-int send_msg (int sd, void *buffer, int size);
+int send_frame (int sd, int opcode, int tag, void *payload, int length);
+
+/**
+ * Receives a frame header.
+ * @param[in]	sd A valid socket descriptor.
+ * @param[out]	f Decoded header.
+ * @return	0 on success, -1 on error or if data received is not a frame,
+ * 		-2 if frame has another protocol version.
+ */
+int recv_frame (int sd, frame *f);
+
+/**
+ * Receives and discards a payload, or what is left of it.
+ * @param[in]	sd A valid socket descriptor.
+ * @param[in]	size Number of bytes to discard.
+ * @return	0 on success, -1 on error.
+ */
+int skip_msg (int sd, int size);
+
+/**
+ * Waits with poll() for data to receive on a socket, e.g. before receiving a
+ * reply which may take longer than the socket's receive timeout.
+ * @param[in]	sd A valid socket descriptor.
+ * @param[in]	timeout Milliseconds to wait, -1 for no limit.
+ * @return	0 if data is available, -1 on error or if time limit expired, in
+ * 		which case errno is ETIMEDOUT.
+ */
+int await_msg (int sd, int timeout);
+
+/**
+ * Tells whether peer closed a connection on which it isn't expected to send
+ * anything, e.g. a client which gave up waiting for a reply.
+ * @param[in]	sd A valid socket descriptor.
+ * @return	True if connection has been closed or reset.
+ */
+bool hung_up (int sd);
 
 /**
  * Receives message through socket.
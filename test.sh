@@ -25,5 +25,87 @@ for i in 1 2 3; do
 	echo "End cycle $i"
 done
 
+# kernels run on servers must count as the client does
+if ! ./countscan dm.conf; then
+	echo "FAIL"
+	exit 1
+fi
+
+# a region stores only the blocks written since its last sync
+if ! ./checkregion dm.conf; then
+	echo "FAIL"
+	exit 1
+fi
+
+# a resync updates only the blocks other clients wrote
+if ! ./checkresync dm.conf; then
+	echo "FAIL"
+	exit 1
+fi
+
+# a range write sends only its slice and makes other copies stale
+if ! ./checkrange dm.conf; then
+	echo "FAIL"
+	exit 1
+fi
+
+# asynchronous requests complete their futures, or run their callbacks
+if ! ./checkasync dm.conf; then
+	echo "FAIL"
+	exit 1
+fi
+
+# blocks updated in sequence are fetched ahead, in both directions
+if ! ./checkprefetch prefetch.conf; then
+	echo "FAIL"
+	exit 1
+fi
+
+# queued writes collapse, are sent when the queue fills or the interval
+# expires, and dm_flush() reports those refused
+if ! ./checkwriteback writeback.conf 127.0.0.1 1234 5678; then
+	echo "FAIL"
+	exit 1
+fi
+
+# clients keep using blocks moved to another server; runs last, since other
+# tests expect blocks on the servers dm.conf lists
+if ! ./checkmove dm.conf 127.0.0.1 5678; then
+	echo "FAIL"
+	exit 1
+fi
+
+# clients resume their mappings after losing connections within the grace
+# period of servers, and map blocks again after it or a restart
+killall server
+sleep 0.2
+SERVERS="cd ../src; (./server -g 2 1234 0 255 &);"
+SERVERS="$SERVERS (./server -g 2 5678 256 511 &)"
+sh -c "$SERVERS"
+sleep 0.2
+if ! ./checkresume dm.conf 2 "killall server; sleep 0.2; $SERVERS; sleep 0.2"
+then
+	echo "FAIL"
+	exit 1
+fi
+
+# replicas serve what the primary wrote, a stale write is refused, and reads
+# go to the primary while it is silent
+killall server
+sleep 0.2
+cd ../src
+./server -R 1240 0 255 &
+./server -R 1241 0 255 &
+sleep 0.2
+./server -r 127.0.0.1:1240 -r 127.0.0.1:1241 1234 0 255 &
+P=$!
+sleep 0.2
+cd ../test
+if ! ./checkreplica replica.conf "kill -STOP $P; (sleep 9; kill -CONT $P) &" \
+	127.0.0.1 1240 1241; then
+	echo "FAIL"
+	exit 1
+fi
+
 echo "OK"
 killall server
@@ -0,0 +1,150 @@
+/**
+ * @file checkasync.cpp
+ * @brief Simple test program, for asynchronous requests. Maps, waits on,
+ * updates and writes blocks of both servers asynchronously, and checks the
+ * results delivered through futures, one of them by a callback, against what
+ * another client reads and writes.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <unistd.h>
+#include "../src/distmem.h"
+
+/**
+ * Number of blocks used on each server.
+ */
+#define BLOCKS 8
+
+/**
+ * First block of second server.
+ */
+#define SECOND 256
+
+/**
+ * Result of a request delivered by callback.
+ */
+struct delivery {
+	/**
+	 * Result of request.
+	 */
+	int result;
+
+	/**
+	 * True once callback has run.
+	 */
+	bool called;
+};
+
+/**
+ * Callback of an asynchronous request: stores its result.
+ * @param[in]	result Result of request.
+ * @param[in]	arg Delivery structure.
+ * @return	No value is returned.
+ */
+static void deliver (int result, void *arg)
+{
+	delivery *d = (delivery *) arg;
+	d->result = result;
+	__atomic_store_n (&d->called, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * Checkasync main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 2)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client dm, writer;
+	if (dm.dm_init (config_file) != 0 ||
+	    writer.dm_init (config_file) != 0) {
+		printf ("Checkasync: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	int n = 2 * BLOCKS;
+	block_id ids[n];
+	char blocks[n][size], data[n][size];
+	for (int k = 0; k < BLOCKS; k++) {
+		ids[k] = k;
+		ids[BLOCKS + k] = SECOND + k;
+	}
+
+	// maps are in flight on both servers at once
+	int mapped = 0;
+	DM_future maps[n];
+	for (int k = 0; k < n; k++)
+		dm.dm_block_map_async (ids[k], blocks[k], &maps[k]);
+	for (int k = 0; k < n; k++) {
+		if (maps[k].wait () == 0)
+			mapped++;
+		if (writer.dm_block_map (ids[k], data[k]) != 0) {
+			printf ("Checkasync: Error while mapping DM on LM\n");
+			exit (1);
+		}
+	}
+
+	// waits complete once another client writes: one through its future,
+	// the other through its callback
+	delivery d = { -1, false };
+	DM_future waited, called (deliver, &d);
+	int sent = dm.dm_block_wait_async (ids[0], &waited) == 0 ? 1 : 0;
+	sent += dm.dm_block_wait_async (ids[BLOCKS], &called) == 0 ? 1 : 0;
+	for (int k = 0; k < n; k++) {
+		memset (data[k], 'a' + k, size);
+		if (writer.dm_block_write (ids[k]) != 0) {
+			printf ("Checkasync: Error while writing DM\n");
+			exit (1);
+		}
+	}
+	int woken = waited.wait () == 0 ? 1 : 0;
+	for (int t = 0; t < 100 && !__atomic_load_n (&d.called,
+						      __ATOMIC_ACQUIRE); t++)
+		usleep (50000);
+	if (__atomic_load_n (&d.called, __ATOMIC_ACQUIRE) && d.result == 0)
+		woken++;
+
+	// updates bring what the other client wrote
+	int updated = 0;
+	DM_future updates[n];
+	for (int k = 0; k < n; k++)
+		dm.dm_block_update_async (ids[k], &updates[k]);
+	for (int k = 0; k < n; k++)
+		if (updates[k].wait () == 0 && blocks[k][0] == 'a' + k &&
+		    blocks[k][size - 1] == 'a' + k)
+			updated++;
+
+	// writes reach the other client
+	int written = 0;
+	DM_future writes[n];
+	for (int k = 0; k < n; k++) {
+		memset (blocks[k], 'A' + k, size);
+		dm.dm_block_write_async (ids[k], &writes[k]);
+	}
+	for (int k = 0; k < n; k++)
+		if (writes[k].wait () == 0 &&
+		    writer.dm_block_update (ids[k]) == 0 &&
+		    data[k][0] == 'A' + k && data[k][size - 1] == 'A' + k)
+			written++;
+
+	bool bad = mapped != n || sent != 2 || woken != 2 || updated != n ||
+		   written != n;
+
+	printf ("Asynchronous maps: %d, updates: %d, writes: %d of %d\n"
+		"\tWaits sent: %d, woken: %d\n", mapped, updated, written, n,
+		sent, woken);
+
+	for (int k = 0; k < n; k++) {
+		dm.dm_block_unmap (ids[k]);
+		writer.dm_block_unmap (ids[k]);
+	}
+
+	exit (bad ? 1 : 0);
+}
@@ -0,0 +1,90 @@
+/**
+ * @file checkmove.cpp
+ * @brief Simple test program. Moves a range of blocks to another server while
+ * two clients have routes to it, then checks that what one writes through its
+ * stale route is read by the other through its own.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include "../src/distmem.h"
+
+/**
+ * First block moved.
+ */
+#define FIRST 200
+
+/**
+ * Last block moved.
+ */
+#define LAST 255
+
+/**
+ * Checkmove main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file.
+ * @param[in]	argv[2] New owner's address in dotted notation.
+ * @param[in]	argv[3] New owner's port.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 4)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client dm, admin, writer;
+	if (dm.dm_init (config_file) != 0 || admin.dm_init (config_file) != 0
+	    || writer.dm_init (config_file) != 0) {
+		printf ("Checkmove: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	char blocks[LAST - FIRST + 1][size];
+
+	// each block is filled with its own id
+	for (int i = FIRST; i <= LAST; i++) {
+		char *b = blocks[i - FIRST];
+		if (dm.dm_block_map (i, b) != 0) {
+			printf ("Checkmove: Error while mapping DM on LM\n");
+			exit (1);
+		}
+		memset (b, i, size);
+		if (dm.dm_block_write (i) != 0) {
+			printf ("Checkmove: Error while writing DM\n");
+			exit (1);
+		}
+	}
+
+	if (admin.dm_migrate (FIRST, LAST, argv[2], atoi (argv[3])) != 0) {
+		printf ("Checkmove: Error while moving blocks\n");
+		exit (1);
+	}
+
+	// both clients still route the range to its old owner, which
+	// redirects them: writer stores new data, dm reads it
+	int bad = 0;
+	char data[size];
+	for (int i = FIRST; i <= LAST; i++) {
+		char *b = blocks[i - FIRST];
+		if (writer.dm_block_map (i, data) != 0) {
+			printf ("Checkmove: Error while mapping DM on LM\n");
+			exit (1);
+		}
+		memset (data, i + 1, size);
+		if (writer.dm_block_write (i) != 0 ||
+		    dm.dm_block_update (i) != 0 || b[0] != (char) (i + 1) ||
+		    b[size - 1] != (char) (i + 1))
+			bad++;
+		writer.dm_block_unmap (i);
+	}
+
+	printf ("Moved blocks: %d, wrong after move: %d\n", LAST - FIRST + 1,
+		bad);
+
+	for (int i = FIRST; i <= LAST; i++)
+		dm.dm_block_unmap (i);
+
+	exit (bad == 0 ? 0 : 1);
+}
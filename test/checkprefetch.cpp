@@ -0,0 +1,136 @@
+/**
+ * @file checkprefetch.cpp
+ * @brief Simple test program, for clients prefetching blocks (Prefetch=4).
+ * Walks blocks of both servers forward and backward, then checks that a write
+ * landing after a prefetch is only read by a later update, and that a wait on
+ * a block which was invalid when prefetched returns at once.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <unistd.h>
+#include "../src/distmem.h"
+
+/**
+ * Number of blocks walked.
+ */
+#define BLOCKS 16
+
+/**
+ * First block walked, so that both servers own some.
+ */
+#define FIRST 248
+
+/**
+ * Number of blocks updated before prefetching starts: a stride is trusted
+ * once it has been seen twice.
+ */
+#define WARM 3
+
+/**
+ * Walks blocks at a constant stride, counting those which don't hold value c.
+ * @param[in]	dm Initialized DM_client.
+ * @param[in]	blocks Local blocks, one after the other.
+ * @param[in]	size Block dimension.
+ * @param[in]	from Index of first block walked.
+ * @param[in]	to Index of last block walked.
+ * @param[in]	c Expected value.
+ * @return	Number of wrong blocks.
+ */
+static int walk (DM_client *dm, char *blocks, int size, int from, int to,
+		 char c)
+{
+	int wrong = 0;
+	int step = from <= to ? 1 : -1;
+	for (int i = from; i != to + step; i += step)
+		if (dm->dm_block_update (FIRST + i) != 0 ||
+		    blocks[i * size] != c || blocks[(i + 1) * size - 1] != c)
+			wrong++;
+	return wrong;
+}
+
+/**
+ * Writes value c into blocks of a client, from index first to last.
+ * @param[in]	dm Initialized DM_client.
+ * @param[in]	blocks Local blocks, one after the other.
+ * @param[in]	size Block dimension.
+ * @param[in]	first Index of first block.
+ * @param[in]	last Index of last block.
+ * @param[in]	c Value.
+ * @return	No value is returned.
+ */
+static void fill (DM_client *dm, char *blocks, int size, int first, int last,
+		  char c)
+{
+	for (int i = first; i <= last; i++) {
+		memset (blocks + i * size, c, size);
+		if (dm->dm_block_write (FIRST + i) != 0) {
+			printf ("Checkprefetch: Error while writing DM\n");
+			exit (1);
+		}
+	}
+}
+
+/**
+ * Checkprefetch main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file, with
+ *		Prefetch=4.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 2)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client dm, writer;
+	if (dm.dm_init (config_file) != 0 ||
+	    writer.dm_init (config_file) != 0) {
+		printf ("Checkprefetch: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	char blocks[BLOCKS][size], data[BLOCKS][size];
+	char *local = blocks[0], *written = data[0];
+
+	for (int i = 0; i < BLOCKS; i++) {
+		if (dm.dm_block_map (FIRST + i, blocks[i]) != 0 ||
+		    writer.dm_block_map (FIRST + i, data[i]) != 0) {
+			printf ("Checkprefetch: Error while mapping DM on "
+				"LM\n");
+			exit (1);
+		}
+	}
+
+	// forward: blocks ahead are fetched with what was written before,
+	// a write landing after their prefetch is read only by a later update
+	fill (&writer, written, size, 0, BLOCKS - 1, 'f');
+	int forward = walk (&dm, local, size, 0, WARM - 1, 'f');
+	usleep (200000);
+	fill (&writer, written, size, WARM + 1, WARM + 1, 'g');
+	forward += walk (&dm, local, size, WARM, BLOCKS - 1, 'f');
+	int landed = dm.dm_block_update (FIRST + WARM + 1) == 0 &&
+		     blocks[WARM + 1][0] == 'g' ? 1 : 0;
+
+	// backward: a block invalid when prefetched needs no wait
+	fill (&writer, written, size, 0, BLOCKS - 1, 'b');
+	int backward = walk (&dm, local, size, BLOCKS - 1, BLOCKS - WARM, 'b');
+	int waited = dm.dm_block_wait_for (FIRST + BLOCKS - WARM - 2, 2000);
+	backward += walk (&dm, local, size, BLOCKS - WARM - 1, 0, 'b');
+
+	bool bad = forward != 0 || landed != 1 || backward != 0 || waited != 0;
+
+	printf ("Blocks walked: %d, wrong forward: %d, backward: %d\n"
+		"\tWrite after prefetch read by a later update: %d\n"
+		"\tWait on a block prefetched invalid: %d\n", BLOCKS, forward,
+		backward, landed, waited);
+
+	for (int i = 0; i < BLOCKS; i++) {
+		dm.dm_block_unmap (FIRST + i);
+		writer.dm_block_unmap (FIRST + i);
+	}
+
+	exit (bad ? 1 : 0);
+}
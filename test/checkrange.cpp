@@ -0,0 +1,125 @@
+/**
+ * @file checkrange.cpp
+ * @brief Simple test program, for byte ranges of blocks. Writes a slice of a
+ * block and checks that another client reads only that slice, that ranges
+ * exceeding the block are rejected, and that a range write makes the other
+ * client's copy stale.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include "../src/distmem.h"
+
+/**
+ * First byte of the slice written.
+ */
+#define OFFSET 40
+
+/**
+ * Number of bytes of the slice written, ending well inside a block.
+ */
+#define LENGTH 48
+
+/**
+ * Checks that bytes from first to last of a block all hold value c.
+ * @param[in]	b Block.
+ * @param[in]	first First byte.
+ * @param[in]	last Last byte.
+ * @param[in]	c Value.
+ * @return	True if they do, false otherwise.
+ */
+static bool holds (char *b, int first, int last, char c)
+{
+	for (int i = first; i <= last; i++)
+		if (b[i] != c)
+			return false;
+	return true;
+}
+
+/**
+ * Checkrange main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 2)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client writer, reader;
+	if (writer.dm_init (config_file) != 0 ||
+	    reader.dm_init (config_file) != 0) {
+		printf ("Checkrange: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = writer.dm_block_dim ();
+
+	// one block on each server
+	block_id ids[] = { 10, 300 };
+	int n = sizeof (ids) / sizeof (ids[0]);
+	char written[n][size], read[n][size];
+	for (int k = 0; k < n; k++) {
+		if (writer.dm_block_map (ids[k], written[k]) != 0 ||
+		    reader.dm_block_map (ids[k], read[k]) != 0) {
+			printf ("Checkrange: Error while mapping DM on LM\n");
+			exit (1);
+		}
+		memset (written[k], 'a', size);
+		if (writer.dm_block_write (ids[k]) != 0 ||
+		    reader.dm_block_update (ids[k]) != 0) {
+			printf ("Checkrange: Error while writing DM\n");
+			exit (1);
+		}
+	}
+
+	int wrong = 0, rejected = 0, stale = 0;
+	for (int k = 0; k < n; k++) {
+		// only the slice is sent and read back
+		memset (written[k], 'w', size);
+		memset (written[k] + OFFSET, 'b', LENGTH);
+		memset (read[k], 'x', size);
+		if (writer.dm_block_write_range (ids[k], OFFSET, LENGTH) != 0 ||
+		    reader.dm_block_read_range (ids[k], OFFSET, LENGTH) != 0 ||
+		    !holds (read[k], 0, OFFSET - 1, 'x') ||
+		    !holds (read[k], OFFSET, OFFSET + LENGTH - 1, 'b') ||
+		    !holds (read[k], OFFSET + LENGTH, size - 1, 'x'))
+			wrong++;
+
+		// ranges exceeding the block, or starting before it
+		if (reader.dm_block_read_range (ids[k], size - LENGTH + 1,
+						LENGTH) == -1)
+			rejected++;
+		if (reader.dm_block_read_range (ids[k], -1, LENGTH) == -1)
+			rejected++;
+		if (writer.dm_block_write_range (ids[k], size - LENGTH + 1,
+						 LENGTH) == -1)
+			rejected++;
+		if (writer.dm_block_write_range (ids[k], -1, LENGTH) == -1)
+			rejected++;
+
+		// reader's copy predates the range write: its write is
+		// refused, and an update brings the whole block
+		if (reader.dm_block_write (ids[k]) == -2)
+			stale++;
+		if (reader.dm_block_update (ids[k]) != 0 ||
+		    !holds (read[k], 0, OFFSET - 1, 'a') ||
+		    !holds (read[k], OFFSET, OFFSET + LENGTH - 1, 'b') ||
+		    !holds (read[k], OFFSET + LENGTH, size - 1, 'a'))
+			wrong++;
+	}
+	bool bad = wrong != 0 || rejected != 4 * n || stale != n;
+
+	printf ("Ranges written: %d, wrong: %d\n\tRanges rejected: %d of %d\n"
+		"\tStale writes refused: %d\n", n, wrong, rejected, 4 * n,
+		stale);
+
+	for (int k = 0; k < n; k++) {
+		writer.dm_block_unmap (ids[k]);
+		reader.dm_block_unmap (ids[k]);
+	}
+
+	exit (bad ? 1 : 0);
+}
@@ -0,0 +1,105 @@
+/**
+ * @file checkregion.cpp
+ * @brief Simple test program. Writes into a few blocks of a mapped region, then
+ * checks that dm_region_sync() stores only the blocks sharing a page with them,
+ * and that writes following a sync are caught again.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <unistd.h>
+#include "../src/distmem.h"
+
+/**
+ * Number of blocks of region, starting at block 0.
+ */
+#define BLOCKS 128
+
+/**
+ * Returns how many blocks of region share a page with block a or block b.
+ * @param[in]	a Block id.
+ * @param[in]	b Block id.
+ * @param[in]	size Block dimension.
+ * @return	Number of blocks.
+ */
+static int sharing (int a, int b, int size)
+{
+	long page = sysconf (_SC_PAGESIZE);
+	int n = 0;
+	for (int i = 0; i < BLOCKS; i++) {
+		long first = (long) i * size / page;
+		long last = ((long) (i + 1) * size - 1) / page;
+		long pa = (long) a * size / page, pb = (long) b * size / page;
+		if ((first <= pa && pa <= last) || (first <= pb && pb <= last))
+			n++;
+	}
+	return n;
+}
+
+/**
+ * Checkregion main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 2)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client dm, reader;
+	if (dm.dm_init (config_file) != 0 ||
+	    reader.dm_init (config_file) != 0) {
+		printf ("Checkregion: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	char blocks[BLOCKS][size];
+
+	void *address;
+	if (dm.dm_region_map (0, BLOCKS, &address) != 0) {
+		printf ("Checkregion: Error while mapping region\n");
+		exit (1);
+	}
+	char *region = (char *) address;
+	for (int i = 0; i < BLOCKS; i++) {
+		if (reader.dm_block_map (i, blocks[i]) != 0) {
+			printf ("Checkregion: Error while mapping DM on LM\n");
+			exit (1);
+		}
+	}
+
+	// first write to a page faults and marks it dirty; reader counts
+	// the blocks each sync stored
+	region[5 * size] = 'r';
+	region[100 * size + size - 1] = 'r';
+	int first = dm.dm_region_sync (region);
+	int written = reader.dm_resync (0, BLOCKS - 1);
+	int expected = sharing (5, 100, size);
+	bool bad = first != 0 || written != expected ||
+		   blocks[5][0] != 'r' || blocks[100][size - 1] != 'r';
+
+	// nothing written: nothing stored
+	int second = dm.dm_region_sync (region);
+	int rewritten = reader.dm_resync (0, BLOCKS - 1);
+	bad = bad || second != 0 || rewritten != 0;
+
+	// pages were protected again by last sync
+	region[5 * size] = 's';
+	int third = dm.dm_region_sync (region);
+	int again = reader.dm_resync (0, BLOCKS - 1);
+	bad = bad || third != 0 || again != sharing (5, 5, size) ||
+	      blocks[5][0] != 's';
+
+	printf ("Region blocks: %d, stored after writes: %d (expected %d), "
+		"without writes: %d, after a new write: %d\n", BLOCKS,
+		written, expected, rewritten, again);
+
+	dm.dm_region_unmap (region);
+	for (int i = 0; i < BLOCKS; i++)
+		reader.dm_block_unmap (i);
+
+	exit (bad ? 1 : 0);
+}
@@ -0,0 +1,156 @@
+/**
+ * @file checkreplica.cpp
+ * @brief Simple test program, for a server replicated on others. Checks that
+ * writes on the primary server are read from replicas, that a write based on
+ * stale data is refused and followed by an update bringing the primary's data,
+ * and that reads fall back on the primary while replicas lost it.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <unistd.h>
+#include "../src/distmem.h"
+
+/**
+ * Number of blocks used, starting at block 0.
+ */
+#define BLOCKS 8
+
+/**
+ * Counts versioned updates served by replica servers, and those refused.
+ * @param[in]	dm Initialized DM_client.
+ * @param[in]	address Replicas address in dotted notation.
+ * @param[in]	ports Replica ports.
+ * @param[in]	n Number of replicas.
+ * @param[out]	errors Number of refused updates.
+ * @return	Number of updates, -1 on error.
+ */
+static long long served (DM_client *dm, char *address, char **ports, int n,
+			 long long *errors)
+{
+	long long count = 0;
+	*errors = 0;
+	for (int i = 0; i < n; i++) {
+		string report;
+		if (dm->dm_stats (address, atoi (ports[i]), 0, &report) != 0)
+			return -1;
+		size_t at = report.find ("op vupdate ");
+		unsigned long long c, e;
+		if (at != string::npos &&
+		    sscanf (report.c_str () + at, "op vupdate count=%llu "
+			    "errors=%llu", &c, &e) == 2) {
+			count += c;
+			*errors += e;
+		}
+	}
+	return count;
+}
+
+/**
+ * Checkreplica main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file, listing
+ *		one server owning blocks 0 to BLOCKS - 1, with replicas.
+ * @param[in]	argv[2] Shell command suspending primary server for more than
+ *		LEASE + 3 seconds, returning at once.
+ * @param[in]	argv[3] Replicas address in dotted notation.
+ * @param[in]	argv[4...] Replica ports.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc < 5)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client writer, reader, admin, late;
+	if (writer.dm_init (config_file) != 0 ||
+	    reader.dm_init (config_file) != 0 ||
+	    admin.dm_init (config_file) != 0 ||
+	    late.dm_init (config_file) != 0) {
+		printf ("Checkreplica: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = writer.dm_block_dim ();
+	char written[BLOCKS][size], read[BLOCKS][size];
+
+	for (int i = 0; i < BLOCKS; i++) {
+		if (writer.dm_block_map (i, written[i]) != 0 ||
+		    reader.dm_block_map (i, read[i]) != 0) {
+			printf ("Checkreplica: Error while mapping DM on LM\n");
+			exit (1);
+		}
+	}
+
+	// writes on primary reach replicas, which serve reads in turn
+	long long errors;
+	long long before = served (&admin, argv[3], argv + 4, argc - 4,
+				   &errors);
+	bool bad = false;
+	for (int i = 0; i < BLOCKS; i++) {
+		memset (written[i], 'a' + i, size);
+		if (writer.dm_block_write (i) != 0)
+			bad = true;
+	}
+	// replicas receive writes asynchronously
+	usleep (200000);
+	for (int i = 0; i < BLOCKS; i++)
+		if (reader.dm_block_update (i) != 0 || read[i][0] != 'a' + i)
+			bad = true;
+	long long replicated = served (&admin, argv[3], argv + 4, argc - 4,
+				       &errors) - before;
+	bad = bad || replicated <= 0;
+
+	// a write based on stale data is refused; the following update
+	// brings the primary's data, even if replicas haven't got it yet
+	int refused = 0, stale = 0;
+	for (int i = 0; i < BLOCKS; i++) {
+		memset (written[i], 'A' + i, size);
+		if (writer.dm_block_write (i) != 0)
+			bad = true;
+		memset (read[i], 'z', size);
+		if (reader.dm_block_write (i) == -2)
+			refused++;
+		if (reader.dm_block_update (i) != 0 || read[i][0] != 'A' + i)
+			stale++;
+	}
+	bad = bad || refused != BLOCKS || stale != 0;
+
+	// replicas which lost their primary refuse reads, which are repeated
+	// on the primary once it answers again. Copies serve reads of a
+	// client in turn, primary first: late maps a block on the primary,
+	// so that its update goes to a replica
+	char copy[size];
+	if (late.dm_block_map (0, copy) != 0) {
+		printf ("Checkreplica: Error while mapping DM on LM\n");
+		exit (1);
+	}
+	long long refusals;
+	served (&admin, argv[3], argv + 4, argc - 4, &refusals);
+	if (system (argv[2]) != 0) {
+		printf ("Checkreplica: Error while suspending primary\n");
+		exit (1);
+	}
+	// replicas check their lease every second, counting whole seconds
+	sleep (LEASE + 3);
+	int failed = late.dm_block_update (0) != 0 ? 1 : 0;
+	for (int i = 0; i < BLOCKS; i++)
+		if (reader.dm_block_update (i) != 0)
+			failed++;
+	served (&admin, argv[3], argv + 4, argc - 4, &errors);
+	refusals = errors - refusals;
+	bad = bad || failed != 0 || refusals <= 0;
+
+	printf ("Replicated reads: %lld\n\tStale writes refused: %d, stale "
+		"after update: %d\n\tReads refused by lagging replicas: %lld, "
+		"failed: %d\n", replicated, refused, stale, refusals, failed);
+
+	for (int i = 0; i < BLOCKS; i++) {
+		writer.dm_block_unmap (i);
+		reader.dm_block_unmap (i);
+	}
+	late.dm_block_unmap (0);
+
+	exit (bad ? 1 : 0);
+}
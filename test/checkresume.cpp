@@ -0,0 +1,114 @@
+/**
+ * @file checkresume.cpp
+ * @brief Simple test program, for servers run with a grace period. Breaks the
+ * connections of its clients, then checks that their mappings survive if they
+ * reconnect within the grace period, and that dm_resync() maps blocks again
+ * after the grace period ends or servers are restarted.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../src/distmem.h"
+
+/**
+ * Number of blocks mapped, starting at block 250 so that both servers own
+ * some.
+ */
+#define BLOCKS 12
+
+/**
+ * First block mapped.
+ */
+#define FIRST 250
+
+/**
+ * Breaks all connections of the process, as a network failure would.
+ * @return	No value is returned.
+ */
+static void disconnect ()
+{
+	for (int fd = 3; fd < 1024; fd++) {
+		int type;
+		socklen_t len = sizeof (type);
+		if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0)
+			shutdown (fd, SHUT_RDWR);
+	}
+}
+
+/**
+ * Checkresume main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file.
+ * @param[in]	argv[2] Grace period of servers, in seconds.
+ * @param[in]	argv[3] Shell command restarting servers.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 4)
+		exit (1);
+
+	char *config_file = argv[1];
+	int grace = atoi (argv[2]);
+
+	DM_client dm, writer;
+	if (dm.dm_init (config_file) != 0 ||
+	    writer.dm_init (config_file) != 0) {
+		printf ("Checkresume: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	char blocks[BLOCKS][size], data[size];
+
+	for (int i = 0; i < BLOCKS; i++) {
+		if (dm.dm_block_map (FIRST + i, blocks[i]) != 0) {
+			printf ("Checkresume: Error while mapping DM on LM\n");
+			exit (1);
+		}
+	}
+	if (writer.dm_block_map (FIRST + BLOCKS - 1, data) != 0) {
+		printf ("Checkresume: Error while mapping DM on LM\n");
+		exit (1);
+	}
+
+	// within grace period: clients resume their mappings and versions
+	disconnect ();
+	memset (data, 'g', size);
+	int written = writer.dm_block_write (FIRST + BLOCKS - 1);
+	int updated = dm.dm_block_update (FIRST + BLOCKS - 1);
+	char *last = blocks[BLOCKS - 1];
+	bool bad = written != 0 || updated != 0 || last[0] != 'g';
+	memset (last, 'h', size);
+	int rewritten = dm.dm_block_write (FIRST + BLOCKS - 1);
+	int within = dm.dm_resync (FIRST, FIRST + BLOCKS - 1);
+	bad = bad || rewritten != 0 || within != 0;
+
+	// beyond grace period: mappings are released, resync maps them again
+	disconnect ();
+	sleep (grace + 1);
+	int lost = dm.dm_block_update (FIRST);
+	int beyond = dm.dm_resync (FIRST, FIRST + BLOCKS - 1);
+	int later = dm.dm_block_update (FIRST);
+	bad = bad || lost != -1 || beyond != BLOCKS || later != 0;
+
+	// servers restarted: every mapping is lost, resync maps them again
+	if (system (argv[3]) != 0) {
+		printf ("Checkresume: Error while restarting servers\n");
+		exit (1);
+	}
+	int restarted = dm.dm_resync (FIRST, FIRST + BLOCKS - 1);
+	memset (blocks[0], 'r', size);
+	bad = bad || restarted != BLOCKS || dm.dm_block_write (FIRST) != 0;
+
+	printf ("Within grace period: write %d update %d write %d resync %d\n"
+		"\tBeyond grace period: update %d resync %d update %d\n"
+		"\tAfter restart: resync %d\n", written, updated, rewritten,
+		within, lost, beyond, later, restarted);
+
+	for (int i = 0; i < BLOCKS; i++)
+		dm.dm_block_unmap (FIRST + i);
+
+	exit (bad ? 1 : 0);
+}
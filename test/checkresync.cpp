@@ -0,0 +1,81 @@
+/**
+ * @file checkresync.cpp
+ * @brief Simple test program. Another client writes a few blocks on both
+ * servers, then checks that dm_resync() updates exactly those blocks.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include "../src/distmem.h"
+
+/**
+ * Number of blocks mapped, starting at block 0.
+ */
+#define BLOCKS 512
+
+/**
+ * Checkresync main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 2)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client dm, writer;
+	if (dm.dm_init (config_file) != 0 ||
+	    writer.dm_init (config_file) != 0) {
+		printf ("Checkresync: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	char blocks[BLOCKS][size];
+
+	for (int i = 0; i < BLOCKS; i++) {
+		if (dm.dm_block_map (i, blocks[i]) != 0) {
+			printf ("Checkresync: Error while mapping DM on LM\n");
+			exit (1);
+		}
+	}
+	int before = dm.dm_resync (0, BLOCKS - 1);
+
+	// blocks written on both servers, including the edges of their
+	// ranges
+	int changed[] = { 3, 200, 255, 256, 300, 511 };
+	int n = sizeof (changed) / sizeof (changed[0]);
+	char data[size];
+	for (int k = 0; k < n; k++) {
+		memset (data, 'a' + k, size);
+		if (writer.dm_block_map (changed[k], data) != 0) {
+			printf ("Checkresync: Error while mapping DM on LM\n");
+			exit (1);
+		}
+		memset (data, 'a' + k, size);
+		if (writer.dm_block_write (changed[k]) != 0) {
+			printf ("Checkresync: Error while writing DM\n");
+			exit (1);
+		}
+		writer.dm_block_unmap (changed[k]);
+	}
+
+	int updated = dm.dm_resync (0, BLOCKS - 1);
+	int after = dm.dm_resync (0, BLOCKS - 1);
+	bool bad = before != 0 || updated != n || after != 0;
+	for (int k = 0; k < n; k++) {
+		char *b = blocks[changed[k]];
+		if (b[0] != 'a' + k || b[size - 1] != 'a' + k)
+			bad = true;
+	}
+
+	printf ("Blocks written: %d, updated by resync: %d, before writes: %d, "
+		"after resync: %d\n", n, updated, before, after);
+
+	for (int i = 0; i < BLOCKS; i++)
+		dm.dm_block_unmap (i);
+
+	exit (bad ? 1 : 0);
+}
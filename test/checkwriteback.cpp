@@ -0,0 +1,167 @@
+/**
+ * @file checkwriteback.cpp
+ * @brief Simple test program, for clients queuing writes (WriteBack=4,
+ * FlushInterval=1000). Queues writes to both servers, then checks that
+ * repeated writes of a block collapse into one carrying the data of flush
+ * time, that queued writes are sent when the queue is full or the interval
+ * expires, and that dm_flush() reports a write refused as stale.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include <unistd.h>
+#include "../src/distmem.h"
+
+/**
+ * Number of blocks used on each server.
+ */
+#define BLOCKS 4
+
+/**
+ * First block of second server.
+ */
+#define SECOND 256
+
+/**
+ * Number of writes of the same block before a flush.
+ */
+#define REPEATS 5
+
+/**
+ * Counts write requests served by servers.
+ * @param[in]	dm Initialized DM_client.
+ * @param[in]	address Servers address in dotted notation.
+ * @param[in]	ports Server ports.
+ * @param[in]	n Number of servers.
+ * @return	Number of writes, -1 on error.
+ */
+static long long writes (DM_client *dm, char *address, char **ports, int n)
+{
+	long long count = 0;
+	for (int i = 0; i < n; i++) {
+		string report;
+		if (dm->dm_stats (address, atoi (ports[i]), 0, &report) != 0)
+			return -1;
+		size_t at = report.find ("op write ");
+		unsigned long long c;
+		if (at != string::npos &&
+		    sscanf (report.c_str () + at, "op write count=%llu",
+			    &c) == 1)
+			count += c;
+	}
+	return count;
+}
+
+/**
+ * Checkwriteback main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file, with
+ *		WriteBack=4 and FlushInterval=1000.
+ * @param[in]	argv[2] Servers address in dotted notation.
+ * @param[in]	argv[3...] Server ports.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc < 4)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client dm, reader, admin;
+	if (dm.dm_init (config_file) != 0 ||
+	    reader.dm_init (config_file) != 0 ||
+	    admin.dm_init (config_file) != 0) {
+		printf ("Checkwriteback: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	int n = 2 * BLOCKS;
+	block_id ids[n];
+	char blocks[n][size], data[n][size];
+	for (int k = 0; k < BLOCKS; k++) {
+		ids[k] = k;
+		ids[BLOCKS + k] = SECOND + k;
+	}
+	for (int k = 0; k < n; k++) {
+		if (dm.dm_block_map (ids[k], blocks[k]) != 0 ||
+		    reader.dm_block_map (ids[k], data[k]) != 0) {
+			printf ("Checkwriteback: Error while mapping DM on "
+				"LM\n");
+			exit (1);
+		}
+	}
+
+	// repeated writes of one block on each server collapse into one,
+	// sending local data as it is at flush time
+	long long before = writes (&admin, argv[2], argv + 3, argc - 3);
+	int queued = 0;
+	for (int r = 0; r < REPEATS; r++) {
+		memset (blocks[0], 'a' + r, size);
+		memset (blocks[BLOCKS], 'a' + r, size);
+		queued += dm.dm_block_write (ids[0]) == 0 ? 1 : 0;
+		queued += dm.dm_block_write (ids[BLOCKS]) == 0 ? 1 : 0;
+	}
+	memset (blocks[0], 'z', size);
+	memset (blocks[BLOCKS], 'z', size);
+	int flushed = dm.dm_flush (NULL);
+	long long sent = writes (&admin, argv[2], argv + 3, argc - 3) - before;
+	bool bad = queued != 2 * REPEATS || flushed != 0 || sent != 2;
+	if (reader.dm_block_update (ids[0]) != 0 || data[0][0] != 'z' ||
+	    reader.dm_block_update (ids[BLOCKS]) != 0 ||
+	    data[BLOCKS][0] != 'z')
+		bad = true;
+
+	// a full queue is sent by the write filling it, on both servers
+	int full = 0;
+	for (int k = 1; k <= BLOCKS; k++) {
+		memset (blocks[k], 'f', size);
+		dm.dm_block_write (ids[k]);
+	}
+	for (int k = 1; k <= BLOCKS; k++)
+		if (reader.dm_block_update (ids[k]) == 0 && data[k][0] == 'f')
+			full++;
+
+	// a write left in the queue is sent once the interval expires
+	memset (blocks[n - 1], 'i', size);
+	dm.dm_block_write (ids[n - 1]);
+	usleep (1500000);
+	int expired = reader.dm_block_update (ids[n - 1]) == 0 &&
+		      data[n - 1][0] == 'i' ? 1 : 0;
+
+	// a write based on stale data is refused: dm_flush() reports it
+	// once, the other write queued with it succeeds
+	memset (data[1], 's', size);
+	if (reader.dm_block_write (ids[1]) != 0 ||
+	    reader.dm_flush (NULL) != 0) {
+		printf ("Checkwriteback: Error while writing DM\n");
+		exit (1);
+	}
+	memset (blocks[1], 'x', size);
+	memset (blocks[n - 2], 'y', size);
+	dm.dm_block_write (ids[1]);
+	dm.dm_block_write (ids[n - 2]);
+	vector<pair<block_id, int> > failed;
+	int refused = dm.dm_flush (&failed);
+	bad = bad || refused != -1 || failed.size () != 1 ||
+	      failed[0].first != ids[1] || failed[0].second != -2;
+	if (reader.dm_block_update (ids[1]) != 0 || data[1][0] != 's' ||
+	    reader.dm_block_update (ids[n - 2]) != 0 || data[n - 2][0] != 'y')
+		bad = true;
+	failed.clear ();
+	int again = dm.dm_flush (&failed);
+	bad = bad || again != 0 || !failed.empty () || full != BLOCKS ||
+	      expired != 1;
+
+	printf ("Writes queued: %d, sent: %lld\n\tSent by a full queue: %d of "
+		"%d, after interval: %d\n\tFlush with a stale write: %d, "
+		"next flush: %d\n", queued, sent, full, BLOCKS, expired,
+		refused, again);
+
+	for (int k = 0; k < n; k++) {
+		dm.dm_block_unmap (ids[k]);
+		reader.dm_block_unmap (ids[k]);
+	}
+
+	exit (bad ? 1 : 0);
+}
@@ -0,0 +1,126 @@
+/**
+ * @file countscan.cpp
+ * @brief Simple test program. Stores a file in distributed memory, counts
+ * spaces and words in file and sums its bytes on servers with dm_scan(), then
+ * checks results against the same counts done on local memory.
+ *
+ * @author Valerio Luconi
+ * @version 0.1
+ * @date June 2010
+ */
+
+#include "../src/distmem.h"
+
+/**
+ * Countscan main function.
+ * @param[in]	argv[1] A valid Distributed Memory configuration file.
+ */
+int main (int argc, char *argv[])
+{
+	if (argc != 2)
+		exit (1);
+
+	char *config_file = argv[1];
+
+	DM_client dm;
+	int ret = dm.dm_init (config_file);
+	if (ret != 0) {
+		printf ("Countscan: Error while connecting to servers\n");
+		exit (1);
+	}
+	int size = dm.dm_block_dim ();
+	char blocks[512][size];
+
+	// map dm on lm
+	for (int i = 0; i < 512; i++) {
+		ret = dm.dm_block_map (i, blocks[i]);
+		if (ret == -1) {
+			printf ("Countscan: Error while mapping DM on LM\n");
+			exit (1);
+		}
+	}
+
+	FILE *fp = fopen ("divina", "r");
+	if (fp == NULL) {
+		printf ("Countscan: Error while opening file\n");
+		exit (1);
+	}
+
+	// read file and store it on local memory from block 1, so that it
+	// spans both servers
+	// n = number of blocks
+	// tot = number of bytes
+	int n = 0;
+	int bytes, tot = 0;
+	while (feof (fp) == 0 && n < 511) {
+		bytes = fread (blocks[n + 1], 1, size, fp);
+		tot += bytes;
+		n++;
+	}
+	fclose (fp);
+
+	for (int i = 1; i <= n; i++) {
+		ret = dm.dm_block_write (i);
+		if (ret == -2) {
+			// block written by another client: ours is stored
+			// again over it
+			char copy[size];
+			memcpy (copy, blocks[i], size);
+			ret = dm.dm_block_update (i);
+			memcpy (blocks[i], copy, size);
+			if (ret >= 0)
+				ret = dm.dm_block_write (i);
+		}
+		if (ret < 0) {
+			printf ("Countscan: Error while writing file on DM\n");
+			exit (1);
+		}
+	}
+
+	// count on local memory: spaces, words and sum of bytes
+	char file[tot + 1];
+	for (int i = 1; i <= n; i++)
+		memcpy (file + (i - 1) * size, blocks[i],
+			i < n ? size : tot - (n - 1) * size);
+	file[tot] = '\0';
+
+	int count = 0;
+	long long sum = 0;
+	for (int i = 0; i < tot; i++) {
+		if (file[i] == ' ')
+			count++;
+		sum += (unsigned char) file[i];
+	}
+
+	int words = 0;
+	char *w = strtok (file, " \t\r\n");
+	while (w != NULL) {
+		words++;
+		w = strtok (NULL, " \t\r\n");
+	}
+
+	// same counts on servers
+	scan_result spaces, runs, bytesum;
+	if (dm.dm_scan (1, tot, SCAN_COUNT, 0, " ", &spaces) < 0 ||
+	    dm.dm_scan (1, tot, SCAN_RUNS, 1, " \t\r\n", &runs) < 0 ||
+	    dm.dm_scan (1, tot, SCAN_SUM, 1, NULL, &bytesum) < 0) {
+		printf ("Countscan: Error while scanning DM\n");
+		exit (1);
+	}
+
+	printf ("Spaces Number: %d (scan %lld)\n\tWords Number: %d (scan %lld)"
+		"\n\tBytes Sum: %lld (scan %lld)\n", count, spaces.value,
+		words, runs.value, sum, bytesum.value);
+
+	for (int i = 0; i < 512; i++) {
+		ret = dm.dm_block_unmap (i);
+	}
+
+	if (spaces.value != count || runs.value != words ||
+	    bytesum.value != sum) {
+		printf ("Countscan: Scan results differ from local counts\n");
+		exit (1);
+	}
+
+	exit (0);
+}